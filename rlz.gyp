@@ -16,31 +16,79 @@
       'sources': [
         'win/lib/assert.cc',
         'win/lib/assert.h',
+        'win/lib/async_ping.cc',
+        'win/lib/async_ping.h',
+        'win/lib/cgi_builder.cc',
+        'win/lib/cgi_builder.h',
         'win/lib/crc32.h',
         'win/lib/crc32_wrapper.cc',
         'win/lib/crc8.h',
         'win/lib/crc8.cc',
+        'win/lib/event_bitmap.cc',
+        'win/lib/event_bitmap.h',
+        'win/lib/event_queue.cc',
+        'win/lib/event_queue.h',
+        'win/lib/file_value_store.cc',
+        'win/lib/file_value_store.h',
         'win/lib/financial_ping.cc',
         'win/lib/financial_ping.h',
+        'win/lib/gzip.cc',
+        'win/lib/gzip.h',
         'win/lib/lib_mutex.cc',
         'win/lib/lib_mutex.h',
         'win/lib/lib_values.cc',
         'win/lib/lib_values.h',
         'win/lib/machine_deal.cc',
         'win/lib/machine_deal.h',
+        'win/lib/ping_health.cc',
+        'win/lib/ping_health.h',
+        'win/lib/ping_params_cache.cc',
+        'win/lib/ping_params_cache.h',
+        'win/lib/ping_response.cc',
+        'win/lib/ping_response.h',
+        'win/lib/ping_retry_queue.cc',
+        'win/lib/ping_retry_queue.h',
+        'win/lib/ping_session.cc',
+        'win/lib/ping_session.h',
+        'win/lib/ping_transport.cc',
+        'win/lib/ping_transport.h',
         'win/lib/process_info.cc',
         'win/lib/process_info.h',
+        'win/lib/registry_value_store.cc',
+        'win/lib/registry_value_store.h',
         'win/lib/rlz_lib.cc',
         'win/lib/rlz_lib.h',
+        'win/lib/shared_state_mirror.cc',
+        'win/lib/shared_state_mirror.h',
+        'win/lib/state_cache.cc',
+        'win/lib/state_cache.h',
         'win/lib/string_utils.cc',
         'win/lib/string_utils.h',
+        'win/lib/trace.cc',
+        'win/lib/trace.h',
         'win/lib/user_key.cc',
         'win/lib/user_key.h',
+        'win/lib/user_sweep.cc',
+        'win/lib/user_sweep.h',
+        'win/lib/value_store.cc',
+        'win/lib/value_store.h',
         'win/lib/vista_winnt.h',
+        'win/lib/winhttp_transport.cc',
+        'win/lib/winhttp_transport.h',
+        'win/lib/wininet_transport.cc',
+        'win/lib/wininet_transport.h',
+        'win/lib/write_batch.cc',
+        'win/lib/write_batch.h',
       ],
       'dependencies': [
         '../base/base.gyp:base',
+        '../third_party/zlib/zlib.gyp:zlib',
       ],
+      'link_settings': {
+        'libraries': [
+          '-lwinhttp.lib',
+        ],
+      },
     },
     {
       'target_name': 'rlz',
@@ -55,18 +103,50 @@
         '../third_party/zlib/zlib.gyp:zlib',
       ],
     },
+    {
+      'target_name': 'rlz_benchmarks',
+      'type': 'executable',
+      'include_dirs': [],
+      'sources': [
+        'win/test/rlz_benchmarks.cc',
+      ],
+      'dependencies': [
+        ':rlz_lib',
+        '../base/base.gyp:base',
+        '../third_party/zlib/zlib.gyp:zlib',
+      ],
+    },
+    {
+      'target_name': 'rlz_stress',
+      'type': 'executable',
+      'include_dirs': [],
+      'sources': [
+        'win/test/rlz_stress.cc',
+      ],
+      'dependencies': [
+        ':rlz_lib',
+        '../base/base.gyp:base',
+        '../third_party/zlib/zlib.gyp:zlib',
+      ],
+    },
     {
       'target_name': 'rlz_unittests',
       'type': 'executable',
       'include_dirs': [],
       'sources': [
+        'win/lib/cgi_builder_unittest.cc',
         'win/lib/crc32_unittest.cc',
         'win/lib/crc8_unittest.cc',
+        'win/lib/event_bitmap_test.cc',
         'win/lib/financial_ping_test.cc',
+        'win/lib/gzip_unittest.cc',
         'win/lib/lib_values_unittest.cc',
         'win/lib/machine_deal_test.cc',
+        'win/lib/ping_response_unittest.cc',
         'win/lib/rlz_lib_test.cc',
         'win/lib/string_utils_unittest.cc',
+        'win/lib/value_store_test.cc',
+        'win/lib/write_batch_test.cc',
         'win/test/rlz_test_helpers.cc',
         'win/test/rlz_test_helpers.h',
         'win/test/rlz_unittest_main.cc',
@@ -9,7 +9,14 @@
 #endif
 #include <windows.h>
 
+#include "rlz/win/lib/event_queue.h"
+
 BOOL APIENTRY DllMain(HANDLE module, DWORD  reason, LPVOID reserved) {
+  // Nothing may block under the loader lock, so the events still queued by
+  // the write-behind recording are dropped. Hosts which enabled it, and so
+  // pinned the DLL, call ShutdownEventWriteBehind() before they exit.
+  if (reason == DLL_PROCESS_DETACH)
+    rlz_lib::EventQueue::Detach();
   return TRUE;
 }
 
@@ -5,6 +5,7 @@
 // Functions exported by the RLZ DLL.
 
 #include "rlz/win/lib/rlz_lib.h"
+#include "rlz/win/lib/trace.h"
 
 #define RLZ_DLL_EXPORT extern "C" __declspec(dllexport)
 
@@ -12,18 +13,36 @@ RLZ_DLL_EXPORT bool RecordProductEvent(rlz_lib::Product product,
                                        rlz_lib::AccessPoint point,
                                        rlz_lib::Event event_id,
                                        const wchar_t* sid = NULL) {
+  rlz_lib::ScopedTraceSpan span("RecordProductEvent");
   return rlz_lib::RecordProductEvent(product, point, event_id, sid);
 }
 
+RLZ_DLL_EXPORT bool RecordProductEvents(rlz_lib::Product product,
+                                        const rlz_lib::AccessPoint* points,
+                                        const rlz_lib::Event* events,
+                                        size_t count, bool* results,
+                                        const wchar_t* sid = NULL) {
+  rlz_lib::ScopedTraceSpan span("RecordProductEvents");
+  return rlz_lib::RecordProductEvents(product, points, events, count, results,
+                                      sid);
+}
+
 RLZ_DLL_EXPORT bool GetProductEventsAsCgi(rlz_lib::Product product,
                                           char* unescaped_cgi,
                                           size_t unescaped_cgi_size,
                                           const wchar_t* sid = NULL) {
+  rlz_lib::ScopedTraceSpan span("GetProductEventsAsCgi");
   return rlz_lib::GetProductEventsAsCgi(product, unescaped_cgi,
                                         unescaped_cgi_size, sid);
 }
+RLZ_DLL_EXPORT bool HasPendingEvents(rlz_lib::Product product,
+                                     const wchar_t* sid = NULL) {
+  rlz_lib::ScopedTraceSpan span("HasPendingEvents");
+  return rlz_lib::HasPendingEvents(product, sid);
+}
 RLZ_DLL_EXPORT bool ClearAllProductEvents(rlz_lib::Product product,
                                           const wchar_t* sid = NULL) {
+  rlz_lib::ScopedTraceSpan span("ClearAllProductEvents");
   return rlz_lib::ClearAllProductEvents(product, sid);
 }
 
@@ -31,35 +50,61 @@ RLZ_DLL_EXPORT bool ClearProductEvent(rlz_lib::Product product,
                                       rlz_lib::AccessPoint point,
                                       rlz_lib::Event event_id,
                                       const wchar_t* sid = NULL) {
+  rlz_lib::ScopedTraceSpan span("ClearProductEvent");
   return rlz_lib::ClearProductEvent(product, point, event_id, sid);
 }
 
+RLZ_DLL_EXPORT bool ClearProductEvents(rlz_lib::Product product,
+                                       const rlz_lib::AccessPoint* points,
+                                       const rlz_lib::Event* events,
+                                       size_t count, bool* results,
+                                       const wchar_t* sid = NULL) {
+  rlz_lib::ScopedTraceSpan span("ClearProductEvents");
+  return rlz_lib::ClearProductEvents(product, points, events, count, results,
+                                     sid);
+}
+
 RLZ_DLL_EXPORT bool GetAccessPointRlz(rlz_lib::AccessPoint point,
                                       char* rlz,
                                       size_t rlz_size,
                                       const wchar_t* sid = NULL) {
+  rlz_lib::ScopedTraceSpan span("GetAccessPointRlz");
   return rlz_lib::GetAccessPointRlz(point, rlz, rlz_size, sid);
 }
 
+RLZ_DLL_EXPORT bool GetAccessPointRlzs(
+    const rlz_lib::AccessPoint* access_points,
+    char* rlzs,
+    size_t rlz_size,
+    const wchar_t* sid = NULL) {
+  rlz_lib::ScopedTraceSpan span("GetAccessPointRlzs");
+  return rlz_lib::GetAccessPointRlzs(access_points, rlzs, rlz_size, sid);
+}
+
 RLZ_DLL_EXPORT bool SetAccessPointRlz(rlz_lib::AccessPoint point,
                                       const char* new_rlz,
                                       const wchar_t* sid = NULL) {
+  rlz_lib::ScopedTraceSpan span("SetAccessPointRlz");
   return rlz_lib::SetAccessPointRlz(point, new_rlz, sid);
 }
 
 RLZ_DLL_EXPORT bool CreateMachineState() {
+  rlz_lib::ScopedTraceSpan span("CreateMachineState");
   return rlz_lib::CreateMachineState();
 }
 
 RLZ_DLL_EXPORT bool SetMachineDealCode(const char* dcc) {
+  rlz_lib::ScopedTraceSpan span("SetMachineDealCode");
   return rlz_lib::SetMachineDealCode(dcc);
 }
 
 RLZ_DLL_EXPORT bool GetMachineDealCodeAsCgi(char* cgi, size_t cgi_size) {
+  rlz_lib::ScopedTraceSpan span("GetMachineDealCodeAsCgi");
   return rlz_lib::GetMachineDealCodeAsCgi(cgi, cgi_size);
 }
 
 RLZ_DLL_EXPORT bool GetMachineDealCode2(char* dcc, size_t dcc_size) {
+  rlz_lib::ScopedTraceSpan span("GetMachineDealCode2");
   return rlz_lib::GetMachineDealCode(dcc, dcc_size);
 }
 
@@ -68,22 +113,37 @@ RLZ_DLL_EXPORT bool GetPingParams(rlz_lib::Product product,
                                   char* unescaped_cgi,
                                   size_t unescaped_cgi_size,
                                   const wchar_t* sid = NULL) {
+  rlz_lib::ScopedTraceSpan span("GetPingParams");
   return rlz_lib::GetPingParams(product, access_points, unescaped_cgi,
                                 unescaped_cgi_size, sid);
 }
 
+RLZ_DLL_EXPORT bool GetPingParams2(rlz_lib::Product product,
+                                   const rlz_lib::AccessPoint* access_points,
+                                   char* unescaped_cgi,
+                                   size_t unescaped_cgi_size,
+                                   const wchar_t* sid,
+                                   size_t* required_size) {
+  rlz_lib::ScopedTraceSpan span("GetPingParams2");
+  return rlz_lib::GetPingParams(product, access_points, unescaped_cgi,
+                                unescaped_cgi_size, sid, required_size);
+}
+
 RLZ_DLL_EXPORT bool ParsePingResponse(rlz_lib::Product product,
                                       const char* response,
                                       const wchar_t* sid = NULL) {
+  rlz_lib::ScopedTraceSpan span("ParsePingResponse");
   return rlz_lib::ParsePingResponse(product, response, sid);
 }
 
 RLZ_DLL_EXPORT bool IsPingResponseValid(const char* response,
                                         int* checksum_idx) {
+  rlz_lib::ScopedTraceSpan span("IsPingResponseValid");
   return rlz_lib::IsPingResponseValid(response, checksum_idx);
 }
 
 RLZ_DLL_EXPORT bool SetMachineDealCodeFromPingResponse(const char* response) {
+  rlz_lib::ScopedTraceSpan span("SetMachineDealCodeFromPingResponse");
   return rlz_lib::SetMachineDealCodeFromPingResponse(response);
 }
 
@@ -95,6 +155,7 @@ RLZ_DLL_EXPORT bool SendFinancialPing(rlz_lib::Product product,
                                       const char* product_lang,
                                       bool exclude_machine_id,
                                       const wchar_t* sid = NULL) {
+  rlz_lib::ScopedTraceSpan span("SendFinancialPing");
   return rlz_lib::SendFinancialPing(product, access_points, product_signature,
       product_brand, product_id, product_lang, exclude_machine_id, sid);
 }
@@ -108,13 +169,170 @@ RLZ_DLL_EXPORT bool SendFinancialPingNoDelay(
     const char* product_lang,
     bool exclude_machine_id,
     const wchar_t* sid) {
+  rlz_lib::ScopedTraceSpan span("SendFinancialPingNoDelay");
   return rlz_lib::SendFinancialPing(product, access_points, product_signature,
       product_brand, product_id, product_lang, exclude_machine_id, sid,
       true);
 }
 
+RLZ_DLL_EXPORT rlz_lib::FinancialPingHandle SendFinancialPingAsync(
+    rlz_lib::Product product,
+    const rlz_lib::AccessPoint* access_points,
+    const char* product_signature,
+    const char* product_brand,
+    const char* product_id,
+    const char* product_lang,
+    bool exclude_machine_id,
+    const wchar_t* sid,
+    bool skip_time_check,
+    DWORD timeout_ms,
+    rlz_lib::FinancialPingCallback callback,
+    void* context) {
+  rlz_lib::ScopedTraceSpan span("SendFinancialPingAsync");
+  return rlz_lib::SendFinancialPingAsync(product, access_points,
+      product_signature, product_brand, product_id, product_lang,
+      exclude_machine_id, sid, skip_time_check, timeout_ms, callback,
+      context);
+}
+
+RLZ_DLL_EXPORT void CancelFinancialPing(rlz_lib::FinancialPingHandle handle) {
+  rlz_lib::ScopedTraceSpan span("CancelFinancialPing");
+  rlz_lib::CancelFinancialPing(handle);
+}
+
+RLZ_DLL_EXPORT void CloseFinancialPingHandle(
+    rlz_lib::FinancialPingHandle handle) {
+  rlz_lib::ScopedTraceSpan span("CloseFinancialPingHandle");
+  rlz_lib::CloseFinancialPingHandle(handle);
+}
+
+RLZ_DLL_EXPORT bool SendFinancialPings(
+    const rlz_lib::FinancialPingParams* pings,
+    size_t count,
+    const wchar_t* sid,
+    bool* results) {
+  rlz_lib::ScopedTraceSpan span("SendFinancialPings");
+  return rlz_lib::SendFinancialPings(pings, count, sid, results);
+}
+
 RLZ_DLL_EXPORT void ClearProductState(rlz_lib::Product product,
                                       const rlz_lib::AccessPoint* access_points,
                                       const wchar_t* sid = NULL) {
+  rlz_lib::ScopedTraceSpan span("ClearProductState");
   return rlz_lib::ClearProductState(product, access_points, sid);
 }
+
+RLZ_DLL_EXPORT bool SendFinancialPingsForUsers(
+    const rlz_lib::FinancialPingParams* pings,
+    size_t count,
+    const wchar_t* const* sids,
+    size_t sid_count,
+    int max_threads,
+    bool* results) {
+  rlz_lib::ScopedTraceSpan span("SendFinancialPingsForUsers");
+  return rlz_lib::SendFinancialPingsForUsers(pings, count, sids, sid_count,
+                                             max_threads, results);
+}
+
+RLZ_DLL_EXPORT void ClearProductStateForUsers(
+    rlz_lib::Product product,
+    const rlz_lib::AccessPoint* access_points,
+    const wchar_t* const* sids,
+    size_t sid_count) {
+  rlz_lib::ScopedTraceSpan span("ClearProductStateForUsers");
+  rlz_lib::ClearProductStateForUsers(product, access_points, sids, sid_count);
+}
+
+RLZ_DLL_EXPORT void EnableStateCache(bool enable) {
+  rlz_lib::ScopedTraceSpan span("EnableStateCache");
+  rlz_lib::EnableStateCache(enable);
+}
+
+RLZ_DLL_EXPORT bool SetLockTimeout(int timeout_ms) {
+  rlz_lib::ScopedTraceSpan span("SetLockTimeout");
+  return rlz_lib::SetLockTimeout(timeout_ms);
+}
+
+RLZ_DLL_EXPORT bool GetLockStats(rlz_lib::LockStats* stats) {
+  rlz_lib::ScopedTraceSpan span("GetLockStats");
+  return rlz_lib::GetLockStats(stats);
+}
+
+RLZ_DLL_EXPORT void ResetLockStats() {
+  rlz_lib::ScopedTraceSpan span("ResetLockStats");
+  rlz_lib::ResetLockStats();
+}
+
+RLZ_DLL_EXPORT bool GetPingHealthStats(rlz_lib::Product product,
+                                       rlz_lib::PingHealthStats* stats,
+                                       const wchar_t* sid) {
+  rlz_lib::ScopedTraceSpan span("GetPingHealthStats");
+  return rlz_lib::GetPingHealthStats(product, stats, sid);
+}
+
+RLZ_DLL_EXPORT bool ResetPingHealthStats(rlz_lib::Product product,
+                                         const wchar_t* sid) {
+  rlz_lib::ScopedTraceSpan span("ResetPingHealthStats");
+  return rlz_lib::ResetPingHealthStats(product, sid);
+}
+
+RLZ_DLL_EXPORT void EnableSharedStateMirror(bool enable) {
+  rlz_lib::ScopedTraceSpan span("EnableSharedStateMirror");
+  rlz_lib::EnableSharedStateMirror(enable);
+}
+
+RLZ_DLL_EXPORT void EnableCompactEventStorage(bool enable) {
+  rlz_lib::ScopedTraceSpan span("EnableCompactEventStorage");
+  rlz_lib::EnableCompactEventStorage(enable);
+}
+
+RLZ_DLL_EXPORT void EnableEventWriteBehind(bool enable) {
+  rlz_lib::ScopedTraceSpan span("EnableEventWriteBehind");
+  rlz_lib::EnableEventWriteBehind(enable);
+}
+
+RLZ_DLL_EXPORT bool FlushQueuedEvents() {
+  rlz_lib::ScopedTraceSpan span("FlushQueuedEvents");
+  return rlz_lib::FlushQueuedEvents();
+}
+
+RLZ_DLL_EXPORT bool ShutdownEventWriteBehind() {
+  rlz_lib::ScopedTraceSpan span("ShutdownEventWriteBehind");
+  return rlz_lib::ShutdownEventWriteBehind();
+}
+
+RLZ_DLL_EXPORT void EnableCompressedPings(bool enable) {
+  rlz_lib::ScopedTraceSpan span("EnableCompressedPings");
+  rlz_lib::EnableCompressedPings(enable);
+}
+
+RLZ_DLL_EXPORT bool SetPingTransport(rlz_lib::PingTransportType type) {
+  rlz_lib::ScopedTraceSpan span("SetPingTransport");
+  return rlz_lib::SetPingTransport(type);
+}
+
+RLZ_DLL_EXPORT void EnableUserKeyCache(bool enable) {
+  rlz_lib::ScopedTraceSpan span("EnableUserKeyCache");
+  rlz_lib::EnableUserKeyCache(enable);
+}
+
+RLZ_DLL_EXPORT void InvalidateUserKeyCache(const wchar_t* sid) {
+  rlz_lib::ScopedTraceSpan span("InvalidateUserKeyCache");
+  rlz_lib::InvalidateUserKeyCache(sid);
+}
+
+RLZ_DLL_EXPORT void EnableFileStateStore(bool enable,
+                                         bool mirror_to_registry) {
+  rlz_lib::ScopedTraceSpan span("EnableFileStateStore");
+  rlz_lib::EnableFileStateStore(enable, mirror_to_registry);
+}
+
+RLZ_DLL_EXPORT void PrefetchMachineId() {
+  rlz_lib::ScopedTraceSpan span("PrefetchMachineId");
+  rlz_lib::PrefetchMachineId();
+}
+
+RLZ_DLL_EXPORT void SetTraceCallback(rlz_lib::TraceCallback callback,
+                                     void* context) {
+  rlz_lib::SetTraceCallback(callback, context);
+}
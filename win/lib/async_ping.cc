@@ -0,0 +1,121 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Financial pings sent on the system thread pool.
+
+#include "rlz/win/lib/async_ping.h"
+
+#include "rlz/win/lib/assert.h"
+#include "rlz/win/lib/ping_health.h"
+#include "rlz/win/lib/ping_retry_queue.h"
+
+namespace rlz_lib {
+
+AsyncFinancialPing::AsyncFinancialPing(Product product,
+                                       const std::string& request,
+                                       const wchar_t* sid,
+                                       FinancialPingCallback callback,
+                                       void* context)
+    : product_(product),
+      request_(request),
+      sid_(sid ? sid : L""),
+      has_sid_(sid != NULL),
+      callback_(callback),
+      context_(context),
+      timer_(NULL) {
+}
+
+AsyncFinancialPing::~AsyncFinancialPing() {
+}
+
+// static
+AsyncFinancialPing* AsyncFinancialPing::Start(Product product,
+                                              const std::string& request,
+                                              const wchar_t* sid,
+                                              DWORD timeout_ms,
+                                              FinancialPingCallback callback,
+                                              void* context) {
+  AsyncFinancialPing* ping = new AsyncFinancialPing(product, request, sid,
+                                                    callback, context);
+  // One reference for the caller and one for the work item.
+  ping->AddRef();
+  ping->AddRef();
+
+  // The timeout runs from now, so that it includes the time spent waiting
+  // for a pool thread. The timer is deleted by the work item.
+  if (timeout_ms > 0 &&
+      !CreateTimerQueueTimer(&ping->timer_, NULL, OnTimeout, ping, timeout_ms,
+                             0, WT_EXECUTEONLYONCE | WT_EXECUTEINTIMERTHREAD)) {
+    ping->timer_ = NULL;
+    ping->Release();
+    ping->Release();
+    return NULL;
+  }
+
+  if (!QueueUserWorkItem(RunPing, ping, WT_EXECUTELONGFUNCTION)) {
+    ASSERT_STRING("AsyncFinancialPing::Start: QueueUserWorkItem failed");
+    if (ping->timer_)
+      DeleteTimerQueueTimer(NULL, ping->timer_, INVALID_HANDLE_VALUE);
+    ping->Release();
+    ping->Release();
+    return NULL;
+  }
+
+  return ping;
+}
+
+void AsyncFinancialPing::Cancel() {
+  canceller_.Cancel();
+}
+
+// static
+DWORD WINAPI AsyncFinancialPing::RunPing(void* param) {
+  AsyncFinancialPing* ping = static_cast<AsyncFinancialPing*>(param);
+  ping->Run();
+  ping->Release();
+  return 0;
+}
+
+// static
+void CALLBACK AsyncFinancialPing::OnTimeout(void* param, BOOLEAN timer_fired) {
+  // The work item holds a reference until the timer is deleted.
+  static_cast<AsyncFinancialPing*>(param)->Cancel();
+}
+
+void AsyncFinancialPing::Run() {
+  std::string response;
+  bool valid_response = false;
+  PingResult ping_result;
+  bool result = FinancialPing::PingServer(request_.c_str(), &response,
+                                          &canceller_, &valid_response,
+                                          &ping_result);
+
+  // Waits for a running OnTimeout() to return.
+  if (timer_) {
+    DeleteTimerQueueTimer(NULL, timer_, INVALID_HANDLE_VALUE);
+    timer_ = NULL;
+  }
+
+  // Queue the ping for a retry if it did not get a response, and count it.
+  // Cancelled pings, including those which timed out, are neither retried
+  // nor counted.
+  const wchar_t* sid = has_sid_ ? sid_.c_str() : NULL;
+  if (!canceller_.cancelled()) {
+    PingRetryQueue::RecordResult(product_, sid, request_,
+                                 ping_result.status != 0);
+    PingHealth::RecordPing(product_, sid, ping_result, valid_response);
+  }
+
+  // Parse the ping response - update RLZs, clear events.
+  if (result && valid_response && !canceller_.cancelled()) {
+    result = FinancialPing::ParseResponse(product_, response.c_str(), sid);
+  } else {
+    result = false;
+  }
+
+  if (callback_)
+    callback_(result, context_);
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,62 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Financial pings sent on the system thread pool.
+
+#ifndef RLZ_WIN_LIB_ASYNC_PING_H_
+#define RLZ_WIN_LIB_ASYNC_PING_H_
+
+#include <windows.h>
+#include <string>
+
+#include "base/basictypes.h"
+#include "base/memory/ref_counted.h"
+#include "rlz/win/lib/financial_ping.h"
+#include "rlz/win/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+// One asynchronous ping. The object is referenced by the caller's handle and
+// by the pending work item, and goes away once both are done with it.
+class AsyncFinancialPing
+    : public base::RefCountedThreadSafe<AsyncFinancialPing> {
+ public:
+  // Queues the round trip to the server for |request|, and the parsing of
+  // the response. Returns the caller's reference, or NULL if the work item
+  // could not be queued.
+  static AsyncFinancialPing* Start(Product product, const std::string& request,
+                                   const wchar_t* sid, DWORD timeout_ms,
+                                   FinancialPingCallback callback,
+                                   void* context);
+
+  void Cancel();
+
+ private:
+  friend class base::RefCountedThreadSafe<AsyncFinancialPing>;
+
+  AsyncFinancialPing(Product product, const std::string& request,
+                     const wchar_t* sid, FinancialPingCallback callback,
+                     void* context);
+  ~AsyncFinancialPing();
+
+  static DWORD WINAPI RunPing(void* param);
+  static void CALLBACK OnTimeout(void* param, BOOLEAN timer_fired);
+
+  void Run();
+
+  Product product_;
+  std::string request_;
+  std::wstring sid_;
+  bool has_sid_;
+  FinancialPingCallback callback_;
+  void* context_;
+  HANDLE timer_;
+  PingCanceller canceller_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncFinancialPing);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_ASYNC_PING_H_
@@ -0,0 +1,76 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Builds CGI strings in a fixed size buffer, without formatting or heap
+// allocation.
+
+#include "rlz/win/lib/cgi_builder.h"
+
+#include <string.h>
+
+namespace rlz_lib {
+
+CgiBuilder::CgiBuilder(char* buffer, size_t buffer_size)
+    : buffer_(buffer), buffer_size_(buffer_size), length_(0) {
+  buffer_[0] = 0;
+}
+
+void CgiBuilder::Append(const base::StringPiece& text) {
+  size_t position = this->position();
+  size_t copied = text.size();
+  if (copied > buffer_size_ - 1 - position)
+    copied = buffer_size_ - 1 - position;
+
+  memcpy(buffer_ + position, text.data(), copied);
+  buffer_[position + copied] = 0;
+  length_ += text.size();
+}
+
+void CgiBuilder::Append(char letter) {
+  if (length_ + 1 < buffer_size_) {
+    buffer_[length_] = letter;
+    buffer_[length_ + 1] = 0;
+  }
+  ++length_;
+}
+
+void CgiBuilder::AppendAscii(const wchar_t* text) {
+  for (; *text; ++text)
+    Append(*text < 0x80 ? static_cast<char>(*text) : '?');
+}
+
+void CgiBuilder::AppendParam(const char* name,
+                             const base::StringPiece& value) {
+  if (length_ > 0)
+    Append('&');
+  Append(name);
+  Append('=');
+  Append(value);
+}
+
+char* CgiBuilder::tail() {
+  return buffer_ + position();
+}
+
+size_t CgiBuilder::available() const {
+  return buffer_size_ - position();
+}
+
+void CgiBuilder::Advance(size_t length) {
+  length_ += length;
+  buffer_[position()] = 0;
+}
+
+void CgiBuilder::Truncate(size_t length) {
+  if (length < length_) {
+    length_ = length;
+    buffer_[position()] = 0;
+  }
+}
+
+size_t CgiBuilder::position() const {
+  return length_ < buffer_size_ ? length_ : buffer_size_ - 1;
+}
+
+}  // namespace rlz_lib
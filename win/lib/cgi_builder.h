@@ -0,0 +1,66 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Builds CGI strings in a fixed size buffer, without formatting or heap
+// allocation.
+
+#ifndef RLZ_WIN_LIB_CGI_BUILDER_H_
+#define RLZ_WIN_LIB_CGI_BUILDER_H_
+
+#include <stddef.h>
+
+#include "base/basictypes.h"
+#include "base/string_piece.h"
+
+namespace rlz_lib {
+
+// Appends to a caller provided buffer, which is always NULL terminated. Once
+// the text no longer fits, the builder keeps counting the length it would
+// have, so that callers can learn the exact buffer size required; the buffer
+// then holds a truncated, unusable CGI.
+class CgiBuilder {
+ public:
+  // |buffer| must hold at least one char.
+  CgiBuilder(char* buffer, size_t buffer_size);
+
+  void Append(const base::StringPiece& text);
+  void Append(char letter);
+
+  // Appends ASCII |text|. Other characters are replaced with '?'.
+  void AppendAscii(const wchar_t* text);
+
+  // Appends "&<name>=<value>", without the '&' if the CGI is still empty.
+  void AppendParam(const char* name, const base::StringPiece& value);
+
+  // For functions which write into the buffer themselves: they may write up
+  // to available() chars, including the NULL terminator, at tail(), then
+  // report with Advance() the length they wrote or, if they did not fit, the
+  // length they needed.
+  char* tail();
+  size_t available() const;
+  void Advance(size_t length);
+
+  // Drops what was appended after the first |length| chars.
+  void Truncate(size_t length);
+
+  bool overflowed() const { return length_ >= buffer_size_; }
+
+  // The length of the CGI, whether or not it fit in the buffer.
+  size_t length() const { return length_; }
+  size_t required_size() const { return length_ + 1; }
+
+ private:
+  // Where the next char goes, or the NULL terminator once overflowed.
+  size_t position() const;
+
+  char* buffer_;
+  size_t buffer_size_;
+  size_t length_;
+
+  DISALLOW_COPY_AND_ASSIGN(CgiBuilder);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_CGI_BUILDER_H_
@@ -0,0 +1,72 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit test for the CGI builder used in the RLZ library.
+
+#include <string.h>
+
+#include "base/basictypes.h"
+#include "testing/gmock/include/gmock/gmock.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+#include "rlz/win/lib/cgi_builder.h"
+
+TEST(CgiBuilderUnittest, Append) {
+  char buffer[64];
+  rlz_lib::CgiBuilder builder(buffer, arraysize(buffer));
+  EXPECT_STREQ("", buffer);
+
+  builder.AppendParam("as", "swg");
+  builder.AppendParam("brand", "GGLA");
+  builder.Append('&');
+  builder.Append("rlz=T4:");
+  builder.AppendAscii(L"TbRlz\x00e9");
+  EXPECT_STREQ("as=swg&brand=GGLA&rlz=T4:TbRlz?", buffer);
+  EXPECT_EQ(strlen(buffer), builder.length());
+  EXPECT_EQ(strlen(buffer) + 1, builder.required_size());
+  EXPECT_FALSE(builder.overflowed());
+
+  builder.Truncate(6);
+  EXPECT_STREQ("as=swg", buffer);
+  EXPECT_EQ(6u, builder.length());
+}
+
+TEST(CgiBuilderUnittest, Overflow) {
+  char buffer[8];
+  rlz_lib::CgiBuilder builder(buffer, arraysize(buffer));
+
+  builder.Append("rep=2");
+  EXPECT_FALSE(builder.overflowed());
+  builder.AppendParam("dcc", "dcc_value");
+  EXPECT_TRUE(builder.overflowed());
+  EXPECT_EQ(strlen("rep=2&dcc=dcc_value") + 1, builder.required_size());
+  EXPECT_EQ(7u, strlen(buffer));
+
+  // Exactly as long as the buffer allows.
+  rlz_lib::CgiBuilder exact(buffer, arraysize(buffer));
+  exact.Append("1234567");
+  EXPECT_FALSE(exact.overflowed());
+  EXPECT_STREQ("1234567", buffer);
+  exact.Append('8');
+  EXPECT_TRUE(exact.overflowed());
+  EXPECT_EQ(9u, exact.required_size());
+}
+
+TEST(CgiBuilderUnittest, Advance) {
+  char buffer[16];
+  rlz_lib::CgiBuilder builder(buffer, arraysize(buffer));
+  builder.Append("rep=2&");
+
+  EXPECT_EQ(10u, builder.available());
+  strcpy(builder.tail(), "rlz=");
+  builder.Advance(4);
+  EXPECT_STREQ("rep=2&rlz=", buffer);
+
+  // A writer which did not fit reports the length it needed.
+  builder.tail()[0] = 0;
+  builder.Advance(20);
+  EXPECT_TRUE(builder.overflowed());
+  EXPECT_EQ(31u, builder.required_size());
+  EXPECT_EQ(1u, builder.available());
+}
@@ -10,8 +10,18 @@
 namespace rlz_lib {
 
 int Crc32(const unsigned char* buf, int length);
+
+// The CRC of length characters of text. Returns false if they are not all
+// ASCII.
+bool Crc32(const char* text, int length, int* crc);
+
+// Same as above, on a NULL terminated string.
 bool Crc32(const char* text, int* crc);
 
+// Updates *crc, the CRC of the preceding text, with length more characters
+// of text. Leaves *crc unchanged and returns false if they are not all ASCII.
+bool UpdateCrc32(const char* text, int length, int* crc);
+
 }  // namespace rlz_lib
 
 #endif  // RLZ_WIN_LIB_CRC32_H_
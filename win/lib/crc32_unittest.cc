@@ -4,11 +4,13 @@
 //
 // A test for ZLib's checksum function.
 
+#include "base/basictypes.h"
 #include "base/logging.h"
 #include "testing/gmock/include/gmock/gmock.h"
 #include "testing/gtest/include/gtest/gtest.h"
 
 #include "rlz/win/lib/crc32.h"
+#include "third_party/zlib/zlib.h"
 
 TEST(Crc32Unittest, ByteTest) {
   struct {
@@ -50,3 +52,61 @@ TEST(Crc32Unittest, CharTest) {
     EXPECT_EQ(kData[i].crc, crc);
   }
 }
+
+TEST(Crc32Unittest, BulkTest) {
+  // Long enough for the vectorized code paths, at every alignment.
+  char text[1024 + 16];
+  for (int i = 0; i < arraysize(text); i++)
+    text[i] = 'a' + i % 26;
+
+  for (int offset = 0; offset < 16; offset++) {
+    for (int length = 0; length <= 1024; length += 31) {
+      const char* data = text + offset;
+      int expected = 0;
+      for (int i = 0; i < length; i++) {
+        expected = crc32(expected,
+                         reinterpret_cast<const unsigned char*>(data + i), 1);
+      }
+
+      int crc;
+      EXPECT_TRUE(rlz_lib::Crc32(data, length, &crc));
+      EXPECT_EQ(expected, crc);
+      EXPECT_EQ(expected, rlz_lib::Crc32(
+          reinterpret_cast<const unsigned char*>(data), length));
+    }
+  }
+
+  // Non ASCII characters are rejected wherever they are.
+  for (int i = 0; i < 100; i++) {
+    text[i] = '\xe9';
+    int crc;
+    EXPECT_FALSE(rlz_lib::Crc32(text, 100, &crc));
+    text[i] = 'a';
+  }
+}
+
+TEST(Crc32Unittest, UpdateTest) {
+  char text[1024];
+  for (int i = 0; i < arraysize(text); i++)
+    text[i] = 'a' + i % 26;
+
+  int expected;
+  EXPECT_TRUE(rlz_lib::Crc32(text, arraysize(text), &expected));
+
+  // Any split of the text gives the same CRC.
+  for (int split = 0; split <= arraysize(text); split += 97) {
+    int crc = 0;
+    EXPECT_TRUE(rlz_lib::UpdateCrc32(text, split, &crc));
+    EXPECT_TRUE(rlz_lib::UpdateCrc32(text + split, arraysize(text) - split,
+                                     &crc));
+    EXPECT_EQ(expected, crc);
+  }
+
+  // Non ASCII characters leave the CRC unchanged.
+  int crc = 0;
+  EXPECT_TRUE(rlz_lib::UpdateCrc32(text, 10, &crc));
+  int partial = crc;
+  text[20] = '\xe9';
+  EXPECT_FALSE(rlz_lib::UpdateCrc32(text + 10, 20, &crc));
+  EXPECT_EQ(partial, crc);
+}
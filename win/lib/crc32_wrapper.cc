@@ -6,14 +6,169 @@
 // and use our types.
 
 #include "rlz/win/lib/crc32.h"
+
+#include <string.h>
+
+#include "build/build_config.h"
 #include "rlz/win/lib/assert.h"
 #include "rlz/win/lib/string_utils.h"
 #include "third_party/zlib/zlib.h"
 
+#if defined(ARCH_CPU_X86_FAMILY)
+#include <emmintrin.h>
+#include <intrin.h>
+#include <wmmintrin.h>
+#endif
+
+namespace {
+
+#if defined(ARCH_CPU_X86_FAMILY)
+
+// Set on first use. Racing threads compute the same value.
+int g_has_clmul = -1;
+
+bool HasClmul() {
+  if (g_has_clmul < 0) {
+    int cpu_info[4];
+    __cpuid(cpu_info, 1);
+    bool has_sse2 = (cpu_info[3] & (1 << 26)) != 0;
+    bool has_pclmulqdq = (cpu_info[2] & (1 << 1)) != 0;
+    g_has_clmul = has_sse2 && has_pclmulqdq ? 1 : 0;
+  }
+
+  return g_has_clmul == 1;
+}
+
+// The CRC-32 of length bytes of buf, a multiple of 16 and at least 64, by
+// folding with carry-less multiplications as described in "Fast CRC
+// Computation for Generic Polynomials Using PCLMULQDQ Instruction" by Intel.
+// crc and the result are bit inverted, as inside zlib.
+unsigned int ClmulCrc32(const unsigned char* buf, int length,
+                        unsigned int crc) {
+  // The bit-reflected constants k1 to k5 and the polynomials from the paper.
+  const __m128i k1k2 = _mm_setr_epi32(0x54442bd4, 0x1, 0xc6e41596, 0x1);
+  const __m128i k3k4 = _mm_setr_epi32(0x751997d0, 0x1, 0xccaa009e, 0x0);
+  const __m128i k5k0 = _mm_setr_epi32(0x63cd6124, 0x1, 0x0, 0x0);
+  const __m128i poly = _mm_setr_epi32(0xdb710641, 0x1, 0xf7011641, 0x1);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+  const __m128i* blocks = reinterpret_cast<const __m128i*>(buf);
+  __m128i x1 = _mm_loadu_si128(blocks);
+  __m128i x2 = _mm_loadu_si128(blocks + 1);
+  __m128i x3 = _mm_loadu_si128(blocks + 2);
+  __m128i x4 = _mm_loadu_si128(blocks + 3);
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+  blocks += 4;
+  length -= 64;
+
+  // Fold 64 bytes at a time in 4 parallel lanes.
+  for (; length >= 64; blocks += 4, length -= 64) {
+    __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(blocks));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(blocks + 1));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(blocks + 2));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(blocks + 3));
+  }
+
+  // Fold the lanes into one, then the remaining 16 byte blocks.
+  __m128i lanes[3] = {x2, x3, x4};
+  for (int i = 0; i < 3; ++i) {
+    __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, lanes[i]), x5);
+  }
+
+  for (; length >= 16; ++blocks, length -= 16) {
+    __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128(blocks)), x5);
+  }
+
+  // Fold 128 bits to 64 bits.
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5k0, 0x00), x2);
+
+  // Barrett reduction to 32 bits.
+  x2 = _mm_and_si128(x1, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return static_cast<unsigned int>(_mm_cvtsi128_si32(_mm_srli_si128(x1, 4)));
+}
+
+#endif  // defined(ARCH_CPU_X86_FAMILY)
+
+bool IsAsciiBuffer(const char* text, int length) {
+  int i = 0;
+#if defined(ARCH_CPU_X86_FAMILY)
+  // The high bit of each byte is set for non ASCII characters.
+  for (; i + 16 <= length; i += 16) {
+    __m128i block =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+    if (_mm_movemask_epi8(block))
+      return false;
+  }
+#endif
+
+  for (; i < length; ++i) {
+    if (!rlz_lib::IsAscii(text[i]))
+      return false;
+  }
+
+  return true;
+}
+
+// Continues crc, the CRC of the preceding bytes, with length bytes of buf.
+uLong ContinueCrc32(uLong crc, const unsigned char* buf, int length) {
+#if defined(ARCH_CPU_X86_FAMILY)
+  if (length >= 64 && HasClmul()) {
+    int folded_length = length & ~15;
+    crc = ~ClmulCrc32(buf, folded_length, ~static_cast<unsigned int>(crc));
+    buf += folded_length;
+    length -= folded_length;
+  }
+#endif
+
+  return crc32(crc, buf, length);
+}
+
+}  // namespace anonymous
+
 namespace rlz_lib {
 
 int Crc32(const unsigned char* buf, int length) {
-  return crc32(0L, buf, length);
+  return ContinueCrc32(0, buf, length);
+}
+
+bool Crc32(const char* text, int length, int* crc) {
+  if (!crc) {
+    ASSERT_STRING("Crc32: crc is NULL.");
+    return false;
+  }
+
+  *crc = 0;
+  if (!text || length < 0) {
+    ASSERT_STRING("Crc32: Invalid text.");
+    return false;
+  }
+
+  if (!IsAsciiBuffer(text, length))
+    return false;
+
+  *crc = Crc32(reinterpret_cast<const unsigned char*>(text), length);
+  return true;
 }
 
 bool Crc32(const char* text, int* crc) {
@@ -23,13 +178,20 @@ bool Crc32(const char* text, int* crc) {
   }
 
   *crc = 0;
-  for (int i = 0; text[i]; i++) {
-    if (!IsAscii(text[i]))
-      return false;
+  return Crc32(text, static_cast<int>(strlen(text)), crc);
+}
 
-    *crc = crc32(*crc, reinterpret_cast<const unsigned char*>(text + i), 1);
+bool UpdateCrc32(const char* text, int length, int* crc) {
+  if (!crc || !text || length < 0) {
+    ASSERT_STRING("UpdateCrc32: Invalid arguments.");
+    return false;
   }
 
+  if (!IsAsciiBuffer(text, length))
+    return false;
+
+  *crc = ContinueCrc32(static_cast<unsigned int>(*crc),
+                       reinterpret_cast<const unsigned char*>(text), length);
   return true;
 }
 
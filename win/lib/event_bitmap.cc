@@ -0,0 +1,149 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The compact storage of the product events as a single bitmap value.
+
+#include "rlz/win/lib/event_bitmap.h"
+
+#include <string.h>
+
+#include "base/atomicops.h"
+#include "base/string_piece.h"
+#include "rlz/win/lib/assert.h"
+#include "rlz/win/lib/lib_values.h"
+
+namespace {
+
+COMPILE_ASSERT(rlz_lib::LAST_EVENT <= 8, event_bits_do_not_fit_in_a_byte);
+
+// Set once at startup, so the load does not need a barrier.
+base::subtle::Atomic32 g_enabled = 0;
+
+// Legacy event value names are <AccessPointName><EventName>, 2 + 1 chars.
+const int kLegacyValueNameLength = 3;
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+EventBitmap::EventBitmap() : size_(LAST_ACCESS_POINT) {
+  COMPILE_ASSERT(LAST_ACCESS_POINT <= kMaxSize,
+                 access_points_do_not_fit_in_the_bitmap);
+  memset(bits_, 0, sizeof(bits_));
+}
+
+// static
+void EventBitmap::SetEnabled(bool enabled) {
+  base::subtle::NoBarrier_Store(&g_enabled, enabled ? 1 : 0);
+}
+
+// static
+bool EventBitmap::IsEnabled() {
+  return base::subtle::NoBarrier_Load(&g_enabled) != 0;
+}
+
+bool EventBitmap::Read(HKEY key, const wchar_t* value_name) {
+  memset(bits_, 0, sizeof(bits_));
+  size_ = LAST_ACCESS_POINT;
+
+  DWORD type = REG_NONE;
+  DWORD size = sizeof(bits_);
+  LONG result = RegQueryValueExW(key, value_name, NULL, &type, bits_, &size);
+  if (result == ERROR_FILE_NOT_FOUND)
+    return true;
+
+  if (result != ERROR_SUCCESS || type != REG_BINARY) {
+    ASSERT_STRING("EventBitmap::Read: Could not read the events bitmap");
+    memset(bits_, 0, sizeof(bits_));
+    return false;
+  }
+
+  if (size > size_)
+    size_ = size;
+  return true;
+}
+
+bool EventBitmap::Write(HKEY key, const wchar_t* value_name) const {
+  if (empty()) {
+    LONG result = RegDeleteValueW(key, value_name);
+    return result == ERROR_SUCCESS || result == ERROR_FILE_NOT_FOUND;
+  }
+
+  return RegSetValueExW(key, value_name, 0, REG_BINARY, bits_, size_) ==
+      ERROR_SUCCESS;
+}
+
+void EventBitmap::AddLegacyEvents(HKEY key) {
+  wchar_t name[kLegacyValueNameLength + 1];
+  for (DWORD index = 0; ; ++index) {
+    DWORD name_size = arraysize(name);
+    LONG result = RegEnumValueW(key, index, name, &name_size, NULL, NULL,
+                                NULL, NULL);
+    if (result == ERROR_MORE_DATA)
+      continue;  // Too long to be an event.
+    if (result != ERROR_SUCCESS)
+      break;
+
+    if (name_size != kLegacyValueNameLength)
+      continue;
+
+    char ascii_name[kLegacyValueNameLength];
+    bool is_ascii = true;
+    for (int i = 0; i < kLegacyValueNameLength; ++i) {
+      is_ascii &= name[i] < 0x80;
+      ascii_name[i] = static_cast<char>(name[i]);
+    }
+
+    AccessPoint point;
+    Event event;
+    base::StringPiece name_piece(ascii_name, kLegacyValueNameLength);
+    if (!is_ascii ||
+        !GetAccessPointFromName(name_piece.substr(0, 2), &point) ||
+        point == NO_ACCESS_POINT ||
+        !GetEventFromName(name_piece.substr(2), &event) ||
+        event == INVALID_EVENT)
+      continue;
+
+    Set(point, event);
+  }
+}
+
+bool EventBitmap::Has(AccessPoint point, Event event) const {
+  return (bits_[point] & (1 << event)) != 0;
+}
+
+void EventBitmap::Set(AccessPoint point, Event event) {
+  bits_[point] |= 1 << event;
+}
+
+void EventBitmap::Clear(AccessPoint point, Event event) {
+  bits_[point] &= static_cast<BYTE>(~(1 << event));
+}
+
+bool EventBitmap::empty() const {
+  for (DWORD i = 0; i < size_; ++i) {
+    if (bits_[i])
+      return false;
+  }
+  return true;
+}
+
+void EventBitmap::AppendCgi(std::string* cgi) const {
+  bool first = true;
+  for (int point = NO_ACCESS_POINT + 1; point < LAST_ACCESS_POINT; ++point) {
+    int bits = bits_[point];
+    for (int event = INVALID_EVENT + 1; bits && event < LAST_EVENT; ++event) {
+      if (!(bits & (1 << event)))
+        continue;
+
+      if (!first)
+        cgi->push_back(kEventsCgiSeparator);
+      first = false;
+      cgi->append(GetAccessPointName(static_cast<AccessPoint>(point)));
+      cgi->append(GetEventName(static_cast<Event>(event)));
+    }
+  }
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,65 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The compact storage of the product events as a single bitmap value.
+
+#ifndef RLZ_WIN_LIB_EVENT_BITMAP_H_
+#define RLZ_WIN_LIB_EVENT_BITMAP_H_
+
+#include <windows.h>
+
+#include "base/basictypes.h"
+#include "rlz/win/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+// The events of a product, stored as one REG_BINARY value in which byte i
+// holds the events of access point i as (1 << event) bits. Bytes beyond the
+// known access points are kept as read, so that the bitmaps of newer clients
+// survive a rewrite.
+class EventBitmap {
+ public:
+  EventBitmap();
+
+  // Whether new events are written as bitmaps. When disabled, events are
+  // written with one registry value per event, as older clients expect.
+  // Bitmaps are always read.
+  static void SetEnabled(bool enabled);
+  static bool IsEnabled();
+
+  // Reads the bitmap from |value_name| of |key|. A missing value is an empty
+  // bitmap. Returns false if the value could not be read.
+  bool Read(HKEY key, const wchar_t* value_name);
+
+  // Writes the bitmap to |value_name| of |key|, or deletes the value if the
+  // bitmap is empty.
+  bool Write(HKEY key, const wchar_t* value_name) const;
+
+  // Adds the events stored with one value per event in |key|, the legacy
+  // layout.
+  void AddLegacyEvents(HKEY key);
+
+  bool Has(AccessPoint point, Event event) const;
+  void Set(AccessPoint point, Event event);
+  void Clear(AccessPoint point, Event event);
+  bool empty() const;
+
+  // Appends the events to |cgi| as kEventsCgiSeparator separated
+  // <AccessPointName><EventName> pairs, in access point and event order.
+  void AppendCgi(std::string* cgi) const;
+
+ private:
+  // Access points are numbered below 256, so the bitmap never needs more
+  // bytes.
+  static const int kMaxSize = 256;
+
+  BYTE bits_[kMaxSize];
+  DWORD size_;
+
+  DISALLOW_COPY_AND_ASSIGN(EventBitmap);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_EVENT_BITMAP_H_
@@ -0,0 +1,140 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// A test application for the compact event storage.
+//
+// These tests should not be executed on the build server:
+// - They assert for the failed cases.
+// - They modify machine state (registry).
+//
+// These tests require write access to HKLM and HKCU.
+
+#include <string>
+
+#include "base/logging.h"
+#include "base/win/registry.h"
+#include "testing/gmock/include/gmock/gmock.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+#include "rlz/win/lib/event_bitmap.h"
+#include "rlz/win/lib/lib_values.h"
+#include "rlz/win/lib/rlz_lib.h"
+#include "rlz/win/lib/write_batch.h"
+#include "rlz/win/test/rlz_test_helpers.h"
+
+class EventBitmapTest : public RlzLibTestBase {
+ protected:
+  virtual void TearDown() {
+    rlz_lib::EnableCompactEventStorage(false);
+    RlzLibTestBase::TearDown();
+  }
+};
+
+TEST_F(EventBitmapTest, AppendCgi) {
+  rlz_lib::EventBitmap bitmap;
+  EXPECT_TRUE(bitmap.empty());
+
+  bitmap.Set(rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL);
+  bitmap.Set(rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE);
+  bitmap.Set(rlz_lib::IE_HOME_PAGE, rlz_lib::ACTIVATE);
+  EXPECT_FALSE(bitmap.empty());
+  EXPECT_TRUE(bitmap.Has(rlz_lib::IE_HOME_PAGE, rlz_lib::ACTIVATE));
+  EXPECT_FALSE(bitmap.Has(rlz_lib::IE_HOME_PAGE, rlz_lib::SET_TO_GOOGLE));
+
+  std::string cgi("events=");
+  bitmap.AppendCgi(&cgi);
+  EXPECT_EQ("events=I7S,W1I,W1A", cgi);
+
+  bitmap.Clear(rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL);
+  bitmap.Clear(rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE);
+  cgi.clear();
+  bitmap.AppendCgi(&cgi);
+  EXPECT_EQ("W1A", cgi);
+
+  bitmap.Clear(rlz_lib::IE_HOME_PAGE, rlz_lib::ACTIVATE);
+  EXPECT_TRUE(bitmap.empty());
+}
+
+TEST_F(EventBitmapTest, KeepsLegacyEvents) {
+  char cgi[50];
+  rlz_lib::Product product = rlz_lib::TOOLBAR_NOTIFIER;
+
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(product));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(product, rlz_lib::IE_HOME_PAGE,
+                                          rlz_lib::INSTALL));
+
+  rlz_lib::EnableCompactEventStorage(true);
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(product,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(product, cgi, 50));
+  EXPECT_STREQ("events=I7S,W1I", cgi);
+
+  // The legacy event is left for older clients, which do not read the bitmap.
+  {
+    DWORD value = 0;
+    base::win::RegKey key;
+    EXPECT_TRUE(rlz_lib::GetEventsRegKey(HKEY_CURRENT_USER,
+                                         rlz_lib::kEventsSubkeyName, &product,
+                                         KEY_READ, &key));
+    EXPECT_EQ(ERROR_SUCCESS, key.ReadValueDW(L"W1I", &value));
+    EXPECT_EQ(static_cast<DWORD>(1), value);
+  }
+
+  // Events recorded by older clients are merged with the bitmap.
+  rlz_lib::EnableCompactEventStorage(false);
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(product, rlz_lib::IETB_SEARCH_BOX,
+                                          rlz_lib::INSTALL));
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(product, cgi, 50));
+  EXPECT_STREQ("events=I7S,W1I,T4I", cgi);
+
+  EXPECT_TRUE(rlz_lib::ClearProductEvent(product, rlz_lib::IE_DEFAULT_SEARCH,
+                                         rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::ClearProductEvent(product, rlz_lib::IETB_SEARCH_BOX,
+                                         rlz_lib::INSTALL));
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(product, cgi, 50));
+  EXPECT_STREQ("events=W1I", cgi);
+
+  // Once an older client has cleared it, the event is gone.
+  {
+    base::win::RegKey key;
+    EXPECT_TRUE(rlz_lib::GetEventsRegKey(HKEY_CURRENT_USER,
+                                         rlz_lib::kEventsSubkeyName, &product,
+                                         KEY_WRITE, &key));
+    EXPECT_EQ(ERROR_SUCCESS, key.DeleteValue(L"W1I"));
+  }
+  EXPECT_FALSE(rlz_lib::GetProductEventsAsCgi(product, cgi, 50));
+
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(product));
+  EXPECT_FALSE(rlz_lib::GetProductEventsAsCgi(product, cgi, 50));
+  EXPECT_STREQ("", cgi);
+}
+
+TEST_F(EventBitmapTest, StatefulEvents) {
+  char cgi[50];
+  rlz_lib::Product product = rlz_lib::TOOLBAR_NOTIFIER;
+
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(product));
+  rlz_lib::EnableCompactEventStorage(true);
+
+  rlz_lib::RlzWriteBatch batch;
+  EXPECT_TRUE(batch.RecordStatefulEvent(product, rlz_lib::IE_HOME_PAGE,
+                                        rlz_lib::INSTALL));
+  EXPECT_TRUE(batch.Commit(NULL, false));
+
+  // Stateful events are not recorded again, whatever the storage.
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(product, rlz_lib::IE_HOME_PAGE,
+                                          rlz_lib::INSTALL));
+  EXPECT_FALSE(rlz_lib::GetProductEventsAsCgi(product, cgi, 50));
+
+  rlz_lib::EnableCompactEventStorage(false);
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(product, rlz_lib::IE_HOME_PAGE,
+                                          rlz_lib::INSTALL));
+  EXPECT_FALSE(rlz_lib::GetProductEventsAsCgi(product, cgi, 50));
+
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(product));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(product, rlz_lib::IE_HOME_PAGE,
+                                          rlz_lib::INSTALL));
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(product, cgi, 50));
+  EXPECT_STREQ("events=W1I", cgi);
+}
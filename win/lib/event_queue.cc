@@ -0,0 +1,286 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// An optional in-process queue of the product events being recorded.
+
+#include "rlz/win/lib/event_queue.h"
+
+#include <windows.h>
+
+#include "base/atomicops.h"
+#include "base/basictypes.h"
+#include "base/lazy_instance.h"
+#include "base/synchronization/lock.h"
+#include "rlz/win/lib/lib_mutex.h"
+#include "rlz/win/lib/lib_values.h"
+#include "rlz/win/lib/user_key.h"
+#include "rlz/win/lib/write_batch.h"
+
+namespace {
+
+using base::subtle::Atomic32;
+
+COMPILE_ASSERT(rlz_lib::LAST_EVENT <= 32, event_bits_do_not_fit_in_a_word);
+
+// Products are numbered from 1. Events of newer products are recorded
+// directly.
+const int kMaxProducts = 16;
+
+// The queued events, as (1 << event) bits per product and access point.
+Atomic32 g_events[kMaxProducts][rlz_lib::LAST_ACCESS_POINT];
+
+Atomic32 g_enabled = 0;
+Atomic32 g_shut_down = 0;
+
+// Set when events may have been queued since the last flush.
+Atomic32 g_has_events = 0;
+
+// The number of flushes writing events they took from the queue.
+Atomic32 g_flushing = 0;
+
+// Set while the flush timer is armed.
+Atomic32 g_flush_scheduled = 0;
+
+// The flushes of the timer which failed in a row. Past kMaxTimerRetries, the
+// timer is not armed again until another event is queued; the events stay
+// queued for the next library call which reads them.
+const Atomic32 kMaxTimerRetries = 5;
+Atomic32 g_timer_failures = 0;
+
+struct FlushTimer {
+  FlushTimer() : timer(NULL) {}
+
+  base::Lock lock;
+  HANDLE timer;
+};
+
+// Leaky, so that it can also be used from a DLL without an AtExitManager.
+base::LazyInstance<FlushTimer, base::LeakyLazyInstanceTraits<FlushTimer> >
+    g_flush_timer(base::LINKER_INITIALIZED);
+
+void AtomicOr(volatile Atomic32* value, Atomic32 bits) {
+  Atomic32 old_value = base::subtle::NoBarrier_Load(value);
+  for (;;) {
+    Atomic32 previous = base::subtle::NoBarrier_CompareAndSwap(
+        value, old_value, old_value | bits);
+    if (previous == old_value)
+      return;
+    old_value = previous;
+  }
+}
+
+// Writes the queued events. Puts them back in the queue if they could not be
+// written. The caller holds the RLZ lock.
+bool WriteQueuedEvents() {
+  Atomic32 taken[kMaxProducts][rlz_lib::LAST_ACCESS_POINT] = { 0 };
+  rlz_lib::RlzWriteBatch batch;
+  for (int product = 1; product < kMaxProducts; ++product) {
+    for (int point = rlz_lib::NO_ACCESS_POINT + 1;
+         point < rlz_lib::LAST_ACCESS_POINT; ++point) {
+      Atomic32 bits = base::subtle::NoBarrier_AtomicExchange(
+          &g_events[product][point], 0);
+      taken[product][point] = bits;
+      for (int event = rlz_lib::INVALID_EVENT + 1;
+           bits && event < rlz_lib::LAST_EVENT; ++event) {
+        if (bits & (1 << event)) {
+          batch.RecordProductEvent(static_cast<rlz_lib::Product>(product),
+                                   static_cast<rlz_lib::AccessPoint>(point),
+                                   static_cast<rlz_lib::Event>(event));
+        }
+      }
+    }
+  }
+
+  if (batch.empty() || batch.Commit(NULL, false))
+    return true;
+
+  for (int product = 1; product < kMaxProducts; ++product) {
+    for (int point = rlz_lib::NO_ACCESS_POINT + 1;
+         point < rlz_lib::LAST_ACCESS_POINT; ++point) {
+      if (taken[product][point])
+        AtomicOr(&g_events[product][point], taken[product][point]);
+    }
+  }
+  base::subtle::Release_Store(&g_has_events, 1);
+  return false;
+}
+
+// Takes the flush timer, which the caller deletes without the lock, which its
+// callback may take.
+HANDLE TakeFlushTimer() {
+  FlushTimer* flush_timer = g_flush_timer.Pointer();
+  base::AutoLock auto_lock(flush_timer->lock);
+  HANDLE timer = flush_timer->timer;
+  flush_timer->timer = NULL;
+  return timer;
+}
+
+void ScheduleFlush();
+
+VOID CALLBACK FlushTimerCallback(PVOID context, BOOLEAN timer_fired) {
+  // Once shut down, the queued events are written by Shutdown(), if at all.
+  if (base::subtle::NoBarrier_Load(&g_shut_down))
+    return;
+
+  // Events queued from now on arm the timer again.
+  base::subtle::NoBarrier_Store(&g_flush_scheduled, 0);
+  if (rlz_lib::EventQueue::Flush()) {
+    base::subtle::NoBarrier_Store(&g_timer_failures, 0);
+  } else if (base::subtle::NoBarrier_AtomicIncrement(&g_timer_failures, 1) <
+             kMaxTimerRetries) {
+    ScheduleFlush();
+  }
+}
+
+void ScheduleFlush() {
+  if (base::subtle::NoBarrier_CompareAndSwap(&g_flush_scheduled, 0, 1) != 0)
+    return;
+
+  FlushTimer* flush_timer = g_flush_timer.Pointer();
+  base::AutoLock auto_lock(flush_timer->lock);
+  if (base::subtle::NoBarrier_Load(&g_shut_down))
+    return;
+
+  // The previous timer has fired, but its callback may still be running.
+  if (flush_timer->timer)
+    DeleteTimerQueueTimer(NULL, flush_timer->timer, NULL);
+
+  if (!CreateTimerQueueTimer(&flush_timer->timer, NULL, FlushTimerCallback,
+                             NULL, rlz_lib::EventQueue::kFlushDelayMs, 0,
+                             WT_EXECUTEONLYONCE)) {
+    // The events are written by the next library call which reads them.
+    flush_timer->timer = NULL;
+    base::subtle::NoBarrier_Store(&g_flush_scheduled, 0);
+  }
+}
+
+// Set once the module holding the flush timer callback is pinned.
+Atomic32 g_module_pinned = 0;
+
+// Keeps the module loaded until the process exits, since DllMain can not wait
+// for a flush timer callback in progress. Returns false if the module could
+// not be pinned.
+bool PinModule() {
+  if (base::subtle::Acquire_Load(&g_module_pinned))
+    return true;
+
+  HMODULE module = NULL;
+  if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+                          GET_MODULE_HANDLE_EX_FLAG_PIN,
+                          reinterpret_cast<LPCWSTR>(&FlushTimerCallback),
+                          &module))
+    return false;
+
+  base::subtle::Release_Store(&g_module_pinned, 1);
+  return true;
+}
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+// static
+void EventQueue::SetEnabled(bool enabled) {
+  // Without a pinned module, events are not queued, so no timer is armed.
+  if (enabled && !PinModule())
+    enabled = false;
+
+  base::subtle::NoBarrier_Store(&g_enabled, enabled ? 1 : 0);
+  if (!enabled)
+    Flush();
+}
+
+// static
+bool EventQueue::IsEnabled() {
+  return base::subtle::NoBarrier_Load(&g_enabled) != 0;
+}
+
+// static
+bool EventQueue::Push(Product product, AccessPoint point, Event event) {
+  if (!IsEnabled() || base::subtle::NoBarrier_Load(&g_shut_down))
+    return false;
+
+  if (product <= 0 || product >= kMaxProducts ||
+      point <= NO_ACCESS_POINT || point >= LAST_ACCESS_POINT ||
+      event <= INVALID_EVENT || event >= LAST_EVENT)
+    return false;
+
+  // Events which could not be written are recorded directly, so that the
+  // caller gets the failure: a queued event must always be writable.
+  const char* point_name = GetAccessPointName(point);
+  const char* event_name = GetEventName(event);
+  if (!GetProductName(product) || !point_name || !point_name[0] ||
+      !event_name || !event_name[0])
+    return false;
+
+  if (!SupplementaryBranding::GetBrand().empty())
+    return false;
+
+  // Cheap: the integrity level of the process is cached.
+  if (!UserKey::HasAccess(HKEY_CURRENT_USER, true))
+    return false;
+
+  const Atomic32 bit = 1 << event;
+  volatile Atomic32* events = &g_events[product][point];
+  if (base::subtle::NoBarrier_Load(events) & bit)
+    return true;
+
+  AtomicOr(events, bit);
+  base::subtle::Release_Store(&g_has_events, 1);
+  ScheduleFlush();
+  return true;
+}
+
+// static
+bool EventQueue::Flush() {
+  // Without queued events, or a flush writing the ones it took, all the
+  // events are written. A flush announces itself before it takes the flag.
+  if (!base::subtle::Acquire_Load(&g_has_events) &&
+      !base::subtle::Acquire_Load(&g_flushing))
+    return true;
+
+  // Flushes are serialized by the lock, so that none returns before the
+  // events another one took are written.
+  LibMutex lock;
+  if (lock.failed() || !SupplementaryBranding::GetBrand().empty())
+    return false;
+
+  base::subtle::Barrier_AtomicIncrement(&g_flushing, 1);
+  bool result = true;
+  if (base::subtle::NoBarrier_AtomicExchange(&g_has_events, 0))
+    result = WriteQueuedEvents();
+  base::subtle::Barrier_AtomicIncrement(&g_flushing, -1);
+  return result;
+}
+
+// static
+bool EventQueue::Shutdown() {
+  base::subtle::NoBarrier_Store(&g_shut_down, 1);
+
+  HANDLE timer = TakeFlushTimer();
+  if (timer)
+    DeleteTimerQueueTimer(NULL, timer, INVALID_HANDLE_VALUE);
+
+  return Flush();
+}
+
+// static
+void EventQueue::Detach() {
+  base::subtle::NoBarrier_Store(&g_shut_down, 1);
+
+  // Once events were queued, the module is pinned and only detached when the
+  // process exits. Nothing may wait under the loader lock, not even for the
+  // timer lock, which ScheduleFlush() holds while it arms the timer.
+  FlushTimer* flush_timer = g_flush_timer.Pointer();
+  if (!flush_timer->lock.Try())
+    return;
+  HANDLE timer = flush_timer->timer;
+  flush_timer->timer = NULL;
+  flush_timer->lock.Release();
+
+  if (timer)
+    DeleteTimerQueueTimer(NULL, timer, NULL);
+}
+
+}  // namespace rlz_lib
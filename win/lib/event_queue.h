@@ -0,0 +1,63 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// An optional in-process queue of the product events being recorded, written
+// to the registry behind the callers' backs.
+
+#ifndef RLZ_WIN_LIB_EVENT_QUEUE_H_
+#define RLZ_WIN_LIB_EVENT_QUEUE_H_
+
+#include "rlz/win/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+// Queued events are kept as one bit per product, access point and event, set
+// without a lock, so queuing an event already queued does nothing. They are
+// written by a single RlzWriteBatch, from a timer kFlushDelayMs after the
+// first event of a batch was queued, or as soon as a library call reads or
+// clears the events of this process.
+//
+// Only the events of the user running the process, outside of a
+// SupplementaryBranding, are queued.
+class EventQueue {
+ public:
+  static const int kFlushDelayMs = 1000;
+
+  // Enables queuing in this process. Disabling it writes the queued events.
+  // Enabling it pins the module until the process exits, so that the flush
+  // timer never runs after the library was unloaded.
+  static void SetEnabled(bool enabled);
+  static bool IsEnabled();
+
+  // Queues an event. Returns false if the event must be recorded directly:
+  // the queue is disabled or shut down, the event is not for the current
+  // hive, or it is invalid or can not be written, e.g. from a low integrity
+  // process.
+  static bool Push(Product product, AccessPoint point, Event event);
+
+  // Writes the queued events. Cheap when nothing is queued. Events stay
+  // queued, and false is returned, if they could not be written, e.g. because
+  // the RLZ lock timed out or because the calling thread is within a
+  // SupplementaryBranding.
+  static bool Flush();
+
+  // Stops the flush timer, waiting for a flush in progress on the timer
+  // thread, and writes the queued events. Later events are recorded
+  // directly. Must not be called from DllMain.
+  static bool Shutdown();
+
+  // Called from DllMain when the library is unloaded, which happens only when
+  // the process exits once queuing was enabled: stops the flush timer without
+  // waiting for it, and drops the queued events, since writing them would
+  // wait for the RLZ lock under the loader lock.
+  static void Detach();
+
+ private:
+  EventQueue() {}
+  ~EventQueue() {}
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_EVENT_QUEUE_H_
@@ -0,0 +1,782 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The memory-mapped file backend of the RLZ state.
+
+#include "rlz/win/lib/file_value_store.h"
+
+#include <windows.h>
+#include <shlobj.h>
+#include <stddef.h>
+#include <string.h>
+#include <map>
+
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/string_util.h"
+#include "base/synchronization/lock.h"
+#include "base/win/registry.h"
+#include "rlz/win/lib/assert.h"
+#include "rlz/win/lib/event_bitmap.h"
+#include "rlz/win/lib/lib_mutex.h"
+#include "rlz/win/lib/registry_value_store.h"
+
+namespace {
+
+// Bumped, with the file names, when the layout changes; files of another
+// layout are left alone.
+const DWORD kStoreMagic = 0x535a4c52;  // "RLZS"
+const DWORD kStoreVersion = 1;
+
+// Room for the access points and products of newer clients.
+const int kMaxStoredAccessPoints = 128;
+const int kMaxStoredProducts = 16;
+
+COMPILE_ASSERT(rlz_lib::LAST_ACCESS_POINT <= kMaxStoredAccessPoints,
+               access_points_fit_in_the_store);
+COMPILE_ASSERT(rlz_lib::LAST_EVENT <= 8, events_fit_in_a_byte);
+
+// A reader racing with that many commits gives up.
+const int kMaxReadTries = 1000;
+
+const wchar_t kStoreDirectory[] = L"Google\\Rlz";
+const wchar_t kUserStoreName[] = L"RlzState1";
+const wchar_t kMachineStoreName[] = L"RlzMachineState1";
+const wchar_t kStoreExtension[] = L".dat";
+
+const wchar_t kProfileListKeyName[] =
+    L"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\ProfileList\\";
+const wchar_t kProfileImagePathValueName[] = L"ProfileImagePath";
+
+// The start of the files. The two copies of the state follow it, at
+// kBlockAlignment aligned offsets.
+struct StoreHeader {
+  DWORD magic;  // Written last when the file is created.
+  DWORD version;
+  DWORD block_size;
+  DWORD reserved;
+  volatile LONG sequence;  // The copy sequence % 2 is current.
+};
+
+const size_t kBlockAlignment = 64;
+const size_t kHeaderSize = kBlockAlignment;
+COMPILE_ASSERT(sizeof(StoreHeader) <= kHeaderSize, header_fits);
+
+size_t GetBlockOffset(size_t block_size, int copy) {
+  size_t aligned_size = (block_size + kBlockAlignment - 1) &
+      ~(kBlockAlignment - 1);
+  return kHeaderSize + copy * aligned_size;
+}
+
+void ToBits(const rlz_lib::EventBitmap& events, BYTE* bits) {
+  memset(bits, 0, kMaxStoredAccessPoints);
+  for (int point = 0; point < rlz_lib::LAST_ACCESS_POINT; ++point) {
+    for (int event = 0; event < rlz_lib::LAST_EVENT; ++event) {
+      if (events.Has(static_cast<rlz_lib::AccessPoint>(point),
+                     static_cast<rlz_lib::Event>(event)))
+        bits[point] |= 1 << event;
+    }
+  }
+}
+
+void FromBits(const BYTE* bits, rlz_lib::EventBitmap* events) {
+  for (int point = 0; point < rlz_lib::LAST_ACCESS_POINT; ++point) {
+    for (int event = 0; event < rlz_lib::LAST_EVENT; ++event) {
+      if (bits[point] & (1 << event))
+        events->Set(static_cast<rlz_lib::AccessPoint>(point),
+                    static_cast<rlz_lib::Event>(event));
+    }
+  }
+}
+
+bool IsStoredProduct(rlz_lib::Product product) {
+  return product > 0 && product < kMaxStoredProducts &&
+      rlz_lib::GetProductName(product);
+}
+
+bool IsStoredAccessPoint(rlz_lib::AccessPoint point) {
+  return point > rlz_lib::NO_ACCESS_POINT &&
+      point < rlz_lib::LAST_ACCESS_POINT;
+}
+
+// The directories of the files: the ones used by the tests, and the shell
+// folders, which are looked up once.
+struct StoreDirectories {
+  base::Lock lock;
+  std::wstring user_directory;
+  std::wstring machine_directory;
+  std::map<int, std::wstring> folders;
+};
+
+// Leaky, so that it can also be used from a DLL without an AtExitManager.
+base::LazyInstance<StoreDirectories,
+                   base::LeakyLazyInstanceTraits<StoreDirectories> >
+    g_directories(base::LINKER_INITIALIZED);
+
+bool GetFolderPath(int folder, std::wstring* path) {
+  StoreDirectories& directories = g_directories.Get();
+  {
+    base::AutoLock auto_lock(directories.lock);
+    std::map<int, std::wstring>::const_iterator it =
+        directories.folders.find(folder);
+    if (it != directories.folders.end()) {
+      *path = it->second;
+      return true;
+    }
+  }
+
+  wchar_t buffer[MAX_PATH];
+  if (FAILED(SHGetFolderPathW(NULL, folder, NULL, SHGFP_TYPE_CURRENT,
+                              buffer)))
+    return false;
+
+  *path = buffer;
+  base::AutoLock auto_lock(directories.lock);
+  directories.folders[folder] = *path;
+  return true;
+}
+
+// Returns the local application data directory of the user |sid|, from the
+// location of the profile of the user, and the location of the directory in
+// the profile of the user running the process.
+bool GetLocalAppDataOfUser(const wchar_t* sid, std::wstring* directory) {
+  std::wstring profile;
+  std::wstring local_app_data;
+  if (!GetFolderPath(CSIDL_PROFILE, &profile) ||
+      !GetFolderPath(CSIDL_LOCAL_APPDATA, &local_app_data) ||
+      !StartsWith(local_app_data, profile, false))
+    return false;
+
+  std::wstring key_name(kProfileListKeyName);
+  key_name += sid;
+  base::win::RegKey key(HKEY_LOCAL_MACHINE, key_name.c_str(), KEY_READ);
+  std::wstring image_path;
+  if (key.ReadValue(kProfileImagePathValueName, &image_path) !=
+      ERROR_SUCCESS)
+    return false;
+
+  wchar_t expanded[MAX_PATH];
+  DWORD length = ExpandEnvironmentStringsW(image_path.c_str(), expanded,
+                                           arraysize(expanded));
+  if (!length || length > arraysize(expanded))
+    return false;
+
+  *directory = expanded;
+  directory->append(local_app_data, profile.size(), std::wstring::npos);
+  return true;
+}
+
+bool GetUserStorePath(const wchar_t* sid, std::wstring* path) {
+  std::wstring test_directory;
+  {
+    StoreDirectories& directories = g_directories.Get();
+    base::AutoLock auto_lock(directories.lock);
+    test_directory = directories.user_directory;
+  }
+
+  std::wstring directory;
+  if (!test_directory.empty()) {
+    directory = test_directory + L"\\" + (sid && sid[0] ? sid : L"current");
+  } else if (!sid || !sid[0]) {
+    if (!GetFolderPath(CSIDL_LOCAL_APPDATA, &directory))
+      return false;
+  } else if (!GetLocalAppDataOfUser(sid, &directory)) {
+    return false;
+  }
+
+  *path = directory + L"\\" + kStoreDirectory + L"\\" + kUserStoreName;
+  const std::wstring& brand = rlz_lib::SupplementaryBranding::GetBrand();
+  if (!brand.empty())
+    *path += L"-" + brand;
+  *path += kStoreExtension;
+  return true;
+}
+
+bool GetMachineStorePath(std::wstring* path) {
+  std::wstring directory;
+  {
+    StoreDirectories& directories = g_directories.Get();
+    base::AutoLock auto_lock(directories.lock);
+    directory = directories.machine_directory;
+  }
+
+  if (directory.empty() && !GetFolderPath(CSIDL_COMMON_APPDATA, &directory))
+    return false;
+
+  *path = directory + L"\\" + kStoreDirectory + L"\\" + kMachineStoreName +
+      kStoreExtension;
+  return true;
+}
+
+typedef std::map<std::wstring, rlz_lib::MappedStateFile*> FileMap;
+
+// The files mapped by this process.
+struct OpenFiles {
+  base::Lock lock;
+  FileMap files;
+};
+
+// Leaky, so that it can also be used from a DLL without an AtExitManager.
+base::LazyInstance<OpenFiles, base::LeakyLazyInstanceTraits<OpenFiles> >
+    g_open_files(base::LINKER_INITIALIZED);
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+struct UserStateBlock {
+  DWORD migrated;
+  char rlzs[kMaxStoredAccessPoints][kMaxRlzLength + 1];
+  struct ProductState {
+    BYTE events[kMaxStoredAccessPoints];
+    BYTE stateful_events[kMaxStoredAccessPoints];
+    int64 ping_time;
+  } products[kMaxStoredProducts];
+};
+
+struct MachineStateBlock {
+  DWORD migrated;
+  char dcc[kMaxDccLength + 1];
+};
+
+// A mapped store file.
+class MappedStateFile {
+ public:
+  // Returns the mapping of the file at |path|, for blocks of |block_size|
+  // bytes, mapping the file, and creating it if it can, the first time.
+  // Returns NULL if the file could not be mapped, or has another layout.
+  static MappedStateFile* Get(const std::wstring& path, size_t block_size);
+
+  // Unmaps all the files.
+  static void CloseAll();
+
+  // Only called on the files which are no longer in use.
+  ~MappedStateFile() {
+    UnmapViewOfFile(view_);
+    CloseHandle(mapping_);
+    CloseHandle(file_);
+  }
+
+  bool writable() const { return writable_; }
+
+  // Copies |size| bytes at |offset| of the current copy of the state,
+  // without a lock.
+  bool Read(size_t offset, void* data, size_t size) const;
+
+  // Returns the other copy of the state, after copying the current one into
+  // it. The caller must hold the RLZ mutex until it commits it.
+  BYTE* BeginWrite();
+
+  // Flushes the copy returned by BeginWrite(), and makes it current.
+  bool Commit();
+
+ private:
+  MappedStateFile(HANDLE file, HANDLE mapping, BYTE* view, size_t block_size,
+                  bool writable)
+      : file_(file), mapping_(mapping), view_(view), block_size_(block_size),
+        writable_(writable) {
+  }
+
+  static MappedStateFile* Open(const std::wstring& path, size_t block_size);
+
+  StoreHeader* header() const { return reinterpret_cast<StoreHeader*>(view_); }
+
+  BYTE* block(LONG sequence) const {
+    return view_ + GetBlockOffset(block_size_, sequence & 1);
+  }
+
+  HANDLE file_;
+  HANDLE mapping_;
+  BYTE* view_;
+  size_t block_size_;
+  bool writable_;
+
+  DISALLOW_COPY_AND_ASSIGN(MappedStateFile);
+};
+
+// static
+MappedStateFile* MappedStateFile::Get(const std::wstring& path,
+                                      size_t block_size) {
+  OpenFiles& open_files = g_open_files.Get();
+  {
+    base::AutoLock auto_lock(open_files.lock);
+    FileMap::const_iterator it = open_files.files.find(path);
+    if (it != open_files.files.end())
+      return it->second;
+  }
+
+  // Serializes the creation of the file with the other processes.
+  LibMutex lock;
+  if (lock.failed())
+    return NULL;
+
+  MappedStateFile* file = Open(path, block_size);
+  if (!file)
+    return NULL;
+
+  // Files stay mapped, since lock free readers may be using them.
+  base::AutoLock auto_lock(open_files.lock);
+  std::pair<FileMap::iterator, bool> inserted =
+      open_files.files.insert(std::make_pair(path, file));
+  if (!inserted.second)
+    delete file;  // Mapped by another thread in between.
+  return inserted.first->second;
+}
+
+// static
+void MappedStateFile::CloseAll() {
+  OpenFiles& open_files = g_open_files.Get();
+  base::AutoLock auto_lock(open_files.lock);
+  for (FileMap::iterator it = open_files.files.begin();
+       it != open_files.files.end(); ++it)
+    delete it->second;
+  open_files.files.clear();
+}
+
+// static
+MappedStateFile* MappedStateFile::Open(const std::wstring& path,
+                                       size_t block_size) {
+  size_t directory_end = path.rfind(L'\\');
+  if (directory_end != std::wstring::npos)
+    SHCreateDirectoryExW(NULL, path.substr(0, directory_end).c_str(), NULL);
+
+  // Users which may not write the file of another user still read it.
+  bool writable = true;
+  HANDLE file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE |
+                            FILE_SHARE_DELETE, NULL, OPEN_ALWAYS,
+                            FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    writable = false;
+    file = CreateFileW(path.c_str(), GENERIC_READ,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                       NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+      return NULL;
+  }
+
+  // A new file is extended with zeros, which are an empty state.
+  const size_t file_size = GetBlockOffset(block_size, 2);
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size)) {
+    CloseHandle(file);
+    return NULL;
+  }
+  if (size.QuadPart < static_cast<LONGLONG>(file_size)) {
+    LARGE_INTEGER new_size;
+    new_size.QuadPart = file_size;
+    if (!writable || !SetFilePointerEx(file, new_size, NULL, FILE_BEGIN) ||
+        !SetEndOfFile(file)) {
+      CloseHandle(file);
+      return NULL;
+    }
+  }
+
+  HANDLE mapping = CreateFileMappingW(file, NULL,
+                                      writable ? PAGE_READWRITE : PAGE_READONLY,
+                                      0, static_cast<DWORD>(file_size), NULL);
+  if (!mapping) {
+    CloseHandle(file);
+    return NULL;
+  }
+
+  BYTE* view = reinterpret_cast<BYTE*>(MapViewOfFile(mapping,
+      writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, file_size));
+  if (!view) {
+    CloseHandle(mapping);
+    CloseHandle(file);
+    return NULL;
+  }
+
+  scoped_ptr<MappedStateFile> mapped_file(
+      new MappedStateFile(file, mapping, view, block_size, writable));
+
+  StoreHeader* header = mapped_file->header();
+  if (!header->magic && writable) {
+    header->version = kStoreVersion;
+    header->block_size = static_cast<DWORD>(block_size);
+    header->sequence = 0;
+    FlushViewOfFile(view, file_size);
+    MemoryBarrier();
+    header->magic = kStoreMagic;
+    FlushViewOfFile(header, sizeof(*header));
+  }
+
+  if (header->magic != kStoreMagic || header->version != kStoreVersion ||
+      header->block_size != block_size) {
+    ASSERT_STRING("MappedStateFile::Open: Unknown store file layout");
+    return NULL;
+  }
+
+  return mapped_file.release();
+}
+
+bool MappedStateFile::Read(size_t offset, void* data, size_t size) const {
+  DCHECK(offset + size <= block_size_);
+  for (int tries = 0; tries < kMaxReadTries; ++tries) {
+    LONG sequence = header()->sequence;
+    MemoryBarrier();
+    memcpy(data, block(sequence) + offset, size);
+    MemoryBarrier();
+
+    // The copy being read is only rewritten after a commit made the other
+    // one current.
+    if (header()->sequence == sequence)
+      return true;
+
+    YieldProcessor();
+  }
+
+  ASSERT_STRING("MappedStateFile::Read: No consistent copy of the state");
+  return false;
+}
+
+BYTE* MappedStateFile::BeginWrite() {
+  if (!writable_)
+    return NULL;
+
+  LONG sequence = header()->sequence;
+  BYTE* next = block(sequence + 1);
+  memcpy(next, block(sequence), block_size_);
+  return next;
+}
+
+bool MappedStateFile::Commit() {
+  LONG sequence = header()->sequence;
+  if (!FlushViewOfFile(block(sequence + 1), block_size_)) {
+    ASSERT_STRING("MappedStateFile::Commit: Could not flush the state");
+    return false;
+  }
+
+  InterlockedExchange(&header()->sequence, sequence + 1);
+  FlushViewOfFile(header(), sizeof(StoreHeader));
+  return true;
+}
+
+// static
+FileValueStore* FileValueStore::Open(const wchar_t* sid, bool write_access) {
+  std::wstring user_path;
+  if (!GetUserStorePath(sid, &user_path))
+    return NULL;
+
+  MappedStateFile* user_file = MappedStateFile::Get(user_path,
+                                                    sizeof(UserStateBlock));
+  if (!user_file || (write_access && !user_file->writable()))
+    return NULL;
+
+  // The DCC may still be read from a file of the machine that can not be
+  // written.
+  std::wstring machine_path;
+  MappedStateFile* machine_file = NULL;
+  if (GetMachineStorePath(&machine_path))
+    machine_file = MappedStateFile::Get(machine_path,
+                                        sizeof(MachineStateBlock));
+
+  scoped_ptr<FileValueStore> store(new FileValueStore(user_file,
+                                                      machine_file));
+  if (!store->Migrate(sid))
+    return NULL;
+
+  return store.release();
+}
+
+// static
+void FileValueStore::SetDirectoriesForTesting(
+    const wchar_t* user_directory, const wchar_t* machine_directory) {
+  StoreDirectories& directories = g_directories.Get();
+  {
+    base::AutoLock auto_lock(directories.lock);
+    directories.user_directory = user_directory ? user_directory : L"";
+    directories.machine_directory = machine_directory ? machine_directory :
+                                                        L"";
+  }
+  MappedStateFile::CloseAll();
+}
+
+FileValueStore::FileValueStore(MappedStateFile* user_file,
+                               MappedStateFile* machine_file)
+    : user_file_(user_file), machine_file_(machine_file), user_block_(NULL),
+      machine_block_(NULL) {
+}
+
+FileValueStore::~FileValueStore() {
+  // Uncommitted writes are dropped: the next writer starts from the current
+  // copy again.
+}
+
+bool FileValueStore::HasAccess(bool write_access) {
+  return !write_access || user_file_->writable();
+}
+
+bool FileValueStore::ReadAccessPointRlz(AccessPoint point, std::string* rlz) {
+  rlz->clear();
+  if (!IsStoredAccessPoint(point))
+    return false;
+
+  const size_t kRlzSize = kMaxRlzLength + 1;
+  char value[kRlzSize];
+  size_t offset = offsetof(UserStateBlock, rlzs) + point * kRlzSize;
+  if (user_block_) {
+    memcpy(value, user_block_->rlzs[point], kRlzSize);
+  } else if (!user_file_->Read(offset, value, kRlzSize)) {
+    return false;
+  }
+
+  value[kMaxRlzLength] = 0;
+  *rlz = value;
+  return true;
+}
+
+bool FileValueStore::WriteAccessPointRlz(AccessPoint point,
+                                         const std::string& rlz) {
+  if (!IsStoredAccessPoint(point) || rlz.size() > kMaxRlzLength)
+    return false;
+
+  UserStateBlock* block = BeginUserWrite();
+  if (!block)
+    return false;
+
+  base::strlcpy(block->rlzs[point], rlz.c_str(), kMaxRlzLength + 1);
+  return true;
+}
+
+bool FileValueStore::ReadProductEvents(Product product, EventBitmap* events) {
+  if (!IsStoredProduct(product))
+    return false;
+
+  BYTE bits[kMaxStoredAccessPoints];
+  size_t offset = offsetof(UserStateBlock, products) +
+      product * sizeof(UserStateBlock::ProductState) +
+      offsetof(UserStateBlock::ProductState, events);
+  if (user_block_) {
+    memcpy(bits, user_block_->products[product].events, sizeof(bits));
+  } else if (!user_file_->Read(offset, bits, sizeof(bits))) {
+    return false;
+  }
+
+  FromBits(bits, events);
+  return true;
+}
+
+bool FileValueStore::WriteProductEvents(Product product,
+                                        const EventBitmap& events) {
+  if (!IsStoredProduct(product))
+    return false;
+
+  UserStateBlock* block = BeginUserWrite();
+  if (!block)
+    return false;
+
+  ToBits(events, block->products[product].events);
+  return true;
+}
+
+bool FileValueStore::ReadStatefulEvents(Product product,
+                                        EventBitmap* events) {
+  if (!IsStoredProduct(product))
+    return false;
+
+  BYTE bits[kMaxStoredAccessPoints];
+  size_t offset = offsetof(UserStateBlock, products) +
+      product * sizeof(UserStateBlock::ProductState) +
+      offsetof(UserStateBlock::ProductState, stateful_events);
+  if (user_block_) {
+    memcpy(bits, user_block_->products[product].stateful_events,
+           sizeof(bits));
+  } else if (!user_file_->Read(offset, bits, sizeof(bits))) {
+    return false;
+  }
+
+  FromBits(bits, events);
+  return true;
+}
+
+bool FileValueStore::WriteStatefulEvents(Product product,
+                                         const EventBitmap& events) {
+  if (!IsStoredProduct(product))
+    return false;
+
+  UserStateBlock* block = BeginUserWrite();
+  if (!block)
+    return false;
+
+  ToBits(events, block->products[product].stateful_events);
+  return true;
+}
+
+bool FileValueStore::ReadPingTime(Product product, int64* time) {
+  *time = 0;
+  if (!IsStoredProduct(product))
+    return false;
+
+  size_t offset = offsetof(UserStateBlock, products) +
+      product * sizeof(UserStateBlock::ProductState) +
+      offsetof(UserStateBlock::ProductState, ping_time);
+  if (user_block_) {
+    *time = user_block_->products[product].ping_time;
+    return true;
+  }
+  return user_file_->Read(offset, time, sizeof(*time));
+}
+
+bool FileValueStore::WritePingTime(Product product, int64 time) {
+  if (!IsStoredProduct(product))
+    return false;
+
+  UserStateBlock* block = BeginUserWrite();
+  if (!block)
+    return false;
+
+  block->products[product].ping_time = time;
+  return true;
+}
+
+bool FileValueStore::ReadMachineDealCode(std::string* dcc) {
+  dcc->clear();
+  if (!machine_file_)
+    return false;
+
+  MachineStateBlock block;
+  if (machine_block_) {
+    block = *machine_block_;
+  } else if (!machine_file_->Read(0, &block, sizeof(block))) {
+    return false;
+  }
+
+  // Until a user that can write the machine file copies the DCC into it, the
+  // DCC is still in the registry.
+  if (!block.migrated) {
+    RegistryValueStore registry(NULL);
+    return registry.ReadMachineDealCode(dcc);
+  }
+
+  block.dcc[kMaxDccLength] = 0;
+  *dcc = block.dcc;
+  return true;
+}
+
+bool FileValueStore::WriteMachineDealCode(const std::string& dcc) {
+  if (dcc.size() > kMaxDccLength)
+    return false;
+
+  MachineStateBlock* block = BeginMachineWrite();
+  if (!block)
+    return false;
+
+  base::strlcpy(block->dcc, dcc.c_str(), kMaxDccLength + 1);
+  return true;
+}
+
+bool FileValueStore::Commit() {
+  bool result = true;
+  if (user_block_)
+    result &= user_file_->Commit();
+  if (machine_block_)
+    result &= machine_file_->Commit();
+
+  user_block_ = NULL;
+  machine_block_ = NULL;
+  return result;
+}
+
+void FileValueStore::Discard() {
+  // The next writer starts from the current copies again.
+  user_block_ = NULL;
+  machine_block_ = NULL;
+}
+
+UserStateBlock* FileValueStore::BeginUserWrite() {
+  if (!user_block_)
+    user_block_ = reinterpret_cast<UserStateBlock*>(user_file_->BeginWrite());
+  return user_block_;
+}
+
+MachineStateBlock* FileValueStore::BeginMachineWrite() {
+  if (!machine_block_ && machine_file_) {
+    machine_block_ = reinterpret_cast<MachineStateBlock*>(
+        machine_file_->BeginWrite());
+  }
+  return machine_block_;
+}
+
+bool FileValueStore::Migrate(const wchar_t* sid) {
+  DWORD user_migrated = 0;
+  DWORD machine_migrated = 0;
+  if (!user_file_->Read(offsetof(UserStateBlock, migrated), &user_migrated,
+                        sizeof(user_migrated)))
+    return false;
+  // The machine file is copied into by the first user which can write it.
+  if (!machine_file_ || !machine_file_->writable() ||
+      !machine_file_->Read(offsetof(MachineStateBlock, migrated),
+                           &machine_migrated, sizeof(machine_migrated)))
+    machine_migrated = 1;
+
+  if (user_migrated && machine_migrated)
+    return true;
+
+  // Checked again under the mutex, since another process may have copied the
+  // state in between.
+  LibMutex lock;
+  if (lock.failed())
+    return false;
+
+  RegistryValueStore registry(sid);
+  if (!user_migrated) {
+    user_file_->Read(offsetof(UserStateBlock, migrated), &user_migrated,
+                     sizeof(user_migrated));
+  }
+  if (!user_migrated) {
+    UserStateBlock* block = BeginUserWrite();
+    if (!block || !registry.HasAccess(false))
+      return false;
+
+    for (int point = NO_ACCESS_POINT + 1; point < LAST_ACCESS_POINT;
+         ++point) {
+      std::string rlz;
+      if (!registry.ReadAccessPointRlz(static_cast<AccessPoint>(point), &rlz))
+        return false;
+      base::strlcpy(block->rlzs[point], rlz.c_str(), kMaxRlzLength + 1);
+    }
+
+    for (int i = 1; i < kMaxStoredProducts; ++i) {
+      Product product = static_cast<Product>(i);
+      if (!IsStoredProduct(product))
+        continue;
+
+      EventBitmap events;
+      EventBitmap stateful_events;
+      if (!registry.ReadProductEvents(product, &events) ||
+          !registry.ReadStatefulEvents(product, &stateful_events) ||
+          !registry.ReadPingTime(product, &block->products[i].ping_time))
+        return false;
+
+      ToBits(events, block->products[i].events);
+      ToBits(stateful_events, block->products[i].stateful_events);
+    }
+
+    block->migrated = 1;
+  }
+
+  if (!machine_migrated) {
+    machine_file_->Read(offsetof(MachineStateBlock, migrated),
+                        &machine_migrated, sizeof(machine_migrated));
+  }
+
+  MachineStateBlock* machine_block =
+      machine_migrated ? NULL : BeginMachineWrite();
+  if (machine_block) {
+    std::string dcc;
+    if (registry.ReadMachineDealCode(&dcc)) {
+      base::strlcpy(machine_block->dcc, dcc.c_str(), kMaxDccLength + 1);
+      machine_block->migrated = 1;
+    } else {
+      machine_block_ = NULL;
+    }
+  }
+
+  return Commit();
+}
+
+}  // namespace rlz_lib
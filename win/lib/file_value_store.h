@@ -0,0 +1,95 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The memory-mapped file backend of the RLZ state.
+
+#ifndef RLZ_WIN_LIB_FILE_VALUE_STORE_H_
+#define RLZ_WIN_LIB_FILE_VALUE_STORE_H_
+
+#include <string>
+
+#include "rlz/win/lib/value_store.h"
+
+namespace rlz_lib {
+
+class MappedStateFile;
+struct MachineStateBlock;
+struct UserStateBlock;
+
+// Keeps the state of a user in a file of fixed layout in the local
+// application data directory of the user, and the DCC in one in the common
+// application data directory, one file per supplementary brand. Each file
+// holds two copies of its state, and a sequence number whose parity selects
+// the current one. A commit rewrites the other copy, flushes it, and then
+// bumps the sequence, so that the files always hold a whole state, and
+// readers copy values straight from the mapped view without a lock, trying
+// again if a commit raced with them.
+//
+// The files are mapped once per process and stay mapped. Writers must hold
+// the RLZ mutex.
+class FileValueStore : public RlzValueStore {
+ public:
+  // Opens the files of the user |sid| (NULL or empty for the user running
+  // the process), and of the machine. The files are created, and the
+  // registry state is copied into them, the first time they are opened for
+  // writing. Returns NULL if the user file could not be opened.
+  static FileValueStore* Open(const wchar_t* sid, bool write_access);
+
+  // See RlzValueStore::SetFileStoreDirectoriesForTesting().
+  static void SetDirectoriesForTesting(const wchar_t* user_directory,
+                                       const wchar_t* machine_directory);
+
+  virtual ~FileValueStore();
+
+  virtual bool HasAccess(bool write_access);
+
+  virtual bool ReadAccessPointRlz(AccessPoint point, std::string* rlz);
+  virtual bool WriteAccessPointRlz(AccessPoint point, const std::string& rlz);
+
+  virtual bool ReadProductEvents(Product product, EventBitmap* events);
+  virtual bool WriteProductEvents(Product product, const EventBitmap& events);
+  virtual bool ReadStatefulEvents(Product product, EventBitmap* events);
+  virtual bool WriteStatefulEvents(Product product,
+                                   const EventBitmap& events);
+
+  virtual bool ReadPingTime(Product product, int64* time);
+  virtual bool WritePingTime(Product product, int64 time);
+
+  virtual bool ReadMachineDealCode(std::string* dcc);
+  virtual bool WriteMachineDealCode(const std::string& dcc);
+
+  // Publishes the pending copies of the files.
+  virtual bool Commit();
+
+  // Forgets the pending copies, which stay unpublished.
+  virtual void Discard();
+
+ private:
+  FileValueStore(MappedStateFile* user_file, MappedStateFile* machine_file);
+
+  // Copies the current user state into |block|, or the pending one.
+  bool ReadUserBlock(UserStateBlock* block);
+
+  // Returns the pending copy of the state, starting it if needed, or NULL if
+  // the file can not be written.
+  UserStateBlock* BeginUserWrite();
+  MachineStateBlock* BeginMachineWrite();
+
+  // Copies the registry state of |sid| into the files, unless done already.
+  bool Migrate(const wchar_t* sid);
+
+  // Not owned.
+  MappedStateFile* user_file_;
+  MappedStateFile* machine_file_;
+
+  // The copies being written, in the files.
+  UserStateBlock* user_block_;
+  MachineStateBlock* machine_block_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileValueStore);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_FILE_VALUE_STORE_H_
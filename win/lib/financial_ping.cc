@@ -7,18 +7,20 @@
 #include "rlz/win/lib/financial_ping.h"
 
 #include <windows.h>
-#include <wininet.h>
 #include "base/basictypes.h"
 #include "base/memory/scoped_ptr.h"
 #include "base/string_util.h"
 #include "base/stringprintf.h"
 #include "base/utf_string_conversions.h"
 #include "rlz/win/lib/assert.h"
+#include "rlz/win/lib/cgi_builder.h"
 #include "rlz/win/lib/lib_mutex.h"
 #include "rlz/win/lib/lib_values.h"
 #include "rlz/win/lib/machine_deal.h"
+#include "rlz/win/lib/ping_response.h"
 #include "rlz/win/lib/string_utils.h"
 #include "rlz/win/lib/user_key.h"
+#include "rlz/win/lib/value_store.h"
 
 
 namespace {
@@ -36,21 +38,28 @@ int64 GetSystemTimeAsInt64() {
   return ToInt64(now_as_file_time);
 }
 
-}  // namespace anonymous
+// Returns the delay added to an interval on this machine, as a fraction of
+// the maximum delay. The same machine always gets the same fraction.
+double GetPingJitterFraction() {
+  std::wstring machine_id;
+  if (!rlz_lib::MachineDealCode::GetMachineId(&machine_id) ||
+      machine_id.empty())
+    return 0.0;
+
+  // FNV-1a.
+  uint32 hash = 2166136261U;
+  for (size_t i = 0; i < machine_id.size(); ++i) {
+    hash ^= static_cast<uint32>(machine_id[i]);
+    hash *= 16777619U;
+  }
 
+  return hash / 4294967296.0;
+}
 
-namespace rlz_lib {
+}  // namespace anonymous
 
-class InternetHandle {
- public:
-  InternetHandle(HINTERNET handle) { handle_ = handle; }
-  ~InternetHandle() { if (handle_) InternetCloseHandle(handle_); }
-  operator HINTERNET() const { return handle_; }
-  bool operator!() const { return (handle_ == NULL); }
 
- private:
-  HINTERNET handle_;
-};
+namespace rlz_lib {
 
 bool FinancialPing::FormRequest(Product product,
     const AccessPoint* access_points, const char* product_signature,
@@ -64,6 +73,45 @@ bool FinancialPing::FormRequest(Product product,
 
   request->clear();
 
+  // Both passes must see the same state.
+  LibMutex lock;
+  if (lock.failed())
+    return false;
+
+  char buffer[2 * kMaxCgiLength + 1];
+  CgiBuilder builder(buffer, arraysize(buffer));
+  if (FormRequest(product, access_points, product_signature, product_brand,
+                  product_id, product_lang, exclude_machine_id, sid,
+                  &builder)) {
+    request->assign(buffer, builder.length());
+    return true;
+  }
+
+  if (!builder.overflowed())
+    return false;
+
+  // Only with more events and RLZs than expected.
+  scoped_array<char> heap_buffer(new char[builder.required_size()]);
+  CgiBuilder heap_builder(heap_buffer.get(), builder.required_size());
+  if (!FormRequest(product, access_points, product_signature, product_brand,
+                   product_id, product_lang, exclude_machine_id, sid,
+                   &heap_builder))
+    return false;
+
+  request->assign(heap_buffer.get(), heap_builder.length());
+  return true;
+}
+
+bool FinancialPing::FormRequest(Product product,
+    const AccessPoint* access_points, const char* product_signature,
+    const char* product_brand, const char* product_id,
+    const char* product_lang, bool exclude_machine_id, const wchar_t* sid,
+    CgiBuilder* request) {
+  if (!request) {
+    ASSERT_STRING("FinancialPing::FormRequest: request is NULL");
+    return false;
+  }
+
   LibMutex lock;
   if (lock.failed())
     return false;
@@ -90,116 +138,90 @@ bool FinancialPing::FormRequest(Product product,
     }
   }
 
-  base::StringAppendF(request, "%s?", kFinancialPingPath);
+  request->Append(kFinancialPingPath);
+  request->Append('?');
 
   // Add the signature, brand, product id and language.
-  base::StringAppendF(request, "%s=%s", kProductSignatureCgiVariable,
-                      product_signature);
+  request->AppendParam(kProductSignatureCgiVariable, product_signature);
   if (product_brand)
-    base::StringAppendF(request, "&%s=%s", kProductBrandCgiVariable,
-                        product_brand);
+    request->AppendParam(kProductBrandCgiVariable, product_brand);
 
   if (product_id)
-    base::StringAppendF(request, "&%s=%s", kProductIdCgiVariable, product_id);
+    request->AppendParam(kProductIdCgiVariable, product_id);
 
   if (product_lang)
-    base::StringAppendF(request, "&%s=%s", kProductLanguageCgiVariable,
-                        product_lang);
+    request->AppendParam(kProductLanguageCgiVariable, product_lang);
 
   // Add the product events.
   char cgi[kMaxCgiLength + 1];
   cgi[0] = 0;
   bool has_events = GetProductEventsAsCgi(product, cgi, arraysize(cgi), sid);
-  if (has_events)
-    base::StringAppendF(request, "&%s", cgi);
+  if (has_events) {
+    request->Append('&');
+    request->Append(cgi);
+  }
 
   // If we don't have any events, we should ping all the AP's on the system
   // that we know about and have a current RLZ value, even if they are not
   // used by this product.
   AccessPoint all_points[LAST_ACCESS_POINT];
   if (!has_events) {
-    char rlz[kMaxRlzLength + 1];
+    AccessPoint known_points[LAST_ACCESS_POINT];
     int idx = 0;
-    for (int ap = NO_ACCESS_POINT + 1; ap < LAST_ACCESS_POINT; ap++) {
-      rlz[0] = 0;
-      AccessPoint point = static_cast<AccessPoint>(ap);
-      if (GetAccessPointRlz(point, rlz, arraysize(rlz), sid) &&
-          rlz[0] != NULL)
-        all_points[idx++] = point;
+    for (int ap = NO_ACCESS_POINT + 1; ap < LAST_ACCESS_POINT; ap++)
+      known_points[idx++] = static_cast<AccessPoint>(ap);
+    known_points[idx] = NO_ACCESS_POINT;
+
+    // Unsupported access points make the call fail but get an empty slot,
+    // so the result can be ignored.
+    const size_t kRlzSize = kMaxRlzLength + 1;
+    char rlzs[LAST_ACCESS_POINT * kRlzSize];
+    GetAccessPointRlzs(known_points, rlzs, kRlzSize, sid);
+
+    int count = idx;
+    idx = 0;
+    for (int i = 0; i < count; i++) {
+      if (rlzs[i * kRlzSize] != 0)
+        all_points[idx++] = known_points[i];
     }
     all_points[idx] = NO_ACCESS_POINT;
   }
 
   // Add the RLZ's and the DCC if needed. This is the same as get PingParams.
-  // This will also include the RLZ Exchange Protocol CGI Argument.
-  cgi[0] = 0;
+  // This will also include the RLZ Exchange Protocol CGI Argument. They are
+  // written straight into the request.
+  size_t length = request->length();
+  request->Append('&');
+  size_t required_size = 0;
   if (GetPingParams(product, has_events ? access_points : all_points,
-                    cgi, arraysize(cgi), sid))
-    base::StringAppendF(request, "&%s", cgi);
+                    request->tail(), request->available(), sid,
+                    &required_size)) {
+    request->Advance(required_size - 1);
+  } else if (required_size > request->available()) {
+    request->Advance(required_size - 1);  // Overflowed.
+  } else {
+    request->Truncate(length);
+  }
 
   if (has_events && !exclude_machine_id) {
     std::wstring machine_id;
     if (MachineDealCode::GetMachineId(&machine_id)) {
-      base::StringAppendF(request, "&%s=%ls", kMachineIdCgiVariable,
-                          machine_id.c_str());
+      request->Append('&');
+      request->Append(kMachineIdCgiVariable);
+      request->Append('=');
+      request->AppendAscii(machine_id.c_str());
     }
   }
 
-  return true;
+  return !request->overflowed();
 }
 
-bool FinancialPing::PingServer(const char* request, std::string* response) {
-  if (!response)
-    return false;
-
-  response->clear();
-
-  // Initialize WinInet.
-  InternetHandle inet_handle = InternetOpenA(kFinancialPingUserAgent,
-                                             INTERNET_OPEN_TYPE_PRECONFIG,
-                                             NULL, NULL, 0);
-  if (!inet_handle)
-    return false;
-
-  // Open network connection.
-  InternetHandle connection_handle = InternetConnectA(inet_handle,
-      kFinancialServer, kFinancialPort, "", "", INTERNET_SERVICE_HTTP,
-      INTERNET_FLAG_NO_CACHE_WRITE, 0);
-  if (!connection_handle)
-    return false;
-
-  // Prepare the HTTP request.
-  InternetHandle http_handle = HttpOpenRequestA(connection_handle,
-      kFinancialPingType, request, NULL, NULL, kFinancialPingResponseObjects,
-      INTERNET_FLAG_NO_CACHE_WRITE | INTERNET_FLAG_NO_COOKIES, NULL);
-  if (!http_handle)
-    return false;
-
-  // Send the HTTP request. Note: Fails if user is working in off-line mode.
-  if (!HttpSendRequest(http_handle, NULL, 0, NULL, 0))
-    return false;
-
-  // Check the response status.
-  DWORD status;
-  DWORD status_size = sizeof(status);
-  if (!HttpQueryInfo(http_handle, HTTP_QUERY_STATUS_CODE |
-                     HTTP_QUERY_FLAG_NUMBER, &status, &status_size, NULL) ||
-      200 != status)
-    return false;
-
-  // Get the response text.
-  scoped_array<char> buffer(new char[kMaxPingResponseLength]);
-  if (buffer.get() == NULL)
-    return false;
-
-  DWORD bytes_read = 0;
-  while (InternetReadFile(http_handle, buffer.get(), kMaxPingResponseLength,
-                          &bytes_read) && bytes_read > 0) {
-    response->append(buffer.get(), bytes_read);
-    bytes_read = 0;
-  };
-
-  return true;
+bool FinancialPing::PingServer(const char* request, std::string* response,
+                               PingCanceller* canceller,
+                               bool* valid_response, PingResult* result) {
+  scoped_refptr<PingTransport> transport(PingTransport::Get());
+  return transport->Send(request, response, canceller, valid_response,
+                         result);
 }
 
 
@@ -219,10 +241,17 @@ bool FinancialPing::IsPingTime(Product product, const wchar_t* sid,
     return false;
 
   int64 last_ping = 0;
-  base::win::RegKey key;
-  if (!GetPingTimesRegKey(user_key.Get(), KEY_READ, &key) ||
-      key.ReadInt64(GetProductName(product), &last_ping) != ERROR_SUCCESS)
-    return true;
+  if (RlzValueStore::IsFileStoreEnabled()) {
+    ScopedValueStore store(sid, false);
+    if (!store.get() || !store.get()->ReadPingTime(product, &last_ping) ||
+        !last_ping)
+      return true;
+  } else {
+    base::win::RegKey key;
+    if (!GetPingTimesRegKey(user_key.Get(), KEY_READ, &key) ||
+        key.ReadInt64(GetProductName(product), &last_ping) != ERROR_SUCCESS)
+      return true;
+  }
 
   uint64 now = GetSystemTimeAsInt64();
   int64 interval = now - last_ping;
@@ -232,13 +261,78 @@ bool FinancialPing::IsPingTime(Product product, const wchar_t* sid,
     return true;
 
   // Check if this product has any unreported events.
-  char cgi[kMaxCgiLength + 1];
-  cgi[0] = 0;
-  bool has_events = GetProductEventsAsCgi(product, cgi, arraysize(cgi), sid);
+  bool has_events = HasPendingEvents(product, sid);
   if (no_delay && has_events)
     return true;
 
-  return interval >= (has_events ? kEventsPingInterval : kNoEventsPingInterval);
+  return interval >= GetPingInterval(product, sid, has_events);
+}
+
+
+int64 FinancialPing::GetPingInterval(Product product, const wchar_t* sid,
+                                     bool has_events) {
+  int64 interval = kEventsPingInterval;
+
+  DWORD seconds = 0;
+  LibMutex lock;
+  if (!lock.failed()) {
+    UserKey user_key(sid);
+    base::win::RegKey key;
+    if (user_key.HasAccess(false) &&
+        GetPingIntervalsRegKey(user_key.Get(), KEY_READ, &key) &&
+        key.ReadValueDW(GetProductName(product), &seconds) == ERROR_SUCCESS &&
+        seconds >= static_cast<DWORD>(kMinPingIntervalSeconds) &&
+        seconds <= static_cast<DWORD>(kMaxPingIntervalSeconds))
+      interval = seconds * 10000000LL;
+  }
+
+  if (!has_events && interval < kNoEventsPingInterval)
+    interval = kNoEventsPingInterval;
+
+  const int64 max_jitter = interval / 100 * kPingJitterPercent;
+  return interval + static_cast<int64>(max_jitter * GetPingJitterFraction());
+}
+
+
+bool FinancialPing::SetPingInterval(Product product, const wchar_t* sid,
+                                    int seconds) {
+  if (seconds < 0) {
+    ASSERT_STRING("FinancialPing::SetPingInterval: Invalid interval.");
+    return false;
+  }
+
+  const wchar_t* value_name = GetProductName(product);
+  if (!value_name)
+    return false;
+
+  LibMutex lock;
+  if (lock.failed())
+    return false;
+
+  UserKey user_key(sid);
+  if (!user_key.HasAccess(true))
+    return false;
+
+  if (!seconds) {
+    base::win::RegKey key;
+    GetPingIntervalsRegKey(user_key.Get(), KEY_WRITE, &key);
+    LONG result = key.DeleteValue(value_name);
+    if (result != ERROR_SUCCESS && result != ERROR_FILE_NOT_FOUND) {
+      ASSERT_STRING("FinancialPing::SetPingInterval: Failed to delete value.");
+      return false;
+    }
+    return true;
+  }
+
+  if (seconds < kMinPingIntervalSeconds)
+    seconds = kMinPingIntervalSeconds;
+  if (seconds > kMaxPingIntervalSeconds)
+    seconds = kMaxPingIntervalSeconds;
+
+  base::win::RegKey key;
+  return GetPingIntervalsRegKey(user_key.Get(), KEY_WRITE, &key) &&
+      key.WriteValue(value_name, static_cast<DWORD>(seconds)) ==
+      ERROR_SUCCESS;
 }
 
 
@@ -252,6 +346,12 @@ bool FinancialPing::UpdateLastPingTime(Product product, const wchar_t* sid) {
     return false;
 
   uint64 now = GetSystemTimeAsInt64();
+  if (RlzValueStore::IsFileStoreEnabled()) {
+    ScopedValueStore store(sid, true);
+    return store.get() && store.get()->WritePingTime(product, now) &&
+        store.get()->Commit();
+  }
+
   base::win::RegKey key;
   return GetPingTimesRegKey(user_key.Get(), KEY_WRITE, &key) &&
       key.WriteValue(GetProductName(product), &now, sizeof(now),
@@ -268,15 +368,17 @@ bool FinancialPing::ClearLastPingTime(Product product, const wchar_t* sid) {
   if (!user_key.HasAccess(true))
     return false;
 
+  if (RlzValueStore::IsFileStoreEnabled()) {
+    ScopedValueStore store(sid, true);
+    return store.get() && store.get()->WritePingTime(product, 0) &&
+        store.get()->Commit();
+  }
+
   const wchar_t* value_name = GetProductName(product);
   base::win::RegKey key;
   GetPingTimesRegKey(user_key.Get(), KEY_WRITE, &key);
-  key.DeleteValue(value_name);
-
-  // Verify deletion.
-  uint64 value;
-  DWORD size = sizeof(value);
-  if (key.ReadValue(value_name, &value, &size, NULL) == ERROR_SUCCESS) {
+  LONG result = key.DeleteValue(value_name);
+  if (result != ERROR_SUCCESS && result != ERROR_FILE_NOT_FOUND) {
     ASSERT_STRING("FinancialPing::ClearLastPingTime: Failed to delete value.");
     return false;
   }
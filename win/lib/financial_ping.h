@@ -8,10 +8,15 @@
 #define RLZ_WIN_LIB_FINANCIAL_PING_H_
 
 #include <string>
+
+#include "base/basictypes.h"
+#include "rlz/win/lib/ping_transport.h"
 #include "rlz/win/lib/rlz_lib.h"
 
 namespace rlz_lib {
 
+class CgiBuilder;
+
 class FinancialPing {
  public:
   // Form the HTTP request to send to the PSO server.
@@ -24,6 +29,14 @@ class FinancialPing {
                           const char* product_lang, bool exclude_machine_id,
                           const wchar_t* sid, std::string* request);
 
+  // Same as above, into |request|. Fails if the request does not fit, and
+  // request->required_size() then tells the exact size needed.
+  static bool FormRequest(Product product, const AccessPoint* access_points,
+                          const char* product_signature,
+                          const char* product_brand, const char* product_id,
+                          const char* product_lang, bool exclude_machine_id,
+                          const wchar_t* sid, CgiBuilder* request);
+
   // Parse the HTTP response from the financial ping server.
   static bool ParseResponse(Product product, const char* response,
                             const wchar_t* sid);
@@ -35,16 +48,44 @@ class FinancialPing {
   // (case of time reset) or if one day has passed since last_ping and there
   // are events, or one week has passed since last_ping when there are
   // no new events.
+  // The intervals are the ones set by the server, if any, plus a delay
+  // derived from the machine ID, so that machines set up together do not
+  // ping together.
   static bool IsPingTime(Product product, const wchar_t* sid, bool no_delay);
 
+  // Returns the time after the last ping at which IsPingTime() pings, in
+  // 100-nanosecond intervals.
+  static int64 GetPingInterval(Product product, const wchar_t* sid,
+                               bool has_events);
+
+  // Sets the interval between the pings of product, in seconds, as sent by
+  // the server. It replaces the interval when there are events, and is the
+  // minimum interval when there are none. Clamped between
+  // kMinPingIntervalSeconds and kMaxPingIntervalSeconds; 0 restores the
+  // default intervals. Writes to HKCU.
+  static bool SetPingInterval(Product product, const wchar_t* sid,
+                              int seconds);
+
   // Set the last ping time to be now. Writes to HKCU.
   static bool UpdateLastPingTime(Product product, const wchar_t* sid);
 
   // Clear the last ping time - should be called on uninstall. Writes to HKCU.
   static bool ClearLastPingTime(Product product, const wchar_t* sid);
 
-  // Ping the financial server with request. Writes to HKCU.
-  static bool PingServer(const char* request, std::string* response);
+  // Ping the financial server with request, through the PingTransport set
+  // in this process. Writes to HKCU.
+  // If canceller is not NULL, it can be used to abort the ping from another
+  // thread, in which case false is returned.
+  // The response is parsed as it is read, and reading stops once it gets
+  // longer than kMaxPingResponseLength, in which case the response is empty.
+  // If valid_response is not NULL, it is set to whether the response passed
+  // that check, so that an invalid one need not be parsed again.
+  // If result is not NULL, it gets the HTTP status and the timings of the
+  // ping, for PingHealth::RecordPing().
+  static bool PingServer(const char* request, std::string* response,
+                         PingCanceller* canceller = NULL,
+                         bool* valid_response = NULL,
+                         PingResult* result = NULL);
 
  private:
   FinancialPing() {}
@@ -28,6 +28,10 @@
 #include "rlz/win/lib/financial_ping.h"
 #include "rlz/win/lib/lib_values.h"
 #include "rlz/win/lib/machine_deal.h"
+#include "rlz/win/lib/ping_health.h"
+#include "rlz/win/lib/ping_retry_queue.h"
+#include "rlz/win/lib/ping_session.h"
+#include "rlz/win/lib/ping_transport.h"
 #include "rlz/win/test/rlz_test_helpers.h"
 
 namespace {
@@ -48,6 +52,15 @@ int64 GetSystemTimeAsInt64() {
 // Ping times in 100-nanosecond intervals.
 const int64 k1MinuteInterval = 60LL * 10000000LL;  // 1 minute
 
+// Holds the RLZ lock until events[1] is set, after setting events[0].
+DWORD WINAPI HoldLockThread(void* context) {
+  HANDLE* events = static_cast<HANDLE*>(context);
+  rlz_lib::ScopedRlzSession session;
+  SetEvent(events[0]);
+  WaitForSingleObject(events[1], INFINITE);
+  return session.failed() ? 1 : 0;
+}
+
 }  // namespace anonymous
 
 class FinancialPingTest : public RlzLibTestBase {
@@ -178,7 +191,11 @@ static void SetLastPingTime(int64 time, rlz_lib::Product product) {
 
 TEST_F(FinancialPingTest, IsPingTime) {
   int64 now = GetSystemTimeAsInt64();
-  int64 last_ping = now - rlz_lib::kEventsPingInterval - k1MinuteInterval;
+  int64 events_interval = rlz_lib::FinancialPing::GetPingInterval(
+      rlz_lib::TOOLBAR_NOTIFIER, NULL, true);
+  int64 no_events_interval = rlz_lib::FinancialPing::GetPingInterval(
+      rlz_lib::TOOLBAR_NOTIFIER, NULL, false);
+  int64 last_ping = now - events_interval - k1MinuteInterval;
   SetLastPingTime(last_ping, rlz_lib::TOOLBAR_NOTIFIER);
 
   // No events, last ping just over a day ago.
@@ -193,7 +210,7 @@ TEST_F(FinancialPingTest, IsPingTime) {
                                                  NULL, false));
 
   // Has events, last ping just under a day ago.
-  last_ping = now - rlz_lib::kEventsPingInterval + k1MinuteInterval;
+  last_ping = now - events_interval + k1MinuteInterval;
   SetLastPingTime(last_ping, rlz_lib::TOOLBAR_NOTIFIER);
   EXPECT_FALSE(rlz_lib::FinancialPing::IsPingTime(rlz_lib::TOOLBAR_NOTIFIER,
                                                   NULL, false));
@@ -201,13 +218,13 @@ TEST_F(FinancialPingTest, IsPingTime) {
   EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
 
   // No events, last ping just under a week ago.
-  last_ping = now - rlz_lib::kNoEventsPingInterval + k1MinuteInterval;
+  last_ping = now - no_events_interval + k1MinuteInterval;
   SetLastPingTime(last_ping, rlz_lib::TOOLBAR_NOTIFIER);
   EXPECT_FALSE(rlz_lib::FinancialPing::IsPingTime(rlz_lib::TOOLBAR_NOTIFIER,
                                                   NULL, false));
 
   // No events, last ping just over a week ago.
-  last_ping = now - rlz_lib::kNoEventsPingInterval - k1MinuteInterval;
+  last_ping = now - no_events_interval - k1MinuteInterval;
   SetLastPingTime(last_ping, rlz_lib::TOOLBAR_NOTIFIER);
   EXPECT_TRUE(rlz_lib::FinancialPing::IsPingTime(rlz_lib::TOOLBAR_NOTIFIER,
                                                  NULL, false));
@@ -230,7 +247,9 @@ TEST_F(FinancialPingTest, BrandingIsPingTime) {
     return;
 
   int64 now = GetSystemTimeAsInt64();
-  int64 last_ping = now - rlz_lib::kEventsPingInterval - k1MinuteInterval;
+  int64 events_interval = rlz_lib::FinancialPing::GetPingInterval(
+      rlz_lib::TOOLBAR_NOTIFIER, NULL, true);
+  int64 last_ping = now - events_interval - k1MinuteInterval;
   SetLastPingTime(last_ping, rlz_lib::TOOLBAR_NOTIFIER);
 
   // Has events, last ping just over a day ago.
@@ -265,7 +284,9 @@ TEST_F(FinancialPingTest, BrandingIsPingTime) {
 
 TEST_F(FinancialPingTest, ClearLastPingTime) {
   int64 now = GetSystemTimeAsInt64();
-  int64 last_ping = now - rlz_lib::kEventsPingInterval + k1MinuteInterval;
+  int64 events_interval = rlz_lib::FinancialPing::GetPingInterval(
+      rlz_lib::TOOLBAR_NOTIFIER, NULL, true);
+  int64 last_ping = now - events_interval + k1MinuteInterval;
   SetLastPingTime(last_ping, rlz_lib::TOOLBAR_NOTIFIER);
 
   // Has events, last ping just under a day ago.
@@ -280,3 +301,347 @@ TEST_F(FinancialPingTest, ClearLastPingTime) {
   EXPECT_TRUE(rlz_lib::FinancialPing::IsPingTime(rlz_lib::TOOLBAR_NOTIFIER,
                                                  NULL, false));
 }
+
+TEST_F(FinancialPingTest, PingRetryQueue) {
+  rlz_lib::Product product = rlz_lib::TOOLBAR_NOTIFIER;
+  std::string request;
+  bool due = true;
+
+  EXPECT_TRUE(rlz_lib::PingRetryQueue::Clear(product, NULL));
+  EXPECT_FALSE(rlz_lib::PingRetryQueue::Get(product, NULL, &request, &due));
+  EXPECT_FALSE(due);
+
+  // A failed ping is retried with its request, after a delay.
+  EXPECT_TRUE(rlz_lib::PingRetryQueue::RecordResult(product, NULL,
+                                                    "/ping?rlz=A", false));
+  EXPECT_TRUE(rlz_lib::PingRetryQueue::Get(product, NULL, &request, &due));
+  EXPECT_EQ("/ping?rlz=A", request);
+  EXPECT_FALSE(due);
+
+  // Other products are not held back.
+  EXPECT_FALSE(rlz_lib::PingRetryQueue::Get(rlz_lib::PACK, NULL, &request,
+                                            &due));
+
+  // A new request replaces the queued one.
+  EXPECT_TRUE(rlz_lib::PingRetryQueue::RecordResult(product, NULL,
+                                                    "/ping?rlz=B", false));
+  EXPECT_TRUE(rlz_lib::PingRetryQueue::Get(product, NULL, &request, &due));
+  EXPECT_EQ("/ping?rlz=B", request);
+
+  // A ping which reached the server is not retried.
+  EXPECT_TRUE(rlz_lib::PingRetryQueue::RecordResult(product, NULL,
+                                                    "/ping?rlz=B", true));
+  EXPECT_FALSE(rlz_lib::PingRetryQueue::Get(product, NULL, &request, &due));
+
+  // The backoff doubles up to its maximum.
+  EXPECT_EQ(rlz_lib::kPingRetryDelay,
+            rlz_lib::PingRetryQueue::GetBackoff(1));
+  EXPECT_EQ(rlz_lib::kPingRetryDelay * 4,
+            rlz_lib::PingRetryQueue::GetBackoff(3));
+  EXPECT_EQ(rlz_lib::kMaxPingRetryDelay,
+            rlz_lib::PingRetryQueue::GetBackoff(100));
+
+  // Retries are product state.
+  EXPECT_TRUE(rlz_lib::PingRetryQueue::RecordResult(product, NULL,
+                                                    "/ping?rlz=C", false));
+  rlz_lib::ClearProductState(product, NULL);
+  EXPECT_FALSE(rlz_lib::PingRetryQueue::Get(product, NULL, &request, &due));
+}
+
+TEST_F(FinancialPingTest, PingInterval) {
+  rlz_lib::Product product = rlz_lib::TOOLBAR_NOTIFIER;
+  EXPECT_TRUE(rlz_lib::FinancialPing::SetPingInterval(product, NULL, 0));
+
+  // The default intervals, delayed by at most the machine's jitter.
+  int64 events_interval =
+      rlz_lib::FinancialPing::GetPingInterval(product, NULL, true);
+  EXPECT_GE(events_interval, rlz_lib::kEventsPingInterval);
+  EXPECT_LE(events_interval, rlz_lib::kEventsPingInterval +
+      rlz_lib::kEventsPingInterval / 100 * rlz_lib::kPingJitterPercent);
+  EXPECT_GE(rlz_lib::FinancialPing::GetPingInterval(product, NULL, false),
+            rlz_lib::kNoEventsPingInterval);
+
+  // The jitter is the same from one call to the next.
+  EXPECT_EQ(events_interval,
+            rlz_lib::FinancialPing::GetPingInterval(product, NULL, true));
+
+  // A server interval replaces the events interval, and is the minimum
+  // interval without events.
+  const int kTwoWeeks = 14 * 24 * 3600;
+  EXPECT_TRUE(rlz_lib::FinancialPing::SetPingInterval(product, NULL,
+                                                      kTwoWeeks));
+  int64 server_interval = kTwoWeeks * 10000000LL;
+  EXPECT_GE(rlz_lib::FinancialPing::GetPingInterval(product, NULL, true),
+            server_interval);
+  EXPECT_GE(rlz_lib::FinancialPing::GetPingInterval(product, NULL, false),
+            server_interval);
+  EXPECT_LT(rlz_lib::FinancialPing::GetPingInterval(product, NULL, false),
+            server_interval * 2);
+
+  int64 now = GetSystemTimeAsInt64();
+  SetLastPingTime(now - rlz_lib::kNoEventsPingInterval - k1MinuteInterval,
+                  product);
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(product));
+  EXPECT_FALSE(rlz_lib::FinancialPing::IsPingTime(product, NULL, false));
+
+  // Other products keep the default intervals.
+  EXPECT_LT(rlz_lib::FinancialPing::GetPingInterval(rlz_lib::PACK, NULL,
+                                                    true),
+            server_interval);
+
+  // Intervals out of bounds are clamped.
+  EXPECT_TRUE(rlz_lib::FinancialPing::SetPingInterval(product, NULL, 1));
+  EXPECT_GE(rlz_lib::FinancialPing::GetPingInterval(product, NULL, true),
+            rlz_lib::kMinPingIntervalSeconds * 10000000LL);
+  EXPECT_LT(rlz_lib::FinancialPing::GetPingInterval(product, NULL, true),
+            rlz_lib::kEventsPingInterval);
+
+  // The interval is set by the ping response, and is product state.
+  const char kResponse[] =
+      "rlzW1: 1R1\r\n"
+      "ping-interval: 172800\r\n"
+      "crc32: 84B05079";
+  EXPECT_TRUE(rlz_lib::ParsePingResponse(product, kResponse));
+  EXPECT_GE(rlz_lib::FinancialPing::GetPingInterval(product, NULL, true),
+            172800 * 10000000LL);
+
+  rlz_lib::ClearProductState(product, NULL);
+  EXPECT_EQ(events_interval,
+            rlz_lib::FinancialPing::GetPingInterval(product, NULL, true));
+}
+
+TEST_F(FinancialPingTest, PingSession) {
+  // Opening the session and the connection does not touch the network.
+  scoped_refptr<rlz_lib::PingSession> session(rlz_lib::PingSession::Get());
+  ASSERT_TRUE(session != NULL);
+  EXPECT_TRUE(session->connection() != NULL);
+
+  // The pings share the session.
+  EXPECT_EQ(session.get(), rlz_lib::PingSession::Get().get());
+
+  // After a network error, the next ping gets a new session, while requests
+  // in flight keep their connection open.
+  rlz_lib::PingSession::Reset(session);
+  scoped_refptr<rlz_lib::PingSession> new_session(
+      rlz_lib::PingSession::Get());
+  ASSERT_TRUE(new_session != NULL);
+  EXPECT_NE(session.get(), new_session.get());
+
+  DWORD handle_type = 0;
+  DWORD size = sizeof(handle_type);
+  EXPECT_TRUE(InternetQueryOptionA(session->connection(),
+                                   INTERNET_OPTION_HANDLE_TYPE, &handle_type,
+                                   &size));
+  EXPECT_EQ(static_cast<DWORD>(INTERNET_HANDLE_TYPE_CONNECT_HTTP),
+            handle_type);
+
+  // A late error on the old session does not drop the new one.
+  rlz_lib::PingSession::Reset(session);
+  EXPECT_EQ(new_session.get(), rlz_lib::PingSession::Get().get());
+}
+
+TEST_F(FinancialPingTest, LoopbackTransport) {
+  scoped_refptr<rlz_lib::LoopbackPingTransport> transport(
+      new rlz_lib::LoopbackPingTransport);
+  rlz_lib::PingTransport::Set(transport);
+
+  const char kRequest[] = "/tools/pso/ping?as=swg&brand=GGLA";
+  const char kResponse[] =
+      "rlzW1: 1R1\r\n"
+      "ping-interval: 172800\r\n"
+      "crc32: 84B05079";
+  std::string response;
+  bool valid_response = false;
+
+  // The response is read and checked as from the network.
+  transport->SetResponse(kResponse, 200);
+  EXPECT_TRUE(rlz_lib::FinancialPing::PingServer(kRequest, &response, NULL,
+                                                 &valid_response));
+  EXPECT_EQ(kResponse, response);
+  EXPECT_TRUE(valid_response);
+  EXPECT_EQ(1, transport->request_count());
+  EXPECT_EQ(kRequest, transport->last_request());
+
+  transport->SetResponse("rlzW1: 1R1\r\ncrc32: 00000000", 200);
+  EXPECT_TRUE(rlz_lib::FinancialPing::PingServer(kRequest, &response, NULL,
+                                                 &valid_response));
+  EXPECT_FALSE(valid_response);
+
+  // A response which is too long reaches the server, but is dropped.
+  transport->SetResponse(
+      std::string(rlz_lib::kMaxPingResponseLength + 1, 'a'), 200);
+  EXPECT_TRUE(rlz_lib::FinancialPing::PingServer(kRequest, &response, NULL,
+                                                 &valid_response));
+  EXPECT_TRUE(response.empty());
+  EXPECT_FALSE(valid_response);
+
+  // Errors, and unreachable servers, fail the ping.
+  transport->SetResponse(kResponse, 404);
+  EXPECT_FALSE(rlz_lib::FinancialPing::PingServer(kRequest, &response));
+  transport->SetResponse(kResponse, 0);
+  EXPECT_FALSE(rlz_lib::FinancialPing::PingServer(kRequest, &response));
+
+  // So do cancelled pings.
+  transport->SetResponse(kResponse, 200);
+  rlz_lib::PingCanceller canceller;
+  canceller.Cancel();
+  EXPECT_FALSE(rlz_lib::FinancialPing::PingServer(kRequest, &response,
+                                                  &canceller));
+  EXPECT_EQ(6, transport->request_count());
+
+  // Pings in progress keep the transport they started with.
+  scoped_refptr<rlz_lib::PingTransport> current(
+      rlz_lib::PingTransport::Get());
+  rlz_lib::PingTransport::Set(NULL);
+  EXPECT_EQ(transport.get(), current.get());
+  EXPECT_NE(current.get(), rlz_lib::PingTransport::Get().get());
+
+  // Network transports can be created for each type.
+  EXPECT_TRUE(rlz_lib::SetPingTransport(rlz_lib::PING_TRANSPORT_WINHTTP));
+  EXPECT_TRUE(rlz_lib::SetPingTransport(rlz_lib::PING_TRANSPORT_WININET));
+  rlz_lib::PingTransport::Set(NULL);
+}
+
+TEST_F(FinancialPingTest, PingHealth) {
+  scoped_refptr<rlz_lib::LoopbackPingTransport> transport(
+      new rlz_lib::LoopbackPingTransport);
+  rlz_lib::PingTransport::Set(transport);
+
+  rlz_lib::Product product = rlz_lib::TOOLBAR_NOTIFIER;
+  const char kRequest[] = "/tools/pso/ping?as=swg&brand=GGLA";
+  const char kResponse[] =
+      "rlzW1: 1R1\r\n"
+      "ping-interval: 172800\r\n"
+      "crc32: 84B05079";
+  rlz_lib::PingHealthStats stats;
+  std::string response;
+
+  EXPECT_TRUE(rlz_lib::ResetPingHealthStats(product));
+  EXPECT_TRUE(rlz_lib::GetPingHealthStats(product, &stats));
+  EXPECT_EQ(0U, stats.attempts);
+  EXPECT_EQ(0, stats.start_time);
+
+  // Each ping is counted once, by how it ended.
+  transport->SetResponse(kResponse, 200);
+  rlz_lib::PingResult result;
+  bool valid_response = false;
+  EXPECT_TRUE(rlz_lib::FinancialPing::PingServer(kRequest, &response, NULL,
+                                                 &valid_response, &result));
+  EXPECT_EQ(200U, result.status);
+  EXPECT_TRUE(rlz_lib::PingHealth::RecordPing(product, NULL, result,
+                                              valid_response));
+
+  transport->SetResponse("rlzW1: 1R1\r\ncrc32: 00000000", 200);
+  rlz_lib::PingResult invalid_result;
+  EXPECT_TRUE(rlz_lib::FinancialPing::PingServer(kRequest, &response, NULL,
+                                                 &valid_response,
+                                                 &invalid_result));
+  EXPECT_TRUE(rlz_lib::PingHealth::RecordPing(product, NULL, invalid_result,
+                                              valid_response));
+
+  transport->SetResponse(kResponse, 404);
+  rlz_lib::PingResult error_result;
+  EXPECT_FALSE(rlz_lib::FinancialPing::PingServer(kRequest, &response, NULL,
+                                                  &valid_response,
+                                                  &error_result));
+  EXPECT_EQ(404U, error_result.status);
+  EXPECT_TRUE(rlz_lib::PingHealth::RecordPing(product, NULL, error_result,
+                                              valid_response));
+
+  transport->SetResponse(kResponse, 0);
+  rlz_lib::PingResult failed_result;
+  EXPECT_FALSE(rlz_lib::FinancialPing::PingServer(kRequest, &response, NULL,
+                                                  &valid_response,
+                                                  &failed_result));
+  EXPECT_EQ(0U, failed_result.status);
+  EXPECT_TRUE(rlz_lib::PingHealth::RecordPing(product, NULL, failed_result,
+                                              valid_response));
+
+  EXPECT_TRUE(rlz_lib::GetPingHealthStats(product, &stats));
+  EXPECT_NE(0, stats.start_time);
+  EXPECT_EQ(4U, stats.attempts);
+  EXPECT_EQ(1U, stats.successes);
+  EXPECT_EQ(1U, stats.crc_failures);
+  EXPECT_EQ(1U, stats.http_errors);
+  EXPECT_EQ(1U, stats.network_failures);
+
+  // The loopback transport has no network phases, only the reading.
+  uint32 reads = 0;
+  for (int i = 0; i < rlz_lib::kPingLatencyBuckets; ++i) {
+    EXPECT_EQ(0U, stats.latency_ms[rlz_lib::PING_PHASE_RESOLVE][i]);
+    EXPECT_EQ(0U, stats.latency_ms[rlz_lib::PING_PHASE_CONNECT][i]);
+    reads += stats.latency_ms[rlz_lib::PING_PHASE_READ][i];
+  }
+  EXPECT_EQ(4U, reads);
+
+  // Other products are counted apart.
+  EXPECT_TRUE(rlz_lib::GetPingHealthStats(rlz_lib::PACK, &stats));
+  EXPECT_EQ(0U, stats.attempts);
+
+  // The latency buckets are powers of two of milliseconds.
+  EXPECT_EQ(0, rlz_lib::PingHealth::GetLatencyBucket(0));
+  EXPECT_EQ(1, rlz_lib::PingHealth::GetLatencyBucket(1));
+  EXPECT_EQ(2, rlz_lib::PingHealth::GetLatencyBucket(3));
+  EXPECT_EQ(3, rlz_lib::PingHealth::GetLatencyBucket(4));
+  EXPECT_EQ(rlz_lib::kPingLatencyBuckets - 1,
+            rlz_lib::PingHealth::GetLatencyBucket(1LL << 40));
+
+  // The counters can be reset, and are product state.
+  EXPECT_TRUE(rlz_lib::ResetPingHealthStats(product));
+  EXPECT_TRUE(rlz_lib::GetPingHealthStats(product, &stats));
+  EXPECT_EQ(0U, stats.attempts);
+
+  EXPECT_TRUE(rlz_lib::PingHealth::RecordPing(product, NULL, result, true));
+  rlz_lib::ClearProductState(product, NULL);
+  EXPECT_TRUE(rlz_lib::GetPingHealthStats(product, &stats));
+  EXPECT_EQ(0U, stats.attempts);
+
+  rlz_lib::PingTransport::Set(NULL);
+}
+
+TEST_F(FinancialPingTest, PingHealthLockTimeouts) {
+  rlz_lib::PingResult result;
+  rlz_lib::PingHealthStats stats;
+
+  // The timeouts of the earlier tests are counted by the first ping.
+  EXPECT_TRUE(rlz_lib::PingHealth::RecordPing(rlz_lib::TOOLBAR_NOTIFIER,
+                                              NULL, result, false));
+  EXPECT_TRUE(rlz_lib::ResetPingHealthStats(rlz_lib::TOOLBAR_NOTIFIER));
+
+  // A call of this process times out while another thread holds the lock.
+  HANDLE events[2] = {CreateEvent(NULL, TRUE, FALSE, NULL),
+                      CreateEvent(NULL, TRUE, FALSE, NULL)};
+  HANDLE thread = CreateThread(NULL, 0, HoldLockThread, events, 0, NULL);
+  ASSERT_TRUE(thread != NULL);
+  EXPECT_EQ(WAIT_OBJECT_0, WaitForSingleObject(events[0], 30000));
+  {
+    rlz_lib::ScopedRlzSession session(0);
+    EXPECT_TRUE(session.failed());
+  }
+  SetEvent(events[1]);
+  EXPECT_EQ(WAIT_OBJECT_0, WaitForSingleObject(thread, 30000));
+  CloseHandle(thread);
+  CloseHandle(events[0]);
+  CloseHandle(events[1]);
+
+  // The next ping counts it once, for the user rather than for its product.
+  EXPECT_TRUE(rlz_lib::PingHealth::RecordPing(rlz_lib::TOOLBAR_NOTIFIER,
+                                              NULL, result, false));
+  EXPECT_TRUE(rlz_lib::PingHealth::RecordPing(rlz_lib::PACK, NULL, result,
+                                              false));
+  EXPECT_TRUE(rlz_lib::GetPingHealthStats(rlz_lib::TOOLBAR_NOTIFIER, &stats));
+  EXPECT_EQ(1U, stats.attempts);
+  EXPECT_EQ(1U, stats.lock_timeouts);
+  EXPECT_TRUE(rlz_lib::GetPingHealthStats(rlz_lib::PACK, &stats));
+  EXPECT_EQ(1U, stats.attempts);
+  EXPECT_EQ(1U, stats.lock_timeouts);
+  EXPECT_TRUE(rlz_lib::GetPingHealthStats(rlz_lib::DESKTOP, &stats));
+  EXPECT_EQ(0U, stats.attempts);
+  EXPECT_EQ(1U, stats.lock_timeouts);
+
+  // Resetting any product resets them, but not the other products.
+  EXPECT_TRUE(rlz_lib::ResetPingHealthStats(rlz_lib::PACK));
+  EXPECT_TRUE(rlz_lib::GetPingHealthStats(rlz_lib::TOOLBAR_NOTIFIER, &stats));
+  EXPECT_EQ(1U, stats.attempts);
+  EXPECT_EQ(0U, stats.lock_timeouts);
+}
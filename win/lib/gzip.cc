@@ -0,0 +1,117 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Wrappers around ZLib's gzip compression, for the financial pings.
+
+#include "rlz/win/lib/gzip.h"
+
+#include <string.h>
+
+#include "rlz/win/lib/assert.h"
+
+namespace {
+
+// Adding 16 to the window bits selects the gzip format rather than the zlib
+// one.
+const int kGzipWindowBits = MAX_WBITS + 16;
+const int kMemoryLevel = 8;
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+bool GzipCompress(const char* data, size_t length, std::string* compressed) {
+  if (!data || !compressed) {
+    ASSERT_STRING("GzipCompress: Invalid arguments.");
+    return false;
+  }
+
+  compressed->clear();
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, kGzipWindowBits,
+                   kMemoryLevel, Z_DEFAULT_STRATEGY) != Z_OK)
+    return false;
+
+  // deflateBound() does not count the gzip header and trailer.
+  const size_t kGzipOverhead = 18;
+  compressed->resize(deflateBound(&stream, static_cast<uLong>(length)) +
+                     kGzipOverhead);
+
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  stream.avail_in = static_cast<uInt>(length);
+  stream.next_out = reinterpret_cast<Bytef*>(&(*compressed)[0]);
+  stream.avail_out = static_cast<uInt>(compressed->size());
+  int result = deflate(&stream, Z_FINISH);
+  size_t compressed_length = compressed->size() - stream.avail_out;
+  deflateEnd(&stream);
+
+  if (result != Z_STREAM_END) {
+    compressed->clear();
+    return false;
+  }
+
+  compressed->resize(compressed_length);
+  return true;
+}
+
+GzipInflater::GzipInflater()
+    : initialized_(false), finished_(false), failed_(false) {
+  memset(&stream_, 0, sizeof(stream_));
+}
+
+GzipInflater::~GzipInflater() {
+  if (initialized_)
+    inflateEnd(&stream_);
+}
+
+bool GzipInflater::Inflate(const char* input, size_t input_length,
+                           char* output, size_t output_size,
+                           size_t* output_length) {
+  if (!output_length) {
+    ASSERT_STRING("GzipInflater::Inflate: output_length is NULL.");
+    return false;
+  }
+
+  *output_length = 0;
+  if (failed_)
+    return false;
+  if (finished_ || !input_length)
+    return true;
+
+  if (!initialized_) {
+    if (inflateInit2(&stream_, kGzipWindowBits) != Z_OK) {
+      failed_ = true;
+      return false;
+    }
+    initialized_ = true;
+  }
+
+  stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input));
+  stream_.avail_in = static_cast<uInt>(input_length);
+  stream_.next_out = reinterpret_cast<Bytef*>(output);
+  stream_.avail_out = static_cast<uInt>(output_size);
+
+  int result = inflate(&stream_, Z_SYNC_FLUSH);
+  *output_length = output_size - stream_.avail_out;
+
+  if (result == Z_STREAM_END) {
+    finished_ = true;
+    return true;
+  }
+
+  // Z_BUF_ERROR only means that no progress was possible, which is expected
+  // when the input ends in the middle of a block. A full output, however,
+  // may not have held all of the input.
+  if ((result != Z_OK && result != Z_BUF_ERROR) || stream_.avail_in > 0 ||
+      stream_.avail_out == 0) {
+    failed_ = true;
+    return false;
+  }
+
+  return true;
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,48 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Wrappers around ZLib's gzip compression, for the financial pings.
+
+#ifndef RLZ_WIN_LIB_GZIP_H_
+#define RLZ_WIN_LIB_GZIP_H_
+
+#include <string>
+
+#include "base/basictypes.h"
+#include "third_party/zlib/zlib.h"
+
+namespace rlz_lib {
+
+// Compresses length characters of data into a gzip stream.
+bool GzipCompress(const char* data, size_t length, std::string* compressed);
+
+// Inflates a gzip stream fed in chunks, as it is received. Anything after the
+// end of the stream is ignored.
+class GzipInflater {
+ public:
+  GzipInflater();
+  ~GzipInflater();
+
+  // Inflates input_length characters of input into output, and sets
+  // *output_length to the number of characters written. Returns false if the
+  // stream is corrupt, or if the inflated input does not fit in output_size
+  // characters, after which the stream can not be inflated any further.
+  bool Inflate(const char* input, size_t input_length, char* output,
+               size_t output_size, size_t* output_length);
+
+  // Whether the end of the stream was inflated.
+  bool finished() const { return finished_; }
+
+ private:
+  z_stream stream_;
+  bool initialized_;
+  bool finished_;
+  bool failed_;
+
+  DISALLOW_COPY_AND_ASSIGN(GzipInflater);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_GZIP_H_
@@ -0,0 +1,80 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit tests for the gzip wrappers.
+
+#include <algorithm>
+#include <string>
+
+#include "base/logging.h"
+#include "testing/gmock/include/gmock/gmock.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+#include "rlz/win/lib/gzip.h"
+
+namespace {
+
+std::string GetSampleRequest() {
+  std::string request("/tools/pso/ping?as=swg&brand=GGLA&pid=1&hl=en");
+  for (int i = 0; i < 50; ++i)
+    request.append("&events=I7S,W1I&rlz=I7:1R1_____en__252,W1:1R1_____en__252");
+  return request;
+}
+
+}  // namespace anonymous
+
+TEST(GzipUnittest, RoundTrip) {
+  std::string request(GetSampleRequest());
+  std::string compressed;
+  EXPECT_TRUE(rlz_lib::GzipCompress(request.data(), request.size(),
+                                    &compressed));
+  EXPECT_LT(compressed.size(), request.size() / 4);
+
+  // The gzip magic number.
+  ASSERT_GE(compressed.size(), 2u);
+  EXPECT_EQ('\x1f', compressed[0]);
+  EXPECT_EQ('\x8b', compressed[1]);
+
+  // Whatever the chunks, the stream inflates to the original text.
+  for (size_t chunk = 1; chunk <= compressed.size(); chunk += 7) {
+    rlz_lib::GzipInflater inflater;
+    std::string inflated(request.size() + 1, 0);
+    size_t length = 0;
+    for (size_t begin = 0; begin < compressed.size(); begin += chunk) {
+      size_t output_length = 0;
+      EXPECT_TRUE(inflater.Inflate(compressed.data() + begin,
+                                   std::min(chunk, compressed.size() - begin),
+                                   &inflated[length],
+                                   inflated.size() - length, &output_length));
+      length += output_length;
+    }
+    EXPECT_TRUE(inflater.finished());
+    EXPECT_EQ(request, inflated.substr(0, length));
+  }
+}
+
+TEST(GzipUnittest, InvalidStreams) {
+  std::string request(GetSampleRequest());
+  std::string compressed;
+  EXPECT_TRUE(rlz_lib::GzipCompress(request.data(), request.size(),
+                                    &compressed));
+
+  char output[100];
+  size_t output_length = 0;
+
+  // Not gzip.
+  rlz_lib::GzipInflater plain_inflater;
+  EXPECT_FALSE(plain_inflater.Inflate(request.data(), request.size(), output,
+                                      arraysize(output), &output_length));
+
+  // Too long for the output, which is not inflated any further.
+  rlz_lib::GzipInflater inflater;
+  EXPECT_FALSE(inflater.Inflate(compressed.data(), compressed.size(), output,
+                                arraysize(output), &output_length));
+  EXPECT_EQ(arraysize(output), output_length);
+  EXPECT_FALSE(inflater.Inflate(compressed.data(), compressed.size(), output,
+                                arraysize(output), &output_length));
+  EXPECT_EQ(0u, output_length);
+  EXPECT_FALSE(inflater.finished());
+}
@@ -9,21 +9,121 @@
 #include <windows.h>
 #include <Sddl.h>    // For SDDL_REVISION_1, ConvertStringSecurityDescript..
 #include <Aclapi.h>  // For SetSecurityInfo
+#include <string.h>
 
+#include "base/basictypes.h"
+#include "base/lazy_instance.h"
 #include "base/logging.h"
+#include "base/synchronization/lock.h"
+#include "base/threading/thread_local.h"
 #include "base/win/windows_version.h"
+#include "rlz/win/lib/trace.h"
 
 namespace {
 
 const wchar_t kMutexName[] = L"{A946A6A9-917E-4949-B9BC-6BADA8C7FD63}";
 
+// The per-process state of the RLZ mutex: the handle, and how many LibMutex
+// objects currently hold it on each thread.
+class MutexData {
+ public:
+  MutexData()
+      : mutex_(NULL),
+        default_timeout_(rlz_lib::kDefaultLockTimeoutMs),
+        timeout_count_(0) {
+    ResetStats();
+  }
+
+  // Returns the mutex handle, creating and labelling it on first use. The
+  // handle is kept open for the lifetime of the process.
+  HANDLE GetHandle() {
+    base::AutoLock auto_lock(lock_);
+    if (!mutex_) {
+      HANDLE mutex = CreateMutex(NULL, false, kMutexName);
+      if (mutex && !rlz_lib::SetObjectToLowIntegrity(mutex)) {
+        CloseHandle(mutex);
+        mutex = NULL;
+      }
+      mutex_ = mutex;
+    }
+    return mutex_;
+  }
+
+  int GetDepth() {
+    return static_cast<int>(reinterpret_cast<intptr_t>(depth_.Get()));
+  }
+
+  void SetDepth(int depth) {
+    depth_.Set(reinterpret_cast<void*>(static_cast<intptr_t>(depth)));
+  }
+
+  int GetDefaultTimeout() {
+    base::AutoLock auto_lock(lock_);
+    return default_timeout_;
+  }
+
+  void SetDefaultTimeout(int timeout_ms) {
+    base::AutoLock auto_lock(lock_);
+    default_timeout_ = timeout_ms;
+  }
+
+  // Counts an acquisition attempt which ended with |wait_result| after
+  // waiting |wait_ms|.
+  void RecordAcquisition(DWORD wait_result, bool contended, int wait_ms) {
+    base::AutoLock auto_lock(lock_);
+    if (wait_result == WAIT_OBJECT_0 || wait_result == WAIT_ABANDONED) {
+      ++stats_.acquisitions;
+      if (contended)
+        ++stats_.contended_acquisitions;
+    } else if (wait_result == WAIT_TIMEOUT) {
+      ++stats_.timeouts;
+      ++timeout_count_;
+    }
+
+    if (wait_result == WAIT_ABANDONED)
+      ++stats_.abandoned;
+
+    stats_.total_wait_ms += wait_ms;
+    if (wait_ms > stats_.max_wait_ms)
+      stats_.max_wait_ms = wait_ms;
+  }
+
+  void GetStats(rlz_lib::LockStats* stats) {
+    base::AutoLock auto_lock(lock_);
+    *stats = stats_;
+  }
+
+  void ResetStats() {
+    base::AutoLock auto_lock(lock_);
+    memset(&stats_, 0, sizeof(stats_));
+  }
+
+  int64 GetTimeoutCount() {
+    base::AutoLock auto_lock(lock_);
+    return timeout_count_;
+  }
+
+ private:
+  base::Lock lock_;
+  HANDLE mutex_;
+  base::ThreadLocalPointer<void> depth_;
+  int default_timeout_;
+  rlz_lib::LockStats stats_;
+  int64 timeout_count_;
+
+  DISALLOW_COPY_AND_ASSIGN(MutexData);
+};
+
+// Leaky, so that it can also be used from a DLL without an AtExitManager.
+base::LazyInstance<MutexData, base::LeakyLazyInstanceTraits<MutexData> >
+    g_mutex_data(base::LINKER_INITIALIZED);
+
 }  // namespace anonymous
 
 namespace rlz_lib {
 
 // Needed to allow synchronization across integrity levels.
-static bool SetObjectToLowIntegrity(HANDLE object,
-    SE_OBJECT_TYPE type = SE_KERNEL_OBJECT) {
+bool SetObjectToLowIntegrity(HANDLE object, SE_OBJECT_TYPE type) {
   if (base::win::GetVersion() < base::win::VERSION_VISTA)
     return true;  // Not needed on XP.
 
@@ -51,17 +151,83 @@ static bool SetObjectToLowIntegrity(HANDLE object,
   return result;
 }
 
-LibMutex::LibMutex() : acquired_(false), mutex_(NULL) {
-  mutex_ = CreateMutex(NULL, false, kMutexName);
-  bool result = SetObjectToLowIntegrity(mutex_);
-  if (result) {
-    acquired_ = (WAIT_OBJECT_0 == WaitForSingleObject(mutex_, 5000L));
-  }
+LibMutex::LibMutex() : acquired_(false) {
+  Acquire(g_mutex_data.Get().GetDefaultTimeout());
+}
+
+LibMutex::LibMutex(int timeout_ms) : acquired_(false) {
+  Acquire(timeout_ms);
 }
 
 LibMutex::~LibMutex() {
-  if (acquired_) ReleaseMutex(mutex_);
-  CloseHandle(mutex_);
+  if (!acquired_)
+    return;
+
+  MutexData* data = g_mutex_data.Pointer();
+  int depth = data->GetDepth() - 1;
+  data->SetDepth(depth);
+  if (depth == 0)
+    ReleaseMutex(data->GetHandle());
+}
+
+// static
+void LibMutex::SetDefaultTimeout(int timeout_ms) {
+  g_mutex_data.Get().SetDefaultTimeout(timeout_ms);
+}
+
+// static
+int LibMutex::GetDefaultTimeout() {
+  return g_mutex_data.Get().GetDefaultTimeout();
+}
+
+// static
+void LibMutex::GetStats(LockStats* stats) {
+  g_mutex_data.Get().GetStats(stats);
+}
+
+// static
+void LibMutex::ResetStats() {
+  g_mutex_data.Get().ResetStats();
+}
+
+// static
+int64 LibMutex::GetTimeoutCount() {
+  return g_mutex_data.Get().GetTimeoutCount();
+}
+
+void LibMutex::Acquire(int timeout_ms) {
+  MutexData* data = g_mutex_data.Pointer();
+
+  // Nested locks on the same thread reuse the lock already held.
+  int depth = data->GetDepth();
+  if (depth > 0) {
+    data->SetDepth(depth + 1);
+    acquired_ = true;
+    return;
+  }
+
+  HANDLE mutex = data->GetHandle();
+  if (!mutex)
+    return;
+
+  // Try first, so that only the acquisitions that queue are timed.
+  DWORD start = GetTickCount();
+  DWORD result = WaitForSingleObject(mutex, 0);
+  bool contended = (result == WAIT_TIMEOUT);
+  if (contended && timeout_ms > 0) {
+    ScopedTraceSpan span("LibMutexWait");
+    result = WaitForSingleObject(mutex, timeout_ms);
+  }
+  int wait_ms = contended ? static_cast<int>(GetTickCount() - start) : 0;
+
+  data->RecordAcquisition(result, contended, wait_ms);
+
+  // An abandoned mutex belongs to this thread now. Its previous owner died
+  // holding it, but each registry write is consistent on its own, so the
+  // lock is used as usual; not releasing it would block all other clients.
+  acquired_ = (result == WAIT_OBJECT_0 || result == WAIT_ABANDONED);
+  if (acquired_)
+    data->SetDepth(1);
 }
 
 }  // namespace rlz_lib
@@ -3,24 +3,54 @@
 // found in the COPYING file.
 //
 // Mutex to guarantee serialization of RLZ key accesses.
+//
+// The mutex handle is created once per process. The mutex is re-entrant: a
+// LibMutex constructed on a thread that already holds the lock does not wait
+// again, and the lock is released when the outermost LibMutex goes away.
+//
+// Acquisitions wait for the process default timeout, kDefaultLockTimeoutMs
+// unless set otherwise, or for the timeout given to the constructor. A
+// timeout of 0 only tries the lock.
 
 #ifndef RLZ_WIN_LIB_LIB_MUTEX_H_
 #define RLZ_WIN_LIB_LIB_MUTEX_H_
 
 #include <windows.h>
+#include <Aclapi.h>  // For SE_OBJECT_TYPE
+
+#include "rlz/win/lib/rlz_lib.h"
 
 namespace rlz_lib {
 
+// Labels a kernel object low integrity on Vista and later, so that processes
+// at all integrity levels can share it. Returns true on XP.
+bool SetObjectToLowIntegrity(HANDLE object,
+                             SE_OBJECT_TYPE type = SE_KERNEL_OBJECT);
+
 class LibMutex {
  public:
   LibMutex();
+  explicit LibMutex(int timeout_ms);
   ~LibMutex();
 
   bool failed(void) { return !acquired_; }
 
+  static void SetDefaultTimeout(int timeout_ms);
+  static int GetDefaultTimeout();
+
+  // The counters of the acquisitions made by this process. Nested locks are
+  // not counted.
+  static void GetStats(LockStats* stats);
+  static void ResetStats();
+
+  // The number of acquisitions of this process which timed out since it
+  // started. Unlike the stats, it is never reset.
+  static int64 GetTimeoutCount();
+
  private:
+  void Acquire(int timeout_ms);
+
   bool acquired_;
-  HANDLE mutex_;
 };
 
 }  // namespace rlz_lib
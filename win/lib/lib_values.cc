@@ -6,29 +6,249 @@
 
 #include "rlz/win/lib/lib_values.h"
 
+#include <map>
+
+#include "base/lazy_instance.h"
 #include "base/stringprintf.h"
+#include "base/synchronization/lock.h"
 #include "base/win/registry.h"
 #include "rlz/win/lib/assert.h"
 #include "rlz/win/lib/lib_mutex.h"
+#include "rlz/win/lib/trace.h"
 #include "rlz/win/lib/user_key.h"
 
 
 namespace {
 
+// The names of the access points and events, indexed by the enums. Each name
+// is at most two characters, so that the reverse lookup can index a table by
+// the characters of the name.
+const char kAccessPointNames[][3] = {
+  "",    // NO_ACCESS_POINT
+  "I7",  // IE_DEFAULT_SEARCH
+  "W1",  // IE_HOME_PAGE
+  "T4",  // IETB_SEARCH_BOX
+  "Q1",  // QUICK_SEARCH_BOX
+  "D1",  // GD_DESKBAND
+  "D2",  // GD_SEARCH_GADGET
+  "D3",  // GD_WEB_SERVER
+  "D4",  // GD_OUTLOOK
+  "C1",  // CHROME_OMNIBOX
+  "C2",  // CHROME_HOME_PAGE
+  "B2",  // FFTB2_BOX
+  "B3",  // FFTB3_BOX
+  "N1",  // PINYIN_IME_BHO
+  "G1",  // IGOOGLE_WEBPAGE
+  "H1",  // MOBILE_IDLE_SCREEN_BLACKBERRY
+  "H2",  // MOBILE_IDLE_SCREEN_WINMOB
+  "H3",  // MOBILE_IDLE_SCREEN_SYMBIAN
+  "R0",  // FF_HOME_PAGE
+  "R1",  // FF_SEARCH_BOX
+  "R2",  // IE_BROWSED_PAGE
+  "R3",  // QSB_WIN_BOX
+  "R4",  // WEBAPPS_CALENDAR
+  "R5",  // WEBAPPS_DOCS
+  "R6",  // WEBAPPS_GMAIL
+  "R7",  // IETB_LINKDOCTOR
+  "R8",  // FFTB_LINKDOCTOR
+  "T7",  // IETB7_SEARCH_BOX
+  "T8",  // TB8_SEARCH_BOX
+  "C3",  // CHROME_FRAME
+  "V1",  // PARTNER_AP_1
+  "V2",  // PARTNER_AP_2
+  "V3",  // PARTNER_AP_3
+  "V4",  // PARTNER_AP_4
+  "V5",  // PARTNER_AP_5
+  "RH",  // UNDEFINED_AP_H
+  "RI",  // UNDEFINED_AP_I
+  "RJ",  // UNDEFINED_AP_J
+  "RK",  // UNDEFINED_AP_K
+  "RL",  // UNDEFINED_AP_L
+  "RM",  // UNDEFINED_AP_M
+  "RN",  // UNDEFINED_AP_N
+  "RO",  // UNDEFINED_AP_O
+  "RP",  // UNDEFINED_AP_P
+  "RQ",  // UNDEFINED_AP_Q
+  "RR",  // UNDEFINED_AP_R
+  "RS",  // UNDEFINED_AP_S
+  "RT",  // UNDEFINED_AP_T
+  "RU",  // UNDEFINED_AP_U
+  "RV",  // UNDEFINED_AP_V
+  "RW",  // UNDEFINED_AP_W
+  "RX",  // UNDEFINED_AP_X
+  "RY",  // UNDEFINED_AP_Y
+  "RZ",  // UNDEFINED_AP_Z
+  "U0",  // PACK_AP0
+  "U1",  // PACK_AP1
+  "U2",  // PACK_AP2
+  "U3",  // PACK_AP3
+  "U4",  // PACK_AP4
+  "U5",  // PACK_AP5
+  "U6",  // PACK_AP6
+  "U7",  // PACK_AP7
+  "U8",  // PACK_AP8
+  "U9",  // PACK_AP9
+  "UA",  // PACK_AP10
+  "UB",  // PACK_AP11
+  "UC",  // PACK_AP12
+  "UD",  // PACK_AP13
+};
+COMPILE_ASSERT(arraysize(kAccessPointNames) == rlz_lib::LAST_ACCESS_POINT,
+               access_point_names_must_match_the_access_points);
+
+const char kEventNames[][3] = {
+  "",    // INVALID_EVENT
+  "I",   // INSTALL
+  "S",   // SET_TO_GOOGLE
+  "F",   // FIRST_SEARCH
+  "R",   // REPORT_RLS
+  "A",   // ACTIVATE
+};
+COMPILE_ASSERT(arraysize(kEventNames) == rlz_lib::LAST_EVENT,
+               event_names_must_match_the_events);
+
+// The reverse lookup tables are indexed by the characters of the names,
+// which are all in ['0', 'Z'], so they get distinct indices. Other names can
+// collide with a valid one, and are rejected by comparing the name.
+const int kNameCharBits = 6;
+
+int GetNameCharIndex(char letter) {
+  return (letter - '0') & ((1 << kNameCharBits) - 1);
+}
+
+class NameTables {
+ public:
+  NameTables() {
+    memset(access_points_, rlz_lib::NO_ACCESS_POINT, sizeof(access_points_));
+    for (int i = rlz_lib::NO_ACCESS_POINT + 1; i < rlz_lib::LAST_ACCESS_POINT;
+         ++i) {
+      int index = GetAccessPointIndex(kAccessPointNames[i]);
+      VERIFY(access_points_[index] == rlz_lib::NO_ACCESS_POINT);
+      access_points_[index] = i;
+    }
+
+    memset(events_, rlz_lib::INVALID_EVENT, sizeof(events_));
+    for (int i = rlz_lib::INVALID_EVENT + 1; i < rlz_lib::LAST_EVENT; ++i) {
+      int index = GetNameCharIndex(kEventNames[i][0]);
+      VERIFY(events_[index] == rlz_lib::INVALID_EVENT);
+      events_[index] = i;
+    }
+  }
+
+  rlz_lib::AccessPoint GetAccessPoint(const char* name) const {
+    rlz_lib::AccessPoint point = static_cast<rlz_lib::AccessPoint>(
+        access_points_[GetAccessPointIndex(name)]);
+    const char* point_name = kAccessPointNames[point];
+    return point_name[0] == name[0] && point_name[1] == name[1] ?
+        point : rlz_lib::NO_ACCESS_POINT;
+  }
+
+  rlz_lib::Event GetEvent(char name) const {
+    rlz_lib::Event event =
+        static_cast<rlz_lib::Event>(events_[GetNameCharIndex(name)]);
+    return kEventNames[event][0] == name ? event : rlz_lib::INVALID_EVENT;
+  }
+
+ private:
+  static int GetAccessPointIndex(const char* name) {
+    return (GetNameCharIndex(name[0]) << kNameCharBits) |
+           GetNameCharIndex(name[1]);
+  }
+
+  uint8 access_points_[1 << (2 * kNameCharBits)];
+  uint8 events_[1 << kNameCharBits];
+
+  DISALLOW_COPY_AND_ASSIGN(NameTables);
+};
+
+COMPILE_ASSERT(rlz_lib::LAST_ACCESS_POINT <= kuint8max,
+               access_points_must_fit_in_a_byte);
+
+// Leaky, so that it can also be used from a DLL without an AtExitManager.
+base::LazyInstance<NameTables, base::LeakyLazyInstanceTraits<NameTables> >
+    g_name_tables(base::LINKER_INITIALIZED);
+
+struct WideStringLess {
+  bool operator()(const wchar_t* left, const wchar_t* right) const {
+    return wcscmp(left, right) < 0;
+  }
+};
+
+// The location of a subkey of kLibKeyName for a brand, and of its product
+// subkeys.
+struct RegKeyLocation {
+  std::wstring name;
+  std::wstring location;
+  std::map<int, std::wstring> product_locations;
+};
+
+// The locations of the subkeys, by brand and name, built on first use and
+// never freed, so that the references handed out stay valid. Lookups take
+// the name as is, without copying it.
+class RegKeyLocations {
+ public:
+  RegKeyLocations() {}
+
+  const std::wstring& Get(const wchar_t* name) {
+    base::AutoLock auto_lock(lock_);
+    return GetEntry(name)->location;
+  }
+
+  const std::wstring& GetProduct(const wchar_t* name,
+                                 rlz_lib::Product product,
+                                 const wchar_t* product_name) {
+    base::AutoLock auto_lock(lock_);
+    RegKeyLocation* entry = GetEntry(name);
+    std::map<int, std::wstring>::const_iterator it =
+        entry->product_locations.find(product);
+    if (it != entry->product_locations.end())
+      return it->second;
+
+    std::wstring& location = entry->product_locations[product];
+    base::StringAppendF(&location, L"%ls\\%ls", entry->location.c_str(),
+                        product_name);
+    return location;
+  }
+
+ private:
+  typedef std::map<const wchar_t*, RegKeyLocation*, WideStringLess>
+      LocationMap;
+
+  // The caller must hold |lock_|.
+  RegKeyLocation* GetEntry(const wchar_t* name) {
+    LocationMap& locations =
+        brands_[rlz_lib::SupplementaryBranding::GetBrand()];
+    LocationMap::const_iterator it = locations.find(name);
+    if (it != locations.end())
+      return it->second;
+
+    RegKeyLocation* entry = new RegKeyLocation;
+    entry->name = name;
+    base::StringAppendF(&entry->location, L"%ls\\%ls", rlz_lib::kLibKeyName,
+                        name);
+    rlz_lib::SupplementaryBranding::AppendBrandToString(&entry->location);
+    locations[entry->name.c_str()] = entry;
+    return entry;
+  }
+
+  base::Lock lock_;
+  std::map<std::wstring, LocationMap> brands_;
+
+  DISALLOW_COPY_AND_ASSIGN(RegKeyLocations);
+};
+
+// Leaky, so that it can also be used from a DLL without an AtExitManager.
+base::LazyInstance<RegKeyLocations,
+                   base::LeakyLazyInstanceTraits<RegKeyLocations> >
+    g_locations(base::LINKER_INITIALIZED);
+
 bool GetRegKey(HKEY user_key, const wchar_t* name, REGSAM access,
                base::win::RegKey* key) {
-  std::wstring key_location;
-  base::StringAppendF(&key_location, L"%ls\\%ls", rlz_lib::kLibKeyName, name);
-  rlz_lib::SupplementaryBranding::AppendBrandToString(&key_location);
-
-  LONG ret = ERROR_SUCCESS;
-  if (access & (KEY_SET_VALUE | KEY_CREATE_SUB_KEY | KEY_CREATE_LINK)) {
-    ret = key->Create(user_key, key_location.c_str(), access);
-  } else {
-    ret = key->Open(user_key, key_location.c_str(), access);
-  }
+  const std::wstring& key_location(rlz_lib::GetRegKeyLocation(name));
 
-  return ret == ERROR_SUCCESS;
+  rlz_lib::ScopedTraceSpan span("GetRegKey");
+  return rlz_lib::UserKey::OpenKey(user_key, key_location, NULL, access,
+                                   key) == ERROR_SUCCESS;
 }
 
 }  // anonymous
@@ -54,6 +274,7 @@ SupplementaryBranding::SupplementaryBranding(const wchar_t* brand)
   }
 
   brand_ = brand;
+  UserKey::ClosePooledKeys();
 }
 
 SupplementaryBranding::~SupplementaryBranding() {
@@ -61,6 +282,7 @@ SupplementaryBranding::~SupplementaryBranding() {
     return;
 
   brand_.clear();
+  UserKey::ClosePooledKeys();
 }
 
 // static
@@ -69,6 +291,20 @@ void SupplementaryBranding::AppendBrandToString(std::wstring* str) {
     base::StringAppendF(str, L"\\_%ls", brand_.c_str());
 }
 
+ScopedRlzSession::ScopedRlzSession() : lock_(new LibMutex()) {
+}
+
+ScopedRlzSession::ScopedRlzSession(int timeout_ms)
+    : lock_(new LibMutex(timeout_ms)) {
+}
+
+ScopedRlzSession::~ScopedRlzSession() {
+}
+
+bool ScopedRlzSession::failed() const {
+  return lock_->failed();
+}
+
 
 //
 // Registry information.
@@ -80,8 +316,17 @@ const wchar_t kLibKeyName[]               = L"Software\\Google\\Common\\Rlz";
 const wchar_t kRlzsSubkeyName[]           = L"RLZs";
 const wchar_t kEventsSubkeyName[]         = L"Events";
 const wchar_t kStatefulEventsSubkeyName[] = L"StatefulEvents";
+const wchar_t kEventBitsSubkeyName[]      = L"EventBits";
+const wchar_t kStatefulEventBitsSubkeyName[] = L"StatefulEventBits";
 const wchar_t kDccValueName[]             = L"DCC";
+const wchar_t kMachineIdValueName[]       = L"MachineId";
+const wchar_t kMachineIdVolumeValueName[] = L"MachineIdVolume";
+const wchar_t kMachineIdComputerValueName[] = L"MachineIdComputer";
 const wchar_t kPingTimesSubkeyName[]      = L"PTimes";
+const wchar_t kPingRetriesSubkeyName[]    = L"PRetries";
+const wchar_t kPingIntervalsSubkeyName[]  = L"PIntervals";
+const wchar_t kPingHealthSubkeyName[]     = L"PHealth";
+const wchar_t kLockTimeoutsValueName[]    = L"LockTimeouts";
 
 const wchar_t* GetProductName(Product product) {
   switch (product) {
@@ -125,6 +370,7 @@ const char kDccCgiVariable[] = "dcc";
 const char kRlsCgiVariable[] = "rls";
 const char kMachineIdCgiVariable[] = "id";
 const char kSetDccResponseVariable[] = "set_dcc";
+const char kPingIntervalResponseVariable[] = "ping-interval";
 
 //
 // Financial server information.
@@ -133,12 +379,22 @@ const char kSetDccResponseVariable[] = "set_dcc";
 const char kFinancialPingPath[] = "/tools/pso/ping";
 const char kFinancialServer[]   = "clients1.google.com";
 const char kFinancialPingType[] = "GET";
+const char kFinancialPingPostType[] = "POST";
 
 const int kFinancialPort = 80;
 
 // Ping times in 100-nanosecond intervals.
 const int64 kEventsPingInterval = 24LL * 3600LL * 10000000LL;  // 1 day
 const int64 kNoEventsPingInterval = kEventsPingInterval * 7LL;  // 1 week
+const int64 kPingRetryDelay = 5LL * 60LL * 10000000LL;  // 5 minutes
+const int64 kMaxPingRetryDelay = 6LL * 3600LL * 10000000LL;  // 6 hours
+
+const int kMinPingIntervalSeconds = 3600;  // 1 hour
+const int kMaxPingIntervalSeconds = 30 * 24 * 3600;  // 30 days
+const int kPingJitterPercent = 10;
+
+const char kGzipEncoding[] = "gzip";
+const size_t kMinCompressedPingLength = kMaxCgiLength / 2;
 
 const char kFinancialPingUserAgent[] = "Mozilla/4.0 (compatible; Win32)";
 const char* kFinancialPingResponseObjects[] = { "text/*", NULL };
@@ -149,79 +405,12 @@ const char* kFinancialPingResponseObjects[] = { "text/*", NULL };
 //
 
 const char* GetAccessPointName(AccessPoint point) {
-  switch (point) {
-  case NO_ACCESS_POINT:               return "";
-  case IE_DEFAULT_SEARCH:             return "I7";
-  case IE_HOME_PAGE:                  return "W1";
-  case IETB_SEARCH_BOX:               return "T4";
-  case QUICK_SEARCH_BOX:              return "Q1";
-  case GD_DESKBAND:                   return "D1";
-  case GD_SEARCH_GADGET:              return "D2";
-  case GD_WEB_SERVER:                 return "D3";
-  case GD_OUTLOOK:                    return "D4";
-  case CHROME_OMNIBOX:                return "C1";
-  case CHROME_HOME_PAGE:              return "C2";
-  case FFTB2_BOX:                     return "B2";
-  case FFTB3_BOX:                     return "B3";
-  case PINYIN_IME_BHO:                return "N1";
-  case IGOOGLE_WEBPAGE:               return "G1";
-  case MOBILE_IDLE_SCREEN_BLACKBERRY: return "H1";
-  case MOBILE_IDLE_SCREEN_WINMOB:     return "H2";
-  case MOBILE_IDLE_SCREEN_SYMBIAN:    return "H3";
-  case FF_HOME_PAGE:                  return "R0";
-  case FF_SEARCH_BOX:                 return "R1";
-  case IE_BROWSED_PAGE:               return "R2";
-  case QSB_WIN_BOX:                   return "R3";
-  case WEBAPPS_CALENDAR:              return "R4";
-  case WEBAPPS_DOCS:                  return "R5";
-  case WEBAPPS_GMAIL:                 return "R6";
-  case IETB_LINKDOCTOR:               return "R7";
-  case FFTB_LINKDOCTOR:               return "R8";
-  case IETB7_SEARCH_BOX:              return "T7";
-  case TB8_SEARCH_BOX:                return "T8";
-  case CHROME_FRAME:                  return "C3";
-  case PARTNER_AP_1:                  return "V1";
-  case PARTNER_AP_2:                  return "V2";
-  case PARTNER_AP_3:                  return "V3";
-  case PARTNER_AP_4:                  return "V4";
-  case PARTNER_AP_5:                  return "V5";
-  case UNDEFINED_AP_H:                return "RH";
-  case UNDEFINED_AP_I:                return "RI";
-  case UNDEFINED_AP_J:                return "RJ";
-  case UNDEFINED_AP_K:                return "RK";
-  case UNDEFINED_AP_L:                return "RL";
-  case UNDEFINED_AP_M:                return "RM";
-  case UNDEFINED_AP_N:                return "RN";
-  case UNDEFINED_AP_O:                return "RO";
-  case UNDEFINED_AP_P:                return "RP";
-  case UNDEFINED_AP_Q:                return "RQ";
-  case UNDEFINED_AP_R:                return "RR";
-  case UNDEFINED_AP_S:                return "RS";
-  case UNDEFINED_AP_T:                return "RT";
-  case UNDEFINED_AP_U:                return "RU";
-  case UNDEFINED_AP_V:                return "RV";
-  case UNDEFINED_AP_W:                return "RW";
-  case UNDEFINED_AP_X:                return "RX";
-  case UNDEFINED_AP_Y:                return "RY";
-  case UNDEFINED_AP_Z:                return "RZ";
-  case PACK_AP0:                      return "U0";
-  case PACK_AP1:                      return "U1";
-  case PACK_AP2:                      return "U2";
-  case PACK_AP3:                      return "U3";
-  case PACK_AP4:                      return "U4";
-  case PACK_AP5:                      return "U5";
-  case PACK_AP6:                      return "U6";
-  case PACK_AP7:                      return "U7";
-  case PACK_AP8:                      return "U8";
-  case PACK_AP9:                      return "U9";
-  case PACK_AP10:                     return "UA";
-  case PACK_AP11:                     return "UB";
-  case PACK_AP12:                     return "UC";
-  case PACK_AP13:                     return "UD";
+  if (point < NO_ACCESS_POINT || point >= LAST_ACCESS_POINT) {
+    ASSERT_STRING("GetAccessPointName: Unknown Access Point");
+    return NULL;
   }
 
-  ASSERT_STRING("GetAccessPointName: Unknown Access Point");
-  return NULL;
+  return kAccessPointNames[point];
 }
 
 
@@ -234,28 +423,35 @@ bool GetAccessPointFromName(const char* name, AccessPoint* point) {
   if (!name)
     return false;
 
-  for (int i = NO_ACCESS_POINT; i < LAST_ACCESS_POINT; i++)
-    if (strcmp(name, GetAccessPointName(static_cast<AccessPoint>(i))) == 0) {
-      *point = static_cast<AccessPoint>(i);
-      return true;
-    }
+  return GetAccessPointFromName(base::StringPiece(name), point);
+}
 
-  return false;
+
+bool GetAccessPointFromName(const base::StringPiece& name,
+                            AccessPoint* point) {
+  if (!point) {
+    ASSERT_STRING("GetAccessPointFromName: point is NULL");
+    return false;
+  }
+  *point = NO_ACCESS_POINT;
+
+  if (name.empty())
+    return true;
+  if (name.size() != 2)
+    return false;
+
+  *point = g_name_tables.Get().GetAccessPoint(name.data());
+  return *point != NO_ACCESS_POINT;
 }
 
 
 const char* GetEventName(Event event) {
-  switch (event) {
-  case INVALID_EVENT: return "";
-  case INSTALL:       return "I";
-  case SET_TO_GOOGLE: return "S";
-  case FIRST_SEARCH:  return "F";
-  case REPORT_RLS:    return "R";
-  case ACTIVATE:      return "A";
+  if (event < INVALID_EVENT || event >= LAST_EVENT) {
+    ASSERT_STRING("GetPointName: Unknown Event");
+    return NULL;
   }
 
-  ASSERT_STRING("GetPointName: Unknown Event");
-  return NULL;
+  return kEventNames[event];
 }
 
 
@@ -268,13 +464,24 @@ bool GetEventFromName(const char* name, Event* event) {
   if (!name)
     return false;
 
-  for (int i = INVALID_EVENT; i < LAST_EVENT; i++)
-    if (strcmp(name, GetEventName(static_cast<Event>(i))) == 0) {
-      *event = static_cast<Event>(i);
-      return true;
-    }
+  return GetEventFromName(base::StringPiece(name), event);
+}
+
 
-  return false;
+bool GetEventFromName(const base::StringPiece& name, Event* event) {
+  if (!event) {
+    ASSERT_STRING("GetEventFromName: event is NULL");
+    return false;
+  }
+  *event = INVALID_EVENT;
+
+  if (name.empty())
+    return true;
+  if (name.size() != 1)
+    return false;
+
+  *event = g_name_tables.Get().GetEvent(name[0]);
+  return *event != INVALID_EVENT;
 }
 
 
@@ -283,30 +490,67 @@ bool GetPingTimesRegKey(HKEY user_key, REGSAM access, base::win::RegKey* key) {
 }
 
 
+bool GetPingRetriesRegKey(HKEY user_key, REGSAM access,
+                          base::win::RegKey* key) {
+  return GetRegKey(user_key, kPingRetriesSubkeyName, access, key);
+}
+
+
+bool GetPingIntervalsRegKey(HKEY user_key, REGSAM access,
+                            base::win::RegKey* key) {
+  return GetRegKey(user_key, kPingIntervalsSubkeyName, access, key);
+}
+
+
+bool GetPingHealthRegKey(HKEY user_key, REGSAM access,
+                         base::win::RegKey* key) {
+  return GetRegKey(user_key, kPingHealthSubkeyName, access, key);
+}
+
+
+const std::wstring& GetRegKeyLocation(const wchar_t* name) {
+  return g_locations.Get().Get(name);
+}
+
+
+bool GetEventsRegKeyLocation(const wchar_t* event_type,
+                             const rlz_lib::Product* product,
+                             std::wstring* key_location) {
+  if (product == NULL) {
+    *key_location = GetRegKeyLocation(event_type);
+    return true;
+  }
+
+  const wchar_t* product_name = rlz_lib::GetProductName(*product);
+  if (!product_name)
+    return false;
+
+  *key_location = g_locations.Get().GetProduct(event_type, *product,
+                                                product_name);
+  return true;
+}
+
+
 bool GetEventsRegKey(HKEY user_key, const wchar_t* event_type,
                      const rlz_lib::Product* product,
                      REGSAM access, base::win::RegKey* key) {
-  std::wstring key_location;
-  base::StringAppendF(&key_location, L"%ls\\%ls", rlz_lib::kLibKeyName,
-                      event_type);
-  SupplementaryBranding::AppendBrandToString(&key_location);
-
+  const wchar_t* product_name = NULL;
   if (product != NULL) {
-    const wchar_t* product_name = rlz_lib::GetProductName(*product);
+    product_name = rlz_lib::GetProductName(*product);
     if (!product_name)
       return false;
-
-    base::StringAppendF(&key_location, L"\\%ls", product_name);
   }
 
-  LONG ret = ERROR_SUCCESS;
-  if (access & (KEY_SET_VALUE | KEY_CREATE_SUB_KEY | KEY_CREATE_LINK)) {
-    ret = key->Create(user_key, key_location.c_str(), access);
-  } else {
-    ret = key->Open(user_key, key_location.c_str(), access);
-  }
+  // The product subkeys are opened relative to the pooled events key.
+  ScopedTraceSpan span("GetEventsRegKey");
+  return UserKey::OpenKey(user_key, GetRegKeyLocation(event_type),
+                          product_name, access, key) == ERROR_SUCCESS;
+}
+
 
-  return ret == ERROR_SUCCESS;
+bool GetEventBitsRegKey(HKEY user_key, const wchar_t* bits_type,
+                        REGSAM access, base::win::RegKey* key) {
+  return GetRegKey(user_key, bits_type, access, key);
 }
 
 
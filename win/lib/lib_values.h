@@ -8,6 +8,7 @@
 #define RLZ_WIN_LIB_LIB_VALUES_H_
 
 #include "base/basictypes.h"
+#include "base/string_piece.h"
 #include "base/win/registry.h"
 #include "rlz/win/lib/rlz_lib.h"
 
@@ -23,21 +24,56 @@ namespace rlz_lib {
 //   <AccessPointName><EventName> = 1 @
 //   HKCU\kLibKeyName\kEventsSubkeyName\GetProductName(product).
 //
+//   With compact event storage, the events of a product are instead stored as
+//   a single bitmap, one byte of (1 << event) bits per access point:
+//   GetProductName(product) = <REG_BINARY bitmap> @
+//   HKCU\kLibKeyName\kEventBitsSubkeyName.
+//   Stateful events are stored the same way, under kStatefulEventsSubkeyName
+//   and kStatefulEventBitsSubkeyName.
+//
 //   The OEM Deal Confirmation Code (DCC) is stored as
 //   kDccValueName = <DCC value> @ HKLM\kLibKeyName
 //
+//   The machine ID is cached as kMachineIdValueName = <machine ID> @
+//   HKLM\kLibKeyName, with the volume serial number and the computer name it
+//   was computed on as kMachineIdVolumeValueName and
+//   kMachineIdComputerValueName.
+//
 //   The last ping time, per product is stored as:
 //   GetProductName(product) = <last ping time> @
 //   HKCU\kLibKeyName\kPingTimesSubkeyName.
 //
+//   The request of a failed ping, per product, is stored as:
+//   GetProductName(product) = <retry state and request> @
+//   HKCU\kLibKeyName\kPingRetriesSubkeyName.
+//
+//   The ping interval set by the server, per product, is stored as:
+//   GetProductName(product) = <interval in seconds> @
+//   HKCU\kLibKeyName\kPingIntervalsSubkeyName.
+//
+//   The ping health counters, per product, are stored as:
+//   GetProductName(product) = <version and PingHealthStats> @
+//   HKCU\kLibKeyName\kPingHealthSubkeyName, and the lock timeouts, for all
+//   the products, as:
+//   kLockTimeoutsValueName = <count> @ HKCU\kLibKeyName\kPingHealthSubkeyName.
+//
 // The server does not care about any of these constants.
 //
 extern const wchar_t kLibKeyName[];
 extern const wchar_t kRlzsSubkeyName[];
 extern const wchar_t kEventsSubkeyName[];
 extern const wchar_t kStatefulEventsSubkeyName[];
+extern const wchar_t kEventBitsSubkeyName[];
+extern const wchar_t kStatefulEventBitsSubkeyName[];
 extern const wchar_t kDccValueName[];
+extern const wchar_t kMachineIdValueName[];
+extern const wchar_t kMachineIdVolumeValueName[];
+extern const wchar_t kMachineIdComputerValueName[];
 extern const wchar_t kPingTimesSubkeyName[];
+extern const wchar_t kPingRetriesSubkeyName[];
+extern const wchar_t kPingIntervalsSubkeyName[];
+extern const wchar_t kPingHealthSubkeyName[];
+extern const wchar_t kLockTimeoutsValueName[];
 
 const wchar_t* GetProductName(Product product);
 
@@ -46,17 +82,43 @@ const wchar_t* GetProductName(Product product);
 extern const wchar_t kGoogleKeyName[];
 extern const wchar_t kGoogleCommonKeyName[];
 
+// Functions to get the location of the specific registry keys, relative to
+// the user key. Both include the supplementary brand. The locations are built
+// once per brand, and the returned reference stays valid.
+const std::wstring& GetRegKeyLocation(const wchar_t* name);
+
+bool GetEventsRegKeyLocation(const wchar_t* event_type,
+                             const rlz_lib::Product* product,
+                             std::wstring* key_location);
+
 // Function to get the specific registry keys.
 bool GetPingTimesRegKey(HKEY user_key,
                         REGSAM access,
                         base::win::RegKey* key);
 
+bool GetPingRetriesRegKey(HKEY user_key,
+                          REGSAM access,
+                          base::win::RegKey* key);
+
+bool GetPingIntervalsRegKey(HKEY user_key,
+                            REGSAM access,
+                            base::win::RegKey* key);
+
+bool GetPingHealthRegKey(HKEY user_key,
+                         REGSAM access,
+                         base::win::RegKey* key);
+
 bool GetEventsRegKey(HKEY user_key,
                      const wchar_t* event_type,
                      const rlz_lib::Product* product,
                      REGSAM access,
                      base::win::RegKey* key);
 
+bool GetEventBitsRegKey(HKEY user_key,
+                        const wchar_t* bits_type,
+                        REGSAM access,
+                        base::win::RegKey* key);
+
 bool GetAccessPointRlzsRegKey(HKEY user_key,
                               REGSAM access,
                               base::win::RegKey* key);
@@ -90,6 +152,10 @@ bool GetAccessPointRlzsRegKey(HKEY user_key,
 //   A server response setting / confirming the DCC will look like (no spaces):
 //   kDccCgiVariable : <DCC Value>
 //
+//   A server response setting the interval between the pings of the product
+//   will look like (no spaces):
+//   kPingIntervalResponseVariable : <interval in seconds>
+//
 //   Each ping to the server must also contain kProtocolCgiArgument as well.
 //
 //   Pings may also contain (but not necessarily controlled by this Lib):
@@ -115,6 +181,7 @@ extern const char kRlzCgiIndicator[];
 extern const char kRlsCgiVariable[];
 extern const char kMachineIdCgiVariable[];
 extern const char kSetDccResponseVariable[];
+extern const char kPingIntervalResponseVariable[];
 
 //
 // Financial ping server information.
@@ -123,24 +190,43 @@ extern const char kSetDccResponseVariable[];
 extern const char kFinancialPingPath[];
 extern const char kFinancialServer[];
 extern const char kFinancialPingType[];
+extern const char kFinancialPingPostType[];
 
 extern const int kFinancialPort;
 
 extern const int64 kEventsPingInterval;
 extern const int64 kNoEventsPingInterval;
+extern const int64 kPingRetryDelay;
+extern const int64 kMaxPingRetryDelay;
+
+// The bounds of the ping interval a server response may set, in seconds.
+extern const int kMinPingIntervalSeconds;
+extern const int kMaxPingIntervalSeconds;
+
+// The per-machine delay added to the ping intervals, at most this percentage
+// of the interval.
+extern const int kPingJitterPercent;
+
+// Compressed pings: the encoding, and the shortest request sent as a
+// compressed POST body once the server has sent a compressed response.
+extern const char kGzipEncoding[];
+extern const size_t kMinCompressedPingLength;
 
 extern const char kFinancialPingUserAgent[];
 extern const char* kFinancialPingResponseObjects[];
 
 //
 // The names for AccessPoints and Events that we use MUST be the same
-// as those used/understood by the server.
+// as those used/understood by the server. The lookups by name are table
+// based, and take constant time.
 //
 const char* GetAccessPointName(AccessPoint point);
 bool GetAccessPointFromName(const char* name, AccessPoint* point);
+bool GetAccessPointFromName(const base::StringPiece& name, AccessPoint* point);
 
 const char* GetEventName(Event event);
 bool GetEventFromName(const char* name, Event* event);
+bool GetEventFromName(const base::StringPiece& name, Event* event);
 
 }  // namespace rlz_lib
 
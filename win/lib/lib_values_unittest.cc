@@ -59,3 +59,38 @@ TEST(LibValuesUnittest, GetEventFromName) {
   EXPECT_FALSE(rlz_lib::GetEventFromName("F ", &event));
   EXPECT_EQ(rlz_lib::INVALID_EVENT, event);
 }
+
+
+TEST(LibValuesUnittest, NameLookupRoundTrip) {
+  for (int i = rlz_lib::NO_ACCESS_POINT; i < rlz_lib::LAST_ACCESS_POINT; i++) {
+    rlz_lib::AccessPoint expected = static_cast<rlz_lib::AccessPoint>(i);
+    rlz_lib::AccessPoint point;
+    EXPECT_TRUE(rlz_lib::GetAccessPointFromName(
+        rlz_lib::GetAccessPointName(expected), &point));
+    EXPECT_EQ(expected, point);
+  }
+
+  for (int i = rlz_lib::INVALID_EVENT; i < rlz_lib::LAST_EVENT; i++) {
+    rlz_lib::Event expected = static_cast<rlz_lib::Event>(i);
+    rlz_lib::Event event;
+    EXPECT_TRUE(rlz_lib::GetEventFromName(rlz_lib::GetEventName(expected),
+                                          &event));
+    EXPECT_EQ(expected, event);
+  }
+
+  // Names that index the same slots as valid ones.
+  rlz_lib::AccessPoint point;
+  EXPECT_FALSE(rlz_lib::GetAccessPointFromName("Iw", &point));
+  EXPECT_EQ(rlz_lib::NO_ACCESS_POINT, point);
+  rlz_lib::Event event;
+  EXPECT_FALSE(rlz_lib::GetEventFromName("\t", &event));
+  EXPECT_EQ(rlz_lib::INVALID_EVENT, event);
+
+  // Names that are not NULL terminated.
+  EXPECT_TRUE(rlz_lib::GetAccessPointFromName(base::StringPiece("I7S", 2),
+                                              &point));
+  EXPECT_EQ(rlz_lib::IE_DEFAULT_SEARCH, point);
+  EXPECT_TRUE(rlz_lib::GetEventFromName(base::StringPiece("I7S").substr(2),
+                                        &event));
+  EXPECT_EQ(rlz_lib::SET_TO_GOOGLE, event);
+}
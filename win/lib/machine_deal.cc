@@ -8,21 +8,27 @@
 
 #include <windows.h>
 #include <Sddl.h>  // For ConvertSidToStringSidW.
-#include <vector>
+#include <algorithm>
 
 #include "base/basictypes.h"
+#include "base/lazy_instance.h"
 #include "base/memory/scoped_ptr.h"
 #include "base/sha1.h"
-#include "base/string_split.h"
 #include "base/string_util.h"
 #include "base/stringprintf.h"
+#include "base/synchronization/lock.h"
 #include "base/win/registry.h"
 #include "rlz/win/lib/assert.h"
 #include "rlz/win/lib/crc8.h"
 #include "rlz/win/lib/lib_mutex.h"
 #include "rlz/win/lib/lib_values.h"
+#include "rlz/win/lib/ping_params_cache.h"
+#include "rlz/win/lib/ping_response.h"
+#include "rlz/win/lib/shared_state_mirror.h"
+#include "rlz/win/lib/state_cache.h"
 #include "rlz/win/lib/string_utils.h"
 #include "rlz/win/lib/user_key.h"
+#include "rlz/win/lib/value_store.h"
 
 namespace {
 
@@ -71,51 +77,85 @@ void NormalizeDcc(const char* raw_dcc, char* normalized_dcc) {
   normalized_dcc[index] = 0;
 }
 
-bool GetResponseLine(const char* response_text, int response_length,
-                     int* search_index, std::string* response_line) {
-  if (!response_line || !search_index || *search_index > response_length)
+// The machine ID of this process, computed or read once.
+struct MachineIdState {
+  MachineIdState() : calculated(false) {}
+
+  base::Lock lock;
+  bool calculated;
+  std::wstring id;
+};
+
+// Leaky, so that it can also be used from a DLL without an AtExitManager.
+base::LazyInstance<MachineIdState,
+                   base::LeakyLazyInstanceTraits<MachineIdState> >
+    g_machine_id(base::LINKER_INITIALIZED);
+
+// Set once the prefetch has been queued.
+LONG g_prefetch_queued = 0;
+
+// Reads the machine ID cached in HKLM, if it was computed on the same volume
+// and under the same computer name. Images cloned to other machines get a
+// new computer name, or a new volume serial number when the disk is
+// formatted.
+bool ReadCachedMachineId(int volume_id, const std::wstring& computer_name,
+                         std::wstring* machine_id) {
+  base::win::RegKey key(HKEY_LOCAL_MACHINE, rlz_lib::kLibKeyName,
+                        KEY_READ | KEY_WOW64_32KEY);
+  if (!key.Valid())
     return false;
 
-  response_line->clear();
-
-  if (*search_index < 0)
+  DWORD cached_volume_id = 0;
+  std::wstring cached_computer_name;
+  if (key.ReadValueDW(rlz_lib::kMachineIdVolumeValueName,
+                      &cached_volume_id) != ERROR_SUCCESS ||
+      static_cast<int>(cached_volume_id) != volume_id ||
+      key.ReadValue(rlz_lib::kMachineIdComputerValueName,
+                    &cached_computer_name) != ERROR_SUCCESS ||
+      cached_computer_name != computer_name ||
+      key.ReadValue(rlz_lib::kMachineIdValueName, machine_id) !=
+          ERROR_SUCCESS ||
+      machine_id->empty()) {
+    machine_id->clear();
     return false;
-
-  int line_begin = *search_index;
-  const char* line_end = strchr(response_text + line_begin, '\n');
-
-  if (line_end == NULL || line_end - response_text > response_length) {
-    line_end = response_text + response_length;
-    *search_index = -1;
-  } else {
-    *search_index = line_end - response_text + 1;
   }
 
-  response_line->assign(response_text + line_begin,
-                        line_end - response_text - line_begin);
   return true;
 }
 
-bool GetResponseValue(const std::string& response_line,
-                      const std::string& response_key,
-                      std::string* value) {
-  if (!value)
-    return false;
-
-  value->clear();
-
-  if (!StartsWithASCII(response_line, response_key, true))
-    return false;
-
-  std::vector<std::string> tokens;
-  base::SplitString(response_line, ':', &tokens);
-  if (tokens.size() != 2)
-    return false;
+// Caches the machine ID in HKLM. Processes that cannot write to HKLM, and
+// did not run rlz_lib::CreateMachineState(), simply do not cache it.
+void WriteCachedMachineId(int volume_id, const std::wstring& computer_name,
+                          const std::wstring& machine_id) {
+  rlz_lib::LibMutex lock;
+  if (lock.failed())
+    return;
+
+  base::win::RegKey key(HKEY_LOCAL_MACHINE, rlz_lib::kLibKeyName,
+                        KEY_READ | KEY_WRITE | KEY_WOW64_32KEY);
+  if (!key.Valid())
+    return;
+
+  // The ID is written last, so that it is never read with the volume and
+  // computer name of another ID.
+  rlz_lib::StateCache::InvalidateMachine();
+  rlz_lib::SharedStateMirror::InvalidateMachine();
+  rlz_lib::PingParamsCache::InvalidateMachine();
+  key.DeleteValue(rlz_lib::kMachineIdValueName);
+  if (key.WriteValue(rlz_lib::kMachineIdVolumeValueName,
+                     static_cast<DWORD>(volume_id)) == ERROR_SUCCESS &&
+      key.WriteValue(rlz_lib::kMachineIdComputerValueName,
+                     computer_name.c_str()) == ERROR_SUCCESS)
+    key.WriteValue(rlz_lib::kMachineIdValueName, machine_id.c_str());
+}
 
-  // The first token is the key, the second is the value.  The value is already
-  // trimmed for whitespace.
-  *value = tokens[1];
-  return true;
+// |context| is the module reference which keeps the code of the thread
+// loaded until it exits.
+DWORD WINAPI PrefetchMachineIdThread(void* context) {
+  std::wstring machine_id;
+  rlz_lib::MachineDealCode::GetMachineId(&machine_id);
+  FreeLibraryAndExitThread(static_cast<HMODULE>(context), 0);
+  return 0;
 }
 
 }  // namespace anonymous
@@ -136,6 +176,19 @@ bool MachineDealCode::Set(const char* dcc) {
     return false;
   }
 
+  if (RlzValueStore::IsFileStoreEnabled()) {
+    char normalized_dcc[kMaxDccLength + 1];
+    NormalizeDcc(dcc, normalized_dcc);
+
+    ScopedValueStore store(NULL, true);
+    if (!store.get() || !store.get()->WriteMachineDealCode(normalized_dcc) ||
+        !store.get()->Commit()) {
+      ASSERT_STRING("MachineDealCode::Set: Could not write the DCC");
+      return false;
+    }
+    return true;
+  }
+
   base::win::RegKey hklm_key(HKEY_LOCAL_MACHINE, kLibKeyName,
                              KEY_READ | KEY_WRITE | KEY_WOW64_32KEY);
   if (!hklm_key.Valid()) {
@@ -150,6 +203,9 @@ bool MachineDealCode::Set(const char* dcc) {
 
   // Write the DCC to HKLM.  Note that we need to include the null character
   // when writing the string.
+  StateCache::InvalidateMachine();
+  SharedStateMirror::InvalidateMachine();
+  PingParamsCache::InvalidateMachine();
   if (!RegKeyWriteValue(hklm_key, kDccValueName, normalized_dcc)) {
     ASSERT_STRING("MachineDealCode::Set: Could not write the DCC value");
     return false;
@@ -166,48 +222,41 @@ bool MachineDealCode::GetNewCodeFromPingResponse(const char* response,
   *has_new_dcc = false;
   new_dcc[0] = 0;
 
-  int response_length = -1;
-  if (!IsPingResponseValid(response, &response_length))
+  ParsedPingResponse parsed;
+  if (!ParsePingResponseText(response, &parsed))
+    return false;
+
+  return GetNewCodeFromParsedResponse(parsed, has_new_dcc, new_dcc,
+                                      new_dcc_size);
+}
+
+bool MachineDealCode::GetNewCodeFromParsedResponse(
+    const ParsedPingResponse& parsed, bool* has_new_dcc, char* new_dcc,
+    int new_dcc_size) {
+  if (!has_new_dcc || !new_dcc || !new_dcc_size)
     return false;
 
+  *has_new_dcc = false;
+  new_dcc[0] = 0;
+
   // Get the current DCC value to compare to later)
   char stored_dcc[kMaxDccLength + 1];
   if (!Get(stored_dcc, arraysize(stored_dcc)))
     stored_dcc[0] = 0;
 
-  int search_index = 0;
-  std::string response_line;
-  std::string new_dcc_value;
-  bool old_dcc_confirmed = false;
-  const std::string dcc_cgi(kDccCgiVariable);
-  const std::string dcc_cgi_response(kSetDccResponseVariable);
-  while (GetResponseLine(response, response_length, &search_index,
-                         &response_line)) {
-    std::string value;
-
-    if (!old_dcc_confirmed &&
-        GetResponseValue(response_line, dcc_cgi, &value)) {
-      // This is the old DCC confirmation - should match value in registry.
-      if (value != stored_dcc)
-        return false;  // Corrupted DCC - ignore this response.
-      else
-        old_dcc_confirmed = true;
-      continue;
-    }
+  // This is the old DCC confirmation - should match value in registry.
+  if (parsed.has_dcc && parsed.dcc != stored_dcc)
+    return false;  // Corrupted DCC - ignore this response.
 
-    if (!(*has_new_dcc) &&
-        GetResponseValue(response_line, dcc_cgi_response, &value)) {
-      // This is the new DCC.
-      if (value.size() > kMaxDccLength) continue;  // Too long
-      *has_new_dcc = true;
-      new_dcc_value = value;
-    }
+  if (parsed.has_set_dcc) {
+    *has_new_dcc = true;
+    size_t length = std::min(parsed.set_dcc.size(),
+                             static_cast<size_t>(new_dcc_size - 1));
+    parsed.set_dcc.copy(new_dcc, length);
+    new_dcc[length] = 0;
   }
 
-  old_dcc_confirmed |= (NULL == stored_dcc[0]);
-
-  base::strlcpy(new_dcc, new_dcc_value.c_str(), new_dcc_size);
-  return old_dcc_confirmed;
+  return parsed.has_dcc || !stored_dcc[0];
 }
 
 bool MachineDealCode::SetFromPingResponse(const char* response) {
@@ -250,10 +299,6 @@ bool MachineDealCode::GetAsCgi(char* cgi, int cgi_size) {
 }
 
 bool MachineDealCode::Get(char* dcc, int dcc_size) {
-  LibMutex lock;
-  if (lock.failed())
-    return false;
-
   if (!dcc || dcc_size <= 0) {
     ASSERT_STRING("MachineDealCode::Get: Invalid buffer");
     return false;
@@ -261,6 +306,45 @@ bool MachineDealCode::Get(char* dcc, int dcc_size) {
 
   dcc[0] = 0;
 
+  bool has_dcc = false;
+  std::string cached_dcc;
+  int generation;
+  if (RlzValueStore::IsFileStoreEnabled()) {
+    ScopedValueStore store(NULL, false);
+    if (!store.get() || !store.get()->ReadMachineDealCode(&cached_dcc) ||
+        cached_dcc.empty())
+      return false;  // no DCC.
+
+    if (!CopyCachedValue(cached_dcc, dcc, dcc_size)) {
+      ASSERT_STRING("MachineDealCode::Get: Insufficient buffer size");
+      dcc[0] = 0;
+      return false;
+    }
+    return true;
+  }
+
+  if (StateCache::LookupDcc(&has_dcc, &cached_dcc, &generation)) {
+    if (!has_dcc || !CopyCachedValue(cached_dcc, dcc, dcc_size)) {
+      ASSERT_STRING("MachineDealCode::Get: Insufficient buffer size");
+      dcc[0] = 0;
+      return false;
+    }
+    return true;
+  }
+
+  if (SharedStateMirror::LookupDcc(&cached_dcc)) {
+    if (!CopyCachedValue(cached_dcc, dcc, dcc_size)) {
+      ASSERT_STRING("MachineDealCode::Get: Insufficient buffer size");
+      dcc[0] = 0;
+      return false;
+    }
+    return true;
+  }
+
+  LibMutex lock;
+  if (lock.failed())
+    return false;
+
   base::win::RegKey dcc_key(HKEY_LOCAL_MACHINE, kLibKeyName,
                             KEY_READ | KEY_WOW64_32KEY);
   if (!dcc_key.Valid())
@@ -268,26 +352,41 @@ bool MachineDealCode::Get(char* dcc, int dcc_size) {
 
   size_t size = dcc_size;
   if (!RegKeyReadValue(dcc_key, kDccValueName, dcc, &size)) {
+    // The size is left untouched if the value does not exist.
+    if (size <= static_cast<size_t>(dcc_size))
+      StateCache::StoreDcc(generation, false, "");
+
     ASSERT_STRING("MachineDealCode::Get: Insufficient buffer size");
     dcc[0] = 0;
     return false;
   }
 
+  // A value that fills the whole buffer may have been truncated.
+  if (strlen(dcc) + 1 < static_cast<size_t>(dcc_size)) {
+    StateCache::StoreDcc(generation, true, dcc);
+    SharedStateMirror::StoreDcc(dcc);
+  }
+
   return true;
 }
 
 bool MachineDealCode::Clear() {
+  if (RlzValueStore::IsFileStoreEnabled()) {
+    ScopedValueStore store(NULL, true);
+    return store.get() && store.get()->WriteMachineDealCode("") &&
+        store.get()->Commit();
+  }
+
   base::win::RegKey dcc_key(HKEY_LOCAL_MACHINE, kLibKeyName,
                             KEY_READ | KEY_WRITE | KEY_WOW64_32KEY);
   if (!dcc_key.Valid())
     return false;  // no DCC key.
 
-  dcc_key.DeleteValue(kDccValueName);
-
-  // Verify deletion.
-  wchar_t dcc[kMaxDccLength + 1];
-  DWORD dcc_size = arraysize(dcc);
-  if (dcc_key.ReadValue(kDccValueName, dcc, &dcc_size, NULL) == ERROR_SUCCESS) {
+  LONG result = dcc_key.DeleteValue(kDccValueName);
+  StateCache::InvalidateMachine();
+  SharedStateMirror::InvalidateMachine();
+  PingParamsCache::InvalidateMachine();
+  if (result != ERROR_SUCCESS && result != ERROR_FILE_NOT_FOUND) {
     ASSERT_STRING("MachineDealCode::Clear: Could not delete the DCC value.");
     return false;
   }
@@ -386,41 +485,95 @@ bool MachineDealCode::GetMachineId(std::wstring* machine_id) {
   if (!machine_id)
     return false;
 
-  static std::wstring calculated_id;
-  static bool calculated = false;
-  if (calculated) {
-    *machine_id = calculated_id;
-    return true;
-  }
-
-  // Calculate the Windows SID.
-  std::wstring sid_string;
+  int volume_id = 0;
   wchar_t computer_name[MAX_COMPUTERNAME_LENGTH + 1] = {0};
-  DWORD size = arraysize(computer_name);
+  bool write_cache = false;
+  {
+    // Concurrent callers wait for the first one rather than repeat the
+    // lookups.
+    MachineIdState* state = g_machine_id.Pointer();
+    base::AutoLock auto_lock(state->lock);
+    if (state->calculated) {
+      *machine_id = state->id;
+      return true;
+    }
 
-  if (GetComputerNameW(computer_name, &size)) {
-    char sid_buffer[SECURITY_MAX_SID_SIZE];
-    SID* sid = reinterpret_cast<SID*>(sid_buffer);
-    if (GetComputerSid(computer_name, sid, SECURITY_MAX_SID_SIZE)) {
-      sid_string = ConvertSidToString(sid);
+    // Get the system drive volume serial number.
+    bool has_volume_id = GetSystemVolumeSerialNumber(&volume_id);
+    if (!has_volume_id) {
+      ASSERT_STRING("GetMachineId: Failed to retrieve volume serial number");
+      volume_id = 0;
     }
-  }
 
-  // Get the system drive volume serial number.
-  int volume_id = 0;
-  if (!GetSystemVolumeSerialNumber(&volume_id)) {
-    ASSERT_STRING("GetMachineId: Failed to retrieve volume serial number");
-    volume_id = 0;
-  }
+    DWORD size = arraysize(computer_name);
+    bool has_computer_name = GetComputerNameW(computer_name, &size) != FALSE;
+
+    // The computer SID lookup can go to a domain controller, so the ID is
+    // cached in HKLM across processes.
+    bool can_cache = has_volume_id && has_computer_name;
+    if (!can_cache ||
+        !ReadCachedMachineId(volume_id, computer_name, machine_id)) {
+      // Calculate the Windows SID.
+      std::wstring sid_string;
+      if (has_computer_name) {
+        char sid_buffer[SECURITY_MAX_SID_SIZE];
+        SID* sid = reinterpret_cast<SID*>(sid_buffer);
+        if (GetComputerSid(computer_name, sid, SECURITY_MAX_SID_SIZE)) {
+          sid_string = ConvertSidToString(sid);
+        }
+      }
+
+      if (!GetMachineIdImpl(sid_string, volume_id, machine_id))
+        return false;
+
+      // An ID computed without the SID is not cached, so that it is computed
+      // again once the lookup succeeds.
+      write_cache = can_cache && !sid_string.empty();
+    }
 
-  if (!GetMachineIdImpl(sid_string, volume_id, machine_id))
-    return false;
+    state->calculated = true;
+    state->id = *machine_id;
+  }
 
-  calculated = true;
-  calculated_id = *machine_id;
+  // Written without the lock, which callers holding the RLZ mutex take.
+  if (write_cache)
+    WriteCachedMachineId(volume_id, computer_name, *machine_id);
   return true;
 }
 
+// static
+void MachineDealCode::ClearComputedMachineId() {
+  MachineIdState* state = g_machine_id.Pointer();
+  base::AutoLock auto_lock(state->lock);
+  state->calculated = false;
+  state->id.clear();
+}
+
+// static
+void MachineDealCode::PrefetchMachineId() {
+  if (InterlockedExchange(&g_prefetch_queued, 1))
+    return;
+
+  // The thread holds a reference on the module it runs from, so that it does
+  // not run unloaded code if the host unloads the RLZ DLL in between.
+  HMODULE module = NULL;
+  if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS,
+          reinterpret_cast<const wchar_t*>(&PrefetchMachineIdThread),
+          &module)) {
+    InterlockedExchange(&g_prefetch_queued, 0);
+    return;
+  }
+
+  HANDLE thread = CreateThread(NULL, 0, PrefetchMachineIdThread, module, 0,
+                               NULL);
+  if (!thread) {
+    FreeLibrary(module);
+    InterlockedExchange(&g_prefetch_queued, 0);
+    return;
+  }
+  CloseHandle(thread);
+}
+
 bool MachineDealCode::GetMachineIdImpl(const std::wstring& sid_string,
                                        int volume_id,
                                        std::wstring* machine_id) {
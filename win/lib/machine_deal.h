@@ -12,6 +12,8 @@
 
 namespace rlz_lib {
 
+struct ParsedPingResponse;
+
 class MachineDealCode {
  public:
   // Set the OEM Deal Confirmation Code (DCC). This information is used for RLZ
@@ -40,6 +42,13 @@ class MachineDealCode {
                                          char* new_dcc,
                                          int new_dcc_size);
 
+  // Same as GetNewCodeFromPingResponse(), on a response that has already been
+  // parsed and validated.
+  static bool GetNewCodeFromParsedResponse(const ParsedPingResponse& parsed,
+                                           bool* has_new_dcc,
+                                           char* new_dcc,
+                                           int new_dcc_size);
+
   // Get the DCC cgi argument string to append to a daily or financial ping.
   static bool GetAsCgi(char* cgi, int cgi_size);
 
@@ -48,8 +57,15 @@ class MachineDealCode {
 
   // Gets the universal ID for the machine - this is a hash of the Windows
   // machine SID plus a checksum byte.
+  // The ID is computed once per process, and cached in HKLM when the process
+  // can write there for the processes that run after it.
   static bool GetMachineId(std::wstring* id);
 
+  // Starts computing the machine ID on a worker thread, so that a later
+  // GetMachineId() does not wait for the computer SID lookup. Only the first
+  // call has an effect.
+  static void PrefetchMachineId();
+
   // Calculates the universal ID for a machine given an sid and volume id.
   static bool GetMachineIdImpl(const std::wstring& sid_string,
                                int volume_id,
@@ -61,6 +77,10 @@ class MachineDealCode {
   // been successfully called.
   static bool Clear();
 
+  // Forget the machine ID computed by this process, so that the next
+  // GetMachineId() reads or computes it again. Only for testing purposes.
+  static void ClearComputedMachineId();
+
   // Helper for DCC extraction from ping responses.
   // If set_value = true, it extracts the new DCC value to write to registry,
   // if false, it extracts the server's echo of the current DCC value.
@@ -12,15 +12,20 @@
 // rlz_lib::CreateMachineState() has been successfully called.
 
 #include "base/logging.h"
+#include "base/win/registry.h"
 #include "testing/gmock/include/gmock/gmock.h"
 #include "testing/gtest/include/gtest/gtest.h"
 
+#include "rlz/win/lib/lib_values.h"
 #include "rlz/win/lib/machine_deal.h"
 #include "rlz/win/test/rlz_test_helpers.h"
 
 class MachineDealCodeHelper : public rlz_lib::MachineDealCode {
  public:
   static bool Clear() { return rlz_lib::MachineDealCode::Clear(); }
+  static void ClearComputedMachineId() {
+    rlz_lib::MachineDealCode::ClearComputedMachineId();
+  }
 
  private:
   MachineDealCodeHelper() {}
@@ -34,6 +39,42 @@ TEST_F(MachineDealCodeTest, CreateMachineState) {
   EXPECT_TRUE(rlz_lib::CreateMachineState());
 }
 
+namespace {
+
+// Returns the number of ACEs in the DACL of the machine key, or -1.
+int GetMachineKeyAceCount() {
+  base::win::RegKey key(HKEY_LOCAL_MACHINE, rlz_lib::kLibKeyName,
+                        KEY_READ | KEY_WOW64_32KEY);
+  char buffer[4096];
+  DWORD size = sizeof(buffer);
+  if (RegGetKeySecurity(key.Handle(), DACL_SECURITY_INFORMATION, buffer,
+                        &size) != ERROR_SUCCESS)
+    return -1;
+
+  BOOL present = FALSE;
+  BOOL defaulted = FALSE;
+  ACL* dacl = NULL;
+  ACL_SIZE_INFORMATION info;
+  if (!GetSecurityDescriptorDacl(buffer, &present, &dacl, &defaulted) ||
+      !present || !dacl ||
+      !GetAclInformation(dacl, &info, sizeof(info), AclSizeInformation))
+    return -1;
+
+  return info.AceCount;
+}
+
+}  // namespace anonymous
+
+TEST_F(MachineDealCodeTest, CreateMachineStateIsIdempotent) {
+  int ace_count = GetMachineKeyAceCount();
+  EXPECT_LT(0, ace_count);
+
+  // The access granted by the first call is found, and not granted again.
+  EXPECT_TRUE(rlz_lib::CreateMachineState());
+  EXPECT_TRUE(rlz_lib::CreateMachineState());
+  EXPECT_EQ(ace_count, GetMachineKeyAceCount());
+}
+
 TEST_F(MachineDealCodeTest, Set) {
   MachineDealCodeHelper::Clear();
   char dcc_50[50];
@@ -163,3 +204,34 @@ TEST(MachineDealCodeTestMachineId, MachineId) {
   EXPECT_STREQ(L"A341BA986A7E86840688977FCF20C86E253F00919E068B50F8",
                id.c_str());
 }
+
+TEST_F(MachineDealCodeTest, CachedMachineId) {
+  MachineDealCodeHelper::ClearComputedMachineId();
+  std::wstring id;
+  ASSERT_TRUE(rlz_lib::MachineDealCode::GetMachineId(&id));
+
+  base::win::RegKey key(HKEY_LOCAL_MACHINE, rlz_lib::kLibKeyName,
+                        KEY_READ | KEY_WRITE | KEY_WOW64_32KEY);
+  std::wstring cached_id;
+  if (key.ReadValue(rlz_lib::kMachineIdValueName, &cached_id) !=
+      ERROR_SUCCESS)
+    return;  // The computer SID could not be looked up.
+  EXPECT_EQ(id, cached_id);
+
+  // Later processes use the cached ID.
+  EXPECT_EQ(ERROR_SUCCESS,
+            key.WriteValue(rlz_lib::kMachineIdValueName, L"CachedId"));
+  MachineDealCodeHelper::ClearComputedMachineId();
+  EXPECT_TRUE(rlz_lib::MachineDealCode::GetMachineId(&cached_id));
+  EXPECT_EQ(L"CachedId", cached_id);
+
+  // Until the volume changes.
+  EXPECT_EQ(ERROR_SUCCESS,
+            key.WriteValue(rlz_lib::kMachineIdVolumeValueName,
+                           static_cast<DWORD>(0)));
+  MachineDealCodeHelper::ClearComputedMachineId();
+  rlz_lib::MachineDealCode::PrefetchMachineId();
+  EXPECT_TRUE(rlz_lib::MachineDealCode::GetMachineId(&cached_id));
+  EXPECT_EQ(id, cached_id);
+  MachineDealCodeHelper::ClearComputedMachineId();
+}
@@ -0,0 +1,235 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The persisted health counters of the financial pings.
+
+#include "rlz/win/lib/ping_health.h"
+
+#include <windows.h>
+#include <string.h>
+
+#include "base/basictypes.h"
+#include "base/win/registry.h"
+#include "rlz/win/lib/assert.h"
+#include "rlz/win/lib/lib_mutex.h"
+#include "rlz/win/lib/lib_values.h"
+#include "rlz/win/lib/user_key.h"
+
+namespace {
+
+// The REG_BINARY value of the counters of a product.
+struct HealthValue {
+  DWORD version;
+  DWORD reserved;  // 0.
+  rlz_lib::PingHealthStats stats;
+};
+COMPILE_ASSERT(sizeof(HealthValue) == 8 + sizeof(rlz_lib::PingHealthStats),
+               health_value_has_no_padding);
+
+// Changed along with PingHealthStats.
+const DWORD kHealthValueVersion = 1;
+
+// The lock timeouts of this process already counted by a ping. Only read and
+// written while holding the RLZ lock, which no two threads hold together.
+int64 g_counted_lock_timeouts = 0;
+
+int64 GetSystemTimeAsInt64() {
+  FILETIME now_as_file_time;
+  GetSystemTimeAsFileTime(&now_as_file_time);
+  LARGE_INTEGER integer;
+  integer.HighPart = now_as_file_time.dwHighDateTime;
+  integer.LowPart = now_as_file_time.dwLowDateTime;
+  return integer.QuadPart;
+}
+
+void Increment(uint32* counter, int64 count) {
+  const uint32 kMaxCount = 0xFFFFFFFF;
+  *counter = count >= kMaxCount - *counter ?
+      kMaxCount : *counter + static_cast<uint32>(count);
+}
+
+// Reads the counters of |product_name|. Returns false if there are none, or
+// if they are not readable, e.g. from another version.
+bool ReadHealth(HKEY user_key, const wchar_t* product_name,
+                rlz_lib::PingHealthStats* stats) {
+  base::win::RegKey key;
+  if (!rlz_lib::GetPingHealthRegKey(user_key, KEY_READ, &key))
+    return false;
+
+  HealthValue value;
+  DWORD type = REG_NONE;
+  DWORD size = sizeof(value);
+  if (RegQueryValueExW(key.Handle(), product_name, NULL, &type,
+                       reinterpret_cast<BYTE*>(&value), &size) !=
+      ERROR_SUCCESS || type != REG_BINARY || size != sizeof(value) ||
+      value.version != kHealthValueVersion)
+    return false;
+
+  *stats = value.stats;
+  return true;
+}
+
+// Adds |count| to the lock timeouts of the user.
+bool AddLockTimeouts(HKEY user_key, int64 count) {
+  base::win::RegKey key;
+  if (!rlz_lib::GetPingHealthRegKey(user_key, KEY_READ | KEY_WRITE, &key))
+    return false;
+
+  DWORD value = 0;
+  if (key.ReadValueDW(rlz_lib::kLockTimeoutsValueName, &value) !=
+      ERROR_SUCCESS)
+    value = 0;
+  uint32 timeouts = value;
+  Increment(&timeouts, count);
+  return key.WriteValue(rlz_lib::kLockTimeoutsValueName,
+                        static_cast<DWORD>(timeouts)) == ERROR_SUCCESS;
+}
+
+bool WriteHealth(HKEY user_key, const wchar_t* product_name,
+                 const rlz_lib::PingHealthStats& stats) {
+  HealthValue value;
+  memset(&value, 0, sizeof(value));
+  value.version = kHealthValueVersion;
+  memcpy(&value.stats, &stats, sizeof(stats));
+
+  base::win::RegKey key;
+  return rlz_lib::GetPingHealthRegKey(user_key, KEY_WRITE, &key) &&
+      key.WriteValue(product_name, &value, sizeof(value), REG_BINARY) ==
+      ERROR_SUCCESS;
+}
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+// static
+bool PingHealth::RecordPing(Product product, const wchar_t* sid,
+                            const PingResult& result, bool valid_response) {
+  const wchar_t* product_name = GetProductName(product);
+  if (!product_name)
+    return false;
+
+  LibMutex lock;
+  if (lock.failed())
+    return false;  // The timeout is counted with the next ping.
+
+  UserKey user_key(sid);
+  if (!user_key.HasAccess(true))
+    return false;
+
+  PingHealthStats stats;
+  if (!ReadHealth(user_key.Get(), product_name, &stats)) {
+    memset(&stats, 0, sizeof(stats));
+    stats.start_time = GetSystemTimeAsInt64();
+  }
+
+  Increment(&stats.attempts, 1);
+  if (!result.status)
+    Increment(&stats.network_failures, 1);
+  else if (result.status != 200)
+    Increment(&stats.http_errors, 1);
+  else if (!valid_response)
+    Increment(&stats.crc_failures, 1);
+  else
+    Increment(&stats.successes, 1);
+
+  // The lock timeouts are not stored per product.
+  stats.lock_timeouts = 0;
+
+  for (int phase = 0; phase < LAST_PING_PHASE; ++phase) {
+    int64 duration_ms = 0;
+    if (result.timer.GetDuration(static_cast<PingPhase>(phase),
+                                 &duration_ms))
+      Increment(&stats.latency_ms[phase][GetLatencyBucket(duration_ms)], 1);
+  }
+
+  if (!WriteHealth(user_key.Get(), product_name, stats)) {
+    ASSERT_STRING("PingHealth::RecordPing: Could not write the counters");
+    return false;
+  }
+
+  // Only written when this process timed out since its previous ping.
+  int64 lock_timeouts = LibMutex::GetTimeoutCount();
+  if (lock_timeouts > g_counted_lock_timeouts) {
+    if (!AddLockTimeouts(user_key.Get(),
+                         lock_timeouts - g_counted_lock_timeouts)) {
+      ASSERT_STRING("PingHealth::RecordPing: "
+                    "Could not write the lock timeouts");
+      return false;
+    }
+    g_counted_lock_timeouts = lock_timeouts;
+  }
+
+  return true;
+}
+
+// static
+bool PingHealth::Get(Product product, const wchar_t* sid,
+                     PingHealthStats* stats) {
+  if (!stats) {
+    ASSERT_STRING("PingHealth::Get: stats is NULL");
+    return false;
+  }
+  memset(stats, 0, sizeof(*stats));
+
+  const wchar_t* product_name = GetProductName(product);
+  if (!product_name)
+    return false;
+
+  LibMutex lock;
+  if (lock.failed())
+    return false;
+
+  UserKey user_key(sid);
+  if (!user_key.HasAccess(false))
+    return false;
+
+  if (!ReadHealth(user_key.Get(), product_name, stats))
+    memset(stats, 0, sizeof(*stats));
+
+  base::win::RegKey key;
+  DWORD lock_timeouts = 0;
+  if (GetPingHealthRegKey(user_key.Get(), KEY_READ, &key) &&
+      key.ReadValueDW(kLockTimeoutsValueName, &lock_timeouts) ==
+      ERROR_SUCCESS)
+    stats->lock_timeouts = lock_timeouts;
+  return true;
+}
+
+// static
+bool PingHealth::Reset(Product product, const wchar_t* sid) {
+  const wchar_t* product_name = GetProductName(product);
+  if (!product_name)
+    return false;
+
+  LibMutex lock;
+  if (lock.failed())
+    return false;
+
+  UserKey user_key(sid);
+  if (!user_key.HasAccess(true))
+    return false;
+
+  base::win::RegKey key;
+  if (!GetPingHealthRegKey(user_key.Get(), KEY_READ | KEY_WRITE, &key))
+    return true;  // The subkey is only created with the first ping.
+
+  LONG result = key.DeleteValue(product_name);
+  LONG timeouts_result = key.DeleteValue(kLockTimeoutsValueName);
+  return (result == ERROR_SUCCESS || result == ERROR_FILE_NOT_FOUND) &&
+      (timeouts_result == ERROR_SUCCESS ||
+       timeouts_result == ERROR_FILE_NOT_FOUND);
+}
+
+// static
+int PingHealth::GetLatencyBucket(int64 duration_ms) {
+  int bucket = 0;
+  while (duration_ms > 0 && bucket < kPingLatencyBuckets - 1) {
+    duration_ms >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,44 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The persisted health counters of the financial pings.
+
+#ifndef RLZ_WIN_LIB_PING_HEALTH_H_
+#define RLZ_WIN_LIB_PING_HEALTH_H_
+
+#include "base/basictypes.h"
+#include "rlz/win/lib/ping_transport.h"
+#include "rlz/win/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+// The PingHealthStats of each product are kept in the user hive, as a
+// versioned REG_BINARY value which each ping reads and writes once. A value
+// of another version or size is counted from scratch. The lock timeouts are
+// kept apart, for all the products of the user, since a process does not
+// know which product a timeout delayed.
+class PingHealth {
+ public:
+  // Counts a ping of |product| which ended with |result|, and adds the RLZ
+  // lock timeouts of this process since its previous ping was counted to
+  // those of the user.
+  // |valid_response| is whether the response passed IsPingResponseValid().
+  static bool RecordPing(Product product, const wchar_t* sid,
+                         const PingResult& result, bool valid_response);
+
+  static bool Get(Product product, const wchar_t* sid,
+                  PingHealthStats* stats);
+  static bool Reset(Product product, const wchar_t* sid);
+
+  // The latency histogram bucket of a phase of |duration_ms|.
+  static int GetLatencyBucket(int64 duration_ms);
+
+ private:
+  PingHealth() {}
+  ~PingHealth() {}
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_PING_HEALTH_H_
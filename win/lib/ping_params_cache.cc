@@ -0,0 +1,187 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// An in-process cache of the ping params built by GetPingParams().
+
+#include "rlz/win/lib/ping_params_cache.h"
+
+#include <string.h>
+
+#include <map>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "base/lazy_instance.h"
+#include "base/synchronization/lock.h"
+#include "base/win/registry.h"
+#include "rlz/win/lib/cgi_builder.h"
+#include "rlz/win/lib/lib_values.h"
+
+namespace {
+
+// Products ping with one or two access point lists, so a few entries per
+// hive are enough.
+const size_t kMaxEntriesPerHive = 4;
+
+struct Entry {
+  std::vector<rlz_lib::AccessPoint> points;
+  rlz_lib::PingParamsStamp stamp;
+  std::string cgi;
+};
+
+typedef std::vector<Entry> EntryList;
+typedef std::map<std::wstring, EntryList> HiveMap;
+
+struct CacheData {
+  base::Lock lock;
+  HiveMap hives;
+};
+
+// Leaky, so that it can also be used from a DLL without an AtExitManager.
+base::LazyInstance<CacheData, base::LeakyLazyInstanceTraits<CacheData> >
+    g_cache(base::LINKER_INITIALIZED);
+
+// The prefix of the names of the hive's entries, for all brands.
+std::wstring GetUserPrefix(const wchar_t* sid) {
+  std::wstring prefix(sid ? sid : L"");
+  prefix += L"\\";
+  return prefix;
+}
+
+std::wstring GetHiveName(const wchar_t* sid) {
+  return GetUserPrefix(sid) + rlz_lib::SupplementaryBranding::GetBrand();
+}
+
+int64 ToInt64(const FILETIME& ft) {
+  LARGE_INTEGER integer;
+  integer.HighPart = ft.dwHighDateTime;
+  integer.LowPart = ft.dwLowDateTime;
+  return integer.QuadPart;
+}
+
+bool IsSettled(const FILETIME& write_time, const FILETIME& now) {
+  // FILETIMEs count 100ns intervals.
+  const int64 kSettleTime = rlz_lib::PingParamsCache::kSettleTimeMs * 10000LL;
+  return ToInt64(now) - ToInt64(write_time) >= kSettleTime;
+}
+
+bool ReadWriteTime(const base::win::RegKey& key, FILETIME* write_time) {
+  // A missing key keeps a zero write time.
+  write_time->dwLowDateTime = 0;
+  write_time->dwHighDateTime = 0;
+  if (!key.Valid())
+    return true;
+
+  return ::RegQueryInfoKeyW(key.Handle(), NULL, NULL, NULL, NULL, NULL, NULL,
+                            NULL, NULL, NULL, NULL, write_time) ==
+      ERROR_SUCCESS;
+}
+
+bool Matches(const Entry& entry, const rlz_lib::AccessPoint* access_points,
+             int count, const rlz_lib::PingParamsStamp& stamp) {
+  return entry.points.size() == static_cast<size_t>(count) &&
+      (count == 0 || memcmp(&entry.points[0], access_points,
+                            count * sizeof(*access_points)) == 0) &&
+      CompareFileTime(&entry.stamp.rlzs_write_time,
+                      &stamp.rlzs_write_time) == 0 &&
+      CompareFileTime(&entry.stamp.dcc_write_time,
+                      &stamp.dcc_write_time) == 0;
+}
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+// static
+bool PingParamsCache::ReadStamp(HKEY user_key, PingParamsStamp* stamp) {
+  base::win::RegKey rlzs_key;
+  GetAccessPointRlzsRegKey(user_key, KEY_READ, &rlzs_key);
+  base::win::RegKey dcc_key(HKEY_LOCAL_MACHINE, kLibKeyName,
+                            KEY_READ | KEY_WOW64_32KEY);
+  if (!ReadWriteTime(rlzs_key, &stamp->rlzs_write_time) ||
+      !ReadWriteTime(dcc_key, &stamp->dcc_write_time))
+    return false;
+
+  FILETIME now;
+  GetSystemTimeAsFileTime(&now);
+  stamp->settled = IsSettled(stamp->rlzs_write_time, now) &&
+                   IsSettled(stamp->dcc_write_time, now);
+  return true;
+}
+
+// static
+bool PingParamsCache::Lookup(const wchar_t* sid,
+                             const AccessPoint* access_points, int count,
+                             const PingParamsStamp& stamp, CgiBuilder* cgi) {
+  if (!stamp.settled)
+    return false;
+
+  CacheData* cache = g_cache.Pointer();
+  base::AutoLock auto_lock(cache->lock);
+  HiveMap::const_iterator hive = cache->hives.find(GetHiveName(sid));
+  if (hive == cache->hives.end())
+    return false;
+
+  for (EntryList::const_iterator it = hive->second.begin();
+       it != hive->second.end(); ++it) {
+    if (Matches(*it, access_points, count, stamp)) {
+      cgi->Append(it->cgi);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// static
+void PingParamsCache::Store(const wchar_t* sid,
+                            const AccessPoint* access_points, int count,
+                            const PingParamsStamp& stamp,
+                            const std::string& cgi) {
+  if (!stamp.settled)
+    return;
+
+  Entry entry;
+  entry.points.assign(access_points, access_points + count);
+  entry.stamp = stamp;
+  entry.cgi = cgi;
+
+  CacheData* cache = g_cache.Pointer();
+  base::AutoLock auto_lock(cache->lock);
+  EntryList& entries = cache->hives[GetHiveName(sid)];
+
+  // Entries of the same list with an older stamp are dropped, and the most
+  // recent entries come first.
+  for (EntryList::iterator it = entries.begin(); it != entries.end(); ) {
+    if (it->points == entry.points)
+      it = entries.erase(it);
+    else
+      ++it;
+  }
+  entries.insert(entries.begin(), entry);
+  if (entries.size() > kMaxEntriesPerHive)
+    entries.resize(kMaxEntriesPerHive);
+}
+
+// static
+void PingParamsCache::InvalidateUser(const wchar_t* sid) {
+  std::wstring prefix(GetUserPrefix(sid));
+
+  CacheData* cache = g_cache.Pointer();
+  base::AutoLock auto_lock(cache->lock);
+  HiveMap::iterator it = cache->hives.lower_bound(prefix);
+  while (it != cache->hives.end() &&
+         it->first.compare(0, prefix.size(), prefix) == 0)
+    cache->hives.erase(it++);
+}
+
+// static
+void PingParamsCache::InvalidateMachine() {
+  // The DCC is part of the params of every hive.
+  CacheData* cache = g_cache.Pointer();
+  base::AutoLock auto_lock(cache->lock);
+  cache->hives.clear();
+}
+
+}  // namespace rlz_lib
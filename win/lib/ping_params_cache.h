@@ -0,0 +1,68 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// An in-process cache of the ping params built by GetPingParams().
+
+#ifndef RLZ_WIN_LIB_PING_PARAMS_CACHE_H_
+#define RLZ_WIN_LIB_PING_PARAMS_CACHE_H_
+
+#include <windows.h>
+#include <string>
+
+#include "rlz/win/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+class CgiBuilder;
+
+// The state the ping params are built from: the last write times of the RLZs
+// key and of the machine key holding the DCC. The registry updates them on
+// every change, including those made by other processes and older clients,
+// so they serve as version counters for the RLZs and the DCC.
+struct PingParamsStamp {
+  FILETIME rlzs_write_time;
+  FILETIME dcc_write_time;
+
+  // Whether neither key was written recently. Write times only change once
+  // per clock tick, so params built from recently written keys are not
+  // cached: a second write within the same tick would go unnoticed.
+  bool settled;
+};
+
+// Caches the params of the last few access point lists per user SID (NULL
+// or empty for HKCU) and per supplementary brand.
+class PingParamsCache {
+ public:
+  // How long a key must have gone unwritten for its params to be cached.
+  static const int kSettleTimeMs = 2000;
+
+  // Reads the stamp of the current state. The caller must hold the RLZ mutex
+  // and have read access to |user_key|.
+  static bool ReadStamp(HKEY user_key, PingParamsStamp* stamp);
+
+  // Appends the params cached for |access_points| (|count| entries) with
+  // |stamp| to |cgi|. Returns false if not cached.
+  static bool Lookup(const wchar_t* sid, const AccessPoint* access_points,
+                     int count, const PingParamsStamp& stamp,
+                     CgiBuilder* cgi);
+
+  // Caches |cgi|, built for |access_points| after reading |stamp|, if the
+  // stamp is settled.
+  static void Store(const wchar_t* sid, const AccessPoint* access_points,
+                    int count, const PingParamsStamp& stamp,
+                    const std::string& cgi);
+
+  // Called by writers in this process, so that the cached params do not
+  // outlive the state they were built from.
+  static void InvalidateUser(const wchar_t* sid);
+  static void InvalidateMachine();
+
+ private:
+  PingParamsCache() {}
+  ~PingParamsCache() {}
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_PING_PARAMS_CACHE_H_
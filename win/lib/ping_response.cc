@@ -0,0 +1,328 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// A single pass, allocation free parser for the financial ping responses.
+
+#include "rlz/win/lib/ping_response.h"
+
+#include <string.h>
+
+#include "base/basictypes.h"
+#include "rlz/win/lib/assert.h"
+#include "rlz/win/lib/crc32.h"
+#include "rlz/win/lib/lib_values.h"
+#include "rlz/win/lib/string_utils.h"
+#include "rlz/win/lib/trace.h"
+
+namespace {
+
+COMPILE_ASSERT(rlz_lib::LAST_EVENT <= 32, event_bits_do_not_fit_in_an_int);
+
+const char kChecksumPrefix[] = "crc32: ";
+
+bool IsWhitespace(char letter) {
+  return letter == ' ' || letter == '\t' || letter == '\n' ||
+         letter == '\v' || letter == '\f' || letter == '\r';
+}
+
+base::StringPiece TrimLeadingWhitespace(base::StringPiece text) {
+  size_t begin = 0;
+  while (begin < text.size() && IsWhitespace(text[begin]))
+    ++begin;
+  return text.substr(begin);
+}
+
+base::StringPiece TrimWhitespace(base::StringPiece text) {
+  text = TrimLeadingWhitespace(text);
+  size_t end = text.size();
+  while (end > 0 && IsWhitespace(text[end - 1]))
+    --end;
+  return text.substr(0, end);
+}
+
+// Returns the value up to the first space or line break.
+base::StringPiece GetFirstToken(base::StringPiece text) {
+  text = TrimLeadingWhitespace(text);
+  return text.substr(0, text.find_first_of("\r\n "));
+}
+
+// Returns the value of a "<name>: <value>" line if it starts with key.
+bool GetKeyValue(const base::StringPiece& line, const char* key,
+                 base::StringPiece* value) {
+  if (!line.starts_with(key))
+    return false;
+
+  size_t separator = line.find(':');
+  if (separator == base::StringPiece::npos ||
+      line.find(':', separator + 1) != base::StringPiece::npos)
+    return false;  // Not a valid key-value pair.
+
+  *value = TrimWhitespace(line.substr(separator + 1));
+  return true;
+}
+
+// Parses a comma separated list of <AccessPoint><Event> pairs.
+void ParseEvents(base::StringPiece events, int* event_bits) {
+  events = GetFirstToken(events);
+
+  size_t begin = 0;
+  while (begin <= events.size()) {
+    size_t end = events.find(rlz_lib::kEventsCgiSeparator, begin);
+    if (end == base::StringPiece::npos)
+      end = events.size();
+
+    base::StringPiece event_string = events.substr(begin, end - begin);
+    begin = end + 1;
+
+    rlz_lib::AccessPoint point;
+    rlz_lib::Event event;
+    if (event_string.size() != 3 ||  // 3 = 2(AP) + 1(E)
+        !rlz_lib::GetAccessPointFromName(event_string.substr(0, 2), &point) ||
+        point == rlz_lib::NO_ACCESS_POINT ||
+        !rlz_lib::GetEventFromName(event_string.substr(2), &event) ||
+        event == rlz_lib::INVALID_EVENT)
+      continue;
+
+    event_bits[point] |= 1 << event;
+  }
+}
+
+// Parses a positive decimal number of seconds. Returns false if the value
+// has other characters, or does not fit in an int.
+bool ParseSeconds(base::StringPiece value, int* seconds) {
+  value = GetFirstToken(value);
+  if (value.empty())
+    return false;
+
+  int number = 0;
+  for (size_t i = 0; i < value.size(); ++i) {
+    if (value[i] < '0' || value[i] > '9')
+      return false;
+    int digit = value[i] - '0';
+    if (number > (kint32max - digit) / 10)
+      return false;
+    number = number * 10 + digit;
+  }
+
+  if (number <= 0)
+    return false;
+
+  *seconds = number;
+  return true;
+}
+
+void ParseLine(const base::StringPiece& line,
+               rlz_lib::ParsedPingResponse* parsed) {
+  const size_t rlz_variable_length = strlen(rlz_lib::kRlzCgiVariable);
+  const size_t events_variable_length = strlen(rlz_lib::kEventsCgiVariable);
+  const size_t stateful_events_variable_length =
+      strlen(rlz_lib::kStatefulEventsCgiVariable);
+
+  base::StringPiece value;
+  if (line.starts_with(rlz_lib::kRlzCgiVariable)) {  // An RLZ.
+    size_t separator = line.find(": ");
+    if (separator == base::StringPiece::npos)
+      return;  // Not a valid key-value pair.
+
+    rlz_lib::AccessPoint point;
+    if (!rlz_lib::GetAccessPointFromName(
+            line.substr(rlz_variable_length, separator - rlz_variable_length),
+            &point) ||
+        point == rlz_lib::NO_ACCESS_POINT)
+      return;  // Not a valid access point.
+
+    value = GetFirstToken(line.substr(separator + 2));
+    if (value.size() > rlz_lib::kMaxRlzLength)
+      return;  // Too long.
+
+    parsed->has_rlz[point] = true;
+    parsed->rlzs[point] = value;
+  } else if (line.starts_with(rlz_lib::kEventsCgiVariable) &&
+             line.substr(events_variable_length).starts_with(": ")) {
+    ParseEvents(line.substr(events_variable_length + 2), parsed->events);
+  } else if (line.starts_with(rlz_lib::kStatefulEventsCgiVariable) &&
+             line.substr(stateful_events_variable_length).starts_with(": ")) {
+    ParseEvents(line.substr(stateful_events_variable_length + 2),
+                parsed->stateful_events);
+  } else if (GetKeyValue(line, rlz_lib::kDccCgiVariable, &value)) {
+    // Only the first DCC confirmation counts.
+    if (!parsed->has_dcc) {
+      parsed->has_dcc = true;
+      parsed->dcc = value;
+    }
+  } else if (GetKeyValue(line, rlz_lib::kSetDccResponseVariable, &value)) {
+    if (!parsed->has_set_dcc && value.size() <= rlz_lib::kMaxDccLength) {
+      parsed->has_set_dcc = true;
+      parsed->set_dcc = value;
+    }
+  } else if (GetKeyValue(line, rlz_lib::kPingIntervalResponseVariable,
+                         &value)) {
+    int seconds = 0;
+    if (!parsed->has_ping_interval && ParseSeconds(value, &seconds)) {
+      parsed->has_ping_interval = true;
+      parsed->ping_interval = seconds;
+    }
+  }
+}
+
+void ResetRecords(rlz_lib::ParsedPingResponse* parsed) {
+  for (int i = 0; i < rlz_lib::LAST_ACCESS_POINT; ++i) {
+    parsed->has_rlz[i] = false;
+    parsed->rlzs[i].clear();
+    parsed->events[i] = 0;
+    parsed->stateful_events[i] = 0;
+  }
+  parsed->has_dcc = false;
+  parsed->dcc.clear();
+  parsed->has_set_dcc = false;
+  parsed->set_dcc.clear();
+  parsed->has_ping_interval = false;
+  parsed->ping_interval = 0;
+}
+
+// Same as HexStringToInteger() on the trimmed value.
+int GetChecksumValue(base::StringPiece value) {
+  value = TrimWhitespace(value);
+  if (value.starts_with("0x") || value.starts_with("0X"))
+    value.remove_prefix(2);
+
+  unsigned int number = 0;
+  int digit = 0;
+  for (size_t i = 0; i < value.size(); ++i) {
+    if (!rlz_lib::GetHexValue(value[i], &digit))
+      break;
+    number = (number << 4) | digit;
+  }
+
+  return static_cast<int>(number);
+}
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+bool ParsePingResponseText(const char* response, ParsedPingResponse* parsed) {
+  ScopedTraceSpan span("ParsePingResponseText");
+  if (!parsed) {
+    ASSERT_STRING("ParsePingResponseText: parsed is NULL");
+    return false;
+  }
+
+  PingResponseParser parser(response, parsed);
+  if (!response || !response[0])
+    return false;
+
+  return parser.Feed(strlen(response)) && parser.Finish();
+}
+
+PingResponseParser::PingResponseParser(const char* response,
+                                       ParsedPingResponse* parsed)
+    : response_(response),
+      parsed_(parsed),
+      length_(0),
+      ended_(false),
+      too_long_(false),
+      line_begin_(0),
+      first_line_end_(0),
+      found_checksum_(false),
+      is_ascii_(true),
+      crc_(0) {
+  parsed_->checksum_index = -1;
+  ResetRecords(parsed_);
+}
+
+bool PingResponseParser::Feed(size_t length) {
+  if (too_long_)
+    return false;
+
+  if (ended_ || length <= length_)
+    return true;
+
+  // Only the text up to a NULL character counts, as for a C string.
+  const void* end = memchr(response_ + length_, 0, length - length_);
+  if (end) {
+    length = static_cast<const char*>(end) - response_;
+    ended_ = true;
+  }
+  length_ = length;
+
+  if (length_ > kMaxPingResponseLength) {
+    ASSERT_STRING("PingResponseParser: response is too long to parse.");
+    too_long_ = true;
+    return false;
+  }
+
+  // The lines after the checksum line are not covered by the checksum.
+  while (!found_checksum_) {
+    const void* line_end = memchr(response_ + line_begin_, '\n',
+                                  length_ - line_begin_);
+    if (!line_end)
+      break;
+
+    size_t line_length =
+        static_cast<const char*>(line_end) - (response_ + line_begin_);
+    base::StringPiece line(response_ + line_begin_, line_length);
+    if (line_begin_ == 0) {
+      first_line_end_ = line_length;
+    } else if (line.starts_with(kChecksumPrefix)) {
+      found_checksum_ = true;
+      break;
+    }
+
+    ParseLine(line, parsed_);
+
+    // Calculate checksum of message preceeding checksum line.
+    // (+ 1 to include the \n)
+    if (is_ascii_ &&
+        !UpdateCrc32(line.data(), static_cast<int>(line_length + 1), &crc_))
+      is_ascii_ = false;
+
+    line_begin_ += line_length + 1;
+  }
+
+  return true;
+}
+
+bool PingResponseParser::Finish() {
+  if (too_long_ || !length_)
+    return false;
+
+  base::StringPiece checksum_line;
+  if (!found_checksum_) {
+    // The last line has no \n, and may be the checksum line.
+    base::StringPiece line(response_ + line_begin_, length_ - line_begin_);
+    if (line_begin_ == 0)
+      first_line_end_ = length_;
+
+    if (line_begin_ > 0 && line.starts_with(kChecksumPrefix))
+      found_checksum_ = true;
+    else
+      ParseLine(line, parsed_);
+  }
+
+  size_t checksum_index = 0;
+  if (found_checksum_) {
+    checksum_index = line_begin_ - 1;
+    checksum_line = base::StringPiece(response_ + line_begin_,
+                                      length_ - line_begin_);
+    checksum_line = checksum_line.substr(0, checksum_line.find('\n'));
+    if (!is_ascii_)
+      return false;
+  } else {
+    // Failing that, an empty response is just a checksum line.
+    base::StringPiece first_line(response_, first_line_end_);
+    if (!first_line.starts_with(kChecksumPrefix))
+      return false;
+
+    ResetRecords(parsed_);
+    checksum_line = first_line;
+    crc_ = 0;
+  }
+
+  parsed_->checksum_index = static_cast<int>(checksum_index);
+  checksum_line.remove_prefix(strlen(kChecksumPrefix));
+  return crc_ == GetChecksumValue(checksum_line);
+}
+
+}  // namespace rlz_lib
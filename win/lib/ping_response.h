@@ -0,0 +1,106 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// A single pass, allocation free parser for the financial ping responses,
+// which can also be fed the response as it is read.
+
+#ifndef RLZ_WIN_LIB_PING_RESPONSE_H_
+#define RLZ_WIN_LIB_PING_RESPONSE_H_
+
+#include "base/string_piece.h"
+#include "rlz/win/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+// The records of a financial ping response. Expected response format is
+// lines of the form:
+//   rlzW1: 1R1_____en__252
+//   events: W1I,I7S
+//   stateful-events: W1I
+//   dcc: <current DCC>
+//   set_dcc: <new DCC>
+//   ping-interval: <seconds until the next ping>
+//   crc32: <CRC32 of all the text above this line>
+//
+// Only the lines covered by the checksum are parsed. The values point into
+// the response text, which must outlive the parsed response.
+struct ParsedPingResponse {
+  // The index of the checksum line, which is also the length of the message
+  // it covers (without the \n). 0 for an empty response, -1 if unknown.
+  int checksum_index;
+
+  // The new RLZ of each access point. An empty value clears the RLZ. Values
+  // longer than kMaxRlzLength are dropped.
+  bool has_rlz[LAST_ACCESS_POINT];
+  base::StringPiece rlzs[LAST_ACCESS_POINT];
+
+  // The events to clear and the stateful events to record, as bitmasks of
+  // (1 << event) for each access point.
+  int events[LAST_ACCESS_POINT];
+  int stateful_events[LAST_ACCESS_POINT];
+
+  // The first DCC confirmation, and the first new DCC no longer than
+  // kMaxDccLength.
+  bool has_dcc;
+  base::StringPiece dcc;
+  bool has_set_dcc;
+  base::StringPiece set_dcc;
+
+  // The first interval until the next ping, in seconds, as a positive
+  // decimal number. Not checked against the allowed bounds.
+  bool has_ping_interval;
+  int ping_interval;
+};
+
+// Checks the length, the characters and the checksum of response, and fills
+// parsed in the same pass. Returns false if the response is not valid, in
+// which case only parsed->checksum_index may be used.
+bool ParsePingResponseText(const char* response, ParsedPingResponse* parsed);
+
+// Parses a response while it is being read into a buffer: the lines are
+// parsed, and the checksum calculated, as they are completed. Sample usage:
+//   PingResponseParser parser(buffer, &parsed);
+//   while (<more data appended to buffer, for a total of length>)
+//     if (!parser.Feed(length))
+//       <stop reading>
+//   bool valid = parser.Finish();
+// The buffer must not change once fed, and must outlive parsed.
+class PingResponseParser {
+ public:
+  PingResponseParser(const char* response, ParsedPingResponse* parsed);
+
+  // Parses the lines completed by the first length characters of the
+  // response. A NULL character ends the response. Returns false, after which
+  // the response can be dropped, if it is longer than kMaxPingResponseLength.
+  bool Feed(size_t length);
+
+  // Parses the last line and checks the checksum. Returns the same as
+  // ParsePingResponseText() on the response fed so far.
+  bool Finish();
+
+ private:
+  const char* response_;
+  ParsedPingResponse* parsed_;
+
+  // The length fed so far, up to the first NULL character if any.
+  size_t length_;
+  bool ended_;
+  bool too_long_;
+
+  // The beginning of the line not yet completed, and the end of the first
+  // line once it is completed.
+  size_t line_begin_;
+  size_t first_line_end_;
+
+  // The checksum of the completed lines, while looking for the checksum line.
+  bool found_checksum_;
+  bool is_ascii_;
+  int crc_;
+
+  DISALLOW_COPY_AND_ASSIGN(PingResponseParser);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_PING_RESPONSE_H_
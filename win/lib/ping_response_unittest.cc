@@ -0,0 +1,166 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit tests for the financial ping response parser.
+
+#include "base/logging.h"
+#include "testing/gmock/include/gmock/gmock.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+#include "rlz/win/lib/ping_response.h"
+
+TEST(PingResponseUnittest, ParseRecords) {
+  const char kResponse[] =
+      "rlzW1: 1R1_____en__252\r\n"
+      "events: W1I,I7S\r\n"
+      "stateful-events: W1I\r\n"
+      "dcc: dcc_value\r\n"
+      "set_dcc: new_dcc\r\n"
+      "crc32: E700E5BE\r\n"
+      "rlzI7: not_checksummed\r\n";
+
+  rlz_lib::ParsedPingResponse parsed;
+  EXPECT_TRUE(rlz_lib::ParsePingResponseText(kResponse, &parsed));
+  EXPECT_EQ(strstr(kResponse, "\ncrc32") - kResponse, parsed.checksum_index);
+
+  EXPECT_TRUE(parsed.has_rlz[rlz_lib::IE_HOME_PAGE]);
+  EXPECT_EQ("1R1_____en__252",
+            parsed.rlzs[rlz_lib::IE_HOME_PAGE].as_string());
+  EXPECT_FALSE(parsed.has_rlz[rlz_lib::IE_DEFAULT_SEARCH]);
+
+  EXPECT_EQ(1 << rlz_lib::INSTALL, parsed.events[rlz_lib::IE_HOME_PAGE]);
+  EXPECT_EQ(1 << rlz_lib::SET_TO_GOOGLE,
+            parsed.events[rlz_lib::IE_DEFAULT_SEARCH]);
+  EXPECT_EQ(1 << rlz_lib::INSTALL,
+            parsed.stateful_events[rlz_lib::IE_HOME_PAGE]);
+  EXPECT_EQ(0, parsed.stateful_events[rlz_lib::IE_DEFAULT_SEARCH]);
+
+  EXPECT_TRUE(parsed.has_dcc);
+  EXPECT_EQ("dcc_value", parsed.dcc.as_string());
+  EXPECT_TRUE(parsed.has_set_dcc);
+  EXPECT_EQ("new_dcc", parsed.set_dcc.as_string());
+
+  EXPECT_FALSE(parsed.has_ping_interval);
+}
+
+TEST(PingResponseUnittest, ParsePingInterval) {
+  const char kResponse[] =
+      "rlzW1: 1R1\r\n"
+      "ping-interval: 172800\r\n"
+      "crc32: 84B05079";
+
+  rlz_lib::ParsedPingResponse parsed;
+  EXPECT_TRUE(rlz_lib::ParsePingResponseText(kResponse, &parsed));
+  EXPECT_TRUE(parsed.has_ping_interval);
+  EXPECT_EQ(172800, parsed.ping_interval);
+
+  // Only positive decimal numbers are kept.
+  const char kInvalidResponse[] =
+      "ping-interval: 12x\r\n"
+      "crc32: 2C8A44B0";
+  EXPECT_TRUE(rlz_lib::ParsePingResponseText(kInvalidResponse, &parsed));
+  EXPECT_FALSE(parsed.has_ping_interval);
+}
+
+TEST(PingResponseUnittest, ParseInvalidRecords) {
+  const char kResponse[] =
+      "rlzW1: 1R1\r\n"
+      "rlzI7: \r\n"
+      "rlzQ1: "
+      "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n"
+      "events: W1I,ZZI,W1\r\n"
+      "crc32: 0EF81D3D";
+
+  rlz_lib::ParsedPingResponse parsed;
+  EXPECT_TRUE(rlz_lib::ParsePingResponseText(kResponse, &parsed));
+
+  // An empty RLZ clears it, and a too long one is dropped.
+  EXPECT_EQ("1R1", parsed.rlzs[rlz_lib::IE_HOME_PAGE].as_string());
+  EXPECT_TRUE(parsed.has_rlz[rlz_lib::IE_DEFAULT_SEARCH]);
+  EXPECT_TRUE(parsed.rlzs[rlz_lib::IE_DEFAULT_SEARCH].empty());
+  EXPECT_FALSE(parsed.has_rlz[rlz_lib::QUICK_SEARCH_BOX]);
+
+  // Only the well formed event is kept.
+  for (int i = 0; i < rlz_lib::LAST_ACCESS_POINT; ++i) {
+    EXPECT_EQ(i == rlz_lib::IE_HOME_PAGE ? 1 << rlz_lib::INSTALL : 0,
+              parsed.events[i]);
+  }
+
+  EXPECT_FALSE(parsed.has_dcc);
+  EXPECT_FALSE(parsed.has_set_dcc);
+}
+
+TEST(PingResponseUnittest, Validation) {
+  rlz_lib::ParsedPingResponse parsed;
+
+  // Empty response.
+  EXPECT_TRUE(rlz_lib::ParsePingResponseText("crc32: 0", &parsed));
+  EXPECT_EQ(0, parsed.checksum_index);
+
+  // Bad checksum, still reporting where the checksum is.
+  EXPECT_FALSE(rlz_lib::ParsePingResponseText("rlzW1: 1R1\ncrc32: 1234",
+                                              &parsed));
+  EXPECT_EQ(10, parsed.checksum_index);
+
+  // No checksum at all.
+  EXPECT_FALSE(rlz_lib::ParsePingResponseText("rlzW1: 1R1\n", &parsed));
+  EXPECT_EQ(-1, parsed.checksum_index);
+
+  EXPECT_FALSE(rlz_lib::ParsePingResponseText("", &parsed));
+  EXPECT_FALSE(rlz_lib::ParsePingResponseText(NULL, &parsed));
+
+  // Too long.
+  std::string response(rlz_lib::kMaxPingResponseLength, 'x');
+  response.append("\ncrc32: 0");
+  EXPECT_FALSE(rlz_lib::ParsePingResponseText(response.c_str(), &parsed));
+}
+
+TEST(PingResponseUnittest, ParseInChunks) {
+  const char kResponse[] =
+      "rlzW1: 1R1_____en__252\r\n"
+      "events: W1I,I7S\r\n"
+      "stateful-events: W1I\r\n"
+      "dcc: dcc_value\r\n"
+      "set_dcc: new_dcc\r\n"
+      "crc32: E700E5BE\r\n"
+      "rlzI7: not_checksummed\r\n";
+  const size_t kLength = arraysize(kResponse) - 1;
+
+  // Whatever the chunks, the result is the same as in a single pass.
+  for (size_t chunk = 1; chunk <= kLength; ++chunk) {
+    rlz_lib::ParsedPingResponse parsed;
+    rlz_lib::PingResponseParser parser(kResponse, &parsed);
+    for (size_t length = chunk; length < kLength; length += chunk)
+      EXPECT_TRUE(parser.Feed(length));
+    EXPECT_TRUE(parser.Feed(kLength));
+    EXPECT_TRUE(parser.Finish());
+
+    EXPECT_EQ(strstr(kResponse, "\ncrc32") - kResponse, parsed.checksum_index);
+    EXPECT_EQ("1R1_____en__252",
+              parsed.rlzs[rlz_lib::IE_HOME_PAGE].as_string());
+    EXPECT_FALSE(parsed.has_rlz[rlz_lib::IE_DEFAULT_SEARCH]);
+    EXPECT_EQ(1 << rlz_lib::SET_TO_GOOGLE,
+              parsed.events[rlz_lib::IE_DEFAULT_SEARCH]);
+    EXPECT_EQ("new_dcc", parsed.set_dcc.as_string());
+  }
+
+  // A response is invalid until its checksum line is read.
+  rlz_lib::ParsedPingResponse parsed;
+  rlz_lib::PingResponseParser partial_parser(kResponse, &parsed);
+  EXPECT_TRUE(partial_parser.Feed(strstr(kResponse, "\ncrc32") - kResponse));
+  EXPECT_FALSE(partial_parser.Finish());
+}
+
+TEST(PingResponseUnittest, ParseTooLongInChunks) {
+  std::string response(rlz_lib::kMaxPingResponseLength + 100, 'x');
+  response[0] = '\n';
+
+  // Reading stops as soon as the response is too long.
+  rlz_lib::ParsedPingResponse parsed;
+  rlz_lib::PingResponseParser parser(response.c_str(), &parsed);
+  EXPECT_TRUE(parser.Feed(rlz_lib::kMaxPingResponseLength));
+  EXPECT_FALSE(parser.Feed(rlz_lib::kMaxPingResponseLength + 1));
+  EXPECT_FALSE(parser.Feed(response.size()));
+  EXPECT_FALSE(parser.Finish());
+}
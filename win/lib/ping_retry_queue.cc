@@ -0,0 +1,199 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The persisted requests of the financial pings which did not reach the
+// server.
+
+#include "rlz/win/lib/ping_retry_queue.h"
+
+#include <windows.h>
+#include <string.h>
+
+#include "base/rand_util.h"
+#include "base/win/registry.h"
+#include "rlz/win/lib/assert.h"
+#include "rlz/win/lib/lib_mutex.h"
+#include "rlz/win/lib/lib_values.h"
+#include "rlz/win/lib/user_key.h"
+
+namespace {
+
+// The REG_BINARY value of a queued retry: this header followed by the
+// request, without a NULL terminator. The header has no padding, so that the
+// bytes written are all set.
+struct RetryHeader {
+  int64 first_failure_time;
+  int64 next_retry_time;
+  DWORD failures;
+  DWORD reserved;  // 0.
+};
+
+COMPILE_ASSERT(sizeof(RetryHeader) == 24, retry_header_has_no_padding);
+
+// Requests are a few hundred bytes; anything much larger is not queued.
+const size_t kMaxRequestSize = 4 * rlz_lib::kMaxCgiLength;
+
+int64 GetSystemTimeAsInt64() {
+  FILETIME now_as_file_time;
+  GetSystemTimeAsFileTime(&now_as_file_time);
+  LARGE_INTEGER integer;
+  integer.HighPart = now_as_file_time.dwHighDateTime;
+  integer.LowPart = now_as_file_time.dwLowDateTime;
+  return integer.QuadPart;
+}
+
+// Reads the retry of |product_name|. Returns false if there is none, or if
+// it is not readable.
+bool ReadRetry(HKEY user_key, const wchar_t* product_name,
+               RetryHeader* header, std::string* request) {
+  base::win::RegKey key;
+  if (!rlz_lib::GetPingRetriesRegKey(user_key, KEY_READ, &key))
+    return false;
+
+  char buffer[sizeof(RetryHeader) + kMaxRequestSize];
+  DWORD type = REG_NONE;
+  DWORD size = sizeof(buffer);
+  if (RegQueryValueExW(key.Handle(), product_name, NULL, &type,
+                       reinterpret_cast<BYTE*>(buffer), &size) !=
+      ERROR_SUCCESS || type != REG_BINARY || size < sizeof(RetryHeader))
+    return false;
+
+  memcpy(header, buffer, sizeof(*header));
+  request->assign(buffer + sizeof(RetryHeader), size - sizeof(RetryHeader));
+  return true;
+}
+
+bool WriteRetry(HKEY user_key, const wchar_t* product_name,
+                const RetryHeader& header, const std::string& request) {
+  std::string value(reinterpret_cast<const char*>(&header), sizeof(header));
+  value += request;
+
+  base::win::RegKey key;
+  return rlz_lib::GetPingRetriesRegKey(user_key, KEY_WRITE, &key) &&
+      key.WriteValue(product_name, value.data(),
+                     static_cast<DWORD>(value.size()), REG_BINARY) ==
+      ERROR_SUCCESS;
+}
+
+bool DeleteRetry(HKEY user_key, const wchar_t* product_name) {
+  base::win::RegKey key;
+  if (!rlz_lib::GetPingRetriesRegKey(user_key, KEY_READ | KEY_WRITE, &key))
+    return true;  // The subkey is only created with a retry.
+
+  LONG result = key.DeleteValue(product_name);
+  return result == ERROR_SUCCESS || result == ERROR_FILE_NOT_FOUND;
+}
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+// static
+bool PingRetryQueue::Get(Product product, const wchar_t* sid,
+                         std::string* request, bool* due) {
+  request->clear();
+  *due = false;
+
+  const wchar_t* product_name = GetProductName(product);
+  if (!product_name)
+    return false;
+
+  LibMutex lock;
+  if (lock.failed())
+    return false;
+
+  UserKey user_key(sid);
+  if (!user_key.HasAccess(false))
+    return false;
+
+  RetryHeader header;
+  if (!ReadRetry(user_key.Get(), product_name, &header, request))
+    return false;
+
+  int64 now = GetSystemTimeAsInt64();
+  if (now - header.first_failure_time >= kEventsPingInterval ||
+      now < header.first_failure_time) {
+    // Too old, or the clock was reset: ping with a new request.
+    request->clear();
+    if (user_key.HasAccess(true))
+      DeleteRetry(user_key.Get(), product_name);
+    return false;
+  }
+
+  *due = now >= header.next_retry_time ||
+      header.next_retry_time - now > kMaxPingRetryDelay;
+  return true;
+}
+
+// static
+bool PingRetryQueue::RecordResult(Product product, const wchar_t* sid,
+                                  const std::string& request,
+                                  bool reached_server) {
+  const wchar_t* product_name = GetProductName(product);
+  if (!product_name)
+    return false;
+
+  LibMutex lock;
+  if (lock.failed())
+    return false;
+
+  UserKey user_key(sid);
+  if (!user_key.HasAccess(true))
+    return false;
+
+  if (reached_server)
+    return DeleteRetry(user_key.Get(), product_name);
+
+  if (request.size() > kMaxRequestSize)
+    return false;
+
+  int64 now = GetSystemTimeAsInt64();
+  RetryHeader header;
+  std::string queued_request;
+  if (!ReadRetry(user_key.Get(), product_name, &header, &queued_request) ||
+      queued_request != request) {
+    memset(&header, 0, sizeof(header));
+    header.first_failure_time = now;
+  }
+  header.reserved = 0;
+
+  ++header.failures;
+  int64 backoff = GetBackoff(header.failures);
+  header.next_retry_time = now + backoff / 2 +
+      static_cast<int64>(base::RandDouble() * (backoff / 2));
+
+  if (!WriteRetry(user_key.Get(), product_name, header, request)) {
+    ASSERT_STRING("PingRetryQueue::RecordResult: Could not queue the retry");
+    return false;
+  }
+
+  return true;
+}
+
+// static
+bool PingRetryQueue::Clear(Product product, const wchar_t* sid) {
+  const wchar_t* product_name = GetProductName(product);
+  if (!product_name)
+    return false;
+
+  LibMutex lock;
+  if (lock.failed())
+    return false;
+
+  UserKey user_key(sid);
+  if (!user_key.HasAccess(true))
+    return false;
+
+  return DeleteRetry(user_key.Get(), product_name);
+}
+
+// static
+int64 PingRetryQueue::GetBackoff(int failures) {
+  int64 backoff = kPingRetryDelay;
+  for (int i = 1; i < failures && backoff < kMaxPingRetryDelay; ++i)
+    backoff *= 2;
+  return backoff < kMaxPingRetryDelay ? backoff : kMaxPingRetryDelay;
+}
+
+}  // namespace rlz_lib
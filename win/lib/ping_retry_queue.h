@@ -0,0 +1,54 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The persisted requests of the financial pings which did not reach the
+// server, retried with an exponential backoff.
+
+#ifndef RLZ_WIN_LIB_PING_RETRY_QUEUE_H_
+#define RLZ_WIN_LIB_PING_RETRY_QUEUE_H_
+
+#include <string>
+
+#include "base/basictypes.h"
+#include "rlz/win/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+// One retry is kept per product, in the user hive. The n-th consecutive
+// failure of the same request delays its retry by kPingRetryDelay * 2^(n-1),
+// up to kMaxPingRetryDelay, scaled by a random factor in [0.5, 1) so that
+// clients which lost connectivity together do not retry together. A retry
+// which has not gone through within kEventsPingInterval of the first failure
+// is dropped, and the next ping forms a new request.
+//
+// Only pings which did not get a response are queued. A ping the server
+// answered is never retried, whether or not its response was valid.
+class PingRetryQueue {
+ public:
+  // Gets the queued request of |product|, and whether its retry is due.
+  // Returns false if no retry is queued.
+  static bool Get(Product product, const wchar_t* sid, std::string* request,
+                  bool* due);
+
+  // Records the outcome of a ping of |request|. A ping which got an HTTP
+  // response, whatever its status, drops the queued retry; a failed one
+  // queues, or delays, a retry.
+  static bool RecordResult(Product product, const wchar_t* sid,
+                           const std::string& request, bool reached_server);
+
+  // Drops the queued retry of |product|.
+  static bool Clear(Product product, const wchar_t* sid);
+
+  // The delay before the retry which follows |failures| consecutive
+  // failures, in 100-nanosecond intervals and without the random factor.
+  static int64 GetBackoff(int failures);
+
+ private:
+  PingRetryQueue() {}
+  ~PingRetryQueue() {}
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_PING_RETRY_QUEUE_H_
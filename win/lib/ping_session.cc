@@ -0,0 +1,78 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// A process-wide WinInet session to the financial server.
+
+#include "rlz/win/lib/ping_session.h"
+
+#include "base/lazy_instance.h"
+#include "base/synchronization/lock.h"
+#include "rlz/win/lib/lib_values.h"
+#include "rlz/win/lib/rlz_lib.h"
+#include "rlz/win/lib/trace.h"
+
+namespace {
+
+struct SharedSession {
+  base::Lock lock;
+  scoped_refptr<rlz_lib::PingSession> session;
+};
+
+// Leaky, so that it can also be used from a DLL without an AtExitManager.
+base::LazyInstance<SharedSession, base::LeakyLazyInstanceTraits<SharedSession> >
+    g_shared_session(base::LINKER_INITIALIZED);
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+PingSession::PingSession(HINTERNET internet, HINTERNET connection)
+    : internet_(internet), connection_(connection) {
+}
+
+PingSession::~PingSession() {
+  InternetCloseHandle(connection_);
+  InternetCloseHandle(internet_);
+}
+
+// static
+scoped_refptr<PingSession> PingSession::Get() {
+  SharedSession& shared = g_shared_session.Get();
+  base::AutoLock auto_lock(shared.lock);
+  if (shared.session)
+    return shared.session;
+
+  // Initialize WinInet.
+  ScopedTraceSpan open_span("InternetOpen");
+  HINTERNET internet = InternetOpenA(kFinancialPingUserAgent,
+                                     INTERNET_OPEN_TYPE_PRECONFIG,
+                                     NULL, NULL, 0);
+  open_span.End();
+  if (!internet)
+    return NULL;
+
+  // Open network connection.
+  ScopedTraceSpan connect_span("InternetConnect");
+  HINTERNET connection = InternetConnectA(internet,
+      kFinancialServer, kFinancialPort, "", "", INTERNET_SERVICE_HTTP,
+      INTERNET_FLAG_NO_CACHE_WRITE, 0);
+  connect_span.End();
+  if (!connection) {
+    InternetCloseHandle(internet);
+    return NULL;
+  }
+
+  shared.session = new PingSession(internet, connection);
+  return shared.session;
+}
+
+// static
+void PingSession::Reset(PingSession* session) {
+  SharedSession& shared = g_shared_session.Get();
+  base::AutoLock auto_lock(shared.lock);
+  if (shared.session.get() == session)
+    shared.session = NULL;
+}
+
+}  // namespace rlz_lib
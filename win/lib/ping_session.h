@@ -0,0 +1,48 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// A process-wide WinInet session to the financial server, shared by all the
+// pings so that they can reuse the proxy settings, DNS lookup and keep-alive
+// connection of the previous ones.
+
+#ifndef RLZ_WIN_LIB_PING_SESSION_H_
+#define RLZ_WIN_LIB_PING_SESSION_H_
+
+#include <windows.h>
+#include <wininet.h>
+
+#include "base/basictypes.h"
+#include "base/memory/ref_counted.h"
+
+namespace rlz_lib {
+
+class PingSession : public base::RefCountedThreadSafe<PingSession> {
+ public:
+  // Returns the shared session, opening it if needed, or NULL if WinInet
+  // could not be initialized. Requests opened on the connection must hold
+  // the reference until they are closed.
+  static scoped_refptr<PingSession> Get();
+
+  // Called after a network error on a request made with |session|: drops the
+  // shared session if it is still |session|, so that the next ping starts
+  // from scratch. Requests in flight keep their own reference.
+  static void Reset(PingSession* session);
+
+  HINTERNET connection() const { return connection_; }
+
+ private:
+  friend class base::RefCountedThreadSafe<PingSession>;
+
+  PingSession(HINTERNET internet, HINTERNET connection);
+  ~PingSession();
+
+  HINTERNET internet_;
+  HINTERNET connection_;
+
+  DISALLOW_COPY_AND_ASSIGN(PingSession);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_PING_SESSION_H_
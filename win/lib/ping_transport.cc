@@ -0,0 +1,412 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The HTTP transports the financial pings are sent with.
+
+#include "rlz/win/lib/ping_transport.h"
+
+#include <string.h>
+
+#include "base/atomicops.h"
+#include "base/lazy_instance.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/stringprintf.h"
+#include "rlz/win/lib/assert.h"
+#include "rlz/win/lib/lib_values.h"
+#include "rlz/win/lib/winhttp_transport.h"
+#include "rlz/win/lib/wininet_transport.h"
+
+namespace {
+
+// Compressed pings are opt-in. The server is known to support compression
+// once it has sent a compressed response.
+base::subtle::Atomic32 g_compression_enabled = 0;
+base::subtle::Atomic32 g_server_accepts_gzip = 0;
+
+struct SharedTransport {
+  base::Lock lock;
+  scoped_refptr<rlz_lib::PingTransport> transport;
+
+  // The response buffer of the previous ping, if no ping holds it.
+  scoped_array<char> free_buffer;
+};
+
+// Leaky, so that it can also be used from a DLL without an AtExitManager.
+base::LazyInstance<SharedTransport,
+                   base::LeakyLazyInstanceTraits<SharedTransport> >
+    g_shared_transport(base::LINKER_INITIALIZED);
+
+char* AcquireResponseBuffer() {
+  {
+    SharedTransport& shared = g_shared_transport.Get();
+    base::AutoLock auto_lock(shared.lock);
+    if (shared.free_buffer.get())
+      return shared.free_buffer.release();
+  }
+
+  return new char[rlz_lib::kMaxPingResponseLength + 1];
+}
+
+void ReleaseResponseBuffer(char* buffer) {
+  {
+    SharedTransport& shared = g_shared_transport.Get();
+    base::AutoLock auto_lock(shared.lock);
+    if (!shared.free_buffer.get()) {
+      shared.free_buffer.reset(buffer);
+      return;
+    }
+  }
+
+  delete[] buffer;
+}
+
+// Statuses of a server, or of a proxy, which does not take a compressed
+// POST body.
+bool IsRejectedBodyStatus(DWORD status) {
+  return status == 400 ||  // Bad request.
+         status == 405 ||  // Method not allowed.
+         status == 411 ||  // Length required.
+         status == 415;    // Unsupported media type.
+}
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+PingCanceller::PingCanceller()
+    : request_(NULL), close_(NULL), cancelled_(false), closed_(false) {
+}
+
+PingCanceller::~PingCanceller() {
+}
+
+void PingCanceller::Cancel() {
+  base::AutoLock auto_lock(lock_);
+  cancelled_ = true;
+  if (request_ && !closed_) {
+    // Closing the handle makes the blocking calls on it return.
+    close_(request_);
+    closed_ = true;
+  }
+}
+
+bool PingCanceller::cancelled() {
+  base::AutoLock auto_lock(lock_);
+  return cancelled_;
+}
+
+bool PingCanceller::Attach(void* request, CloseFunction close) {
+  base::AutoLock auto_lock(lock_);
+  if (cancelled_)
+    return false;
+
+  request_ = request;
+  close_ = close;
+  closed_ = false;
+  return true;
+}
+
+bool PingCanceller::Detach() {
+  base::AutoLock auto_lock(lock_);
+  bool closed = closed_;
+  request_ = NULL;
+  close_ = NULL;
+  closed_ = false;
+  return closed;
+}
+
+PingPhaseTimer::PingPhaseTimer() {
+}
+
+void PingPhaseTimer::Start() {
+  start_ = base::TimeTicks::Now();
+  for (int i = 0; i < LAST_PING_PHASE; ++i)
+    ends_[i] = base::TimeTicks();
+}
+
+void PingPhaseTimer::MarkEnd(PingPhase phase) {
+  if (phase >= 0 && phase < LAST_PING_PHASE)
+    ends_[phase] = base::TimeTicks::Now();
+}
+
+void PingPhaseTimer::Finish() {
+  MarkEnd(PING_PHASE_READ);
+}
+
+bool PingPhaseTimer::GetDuration(PingPhase phase, int64* duration_ms) const {
+  if (phase < 0 || phase >= LAST_PING_PHASE || ends_[phase].is_null() ||
+      start_.is_null())
+    return false;
+
+  base::TimeTicks begin = start_;
+  for (int i = phase - 1; i >= 0; --i) {
+    if (!ends_[i].is_null()) {
+      begin = ends_[i];
+      break;
+    }
+  }
+  *duration_ms = (ends_[phase] - begin).InMilliseconds();
+  if (*duration_ms < 0)
+    *duration_ms = 0;
+  return true;
+}
+
+PingResponseReader::PingResponseReader()
+    : buffer_(AcquireResponseBuffer()),
+      length_(0),
+      compressed_(false),
+      dropped_(false),
+      parser_(buffer_, &parsed_) {
+}
+
+PingResponseReader::~PingResponseReader() {
+  ReleaseResponseBuffer(buffer_);
+}
+
+void PingResponseReader::Start(bool compressed) {
+  compressed_ = compressed;
+}
+
+char* PingResponseReader::chunk() {
+  return compressed_ ? compressed_chunk_ : buffer_ + length_;
+}
+
+DWORD PingResponseReader::chunk_size() const {
+  // One more character than allowed is read, to tell a response which is
+  // too long.
+  if (compressed_)
+    return kCompressedChunkSize;
+  return static_cast<DWORD>(kMaxPingResponseLength + 1 - length_);
+}
+
+bool PingResponseReader::Read(DWORD bytes_read) {
+  if (dropped_)
+    return false;
+
+  size_t inflated_length = bytes_read;
+  if (compressed_ &&
+      !inflater_.Inflate(compressed_chunk_, bytes_read, buffer_ + length_,
+                         kMaxPingResponseLength + 1 - length_,
+                         &inflated_length)) {
+    dropped_ = true;  // Corrupt, or too long once inflated.
+    return false;
+  }
+
+  length_ += inflated_length;
+  if (!parser_.Feed(length_)) {
+    dropped_ = true;
+    return false;
+  }
+
+  return true;
+}
+
+void PingResponseReader::GetResponse(std::string* response,
+                                     bool* valid_response) {
+  if (dropped_) {
+    response->clear();
+    if (valid_response)
+      *valid_response = false;
+    return;
+  }
+
+  response->assign(buffer_, length_);
+  if (valid_response)
+    *valid_response = parser_.Finish();
+}
+
+// static
+scoped_refptr<PingTransport> PingTransport::Get() {
+  SharedTransport& shared = g_shared_transport.Get();
+  base::AutoLock auto_lock(shared.lock);
+  if (!shared.transport)
+    shared.transport = Create(PING_TRANSPORT_WININET);
+  return shared.transport;
+}
+
+// static
+void PingTransport::Set(PingTransport* transport) {
+  // The previous transport is released without the lock.
+  scoped_refptr<PingTransport> previous;
+  SharedTransport& shared = g_shared_transport.Get();
+  base::AutoLock auto_lock(shared.lock);
+  previous.swap(shared.transport);
+  shared.transport = transport;
+}
+
+// static
+PingTransport* PingTransport::Create(PingTransportType type) {
+  switch (type) {
+  case PING_TRANSPORT_WININET: return new WinInetPingTransport;
+  case PING_TRANSPORT_WINHTTP: return new WinHttpPingTransport;
+  }
+
+  ASSERT_STRING("PingTransport::Create: Unknown transport");
+  return NULL;
+}
+
+// static
+void PingTransport::SetCompressionEnabled(bool enabled) {
+  base::subtle::NoBarrier_Store(&g_compression_enabled, enabled ? 1 : 0);
+}
+
+// static
+bool PingTransport::IsCompressionEnabled() {
+  return base::subtle::NoBarrier_Load(&g_compression_enabled) != 0;
+}
+
+bool PingTransport::Send(const char* request, std::string* response,
+                         PingCanceller* canceller, bool* valid_response,
+                         PingResult* result) {
+  if (!response)
+    return false;
+
+  response->clear();
+  if (valid_response)
+    *valid_response = false;
+
+  PingResult local_result;
+  if (!result)
+    result = &local_result;
+  result->status = 0;
+
+  HttpRequest http_request;
+  if (!PrepareRequest(request, true, &http_request))
+    return false;
+
+  scoped_ptr<PingResponseReader> reader(new PingResponseReader);
+  DWORD status = 0;
+  result->timer.Start();
+  bool received = SendRequest(http_request, canceller, reader.get(),
+                              &result->timer, &status);
+  if (received && !http_request.body.empty() &&
+      IsRejectedBodyStatus(status)) {
+    // Send the request again as before, and no compressed ones any more.
+    base::subtle::NoBarrier_Store(&g_server_accepts_gzip, 0);
+    if (!PrepareRequest(request, false, &http_request))
+      return false;
+    reader.reset(new PingResponseReader);
+    result->timer.Start();
+    received = SendRequest(http_request, canceller, reader.get(),
+                           &result->timer, &status);
+  }
+  result->timer.Finish();
+  if (received)
+    result->status = status;
+
+  if (!received || status != 200)
+    return false;
+
+  // A cancelled read looks like the end of the response.
+  if (canceller && canceller->cancelled())
+    return false;
+
+  // A compressed response tells that the server supports compression.
+  if (reader->compressed())
+    base::subtle::NoBarrier_Store(&g_server_accepts_gzip, 1);
+
+  reader->GetResponse(response, valid_response);
+  return true;
+}
+
+// static
+bool PingTransport::PrepareRequest(const char* request,
+                                   bool allow_compressed_body,
+                                   HttpRequest* http_request) {
+  if (!request || !request[0]) {
+    ASSERT_STRING("PingTransport::PrepareRequest: request is empty");
+    return false;
+  }
+
+  http_request->verb = kFinancialPingType;
+  http_request->path = request;
+  http_request->headers.clear();
+  http_request->body.clear();
+  http_request->accept_gzip = IsCompressionEnabled();
+  if (!http_request->accept_gzip)
+    return true;
+
+  base::StringAppendF(&http_request->headers, "Accept-Encoding: %s\r\n",
+                      kGzipEncoding);
+
+  // Long requests are sent as a compressed POST body, once the server is
+  // known to support compression.
+  const char* query = strchr(request, '?');
+  if (!allow_compressed_body || !query ||
+      strlen(request) < kMinCompressedPingLength ||
+      !base::subtle::NoBarrier_Load(&g_server_accepts_gzip) ||
+      !GzipCompress(query + 1, strlen(query + 1), &http_request->body)) {
+    http_request->body.clear();
+    return true;
+  }
+
+  http_request->verb = kFinancialPingPostType;
+  http_request->path.assign(request, query - request);
+  http_request->headers.append(
+      "Content-Type: application/x-www-form-urlencoded\r\n");
+  base::StringAppendF(&http_request->headers, "Content-Encoding: %s\r\n",
+                      kGzipEncoding);
+  return true;
+}
+
+LoopbackPingTransport::LoopbackPingTransport()
+    : status_(200), request_count_(0) {
+}
+
+LoopbackPingTransport::~LoopbackPingTransport() {
+}
+
+void LoopbackPingTransport::SetResponse(const std::string& response,
+                                        DWORD status) {
+  base::AutoLock auto_lock(lock_);
+  response_ = response;
+  status_ = status;
+}
+
+int LoopbackPingTransport::request_count() {
+  base::AutoLock auto_lock(lock_);
+  return request_count_;
+}
+
+std::string LoopbackPingTransport::last_request() {
+  base::AutoLock auto_lock(lock_);
+  return last_request_;
+}
+
+bool LoopbackPingTransport::SendRequest(const HttpRequest& http_request,
+                                        PingCanceller* canceller,
+                                        PingResponseReader* reader,
+                                        PingPhaseTimer* timer,
+                                        DWORD* status) {
+  std::string response;
+  {
+    base::AutoLock auto_lock(lock_);
+    ++request_count_;
+    last_request_ = http_request.path;
+    *status = status_;
+    response = response_;
+  }
+
+  if (!*status || (canceller && canceller->cancelled()))
+    return false;
+  if (*status != 200)
+    return true;
+
+  // Fed in chunks, as from the network.
+  reader->Start(false);
+  size_t offset = 0;
+  while (offset < response.size()) {
+    DWORD length = reader->chunk_size();
+    if (length > response.size() - offset)
+      length = static_cast<DWORD>(response.size() - offset);
+    memcpy(reader->chunk(), response.data() + offset, length);
+    offset += length;
+    if (!reader->Read(length))
+      break;
+  }
+
+  return true;
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,230 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The HTTP transports the financial pings are sent with.
+
+#ifndef RLZ_WIN_LIB_PING_TRANSPORT_H_
+#define RLZ_WIN_LIB_PING_TRANSPORT_H_
+
+#include <windows.h>
+#include <string>
+
+#include "base/basictypes.h"
+#include "base/memory/ref_counted.h"
+#include "base/synchronization/lock.h"
+#include "base/time.h"
+#include "rlz/win/lib/gzip.h"
+#include "rlz/win/lib/ping_response.h"
+#include "rlz/win/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+// Lets another thread abort a PingTransport::Send() call, by closing the
+// handle of the HTTP request in flight.
+class PingCanceller {
+ public:
+  // Closes a request handle: InternetCloseHandle() or WinHttpCloseHandle().
+  typedef BOOL (WINAPI *CloseFunction)(void* request);
+
+  PingCanceller();
+  ~PingCanceller();
+
+  // Aborts the request in flight, if any, and any request attached later.
+  void Cancel();
+  bool cancelled();
+
+  // Called by the transports around the request. Attach() returns false if
+  // the ping was already cancelled. Detach() returns true if Cancel() closed
+  // the handle in between, in which case the caller must not close it again.
+  bool Attach(void* request, CloseFunction close);
+  bool Detach();
+
+ private:
+  base::Lock lock_;
+  void* request_;
+  CloseFunction close_;
+  bool cancelled_;
+  bool closed_;
+
+  DISALLOW_COPY_AND_ASSIGN(PingCanceller);
+};
+
+// Times the phases of a ping. The transports mark the end of each phase they
+// can tell, possibly from the threads of their status callbacks, and each
+// phase lasts from the end of the previous phase marked. The reading ends
+// when the ping does.
+class PingPhaseTimer {
+ public:
+  PingPhaseTimer();
+
+  // Starts timing a ping, forgetting the phases of an earlier one.
+  void Start();
+  void MarkEnd(PingPhase phase);
+  void Finish();
+
+  // Gets how long |phase| took, in milliseconds. Returns false if it was not
+  // marked, e.g. for the connection of a kept-alive connection.
+  bool GetDuration(PingPhase phase, int64* duration_ms) const;
+
+ private:
+  base::TimeTicks start_;
+  base::TimeTicks ends_[LAST_PING_PHASE];
+
+  DISALLOW_COPY_AND_ASSIGN(PingPhaseTimer);
+};
+
+// What happened to a ping on the network, for the health statistics.
+struct PingResult {
+  PingResult() : status(0) {}
+
+  DWORD status;  // The HTTP status of the response, 0 without a response.
+  PingPhaseTimer timer;
+};
+
+// Reads a response for the transports, as it arrives: inflates it if it is
+// compressed, and parses it into a buffer of kMaxPingResponseLength + 1
+// characters. The buffer of the previous ping is reused when no other ping
+// holds it.
+class PingResponseReader {
+ public:
+  PingResponseReader();
+  ~PingResponseReader();
+
+  // Called once the response headers are known, before reading the body.
+  void Start(bool compressed);
+  bool compressed() const { return compressed_; }
+
+  // Where to read the next chunk of the body, and how much to read.
+  char* chunk();
+  DWORD chunk_size() const;
+
+  // Takes bytes_read characters read into chunk(). Returns false once the
+  // response can not be valid: too long, or badly compressed. Reading should
+  // then stop, and the connection not be reused.
+  bool Read(DWORD bytes_read);
+  bool dropped() const { return dropped_; }
+
+  // Copies the response text, which is empty if it was dropped, and sets
+  // *valid_response, if not NULL, to whether it is valid.
+  void GetResponse(std::string* response, bool* valid_response);
+
+ private:
+  // The size of the compressed chunks read before they are inflated.
+  static const DWORD kCompressedChunkSize = 4096;
+
+  char* buffer_;
+  size_t length_;
+  bool compressed_;
+  bool dropped_;
+  ParsedPingResponse parsed_;
+  PingResponseParser parser_;
+  GzipInflater inflater_;
+  char compressed_chunk_[kCompressedChunkSize];
+
+  DISALLOW_COPY_AND_ASSIGN(PingResponseReader);
+};
+
+// A way of sending the financial pings over HTTP. The transport used by the
+// library is process-wide; Get() returns a reference which stays valid for
+// the ping in progress, even if another transport is set in between.
+class PingTransport : public base::RefCountedThreadSafe<PingTransport> {
+ public:
+  // Returns the current transport, by default a WinInet one.
+  static scoped_refptr<PingTransport> Get();
+
+  // Sets the transport pings are sent with from now on. NULL restores the
+  // default transport.
+  static void Set(PingTransport* transport);
+
+  // Creates a transport for the network. Returns NULL for an unknown type.
+  static PingTransport* Create(PingTransportType type);
+
+  // Enables or disables compressed pings in this process. While enabled,
+  // pings accept gzip compressed responses, and requests of at least
+  // kMinCompressedPingLength characters are sent as a gzip compressed POST
+  // body once the server has sent such a response. A POST the server
+  // rejects is sent again as a GET, and compressed requests are not sent any
+  // more. Disabled by default.
+  static void SetCompressionEnabled(bool enabled);
+  static bool IsCompressionEnabled();
+
+  // Sends request, a path with its query, to the financial server. Returns
+  // false if the ping did not reach the server, or if it was cancelled
+  // through canceller. Otherwise response is the response text, which is
+  // empty if it had to be dropped, and *valid_response, if not NULL, tells
+  // whether it is valid. The status and the timings of the ping are set in
+  // *result, if not NULL.
+  bool Send(const char* request, std::string* response,
+            PingCanceller* canceller, bool* valid_response,
+            PingResult* result = NULL);
+
+ protected:
+  friend class base::RefCountedThreadSafe<PingTransport>;
+
+  // The HTTP form of a request.
+  struct HttpRequest {
+    const char* verb;
+    std::string path;
+    std::string headers;  // Each line ends with \r\n.
+    std::string body;
+    bool accept_gzip;
+  };
+
+  PingTransport() {}
+  virtual ~PingTransport() {}
+
+  // Sends http_request. Returns false if no response was received, and
+  // otherwise sets *status to the HTTP status. The body of a 200 response is
+  // fed to reader, after reader->Start(), until it ends or reader->Read()
+  // returns false. The phases the transport can tell are marked on timer,
+  // which is started and finished by the caller.
+  virtual bool SendRequest(const HttpRequest& http_request,
+                           PingCanceller* canceller,
+                           PingResponseReader* reader, PingPhaseTimer* timer,
+                           DWORD* status) = 0;
+
+ private:
+  // Forms the HTTP request of a ping request. Compressed unless
+  // allow_compressed_body is false.
+  static bool PrepareRequest(const char* request, bool allow_compressed_body,
+                             HttpRequest* http_request);
+
+  DISALLOW_COPY_AND_ASSIGN(PingTransport);
+};
+
+// A transport which never touches the network: it answers every ping with a
+// canned response, for the tests and the benchmarks.
+class LoopbackPingTransport : public PingTransport {
+ public:
+  LoopbackPingTransport();
+
+  // The response to the next pings, and their HTTP status. A status of 0
+  // makes the pings fail as if the server could not be reached.
+  void SetResponse(const std::string& response, DWORD status);
+
+  // The number of requests received, and the last one, as a path and query.
+  int request_count();
+  std::string last_request();
+
+ protected:
+  virtual ~LoopbackPingTransport();
+
+  virtual bool SendRequest(const HttpRequest& http_request,
+                           PingCanceller* canceller,
+                           PingResponseReader* reader, PingPhaseTimer* timer,
+                           DWORD* status);
+
+ private:
+  base::Lock lock_;
+  std::string response_;
+  DWORD status_;
+  int request_count_;
+  std::string last_request_;
+
+  DISALLOW_COPY_AND_ASSIGN(LoopbackPingTransport);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_PING_TRANSPORT_H_
@@ -10,9 +10,11 @@
 #include <Sddl.h>  // For ConvertSidToStringSid.
 #include <LMCons.h>  // For UNLEN
 
+#include "base/lazy_instance.h"
 #include "base/logging.h"
 #include "base/memory/scoped_ptr.h"
 #include "base/process_util.h"
+#include "base/synchronization/lock.h"
 #include "base/win/scoped_handle.h"
 #include "base/win/windows_version.h"
 #include "rlz/win/lib/assert.h"
@@ -149,48 +151,131 @@ bool GetUserGroup(long* group) {
 
   return group != 0;
 }
-}  //anonymous
 
+// The privileges of the process, evaluated once.
+struct Privileges {
+  Privileges()
+      : user_evaluated(false),
+        is_system(false),
+        admin_evaluated(false),
+        has_admin_rights(false),
+        integrity_level(rlz_lib::ProcessInfo::INTEGRITY_UNKNOWN) {
+  }
 
-namespace rlz_lib {
+  base::Lock lock;
+  bool user_evaluated;
+  bool is_system;
+  bool admin_evaluated;
+  bool has_admin_rights;
+  rlz_lib::ProcessInfo::IntegrityLevel integrity_level;
+};
 
-bool ProcessInfo::IsRunningAsSystem() {
-  static std::wstring name;
-  static std::wstring domain;
-  static std::wstring sid;
-  if (name.empty())
-    CHECK(SUCCEEDED(GetCurrentUser(&name, &domain, &sid)));
+// Leaky, so that it can also be used from a DLL without an AtExitManager.
+base::LazyInstance<Privileges, base::LeakyLazyInstanceTraits<Privileges> >
+    g_privileges(base::LINKER_INITIALIZED);
+
+// The helpers below expect the lock to be held.
+rlz_lib::ProcessInfo::IntegrityLevel GetIntegrityLevelLocked(
+    Privileges* privileges) {
+  if (privileges->integrity_level != rlz_lib::ProcessInfo::INTEGRITY_UNKNOWN)
+    return privileges->integrity_level;
 
-  return (name == L"SYSTEM");
+  if (base::win::GetVersion() < base::win::VERSION_VISTA)
+    return rlz_lib::ProcessInfo::INTEGRITY_UNKNOWN;
+
+  base::IntegrityLevel level = base::INTEGRITY_UNKNOWN;
+  if (!base::GetProcessIntegrityLevel(base::GetCurrentProcessHandle(), &level))
+    return rlz_lib::ProcessInfo::INTEGRITY_UNKNOWN;
+
+  switch (level) {
+    case base::LOW_INTEGRITY:
+      privileges->integrity_level = rlz_lib::ProcessInfo::LOW_INTEGRITY;
+      break;
+    case base::MEDIUM_INTEGRITY:
+      privileges->integrity_level = rlz_lib::ProcessInfo::MEDIUM_INTEGRITY;
+      break;
+    case base::HIGH_INTEGRITY:
+      privileges->integrity_level = rlz_lib::ProcessInfo::HIGH_INTEGRITY;
+      break;
+    default:
+      break;
+  }
+  return privileges->integrity_level;
 }
 
-bool ProcessInfo::HasAdminRights() {
-  static bool evaluated = false;
-  static bool has_rights = false;
+bool IsRunningAsSystemLocked(Privileges* privileges) {
+  if (!privileges->user_evaluated) {
+    std::wstring name;
+    std::wstring domain;
+    std::wstring sid;
+    CHECK(SUCCEEDED(GetCurrentUser(&name, &domain, &sid)));
+    privileges->is_system = (name == L"SYSTEM");
+    privileges->user_evaluated = true;
+  }
+
+  return privileges->is_system;
+}
 
-  if (!evaluated) {
-    if (IsRunningAsSystem()) {
+bool HasAdminRightsLocked(Privileges* privileges) {
+  if (!privileges->admin_evaluated) {
+    bool has_rights = false;
+    if (IsRunningAsSystemLocked(privileges)) {
       has_rights = true;
     } else if (base::win::GetVersion() >= base::win::VERSION_VISTA) {
       TOKEN_ELEVATION_TYPE elevation;
-      base::IntegrityLevel level;
-
-      if (SUCCEEDED(GetElevationType(&elevation)) &&
-        base::GetProcessIntegrityLevel(base::GetCurrentProcessHandle(), &level))
+      if (SUCCEEDED(GetElevationType(&elevation)))
         has_rights = (elevation == TokenElevationTypeFull) ||
-                    (level == HIGH_INTEGRITY);
+                     (GetIntegrityLevelLocked(privileges) ==
+                          rlz_lib::ProcessInfo::HIGH_INTEGRITY);
     } else {
       long group = 0;
       if (GetUserGroup(&group))
         has_rights = (group == DOMAIN_ALIAS_RID_ADMINS);
     }
+
+    privileges->has_admin_rights = has_rights;
+    privileges->admin_evaluated = true;
+  }
+
+  return privileges->has_admin_rights;
+}
+
+}  //anonymous
+
+
+namespace rlz_lib {
+
+bool ProcessInfo::IsRunningAsSystem() {
+  Privileges* privileges = g_privileges.Pointer();
+  base::AutoLock lock(privileges->lock);
+  return IsRunningAsSystemLocked(privileges);
+}
+
+bool ProcessInfo::HasAdminRights() {
+  bool has_rights = false;
+  {
+    Privileges* privileges = g_privileges.Pointer();
+    base::AutoLock lock(privileges->lock);
+    has_rights = HasAdminRightsLocked(privileges);
   }
 
-  evaluated = true;
   if (!has_rights)
     ASSERT_STRING("ProcessInfo::HasAdminRights: Does not have admin rights.");
 
   return has_rights;
 }
 
+ProcessInfo::IntegrityLevel ProcessInfo::GetIntegrityLevel() {
+  Privileges* privileges = g_privileges.Pointer();
+  base::AutoLock lock(privileges->lock);
+  return GetIntegrityLevelLocked(privileges);
+}
+
+bool ProcessInfo::GetUserSid(std::wstring* sid) {
+  std::wstring name;
+  std::wstring domain;
+  sid->clear();
+  return SUCCEEDED(GetCurrentUser(&name, &domain, sid)) && !sid->empty();
+}
+
 };  // namespace
@@ -7,6 +7,8 @@
 #ifndef RLZ_WIN_LIB_PROCESS_INFO_H_
 #define RLZ_WIN_LIB_PROCESS_INFO_H_
 
+#include <string>
+
 #include "base/basictypes.h"
 
 namespace rlz_lib {
@@ -20,10 +22,18 @@ class ProcessInfo {
     HIGH_INTEGRITY,
   };
 
-  // All these functions cache the result after first run.
+  // All these functions cache the result after first run, and are thread
+  // safe.
   static bool IsRunningAsSystem();
   static bool HasAdminRights();  // System / Admin / High Elevation on Vista
 
+  // The integrity level of the process, INTEGRITY_UNKNOWN if it cannot be
+  // determined (always before Vista). Failures are not cached.
+  static IntegrityLevel GetIntegrityLevel();
+
+  // The string SID of the user the process runs as. Not cached.
+  static bool GetUserSid(std::wstring* sid);
+
  private:
   DISALLOW_COPY_AND_ASSIGN(ProcessInfo);
 };  // class
@@ -0,0 +1,293 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The registry backend of the RLZ state.
+
+#include "rlz/win/lib/registry_value_store.h"
+
+#include "base/stringprintf.h"
+#include "base/utf_string_conversions.h"
+#include "base/win/registry.h"
+#include "rlz/win/lib/assert.h"
+#include "rlz/win/lib/event_bitmap.h"
+#include "rlz/win/lib/lib_values.h"
+#include "rlz/win/lib/ping_params_cache.h"
+#include "rlz/win/lib/shared_state_mirror.h"
+#include "rlz/win/lib/state_cache.h"
+#include "rlz/win/lib/string_utils.h"
+
+namespace {
+
+// Opens the existing key at |location| for deleting from it. Returns false
+// if it does not exist, in which case there is nothing to delete.
+bool OpenForDelete(HKEY root, const std::wstring& location,
+                   base::win::RegKey* key) {
+  return key->Open(root, location.c_str(), KEY_READ | KEY_WRITE) ==
+      ERROR_SUCCESS;
+}
+
+bool IsDeleted(LONG result) {
+  return result == ERROR_SUCCESS || result == ERROR_FILE_NOT_FOUND;
+}
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+RegistryValueStore::RegistryValueStore(const wchar_t* sid)
+    : sid_(sid ? sid : L""), user_key_(sid), result_(true) {
+}
+
+RegistryValueStore::~RegistryValueStore() {
+}
+
+bool RegistryValueStore::HasAccess(bool write_access) {
+  return user_key_.HasAccess(write_access);
+}
+
+bool RegistryValueStore::ReadAccessPointRlz(AccessPoint point,
+                                            std::string* rlz) {
+  rlz->clear();
+  const char* point_name = GetAccessPointName(point);
+  if (!point_name)
+    return false;
+
+  base::win::RegKey key;
+  if (!GetAccessPointRlzsRegKey(user_key_.Get(), KEY_READ, &key))
+    return true;
+
+  char value[kMaxRlzLength + 1];
+  size_t size = arraysize(value);
+  if (!RegKeyReadValue(key, ASCIIToWide(point_name).c_str(), value, &size)) {
+    // The size is left untouched if the value does not exist.
+    return size <= arraysize(value);
+  }
+
+  *rlz = value;
+  return true;
+}
+
+bool RegistryValueStore::WriteAccessPointRlz(AccessPoint point,
+                                             const std::string& rlz) {
+  const char* point_name = GetAccessPointName(point);
+  if (!point_name)
+    return false;
+
+  InvalidateUser();
+  std::wstring value_name(ASCIIToWide(point_name));
+  bool written;
+  if (rlz.empty()) {
+    base::win::RegKey key;
+    written = !OpenForDelete(user_key_.Get(),
+                             GetRegKeyLocation(kRlzsSubkeyName), &key) ||
+        IsDeleted(key.DeleteValue(value_name.c_str()));
+  } else {
+    base::win::RegKey key;
+    written = GetAccessPointRlzsRegKey(user_key_.Get(), KEY_READ | KEY_WRITE,
+                                       &key) &&
+        RegKeyWriteValue(key, value_name.c_str(), rlz.c_str());
+  }
+
+  if (!written) {
+    ASSERT_STRING("RegistryValueStore: Could not write an RLZ value");
+    result_ = false;
+  }
+  return written;
+}
+
+bool RegistryValueStore::ReadProductEvents(Product product,
+                                           EventBitmap* events) {
+  return ReadEvents(product, kEventsSubkeyName, kEventBitsSubkeyName, events);
+}
+
+bool RegistryValueStore::WriteProductEvents(Product product,
+                                            const EventBitmap& events) {
+  return WriteEvents(product, kEventsSubkeyName, kEventBitsSubkeyName,
+                     events);
+}
+
+bool RegistryValueStore::ReadStatefulEvents(Product product,
+                                            EventBitmap* events) {
+  return ReadEvents(product, kStatefulEventsSubkeyName,
+                    kStatefulEventBitsSubkeyName, events);
+}
+
+bool RegistryValueStore::WriteStatefulEvents(Product product,
+                                             const EventBitmap& events) {
+  return WriteEvents(product, kStatefulEventsSubkeyName,
+                     kStatefulEventBitsSubkeyName, events);
+}
+
+bool RegistryValueStore::ReadPingTime(Product product, int64* time) {
+  *time = 0;
+  const wchar_t* product_name = GetProductName(product);
+  if (!product_name)
+    return false;
+
+  base::win::RegKey key;
+  if (GetPingTimesRegKey(user_key_.Get(), KEY_READ, &key) &&
+      key.ReadInt64(product_name, time) != ERROR_SUCCESS)
+    *time = 0;
+  return true;
+}
+
+bool RegistryValueStore::WritePingTime(Product product, int64 time) {
+  const wchar_t* product_name = GetProductName(product);
+  if (!product_name)
+    return false;
+
+  bool written;
+  base::win::RegKey key;
+  if (!time) {
+    written = !OpenForDelete(user_key_.Get(),
+                             GetRegKeyLocation(kPingTimesSubkeyName), &key) ||
+        IsDeleted(key.DeleteValue(product_name));
+  } else {
+    written = GetPingTimesRegKey(user_key_.Get(), KEY_WRITE, &key) &&
+        key.WriteValue(product_name, &time, sizeof(time), REG_QWORD) ==
+        ERROR_SUCCESS;
+  }
+
+  if (!written) {
+    ASSERT_STRING("RegistryValueStore: Could not write a ping time");
+    result_ = false;
+  }
+  return written;
+}
+
+bool RegistryValueStore::ReadMachineDealCode(std::string* dcc) {
+  dcc->clear();
+  base::win::RegKey dcc_key(HKEY_LOCAL_MACHINE, kLibKeyName,
+                            KEY_READ | KEY_WOW64_32KEY);
+  if (!dcc_key.Valid())
+    return true;  // no DCC key.
+
+  char value[kMaxDccLength + 1];
+  size_t size = arraysize(value);
+  if (!RegKeyReadValue(dcc_key, kDccValueName, value, &size))
+    return size <= arraysize(value);
+
+  *dcc = value;
+  return true;
+}
+
+bool RegistryValueStore::WriteMachineDealCode(const std::string& dcc) {
+  base::win::RegKey dcc_key(HKEY_LOCAL_MACHINE, kLibKeyName,
+                            KEY_READ | KEY_WRITE | KEY_WOW64_32KEY);
+  StateCache::InvalidateMachine();
+  SharedStateMirror::InvalidateMachine();
+  PingParamsCache::InvalidateMachine();
+  bool written = dcc_key.Valid() &&
+      (dcc.empty() ? IsDeleted(dcc_key.DeleteValue(kDccValueName)) :
+                     RegKeyWriteValue(dcc_key, kDccValueName, dcc.c_str()));
+  if (!written) {
+    ASSERT_STRING("RegistryValueStore: Could not write the DCC value");
+    result_ = false;
+  }
+  return written;
+}
+
+bool RegistryValueStore::Commit() {
+  bool result = result_;
+  result_ = true;
+  return result;
+}
+
+void RegistryValueStore::Discard() {
+  result_ = true;
+}
+
+bool RegistryValueStore::ReadEvents(Product product,
+                                    const wchar_t* events_type,
+                                    const wchar_t* bits_type,
+                                    EventBitmap* events) {
+  const wchar_t* product_name = GetProductName(product);
+  if (!product_name)
+    return false;
+
+  base::win::RegKey bits_key;
+  if (GetEventBitsRegKey(user_key_.Get(), bits_type, KEY_READ, &bits_key) &&
+      !events->Read(bits_key.Handle(), product_name))
+    return false;
+
+  // Merged with the events recorded by older clients.
+  base::win::RegKey key;
+  if (GetEventsRegKey(user_key_.Get(), events_type, &product, KEY_READ, &key))
+    events->AddLegacyEvents(key.Handle());
+
+  return true;
+}
+
+bool RegistryValueStore::WriteEvents(Product product,
+                                     const wchar_t* events_type,
+                                     const wchar_t* bits_type,
+                                     const EventBitmap& events) {
+  const wchar_t* product_name = GetProductName(product);
+  if (!product_name)
+    return false;
+
+  InvalidateUser();
+
+  // Drop the events from both layouts, and write them in the one in use.
+  bool written = true;
+  std::wstring location;
+  GetEventsRegKeyLocation(events_type, NULL, &location);
+  base::win::RegKey parent_key;
+  if (OpenForDelete(user_key_.Get(), location, &parent_key))
+    written = IsDeleted(parent_key.DeleteKey(product_name));
+
+  base::win::RegKey bits_key;
+  if (EventBitmap::IsEnabled()) {
+    written &= GetEventBitsRegKey(user_key_.Get(), bits_type,
+                                  KEY_READ | KEY_WRITE, &bits_key) &&
+        events.Write(bits_key.Handle(), product_name);
+  } else {
+    if (OpenForDelete(user_key_.Get(), GetRegKeyLocation(bits_type),
+                      &bits_key))
+      written &= IsDeleted(bits_key.DeleteValue(product_name));
+
+    base::win::RegKey key;
+    if (!events.empty() &&
+        !GetEventsRegKey(user_key_.Get(), events_type, &product, KEY_WRITE,
+                         &key)) {
+      written = false;
+    } else if (!events.empty()) {
+      for (int point = NO_ACCESS_POINT + 1; point < LAST_ACCESS_POINT;
+           ++point) {
+        for (int event = INVALID_EVENT + 1; event < LAST_EVENT; ++event) {
+          if (!events.Has(static_cast<AccessPoint>(point),
+                          static_cast<Event>(event)))
+            continue;
+
+          const char* point_name =
+              GetAccessPointName(static_cast<AccessPoint>(point));
+          const char* event_name = GetEventName(static_cast<Event>(event));
+          if (!point_name || !event_name || !point_name[0] || !event_name[0])
+            continue;
+
+          std::wstring value_name;
+          base::StringAppendF(&value_name, L"%ls%ls",
+                              ASCIIToWide(point_name).c_str(),
+                              ASCIIToWide(event_name).c_str());
+          written &= key.WriteValue(value_name.c_str(),
+                                    static_cast<DWORD>(1)) == ERROR_SUCCESS;
+        }
+      }
+    }
+  }
+
+  if (!written) {
+    ASSERT_STRING("RegistryValueStore: Could not write the events");
+    result_ = false;
+  }
+  return written;
+}
+
+void RegistryValueStore::InvalidateUser() {
+  StateCache::InvalidateUser(sid_.c_str());
+  SharedStateMirror::InvalidateUser(sid_.c_str());
+  PingParamsCache::InvalidateUser(sid_.c_str());
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,70 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The registry backend of the RLZ state.
+
+#ifndef RLZ_WIN_LIB_REGISTRY_VALUE_STORE_H_
+#define RLZ_WIN_LIB_REGISTRY_VALUE_STORE_H_
+
+#include <windows.h>
+#include <string>
+
+#include "rlz/win/lib/user_key.h"
+#include "rlz/win/lib/value_store.h"
+
+namespace rlz_lib {
+
+// Reads and writes the state in the layout the library, and older clients,
+// keep in the registry: events are read from both event layouts and written
+// in the one EventBitmap::IsEnabled() selects. Writes are applied at once.
+// The file store copies the registry state through this class, and mirrors
+// its writes to it. The caller must hold the RLZ mutex.
+class RegistryValueStore : public RlzValueStore {
+ public:
+  explicit RegistryValueStore(const wchar_t* sid);
+  virtual ~RegistryValueStore();
+
+  virtual bool HasAccess(bool write_access);
+
+  virtual bool ReadAccessPointRlz(AccessPoint point, std::string* rlz);
+  virtual bool WriteAccessPointRlz(AccessPoint point, const std::string& rlz);
+
+  virtual bool ReadProductEvents(Product product, EventBitmap* events);
+  virtual bool WriteProductEvents(Product product, const EventBitmap& events);
+  virtual bool ReadStatefulEvents(Product product, EventBitmap* events);
+  virtual bool WriteStatefulEvents(Product product,
+                                   const EventBitmap& events);
+
+  virtual bool ReadPingTime(Product product, int64* time);
+  virtual bool WritePingTime(Product product, int64 time);
+
+  virtual bool ReadMachineDealCode(std::string* dcc);
+  virtual bool WriteMachineDealCode(const std::string& dcc);
+
+  virtual bool Commit();
+
+  // The registry writes are applied as they are made.
+  virtual void Discard();
+
+ private:
+  bool ReadEvents(Product product, const wchar_t* events_type,
+                  const wchar_t* bits_type, EventBitmap* events);
+  bool WriteEvents(Product product, const wchar_t* events_type,
+                   const wchar_t* bits_type, const EventBitmap& events);
+
+  // Drops the cached values of the user, which the writes change.
+  void InvalidateUser();
+
+  std::wstring sid_;
+  UserKey user_key_;
+
+  // False once a write failed.
+  bool result_;
+
+  DISALLOW_COPY_AND_ASSIGN(RegistryValueStore);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_REGISTRY_VALUE_STORE_H_
@@ -13,7 +13,9 @@
 #include <winerror.h>
 #include <vector>
 
+#include "base/atomicops.h"
 #include "base/basictypes.h"
+#include "base/lazy_instance.h"
 #include "base/memory/scoped_ptr.h"
 #include "base/string_util.h"
 #include "base/stringprintf.h"
@@ -21,13 +23,27 @@
 #include "base/win/registry.h"
 #include "base/win/windows_version.h"
 #include "rlz/win/lib/assert.h"
-#include "rlz/win/lib/crc32.h"
+#include "rlz/win/lib/async_ping.h"
+#include "rlz/win/lib/cgi_builder.h"
+#include "rlz/win/lib/event_bitmap.h"
+#include "rlz/win/lib/event_queue.h"
 #include "rlz/win/lib/financial_ping.h"
 #include "rlz/win/lib/lib_mutex.h"
 #include "rlz/win/lib/lib_values.h"
 #include "rlz/win/lib/machine_deal.h"
+#include "rlz/win/lib/ping_health.h"
+#include "rlz/win/lib/ping_params_cache.h"
+#include "rlz/win/lib/ping_response.h"
+#include "rlz/win/lib/ping_retry_queue.h"
+#include "rlz/win/lib/ping_transport.h"
+#include "rlz/win/lib/shared_state_mirror.h"
+#include "rlz/win/lib/state_cache.h"
 #include "rlz/win/lib/string_utils.h"
+#include "rlz/win/lib/trace.h"
 #include "rlz/win/lib/user_key.h"
+#include "rlz/win/lib/user_sweep.h"
+#include "rlz/win/lib/value_store.h"
+#include "rlz/win/lib/write_batch.h"
 
 namespace {
 
@@ -37,11 +53,13 @@ namespace {
 const wchar_t* kHKLMAccessProviders =
     L"System\\CurrentControlSet\\Control\\Lsa\\AccessProviders";
 
-// Event information returned from ping response.
-struct ReturnedEvent {
-  rlz_lib::AccessPoint access_point;
-  rlz_lib::Event event_type;
-};
+// The size of the buffer the machine key's security descriptor is first read
+// into, which fits most descriptors.
+const DWORD kInitialSecurityDescriptorSize = 1024;
+
+// Set once CreateMachineState() has found or granted the access of all users
+// to the machine key, so that later calls in this process have nothing to do.
+base::subtle::Atomic32 g_machine_state_created = 0;
 
 // Helper functions
 
@@ -73,6 +91,15 @@ bool IsAccessPointSupported(rlz_lib::AccessPoint point, HKEY user_key) {
   }
 }
 
+// Returns true if |key| has no subkeys or values, with a single query.
+bool IsKeyEmpty(HKEY key) {
+  DWORD subkey_count = 0;
+  DWORD value_count = 0;
+  return RegQueryInfoKeyW(key, NULL, NULL, NULL, &subkey_count, NULL, NULL,
+                          &value_count, NULL, NULL, NULL, NULL) ==
+      ERROR_SUCCESS && subkey_count == 0 && value_count == 0;
+}
+
 // Deletes a registry key if it exists and has no subkeys or values.
 // TODO: Move this to a registry_utils file and add unittest.
 bool DeleteKeyIfEmpty(HKEY root_key, const wchar_t* key_name) {
@@ -84,158 +111,130 @@ bool DeleteKeyIfEmpty(HKEY root_key, const wchar_t* key_name) {
     if (!key.Valid())
       return true;  // Key does not exist - nothing to do.
 
-    base::win::RegistryKeyIterator key_iter(root_key, key_name);
-    if (key_iter.SubkeyCount() > 0)
-      return true;  // Not empty, so nothing to do
-
-    base::win::RegistryValueIterator value_iter(root_key, key_name);
-    if (value_iter.ValueCount() > 0)
+    if (!IsKeyEmpty(key.Handle()))
       return true;  // Not empty, so nothing to do
   }
 
   // The key is empty - delete it now.
-  base::win::RegKey key(root_key, L"", KEY_WRITE);
-  return key.DeleteKey(key_name) == ERROR_SUCCESS;
-}
-
-// Current RLZ can only uses [a-zA-Z0-9_\-]
-// We will be more liberal and allow some additional chars, but not url meta
-// chars.
-bool IsGoodRlzChar(const char ch) {
-  if (IsAsciiAlpha(ch) || IsAsciiDigit(ch))
-    return true;
-
-  switch (ch) {
-    case '_':
-    case '-':
-    case '!':
-    case '@':
-    case '$':
-    case '*':
-    case '(':
-    case ')':
-    case ';':
-    case '.':
-    case '<':
-    case '>':
-    return true;
-  }
-
-  return false;
-}
-
-bool IsGoodRlz(const char* rlz) {
-  if (!rlz)
-    return false;
-
-  if (strlen(rlz) > rlz_lib::kMaxRlzLength)
-    return false;
-
-  for (int i = 0; rlz[i]; i++)
-    if (!IsGoodRlzChar(rlz[i]))
-      return false;
-
-  return true;
+  return RegDeleteKeyW(root_key, key_name) == ERROR_SUCCESS;
 }
 
-// This function will remove bad rlz chars and also limit the max rlz to some
-// reasonable size.  It also assumes that normalized_rlz is at least
-// kMaxRlzLength+1 long.
-void NormalizeRlz(const char* raw_rlz, char* normalized_rlz) {
-  int index = 0;
-  for (; raw_rlz[index] != 0 && index < rlz_lib::kMaxRlzLength; ++index) {
-    char current = raw_rlz[index];
-    if (IsGoodRlzChar(current)) {
-      normalized_rlz[index] = current;
-    } else {
-      normalized_rlz[index] = '.';
+// RegDeleteTreeW and RegCopyTreeW, which are only available on Vista and
+// later.
+class RegistryTreeFunctions {
+ public:
+  typedef LONG (WINAPI *RegDeleteTreeFunc)(HKEY, LPCWSTR);
+  typedef LONG (WINAPI *RegCopyTreeFunc)(HKEY, LPCWSTR, HKEY);
+
+  RegistryTreeFunctions() : reg_delete_tree(NULL), reg_copy_tree(NULL) {
+    HMODULE advapi32 = GetModuleHandleW(L"advapi32.dll");
+    if (advapi32) {
+      reg_delete_tree = reinterpret_cast<RegDeleteTreeFunc>(
+          GetProcAddress(advapi32, "RegDeleteTreeW"));
+      reg_copy_tree = reinterpret_cast<RegCopyTreeFunc>(
+          GetProcAddress(advapi32, "RegCopyTreeW"));
     }
   }
 
-  normalized_rlz[index] = 0;
-}
+  RegDeleteTreeFunc reg_delete_tree;
+  RegCopyTreeFunc reg_copy_tree;
 
-void GetEventsFromResponseString(
-    const std::string& response_line,
-    const std::string& field_header,
-    std::vector<ReturnedEvent>* event_array) {
-  // Get the string of events.
-  std::string events = response_line.substr(field_header.size());
-  TrimWhitespaceASCII(events, TRIM_LEADING, &events);
+ private:
+  DISALLOW_COPY_AND_ASSIGN(RegistryTreeFunctions);
+};
 
-  int events_length = events.find_first_of("\r\n ");
-  if (events_length < 0)
-    events_length = events.size();
-  events = events.substr(0, events_length);
+// Leaky, so that it can also be used from a DLL without an AtExitManager.
+base::LazyInstance<RegistryTreeFunctions,
+                   base::LeakyLazyInstanceTraits<RegistryTreeFunctions> >
+    g_tree_functions(base::LINKER_INITIALIZED);
 
-  // Break this up into individual events
-  int event_end_index = -1;
-  do {
-    int event_begin = event_end_index + 1;
-    event_end_index = events.find(rlz_lib::kEventsCgiSeparator, event_begin);
-    int event_end = event_end_index;
-    if (event_end < 0)
-      event_end = events_length;
+// How a product keeps its state in a subkey of kLibKeyName.
+enum ProductStateLayout {
+  ACCESS_POINT_VALUES,  // A value per access point.
+  PRODUCT_SUBKEY,       // A subkey named after the product.
+  PRODUCT_VALUE,        // A value named after the product.
+};
 
-    std::string event_string = events.substr(event_begin,
-                                             event_end - event_begin);
-    if (event_string.size() != 3)  // 3 = 2(AP) + 1(E)
-      continue;
+struct ProductStateKey {
+  const wchar_t* name;
+  ProductStateLayout layout;
+};
 
-    rlz_lib::AccessPoint point = rlz_lib::NO_ACCESS_POINT;
-    rlz_lib::Event event = rlz_lib::INVALID_EVENT;
-    if (!GetAccessPointFromName(event_string.substr(0, 2).c_str(), &point) ||
-        point == rlz_lib::NO_ACCESS_POINT) {
-      continue;
-    }
+const ProductStateKey kProductStateKeys[] = {
+  { rlz_lib::kRlzsSubkeyName,              ACCESS_POINT_VALUES },
+  { rlz_lib::kEventsSubkeyName,            PRODUCT_SUBKEY },
+  { rlz_lib::kStatefulEventsSubkeyName,    PRODUCT_SUBKEY },
+  { rlz_lib::kEventBitsSubkeyName,         PRODUCT_VALUE },
+  { rlz_lib::kStatefulEventBitsSubkeyName, PRODUCT_VALUE },
+  { rlz_lib::kPingTimesSubkeyName,         PRODUCT_VALUE },
+  { rlz_lib::kPingRetriesSubkeyName,       PRODUCT_VALUE },
+  { rlz_lib::kPingIntervalsSubkeyName,     PRODUCT_VALUE },
+  { rlz_lib::kPingHealthSubkeyName,        PRODUCT_VALUE },
+};
 
-    if (!GetEventFromName(event_string.substr(event_string.size() - 1).c_str(),
-                          &event) || event == rlz_lib::INVALID_EVENT) {
-      continue;
+// Deletes the state of |product| and the RLZs of |access_points| from the
+// subkey |state_key| of the user key, and then the subkey if it is empty.
+// Each subkey is opened once, and the product subkeys are deleted as a whole
+// tree. The caller must hold the lib mutex.
+bool ClearProductStateKey(HKEY user_key, const ProductStateKey& state_key,
+                          const wchar_t* product_name,
+                          const rlz_lib::AccessPoint* access_points) {
+  const std::wstring& location = rlz_lib::GetRegKeyLocation(state_key.name);
+  base::win::RegKey key;
+  LONG result = key.Open(user_key, location.c_str(), KEY_READ | KEY_WRITE);
+  if (result == ERROR_FILE_NOT_FOUND)
+    return true;  // Nothing to clear.
+  if (result != ERROR_SUCCESS)
+    return false;
+
+  bool cleared = true;
+  switch (state_key.layout) {
+    case ACCESS_POINT_VALUES:
+      for (int i = 0; access_points &&
+           access_points[i] != rlz_lib::NO_ACCESS_POINT; ++i) {
+        const char* point_name = rlz_lib::GetAccessPointName(access_points[i]);
+        if (!point_name || !IsAccessPointSupported(access_points[i], user_key))
+          continue;
+        result = key.DeleteValue(ASCIIToWide(point_name).c_str());
+        cleared &= result == ERROR_SUCCESS || result == ERROR_FILE_NOT_FOUND;
+      }
+      break;
+
+    case PRODUCT_SUBKEY: {
+      const RegistryTreeFunctions& tree = g_tree_functions.Get();
+      result = tree.reg_delete_tree ?
+          tree.reg_delete_tree(key.Handle(), product_name) :
+          key.DeleteKey(product_name);
+      cleared = result == ERROR_SUCCESS || result == ERROR_FILE_NOT_FOUND;
+      break;
     }
 
-    ReturnedEvent current_event = {point, event};
-    event_array->push_back(current_event);
-  } while (event_end_index >= 0);
-}
-
-// Event storage functions.
-bool RecordStatefulEvent(rlz_lib::Product product, rlz_lib::AccessPoint point,
-                         rlz_lib::Event event, const wchar_t* sid) {
-  rlz_lib::LibMutex lock;
-  if (lock.failed())
-    return false;
-
-  rlz_lib::UserKey user_key(sid);
-  if (!user_key.HasAccess(true))
-    return false;
+    case PRODUCT_VALUE:
+      result = key.DeleteValue(product_name);
+      cleared = result == ERROR_SUCCESS || result == ERROR_FILE_NOT_FOUND;
+      break;
+  }
 
-  // Write the new event to registry.
-  const char* point_name = GetAccessPointName(point);
-  const char* event_name = GetEventName(event);
-  if (!point_name || !event_name)
-    return false;
+  if (cleared && IsKeyEmpty(key.Handle())) {
+    key.Close();
+    RegDeleteKeyW(user_key, location.c_str());
+  }
+  return cleared;
+}
 
-  if (!point_name[0] || !event_name[0])
+// Reads the events bitmap of |product| from the |bits_type| key. A missing
+// key or value is an empty bitmap.
+bool ReadEventBitmap(HKEY user_key, const wchar_t* bits_type,
+                     rlz_lib::Product product, rlz_lib::EventBitmap* bitmap) {
+  const wchar_t* product_name = rlz_lib::GetProductName(product);
+  if (!product_name)
     return false;
 
-  std::wstring point_name_wide(ASCIIToWide(point_name));
-  std::wstring event_name_wide(ASCIIToWide(event_name));
-  std::wstring new_event_value;
-  base::StringAppendF(&new_event_value, L"%ls%ls", point_name_wide.c_str(),
-                      event_name_wide.c_str());
-  DWORD data = 1;
-
   base::win::RegKey key;
-  if (!GetEventsRegKey(user_key.Get(), rlz_lib::kStatefulEventsSubkeyName,
-                       &product, KEY_WRITE, &key) ||
-      key.WriteValue(new_event_value.c_str(), data) != ERROR_SUCCESS) {
-    ASSERT_STRING(
-        "RecordStatefulEvent: Could not write the new stateful event");
-    return false;
-  }
+  if (!rlz_lib::GetEventBitsRegKey(user_key, bits_type, KEY_READ, &key))
+    return true;
 
-  return true;
+  return bitmap->Read(key.Handle(), product_name);
 }
 
 LONG GetProductEventsAsCgiHelper(rlz_lib::Product product, char* cgi,
@@ -254,6 +253,20 @@ LONG GetProductEventsAsCgiHelper(rlz_lib::Product product, char* cgi,
   base::win::RegKey events;
   GetEventsRegKey(user_key, rlz_lib::kEventsSubkeyName, &product, KEY_READ,
                   &events);
+
+  // Events in the compact layout are merged with any recorded by older
+  // clients, and listed from the bitmap.
+  rlz_lib::EventBitmap bitmap;
+  if (ReadEventBitmap(user_key, rlz_lib::kEventBitsSubkeyName, product,
+                      &bitmap) && !bitmap.empty()) {
+    if (events.Valid())
+      bitmap.AddLegacyEvents(events.Handle());
+
+    bitmap.AppendCgi(&cgi_arg);
+    base::strlcpy(cgi, cgi_arg.c_str(), cgi_size);
+    return cgi_arg.size() < cgi_size ? ERROR_SUCCESS : ERROR_MORE_DATA;
+  }
+
   if (!events.Valid())
     return ERROR_PATH_NOT_FOUND;
 
@@ -291,7 +304,7 @@ LONG GetProductEventsAsCgiHelper(rlz_lib::Product product, char* cgi,
 }
 
 bool ClearAllProductEventValues(rlz_lib::Product product, const wchar_t* key,
-                                const wchar_t* sid) {
+                                const wchar_t* bits_key, const wchar_t* sid) {
   rlz_lib::LibMutex lock;
   if (lock.failed())
     return false;
@@ -304,22 +317,254 @@ bool ClearAllProductEventValues(rlz_lib::Product product, const wchar_t* key,
   if (!product_name)
     return false;
 
+  rlz_lib::StateCache::InvalidateUser(sid);
   base::win::RegKey reg_key;
   rlz_lib::GetEventsRegKey(user_key.Get(), key, NULL, KEY_WRITE, &reg_key);
-  reg_key.DeleteKey(product_name);
-
-  // Verify that the value no longer exists.
-  base::win::RegKey product_events(reg_key.Handle(), product_name, KEY_READ);
-  if (product_events.Valid()) {
+  LONG result = reg_key.DeleteKey(product_name);
+  if (result != ERROR_SUCCESS && result != ERROR_FILE_NOT_FOUND) {
     ASSERT_STRING("ClearAllProductEvents: Key deletion failed");
     return false;
   }
 
+  base::win::RegKey bits_reg_key;
+  if (rlz_lib::GetEventBitsRegKey(user_key.Get(), bits_key, KEY_WRITE,
+                                  &bits_reg_key)) {
+    result = bits_reg_key.DeleteValue(product_name);
+    if (result != ERROR_SUCCESS && result != ERROR_FILE_NOT_FOUND) {
+      ASSERT_STRING("ClearAllProductEvents: Bitmap deletion failed");
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Sets the event bit in the events bitmap of |product|. The events recorded
+// by older clients with one value per event are left to them until cleared,
+// since they do not read the bitmap; reads merge both layouts.
+// The caller must hold the lib mutex and have write access to |user_key|.
+bool RecordEventBit(HKEY user_key, rlz_lib::Product product,
+                    rlz_lib::AccessPoint point, rlz_lib::Event event) {
+  const wchar_t* product_name = rlz_lib::GetProductName(product);
+  if (!product_name)
+    return false;
+
+  base::win::RegKey bits_key;
+  rlz_lib::EventBitmap bitmap;
+  if (!rlz_lib::GetEventBitsRegKey(user_key, rlz_lib::kEventBitsSubkeyName,
+                                   KEY_READ | KEY_WRITE, &bits_key) ||
+      !bitmap.Read(bits_key.Handle(), product_name)) {
+    ASSERT_STRING("RecordProductEvent: Could not open the events bitmap");
+    return false;
+  }
+
+  bitmap.Set(point, event);
+  if (!bitmap.Write(bits_key.Handle(), product_name)) {
+    ASSERT_STRING("RecordProductEvent: Could not write the events bitmap");
+    return false;
+  }
   return true;
 }
 
+// The counterparts of the functions below for the file store, which is read
+// without the lib mutex, and fast enough not to need the state cache.
+bool GetProductEventsFromStore(rlz_lib::Product product, const wchar_t* sid,
+                               rlz_lib::EventBitmap* events) {
+  rlz_lib::ScopedValueStore store(sid, false);
+  return store.get() && store.get()->ReadProductEvents(product, events);
+}
+
+void ReadAccessPointRlzsFromStore(const rlz_lib::AccessPoint* access_points,
+                                  int count, char* rlzs, size_t rlz_size,
+                                  const wchar_t* sid, bool* valid) {
+  rlz_lib::ScopedValueStore store(sid, false);
+  for (int i = 0; i < count; ++i) {
+    char* rlz = rlzs + i * rlz_size;
+    rlz[0] = 0;
+    valid[i] = false;
+
+    std::string value;
+    if (!store.get() || !IsAccessPointSupported(access_points[i], NULL) ||
+        !store.get()->ReadAccessPointRlz(access_points[i], &value))
+      continue;
+
+    valid[i] = rlz_lib::CopyCachedValue(value, rlz, rlz_size);
+    if (!valid[i])
+      ASSERT_STRING("GetAccessPointRlzs: Insufficient buffer size");
+  }
+}
+
+// Reads the RLZs of the first |count| access points into consecutive slots of
+// |rlz_size| chars of |rlzs|. RLZs which are not in the state cache are read
+// with a single pass over the values of the RLZs key. |valid| receives, for
+// each access point, whether GetAccessPointRlz() would have succeeded.
+// The caller must hold the lib mutex and have read access to |user_key|.
+void ReadAccessPointRlzs(const rlz_lib::AccessPoint* access_points, int count,
+                         char* rlzs, size_t rlz_size, HKEY user_key,
+                         const wchar_t* sid, bool* valid) {
+  if (rlz_lib::RlzValueStore::IsFileStoreEnabled()) {
+    ReadAccessPointRlzsFromStore(access_points, count, rlzs, rlz_size, sid,
+                                 valid);
+    return;
+  }
+
+  std::vector<int> generations(count, -1);
+  std::vector<bool> pending(count, false);
+  bool needs_registry = false;
+
+  for (int i = 0; i < count; ++i) {
+    char* rlz = rlzs + i * rlz_size;
+    rlz[0] = 0;
+    valid[i] = false;
+
+    rlz_lib::AccessPoint point = access_points[i];
+    if (!IsAccessPointSupported(point, user_key) ||
+        !rlz_lib::GetAccessPointName(point))
+      continue;
+
+    std::string cached_rlz;
+    if (rlz_lib::StateCache::LookupRlz(sid, point, &cached_rlz,
+                                       &generations[i])) {
+      valid[i] = rlz_lib::CopyCachedValue(cached_rlz, rlz, rlz_size);
+      if (!valid[i])
+        ASSERT_STRING("GetAccessPointRlzs: Insufficient buffer size");
+      continue;
+    }
+
+    pending[i] = true;
+    needs_registry = true;
+  }
+
+  if (!needs_registry)
+    return;
+
+  // Missing values are left as the empty string, as in GetAccessPointRlz().
+  std::string values[rlz_lib::LAST_ACCESS_POINT];
+
+  base::win::RegKey key;
+  DWORD max_name_length = 0;
+  DWORD max_value_size = 0;
+  if (rlz_lib::GetAccessPointRlzsRegKey(user_key, KEY_READ, &key) &&
+      ::RegQueryInfoKeyW(key.Handle(), NULL, NULL, NULL, NULL, NULL, NULL,
+                         NULL, &max_name_length, &max_value_size, NULL,
+                         NULL) == ERROR_SUCCESS) {
+    std::vector<wchar_t> name(max_name_length + 1);
+    std::vector<BYTE> data(max_value_size + sizeof(wchar_t));
+
+    for (DWORD index = 0; ; ++index) {
+      DWORD name_length = name.size();
+      DWORD data_size = data.size() - sizeof(wchar_t);
+      DWORD type = REG_NONE;
+      LONG result = ::RegEnumValueW(key.Handle(), index, &name[0],
+                                    &name_length, NULL, &type, &data[0],
+                                    &data_size);
+      if (result == ERROR_NO_MORE_ITEMS)
+        break;
+
+      if (result != ERROR_SUCCESS || (type != REG_SZ && type != REG_EXPAND_SZ))
+        continue;
+
+      rlz_lib::AccessPoint point = rlz_lib::NO_ACCESS_POINT;
+      std::string point_name(WideToASCII(std::wstring(&name[0], name_length)));
+      if (!GetAccessPointFromName(point_name.c_str(), &point) ||
+          point == rlz_lib::NO_ACCESS_POINT)
+        continue;
+
+      // The data is not necessarily NULL terminated.
+      const wchar_t* text = reinterpret_cast<const wchar_t*>(&data[0]);
+      size_t max_length = data_size / sizeof(wchar_t);
+      size_t length = 0;
+      while (length < max_length && text[length])
+        ++length;
+
+      values[point] = WideToUTF8(std::wstring(text, length));
+    }
+  }
+
+  for (int i = 0; i < count; ++i) {
+    if (!pending[i])
+      continue;
+
+    rlz_lib::AccessPoint point = access_points[i];
+    valid[i] = rlz_lib::CopyCachedValue(values[point], rlzs + i * rlz_size,
+                                        rlz_size);
+    if (!valid[i])
+      ASSERT_STRING("GetAccessPointRlzs: Insufficient buffer size");
+
+    rlz_lib::StateCache::StoreRlz(sid, generations[i], point, values[point]);
+    rlz_lib::SharedStateMirror::StoreRlz(sid, point, values[point]);
+  }
+}
+
+int CountAccessPoints(const rlz_lib::AccessPoint* access_points) {
+  int count = 0;
+  while (access_points[count] != rlz_lib::NO_ACCESS_POINT)
+    ++count;
+  return count;
+}
+
+// Appends the protocol version, the RLZs of the first |count| access points
+// and the DCC to |cgi|. The caller must hold the lib mutex and have read
+// access to |user_key|.
+void BuildPingParams(const rlz_lib::AccessPoint* access_points, int count,
+                     HKEY user_key, const wchar_t* sid,
+                     rlz_lib::CgiBuilder* cgi) {
+  // Add the RLZ Exchange Protocol version, and the &rlz= over.
+  cgi->Append(rlz_lib::kProtocolCgiArgument);
+  cgi->Append('&');
+  cgi->Append(rlz_lib::kRlzCgiVariable);
+  cgi->Append('=');
+
+  // Read all the RLZ's at once, on the stack unless the same access points
+  // are listed several times.
+  const size_t kRlzSize = rlz_lib::kMaxRlzLength + 1;
+  char stack_rlzs[rlz_lib::LAST_ACCESS_POINT * kRlzSize];
+  bool stack_valid[rlz_lib::LAST_ACCESS_POINT];
+  scoped_array<char> heap_rlzs;
+  scoped_array<bool> heap_valid;
+  char* rlzs = stack_rlzs;
+  bool* valid = stack_valid;
+  if (count > rlz_lib::LAST_ACCESS_POINT) {
+    heap_rlzs.reset(new char[count * kRlzSize]);
+    heap_valid.reset(new bool[count]);
+    rlzs = heap_rlzs.get();
+    valid = heap_valid.get();
+  }
+  ReadAccessPointRlzs(access_points, count, rlzs, kRlzSize, user_key, sid,
+                      valid);
+
+  // Now add each of the RLZ's.
+  bool first_rlz = true;  // comma before every RLZ but the first.
+  for (int i = 0; i < count; i++) {
+    if (valid[i]) {
+      const char* access_point = rlz_lib::GetAccessPointName(access_points[i]);
+      if (!access_point)
+        continue;
+
+      if (!first_rlz)
+        cgi->Append(rlz_lib::kRlzCgiSeparator);
+      cgi->Append(access_point);
+      cgi->Append(rlz_lib::kRlzCgiIndicator);
+      cgi->Append(rlzs + i * kRlzSize);
+      first_rlz = false;
+    }
+  }
+
+  // Report the DCC too if not empty.
+  char dcc[rlz_lib::kMaxDccLength + 1];
+  dcc[0] = 0;
+  if (rlz_lib::GetMachineDealCode(dcc, arraysize(dcc)) && dcc[0])
+    cgi->AppendParam(rlz_lib::kDccCgiVariable, dcc);
+}
+
 void CopyRegistryTree(const base::win::RegKey& src, base::win::RegKey* dest) {
-  // First copy values.
+  // RegCopyTreeW copies the whole tree in one call.
+  const RegistryTreeFunctions& tree = g_tree_functions.Get();
+  if (tree.reg_copy_tree &&
+      tree.reg_copy_tree(src.Handle(), NULL, dest->Handle()) == ERROR_SUCCESS)
+    return;
+
+  // Otherwise, first copy values.
   for (base::win::RegistryValueIterator i(src.Handle(), L"");
        i.Valid(); ++i) {
     dest->WriteValue(i.Name(), reinterpret_cast<const void*>(i.Value()),
@@ -335,6 +580,61 @@ void CopyRegistryTree(const base::win::RegKey& src, base::win::RegKey* dest) {
   }
 }
 
+// The SIDs of a multi-user call: |sids| if not NULL, or the users whose hive
+// is loaded.
+bool GetUserSids(const wchar_t* const* sids, size_t sid_count,
+                 std::vector<std::wstring>* user_sids) {
+  if (!sids)
+    return rlz_lib::UserSweep::GetLoadedUserSids(user_sids);
+
+  user_sids->clear();
+  for (size_t i = 0; i < sid_count; ++i) {
+    if (!sids[i] || !sids[i][0]) {
+      ASSERT_STRING("GetUserSids: Empty SID");
+      return false;
+    }
+    user_sids->push_back(sids[i]);
+  }
+  return true;
+}
+
+struct UserPings {
+  const rlz_lib::FinancialPingParams* pings;
+  size_t count;
+};
+
+bool SendUserPings(const wchar_t* sid, void* context) {
+  const UserPings* user_pings = static_cast<const UserPings*>(context);
+  return rlz_lib::SendFinancialPings(user_pings->pings, user_pings->count,
+                                     sid, NULL);
+}
+
+// Gets the request of the ping of |product| to send now: the queued retry
+// of a failed ping once its backoff has elapsed, which is sent as it was
+// formed, or else a new request if it is time to ping. A queued retry that
+// is not due holds back the ping even if |skip_time_check| is true, so that
+// clients coming back online do not all ping at once. Returns false if no
+// ping should be sent now.
+bool GetDueRequest(rlz_lib::Product product,
+                   const rlz_lib::AccessPoint* access_points,
+                   const char* product_signature, const char* product_brand,
+                   const char* product_id, const char* product_lang,
+                   bool exclude_machine_id, const wchar_t* sid,
+                   bool skip_time_check, std::string* request) {
+  bool due = false;
+  if (rlz_lib::PingRetryQueue::Get(product, sid, request, &due))
+    return due;
+
+  // Check if the time is right to ping, before the request is formed.
+  if (!rlz_lib::FinancialPing::IsPingTime(product, sid, skip_time_check))
+    return false;
+
+  return rlz_lib::FinancialPing::FormRequest(product, access_points,
+                                             product_signature, product_brand,
+                                             product_id, product_lang,
+                                             exclude_machine_id, sid, request);
+}
+
 }  // namespace anonymous
 
 
@@ -342,6 +642,19 @@ namespace rlz_lib {
 
 bool RecordProductEvent(Product product, AccessPoint point, Event event,
                         const wchar_t* sid) {
+  // In write-behind mode, the valid events of the current user are only queued
+  // here, where they can be written.
+  if (!sid && EventQueue::Push(product, point, event))
+    return true;
+
+  if (RlzValueStore::IsFileStoreEnabled()) {
+    RlzWriteBatch batch;
+    if (!batch.RecordProductEvent(product, point, event))
+      return false;
+
+    return batch.Commit(sid, false);
+  }
+
   LibMutex lock;
   if (lock.failed())
     return false;
@@ -374,12 +687,20 @@ bool RecordProductEvent(Product product, AccessPoint point, Event event,
   base::win::RegKey key;
   rlz_lib::GetEventsRegKey(user_key.Get(), kStatefulEventsSubkeyName, &product,
                            KEY_READ, &key);
-  if (key.ReadValueDW(new_event_value.c_str(), &value) == ERROR_SUCCESS) {
+  EventBitmap stateful_bitmap;
+  if (key.ReadValueDW(new_event_value.c_str(), &value) == ERROR_SUCCESS ||
+      (ReadEventBitmap(user_key.Get(), kStatefulEventBitsSubkeyName, product,
+                       &stateful_bitmap) &&
+       stateful_bitmap.Has(point, event))) {
     // For a stateful event we skip recording, this function is also
     // considered successful.
     return true;
   }
 
+  StateCache::InvalidateUser(sid);
+  if (EventBitmap::IsEnabled())
+    return RecordEventBit(user_key.Get(), product, point, event);
+
   // Write the new event to registry.
   value = 1;
   base::win::RegKey reg_key;
@@ -393,42 +714,74 @@ bool RecordProductEvent(Product product, AccessPoint point, Event event,
   return true;
 }
 
+bool RecordProductEvents(Product product, const AccessPoint* points,
+                         const Event* events, size_t count, bool* results,
+                         const wchar_t* sid) {
+  if (count && (!points || !events)) {
+    ASSERT_STRING("RecordProductEvents: Invalid buffer");
+    return false;
+  }
+
+  bool result = true;
+  RlzWriteBatch batch;
+  std::vector<size_t> batched;
+  for (size_t i = 0; i < count; ++i) {
+    // In write-behind mode, the valid events of the current user are only
+    // queued here, where they can be written.
+    bool queued = !sid && EventQueue::Push(product, points[i], events[i]);
+    bool valid = queued ||
+        batch.RecordProductEvent(product, points[i], events[i]);
+    if (valid && !queued)
+      batched.push_back(i);
+    if (results)
+      results[i] = valid;
+    result &= valid;
+  }
+
+  if (!batched.empty() && !batch.Commit(sid, false)) {
+    result = false;
+    for (size_t i = 0; results && i < batched.size(); ++i)
+      results[batched[i]] = false;
+  }
+  return result;
+}
+
 bool ClearProductEvent(Product product, AccessPoint point, Event event,
                        const wchar_t* sid) {
-  LibMutex lock;
-  if (lock.failed())
-    return false;
+  EventQueue::Flush();
 
-  UserKey user_key(sid);
-  if (!user_key.HasAccess(true))
+  RlzWriteBatch batch;
+  if (!batch.ClearProductEvent(product, point, event))
     return false;
 
-  // Get the event's registry value and delete it.
-  const char* point_name = GetAccessPointName(point);
-  const char* event_name = GetEventName(event);
-  if (!point_name || !event_name)
-    return false;
+  return batch.Commit(sid, false);
+}
 
-  if (!point_name[0] || !event_name[0])
+bool ClearProductEvents(Product product, const AccessPoint* points,
+                        const Event* events, size_t count, bool* results,
+                        const wchar_t* sid) {
+  if (count && (!points || !events)) {
+    ASSERT_STRING("ClearProductEvents: Invalid buffer");
     return false;
+  }
 
-  std::wstring point_name_wide(ASCIIToWide(point_name));
-  std::wstring event_name_wide(ASCIIToWide(event_name));
-  std::wstring event_value;
-  base::StringAppendF(&event_value, L"%ls%ls", point_name_wide.c_str(),
-                      event_name_wide.c_str());
-  base::win::RegKey key;
-  GetEventsRegKey(user_key.Get(), kEventsSubkeyName, &product, KEY_WRITE, &key);
-  key.DeleteValue(event_value.c_str());
+  EventQueue::Flush();
 
-  // Verify deletion.
-  DWORD value;
-  if (key.ReadValueDW(event_value.c_str(), &value) == ERROR_SUCCESS) {
-    ASSERT_STRING("ClearProductEvent: Could not delete the event value.");
-    return false;
+  bool result = true;
+  RlzWriteBatch batch;
+  for (size_t i = 0; i < count; ++i) {
+    bool valid = batch.ClearProductEvent(product, points[i], events[i]);
+    if (results)
+      results[i] = valid;
+    result &= valid;
   }
 
-  return true;
+  if (!batch.empty() && !batch.Commit(sid, false)) {
+    result = false;
+    for (size_t i = 0; results && i < count; ++i)
+      results[i] = false;
+  }
+  return result;
 }
 
 bool GetProductEventsAsCgi(Product product, char* cgi, size_t cgi_size,
@@ -439,6 +792,87 @@ bool GetProductEventsAsCgi(Product product, char* cgi, size_t cgi_size,
   }
 
   cgi[0] = 0;
+  EventQueue::Flush();
+
+  bool has_events = false;
+  std::string events_cgi;
+  int generation;
+  if (RlzValueStore::IsFileStoreEnabled()) {
+    EventBitmap events;
+    if (!GetProductEventsFromStore(product, sid, &events))
+      return false;
+
+    has_events = !events.empty();
+    base::StringAppendF(&events_cgi, "%s=", kEventsCgiVariable);
+    events.AppendCgi(&events_cgi);
+  } else if (!StateCache::LookupEventsCgi(sid, product, &has_events,
+                                          &events_cgi, &generation)) {
+    LibMutex lock;
+    if (lock.failed())
+      return false;
+
+    UserKey user_key(sid);
+    if (!user_key.HasAccess(false))
+      return false;
+
+    // Always read into a buffer of the maximum size, so that the result does
+    // not depend on |cgi_size| and can be cached.
+    char events_buffer[kMaxCgiLength + 1];
+    LONG result = GetProductEventsAsCgiHelper(product, events_buffer,
+                                              arraysize(events_buffer),
+                                              user_key.Get());
+    if (result == ERROR_MORE_DATA) {
+      // More events than fit in kMaxCgiLength: the truncated list is only
+      // returned to callers with a buffer of the maximum size, and is not
+      // cached.
+      if (cgi_size < kMaxCgiLength + 1) {
+        ASSERT_STRING("GetProductEventsAsCgi: Insufficient buffer size");
+        return false;
+      }
+
+      base::strlcpy(cgi, events_buffer, cgi_size);
+      return true;
+    }
+
+    if (result == ERROR_SUCCESS) {
+      has_events = true;
+      events_cgi = events_buffer;
+    } else if (result != ERROR_FILE_NOT_FOUND &&
+               result != ERROR_PATH_NOT_FOUND) {
+      return false;
+    }
+
+    StateCache::StoreEventsCgi(sid, generation, product, has_events,
+                               events_cgi);
+  }
+
+  if (!has_events)
+    return false;
+
+  if (events_cgi.size() >= cgi_size) {
+    ASSERT_STRING("GetProductEventsAsCgi: Insufficient buffer size");
+    return false;
+  }
+
+  base::strlcpy(cgi, events_cgi.c_str(), cgi_size);
+  return true;
+}
+
+bool HasPendingEvents(Product product, const wchar_t* sid) {
+  EventQueue::Flush();
+
+  if (RlzValueStore::IsFileStoreEnabled()) {
+    EventBitmap events;
+    return GetProductEventsFromStore(product, sid, &events) &&
+        !events.empty();
+  }
+
+  bool has_events = false;
+  std::string events_cgi;
+  int generation;
+  if (StateCache::LookupEventsCgi(sid, product, &has_events, &events_cgi,
+                                  &generation))
+    return has_events;
 
   LibMutex lock;
   if (lock.failed())
@@ -448,29 +882,43 @@ bool GetProductEventsAsCgi(Product product, char* cgi, size_t cgi_size,
   if (!user_key.HasAccess(false))
     return false;
 
-  DWORD size_local =
-      cgi_size <= kMaxCgiLength + 1 ? cgi_size : kMaxCgiLength + 1;
-  UINT length = 0;
-  LONG result = GetProductEventsAsCgiHelper(product, cgi, size_local,
-                                            user_key.Get());
-  if (result == ERROR_MORE_DATA && cgi_size >= (kMaxCgiLength + 1))
-    result = ERROR_SUCCESS;
+  EventBitmap bitmap;
+  if (ReadEventBitmap(user_key.Get(), kEventBitsSubkeyName, product,
+                      &bitmap) && !bitmap.empty())
+    return true;
 
-  if (result != ERROR_SUCCESS) {
-    if (result == ERROR_MORE_DATA)
-      ASSERT_STRING("GetProductEventsAsCgi: Insufficient buffer size");
-    cgi[0] = 0;
+  // Every value of the legacy events key is an event.
+  base::win::RegKey events;
+  if (!GetEventsRegKey(user_key.Get(), kEventsSubkeyName, &product, KEY_READ,
+                       &events))
     return false;
-  }
 
-  return true;
+  DWORD num_values = 0;
+  if (::RegQueryInfoKeyW(events.Handle(), NULL, NULL, NULL, NULL, NULL, NULL,
+                         &num_values, NULL, NULL, NULL, NULL) !=
+      ERROR_SUCCESS)
+    return false;
+
+  return num_values > 0;
 }
 
 bool ClearAllProductEvents(Product product, const wchar_t* sid) {
+  EventQueue::Flush();
+
+  if (RlzValueStore::IsFileStoreEnabled()) {
+    ScopedValueStore scoped_store(sid, true);
+    RlzValueStore* store = scoped_store.get();
+    EventBitmap no_events;
+    return store && store->WriteProductEvents(product, no_events) &&
+        store->WriteStatefulEvents(product, no_events) && store->Commit();
+  }
+
   bool result;
 
-  result = ClearAllProductEventValues(product, kEventsSubkeyName, sid);
-  result &= ClearAllProductEventValues(product, kStatefulEventsSubkeyName, sid);
+  result = ClearAllProductEventValues(product, kEventsSubkeyName,
+                                      kEventBitsSubkeyName, sid);
+  result &= ClearAllProductEventValues(product, kStatefulEventsSubkeyName,
+                                       kStatefulEventBitsSubkeyName, sid);
   return result;
 }
 
@@ -518,8 +966,86 @@ bool GetAccessPointRlz(AccessPoint point, char* rlz, size_t rlz_size,
 
 bool GetAccessPointRlz(AccessPoint point, char* rlz, size_t rlz_size,
                        const wchar_t* sid) {
+  if (!rlz || rlz_size <= 0) {
+    ASSERT_STRING("GetAccessPointRlz: Invalid buffer");
+    return false;
+  }
+
+  if (RlzValueStore::IsFileStoreEnabled()) {
+    bool valid = false;
+    ReadAccessPointRlzsFromStore(&point, 1, rlz, rlz_size, sid, &valid);
+    return valid;
+  }
+
+  std::string cached_rlz;
+  int generation;
+  if (StateCache::LookupRlz(sid, point, &cached_rlz, &generation) ||
+      SharedStateMirror::LookupRlz(sid, point, &cached_rlz)) {
+    if (!CopyCachedValue(cached_rlz, rlz, rlz_size)) {
+      ASSERT_STRING("GetAccessPointRlz: Insufficient buffer size");
+      return false;
+    }
+    return true;
+  }
+
+  // Held from the read until the value is mirrored, so that no writer can
+  // change it in between.
+  LibMutex lock;
+  if (lock.failed())
+    return false;
+
   UserKey user_key(sid);
-  return GetAccessPointRlz(point, rlz, rlz_size, user_key.Get());
+  if (!GetAccessPointRlz(point, rlz, rlz_size, user_key.Get()))
+    return false;
+
+  // A value that fills the whole buffer may have been truncated, so only
+  // cache values known to be complete.
+  if (strlen(rlz) + 1 < rlz_size) {
+    StateCache::StoreRlz(sid, generation, point, rlz);
+    SharedStateMirror::StoreRlz(sid, point, rlz);
+  }
+
+  return true;
+}
+
+bool GetAccessPointRlzs(const AccessPoint* access_points, char* rlzs,
+                        size_t rlz_size, const wchar_t* sid) {
+  if (!access_points) {
+    ASSERT_STRING("GetAccessPointRlzs: access_points is NULL");
+    return false;
+  }
+
+  if (!rlzs || rlz_size <= 0) {
+    ASSERT_STRING("GetAccessPointRlzs: Invalid buffer");
+    return false;
+  }
+
+  int count = CountAccessPoints(access_points);
+  for (int i = 0; i < count; ++i)
+    rlzs[i * rlz_size] = 0;
+
+  scoped_array<bool> valid(new bool[count]);
+  if (RlzValueStore::IsFileStoreEnabled()) {
+    ReadAccessPointRlzsFromStore(access_points, count, rlzs, rlz_size, sid,
+                                 valid.get());
+  } else {
+    LibMutex lock;
+    if (lock.failed())
+      return false;
+
+    UserKey user_key(sid);
+    if (!user_key.HasAccess(false))
+      return false;
+
+    ReadAccessPointRlzs(access_points, count, rlzs, rlz_size, user_key.Get(),
+                        sid, valid.get());
+  }
+
+  bool result = true;
+  for (int i = 0; i < count; ++i)
+    result &= valid[i];
+
+  return result;
 }
 
 bool SetAccessPointRlz(AccessPoint point, const char* new_rlz,
@@ -551,39 +1077,12 @@ bool SetAccessPointRlz(AccessPoint point, const char* new_rlz,
     return false;
   }
 
-  char normalized_rlz[kMaxRlzLength + 1];
-  NormalizeRlz(new_rlz, normalized_rlz);
-  VERIFY(strlen(new_rlz) == rlz_length);
-
   // Write the RLZ for this access point.
-  const char* access_point_name = GetAccessPointName(point);
-  if (!access_point_name)
+  RlzWriteBatch batch;
+  if (!batch.SetAccessPointRlz(point, new_rlz))
     return false;
 
-  std::wstring access_point_name_wide(ASCIIToWide(access_point_name));
-  base::win::RegKey key;
-  GetAccessPointRlzsRegKey(user_key.Get(), KEY_WRITE, &key);
-
-  if (normalized_rlz[0] == 0) {
-    // Setting RLZ to empty == clearing. Delete the registry value.
-    key.DeleteValue(access_point_name_wide.c_str());
-
-    // Verify deletion.
-    DWORD value;
-    if (key.ReadValueDW(access_point_name_wide.c_str(), &value) ==
-        ERROR_SUCCESS) {
-      ASSERT_STRING("SetAccessPointRlz: Could not clear the RLZ value.");
-      return false;
-    }
-  } else {
-    if (!RegKeyWriteValue(key, access_point_name_wide.c_str(),
-                          normalized_rlz)) {
-      ASSERT_STRING("SetAccessPointRlz: Could not write the new RLZ value");
-      return false;
-    }
-  }
-
-  return true;
+  return batch.Commit(sid, false);
 }
 
 
@@ -648,6 +1147,9 @@ bool HasAccess(PSID sid, ACCESS_MASK access_mask, ACL* dacl) {
 }
 
 bool CreateMachineState() {
+  if (base::subtle::NoBarrier_Load(&g_machine_state_created))
+    return true;
+
   LibMutex lock;
   if (lock.failed())
     return false;
@@ -660,25 +1162,47 @@ bool CreateMachineState() {
     return false;
   }
 
-  // Create a SID that represents ALL USERS.
+  // Create SIDs that represent ALL USERS, and Everyone, which is granted
+  // access below.
   DWORD users_sid_size = SECURITY_MAX_SID_SIZE;
   typed_buffer_ptr<SID> users_sid(users_sid_size);
   CreateWellKnownSid(WinBuiltinUsersSid, NULL, users_sid, &users_sid_size);
+  DWORD world_sid_size = SECURITY_MAX_SID_SIZE;
+  typed_buffer_ptr<SID> world_sid(world_sid_size);
+  CreateWellKnownSid(WinWorldSid, NULL, world_sid, &world_sid_size);
 
-  // Get the security descriptor for the registry key.
-  DWORD original_sd_size = 0;
-  ::RegGetKeySecurity(hklm_key.Handle(), DACL_SECURITY_INFORMATION, NULL,
-      &original_sd_size);
+  // Get the security descriptor for the registry key. It usually fits in
+  // the initial buffer, so that it is read once.
+  DWORD original_sd_size = kInitialSecurityDescriptorSize;
   typed_buffer_ptr<SECURITY_DESCRIPTOR> original_sd(original_sd_size);
-
   LONG result = ::RegGetKeySecurity(hklm_key.Handle(),
       DACL_SECURITY_INFORMATION, original_sd, &original_sd_size);
+  if (result == ERROR_INSUFFICIENT_BUFFER) {
+    original_sd.reset(original_sd_size);
+    result = ::RegGetKeySecurity(hklm_key.Handle(),
+        DACL_SECURITY_INFORMATION, original_sd, &original_sd_size);
+  }
   if (result != ERROR_SUCCESS) {
     ASSERT_STRING("rlz_lib::CreateMachineState: "
                   "Unable to create / open machine key.");
     return false;
   }
 
+  // If all users already have read/write access to the registry key, e.g.
+  // from an earlier call, then nothing to do. The DACL of the self-relative
+  // descriptor is checked in place.
+  BOOL dacl_present = FALSE;
+  BOOL dacl_defaulted = FALSE;
+  ACL* original_dacl = NULL;
+  if (::GetSecurityDescriptorDacl(original_sd, &dacl_present, &original_dacl,
+                                  &dacl_defaulted) &&
+      dacl_present && (!original_dacl ||
+                       HasAccess(users_sid, KEY_ALL_ACCESS, original_dacl) ||
+                       HasAccess(world_sid, KEY_ALL_ACCESS, original_dacl))) {
+    base::subtle::NoBarrier_Store(&g_machine_state_created, 1);
+    return true;
+  }
+
   // Make a copy of the security descriptor so we can modify it.  The one
   // returned by RegGetKeySecurity() is self-relative, so we need to make it
   // absolute.
@@ -705,13 +1229,7 @@ bool CreateMachineState() {
     return false;
   }
 
-  // If all users already have read/write access to the registry key, then
-  // nothing to do.  Otherwise change the security descriptor of the key to
-  // give everyone access.
-  if (HasAccess(users_sid, KEY_ALL_ACCESS, dacl)) {
-    return false;
-  }
-
+  // Change the security descriptor of the key to give everyone access.
   // Add ALL-USERS ALL-ACCESS ACL.
   EXPLICIT_ACCESS ea;
   ZeroMemory(&ea, sizeof(EXPLICIT_ACCESS));
@@ -748,6 +1266,8 @@ bool CreateMachineState() {
     ASSERT_STRING("rlz_lib::CreateMachineState: "
                   "Unable to create / open machine key.");
     success = false;
+  } else {
+    base::subtle::NoBarrier_Store(&g_machine_state_created, 1);
   }
 
 
@@ -770,6 +1290,15 @@ bool GetMachineDealCode(char* dcc, size_t dcc_size) {
 
 bool GetPingParams(Product product, const AccessPoint* access_points,
                    char* cgi, size_t cgi_size, const wchar_t* sid) {
+  return GetPingParams(product, access_points, cgi, cgi_size, sid, NULL);
+}
+
+bool GetPingParams(Product product, const AccessPoint* access_points,
+                   char* cgi, size_t cgi_size, const wchar_t* sid,
+                   size_t* required_size) {
+  if (required_size)
+    *required_size = 0;
+
   if (!cgi || cgi_size <= 0) {
     ASSERT_STRING("GetPingParams: Invalid buffer");
     return false;
@@ -790,39 +1319,31 @@ bool GetPingParams(Product product, const AccessPoint* access_points,
     return false;
   }
 
-  // Add the RLZ Exchange Protocol version.
-  std::string cgi_string(kProtocolCgiArgument);
-
-  // Copy the &rlz= over.
-  base::StringAppendF(&cgi_string, "&%s=", kRlzCgiVariable);
-
-  // Now add each of the RLZ's.
-  bool first_rlz = true;  // comma before every RLZ but the first.
-  for (int i = 0; access_points[i] != NO_ACCESS_POINT; i++) {
-    char rlz[kMaxRlzLength + 1];
-    if (GetAccessPointRlz(access_points[i], rlz, arraysize(rlz), sid)) {
-      const char* access_point = GetAccessPointName(access_points[i]);
-      if (!access_point)
-        continue;
-
-      base::StringAppendF(&cgi_string, "%s%s%s%s",
-                          first_rlz ? "" : kRlzCgiSeparator,
-                          access_point, kRlzCgiIndicator, rlz);
-      first_rlz = false;
+  // The params rarely change between pings, so they are built once for
+  // each state of the RLZs and the DCC. The stamp is read first so that
+  // params built from values written in between never match it again. The
+  // stamp only covers the registry, and the file store is read directly.
+  const int count = CountAccessPoints(access_points);
+  CgiBuilder builder(cgi, cgi_size);
+  PingParamsStamp stamp;
+  bool has_stamp = !RlzValueStore::IsFileStoreEnabled() &&
+      PingParamsCache::ReadStamp(user_key.Get(), &stamp);
+  if (!has_stamp ||
+      !PingParamsCache::Lookup(sid, access_points, count, stamp, &builder)) {
+    BuildPingParams(access_points, count, user_key.Get(), sid, &builder);
+    if (has_stamp && !builder.overflowed()) {
+      PingParamsCache::Store(sid, access_points, count, stamp,
+                             std::string(cgi, builder.length()));
     }
   }
 
-  // Report the DCC too if not empty.
-  char dcc[kMaxDccLength + 1];
-  dcc[0] = 0;
-  if (GetMachineDealCode(dcc, arraysize(dcc)) && dcc[0])
-    base::StringAppendF(&cgi_string, "&%s=%s", kDccCgiVariable, dcc);
+  if (required_size)
+    *required_size = builder.required_size();
 
-  if (cgi_string.size() >= cgi_size)
+  if (builder.overflowed()) {
+    cgi[0] = 0;
     return false;
-
-  strncpy(cgi, cgi_string.c_str(), cgi_size);
-  cgi[cgi_size - 1] = 0;
+  }
 
   return true;
 }
@@ -831,56 +1352,21 @@ bool IsPingResponseValid(const char* response, int* checksum_idx) {
   if (!response || !response[0])
     return false;
 
+  ParsedPingResponse parsed;
+  bool valid = ParsePingResponseText(response, &parsed);
   if (checksum_idx)
-    *checksum_idx = -1;
-
-  if (strlen(response) > kMaxPingResponseLength) {
-    ASSERT_STRING("IsPingResponseValid: response is too long to parse.");
-    return false;
-  }
-
-  // Find the checksum line.
-  std::string response_string(response);
-
-  std::string checksum_param("\ncrc32: ");
-  int calculated_crc;
-  int checksum_index = response_string.find(checksum_param);
-  if (checksum_index >= 0) {
-    // Calculate checksum of message preceeding checksum line.
-    // (+ 1 to include the \n)
-    std::string message(response_string.substr(0, checksum_index + 1));
-    if (!Crc32(message.c_str(), &calculated_crc))
-      return false;
-  } else {
-    checksum_param = "crc32: ";  // Empty response case.
-    if (!StartsWithASCII(response_string, checksum_param, true))
-      return false;
-
-    checksum_index = 0;
-    if (!Crc32("", &calculated_crc))
-      return false;
-  }
+    *checksum_idx = parsed.checksum_index;
 
-  // Find the checksum value on the response.
-  int checksum_end = response_string.find("\n", checksum_index + 1);
-  if (checksum_end < 0)
-    checksum_end = response_string.size();
-
-  int checksum_begin = checksum_index + checksum_param.size();
-  std::string checksum = response_string.substr(checksum_begin,
-      checksum_end - checksum_begin + 1);
-  TrimWhitespaceASCII(checksum, TRIM_ALL, &checksum);
-
-  if (checksum_idx)
-    *checksum_idx = checksum_index;
-
-  return calculated_crc == HexStringToInteger(checksum.c_str());
+  return valid;
 }
 
 // TODO: Use something like RSA to make sure the response is
 // from a Google server.
 bool ParsePingResponse(Product product, const char* response,
                        const wchar_t* sid) {
+  // The events reported by the ping may still be queued.
+  EventQueue::Flush();
+
   LibMutex lock;
   if (lock.failed())
     return false;
@@ -889,87 +1375,54 @@ bool ParsePingResponse(Product product, const char* response,
   if (!user_key.HasAccess(true))
     return false;
 
-  std::string response_string(response);
-  int response_length = -1;
-  if (!IsPingResponseValid(response, &response_length))
+  ParsedPingResponse parsed;
+  if (!ParsePingResponseText(response, &parsed))
     return false;
 
-  if (0 == response_length)
+  if (0 == parsed.checksum_index)
     return true;  // Empty response - no parsing.
 
-  std::string events_variable;
-  std::string stateful_events_variable;
-  base::SStringPrintf(&events_variable, "%s: ", kEventsCgiVariable);
-  base::SStringPrintf(&stateful_events_variable, "%s: ",
-                      kStatefulEventsCgiVariable);
-
-  int rlz_cgi_length = strlen(kRlzCgiVariable);
-
-  // Split response lines. Expected response format is lines of the form:
-  // rlzW1: 1R1_____en__252
-  int line_end_index = -1;
-  do {
-    int line_begin = line_end_index + 1;
-    line_end_index = response_string.find("\n", line_begin);
-
-    int line_end = line_end_index;
-    if (line_end < 0)
-      line_end = response_length;
+  RlzWriteBatch batch;
+  for (int i = NO_ACCESS_POINT + 1; i < LAST_ACCESS_POINT; ++i) {
+    AccessPoint point = static_cast<AccessPoint>(i);
 
-    if (line_end <= line_begin)
-      continue;  // Empty line.
-
-    std::string response_line;
-    response_line = response_string.substr(line_begin, line_end - line_begin);
-
-    if (StartsWithASCII(response_line, kRlzCgiVariable, true)) {  // An RLZ.
-      int separator_index = -1;
-      if ((separator_index = response_line.find(": ")) < 0)
-        continue;  // Not a valid key-value pair.
+    // Set the new RLZ.
+    if (parsed.has_rlz[point] &&
+        IsAccessPointSupported(point, user_key.Get())) {
+      char rlz[kMaxRlzLength + 1];
+      rlz[parsed.rlzs[point].copy(rlz, kMaxRlzLength)] = 0;
+      batch.SetAccessPointRlz(point, rlz);
+    }
 
-      // Get the access point.
-      std::string point_name =
-        response_line.substr(3, separator_index - rlz_cgi_length);
-      AccessPoint point = NO_ACCESS_POINT;
-      if (!GetAccessPointFromName(point_name.c_str(), &point) ||
-          point == NO_ACCESS_POINT)
-        continue;  // Not a valid access point.
-
-      // Get the new RLZ.
-      std::string rlz_value(response_line.substr(separator_index + 2));
-      TrimWhitespaceASCII(rlz_value, TRIM_LEADING, &rlz_value);
-
-      int rlz_length = rlz_value.find_first_of("\r\n ");
-      if (rlz_length < 0)
-        rlz_length = rlz_value.size();
-
-      if (rlz_length > kMaxRlzLength)
-        continue;  // Too long.
-
-      if (IsAccessPointSupported(point, user_key.Get()))
-        SetAccessPointRlz(point, rlz_value.substr(0, rlz_length).c_str(), sid);
-    } else if (StartsWithASCII(response_line, events_variable, true)) {
-      // Clear events which server parsed.
-      std::vector<ReturnedEvent> event_array;
-      GetEventsFromResponseString(response_line, events_variable, &event_array);
-      for (size_t i = 0; i < event_array.size(); ++i) {
-        ClearProductEvent(product, event_array[i].access_point,
-                          event_array[i].event_type, sid);
-      }
-    } else if (StartsWithASCII(response_line, stateful_events_variable, true)) {
-      // Record any stateful events the server send over.
-      std::vector<ReturnedEvent> event_array;
-      GetEventsFromResponseString(response_line, stateful_events_variable,
-                                  &event_array);
-      for (size_t i = 0; i < event_array.size(); ++i) {
-        RecordStatefulEvent(product, event_array[i].access_point,
-                            event_array[i].event_type, sid);
-      }
+    // Clear events which server parsed, and record any stateful events the
+    // server send over.
+    for (int j = INVALID_EVENT + 1; j < LAST_EVENT; ++j) {
+      Event event = static_cast<Event>(j);
+      if (parsed.events[point] & (1 << event))
+        batch.ClearProductEvent(product, point, event);
+      if (parsed.stateful_events[point] & (1 << event))
+        batch.RecordStatefulEvent(product, point, event);
     }
-  } while (line_end_index >= 0);
+  }
 
   // Update the DCC in registry if needed.
-  MachineDealCode::SetFromPingResponse(response);
+  bool has_new_dcc = false;
+  char new_dcc[kMaxDccLength + 1];
+  if (MachineDealCode::GetNewCodeFromParsedResponse(parsed, &has_new_dcc,
+                                                    new_dcc,
+                                                    arraysize(new_dcc)) &&
+      has_new_dcc)
+    batch.SetMachineDealCode(new_dcc);
+
+  // Apply all the changes at once. Where transactions are available, a
+  // failure can not leave the response partially applied.
+  if (!batch.Commit(sid, true))
+    return false;
+
+  // The interval only delays the next pings, so a failure to store it does
+  // not fail the response.
+  if (parsed.has_ping_interval)
+    FinancialPing::SetPingInterval(product, sid, parsed.ping_interval);
 
   return true;
 }
@@ -986,23 +1439,37 @@ bool FormFinancialPingRequest(Product product, const AccessPoint* access_points,
                               bool exclude_machine_id,
                               char* request, size_t request_buffer_size,
                               const wchar_t* sid) {
-  if (!request || request_buffer_size == 0)
-    return false;
-  request[0] = 0;
-
-  std::string request_string;
-  if (!FinancialPing::FormRequest(product, access_points, product_signature,
+  return FormFinancialPingRequest(product, access_points, product_signature,
                                   product_brand, product_id, product_lang,
-                                  exclude_machine_id, sid, &request_string))
-    return false;
+                                  exclude_machine_id, request,
+                                  request_buffer_size, sid, NULL);
+}
+
+bool FormFinancialPingRequest(Product product, const AccessPoint* access_points,
+                              const char* product_signature,
+                              const char* product_brand,
+                              const char* product_id,
+                              const char* product_lang,
+                              bool exclude_machine_id,
+                              char* request, size_t request_buffer_size,
+                              const wchar_t* sid, size_t* required_size) {
+  if (required_size)
+    *required_size = 0;
 
-  if ((request_string.size() < 0) ||
-      (static_cast<DWORD>(request_string.size()) >= request_buffer_size))
+  if (!request || request_buffer_size == 0)
     return false;
 
-  strncpy(request, request_string.c_str(), request_buffer_size);
-  request[request_buffer_size - 1] = 0;
-  return true;
+  CgiBuilder builder(request, request_buffer_size);
+  bool result = FinancialPing::FormRequest(product, access_points,
+                                           product_signature, product_brand,
+                                           product_id, product_lang,
+                                           exclude_machine_id, sid, &builder);
+  if (required_size && (result || builder.overflowed()))
+    *required_size = builder.required_size();
+
+  if (!result)
+    request[0] = 0;
+  return result;
 }
 
 
@@ -1017,7 +1484,13 @@ bool PingFinancialServer(Product product, const char* request, char* response,
 
   // Send out the ping.
   std::string response_string;
-  if (!FinancialPing::PingServer(request, &response_string))
+  bool valid_response = false;
+  PingResult ping_result;
+  bool reached_server = FinancialPing::PingServer(request, &response_string,
+                                                  NULL, &valid_response,
+                                                  &ping_result);
+  PingHealth::RecordPing(product, sid, ping_result, valid_response);
+  if (!reached_server)
     return false;
 
   if ((response_string.size() < 0) ||
@@ -1055,30 +1528,213 @@ bool SendFinancialPing(Product product, const AccessPoint* access_points,
                        const char* product_id, const char* product_lang,
                        bool exclude_machine_id, const wchar_t* sid,
                        const bool skip_time_check) {
-  // Create the financial ping request.
+  // Get the request to send, if a ping is due.
   std::string request;
-  if (!FinancialPing::FormRequest(product, access_points, product_signature,
-                                  product_brand, product_id, product_lang,
-                                  exclude_machine_id, sid, &request))
-    return false;
-
-  // Check if the time is right to ping.
-  if (!FinancialPing::IsPingTime(product, sid, skip_time_check))
+  if (!GetDueRequest(product, access_points, product_signature, product_brand,
+                     product_id, product_lang, exclude_machine_id, sid,
+                     skip_time_check, &request))
     return false;
 
   // Send out the ping, update the last ping time irrespective of success.
+  // Pings which do not reach the server are queued for a retry.
   FinancialPing::UpdateLastPingTime(product, sid);
   std::string response;
-  if (!FinancialPing::PingServer(request.c_str(), &response))
+  bool valid_response = false;
+  PingResult ping_result;
+  bool reached_server = FinancialPing::PingServer(request.c_str(), &response,
+                                                  NULL, &valid_response,
+                                                  &ping_result);
+  PingRetryQueue::RecordResult(product, sid, request, ping_result.status != 0);
+  PingHealth::RecordPing(product, sid, ping_result, valid_response);
+  if (!reached_server || !valid_response)
     return false;
 
   // Parse the ping response - update RLZs, clear events.
   return FinancialPing::ParseResponse(product, response.c_str(), sid);
 }
 
+FinancialPingHandle SendFinancialPingAsync(Product product,
+                                           const AccessPoint* access_points,
+                                           const char* product_signature,
+                                           const char* product_brand,
+                                           const char* product_id,
+                                           const char* product_lang,
+                                           bool exclude_machine_id,
+                                           const wchar_t* sid,
+                                           bool skip_time_check,
+                                           DWORD timeout_ms,
+                                           FinancialPingCallback callback,
+                                           void* context) {
+  if (!SupplementaryBranding::GetBrand().empty()) {
+    ASSERT_STRING("SendFinancialPingAsync: "
+                  "Not supported with a supplementary brand");
+    return NULL;
+  }
+
+  // Get the request to send, if a ping is due.
+  std::string request;
+  if (!GetDueRequest(product, access_points, product_signature, product_brand,
+                     product_id, product_lang, exclude_machine_id, sid,
+                     skip_time_check, &request))
+    return NULL;
+
+  // Update the last ping time irrespective of success, as SendFinancialPing()
+  // does.
+  FinancialPing::UpdateLastPingTime(product, sid);
+  return AsyncFinancialPing::Start(product, request, sid, timeout_ms,
+                                   callback, context);
+}
+
+void CancelFinancialPing(FinancialPingHandle handle) {
+  if (handle)
+    handle->Cancel();
+}
+
+void CloseFinancialPingHandle(FinancialPingHandle handle) {
+  if (handle)
+    handle->Release();
+}
+
+bool SendFinancialPings(const FinancialPingParams* pings, size_t count,
+                        const wchar_t* sid, bool* results) {
+  if (results) {
+    for (size_t i = 0; i < count; ++i)
+      results[i] = false;
+  }
+
+  if (!pings) {
+    ASSERT_STRING("SendFinancialPings: pings is NULL");
+    return false;
+  }
+
+  // Create the requests of the products that are due for a ping, and update
+  // their last ping times irrespective of success, as SendFinancialPing()
+  // does.
+  std::vector<std::string> requests(count);
+  std::vector<bool> due(count, false);
+  {
+    ScopedRlzSession session;
+    for (size_t i = 0; i < count; ++i) {
+      const FinancialPingParams& ping = pings[i];
+      if (!GetDueRequest(ping.product, ping.access_points,
+                         ping.product_signature, ping.product_brand,
+                         ping.product_id, ping.product_lang,
+                         ping.exclude_machine_id, sid, ping.skip_time_check,
+                         &requests[i]))
+        continue;
+
+      FinancialPing::UpdateLastPingTime(ping.product, sid);
+      due[i] = true;
+    }
+  }
+
+  // Send the pings without holding the lock. They reuse the same keep-alive
+  // connection.
+  std::vector<std::string> responses(count);
+  std::vector<bool> reached_server(count, false);
+  std::vector<bool> valid_response(count, false);
+  scoped_array<PingResult> ping_results(new PingResult[count]);
+  for (size_t i = 0; i < count; ++i) {
+    if (due[i]) {
+      bool valid = false;
+      reached_server[i] = FinancialPing::PingServer(requests[i].c_str(),
+                                                    &responses[i], NULL,
+                                                    &valid,
+                                                    &ping_results[i]);
+      valid_response[i] = valid;
+    }
+  }
+
+  // Queue the pings which did not get a response for a retry, count them,
+  // and parse the ping responses - update RLZs, clear events.
+  bool all_succeeded = true;
+  ScopedRlzSession session;
+  for (size_t i = 0; i < count; ++i) {
+    if (due[i]) {
+      PingRetryQueue::RecordResult(pings[i].product, sid, requests[i],
+                                   ping_results[i].status != 0);
+      PingHealth::RecordPing(pings[i].product, sid, ping_results[i],
+                             valid_response[i]);
+    }
+    bool result = reached_server[i] && valid_response[i] &&
+        FinancialPing::ParseResponse(pings[i].product, responses[i].c_str(),
+                                     sid);
+    if (results)
+      results[i] = result;
+    if (!result)
+      all_succeeded = false;
+  }
+
+  return all_succeeded;
+}
+
+bool SendFinancialPingsForUsers(const FinancialPingParams* pings,
+                                size_t count, const wchar_t* const* sids,
+                                size_t sid_count, int max_threads,
+                                bool* results) {
+  if (results && sids) {
+    for (size_t i = 0; i < sid_count; ++i)
+      results[i] = false;
+  }
+
+  if (!pings) {
+    ASSERT_STRING("SendFinancialPingsForUsers: pings is NULL");
+    return false;
+  }
+
+  // The pings run on other threads, which cannot use the brand of this one.
+  if (!SupplementaryBranding::GetBrand().empty()) {
+    ASSERT_STRING("SendFinancialPingsForUsers: "
+                  "Not supported with a supplementary brand");
+    return false;
+  }
+
+  std::vector<std::wstring> user_sids;
+  if (!GetUserSids(sids, sid_count, &user_sids))
+    return false;
+  if (user_sids.empty())
+    return true;
+
+  UserPings user_pings = { pings, count };
+  scoped_array<bool> user_results(new bool[user_sids.size()]);
+  UserSweep::Run(user_sids, max_threads, SendUserPings, &user_pings,
+                 user_results.get());
+
+  bool all_succeeded = true;
+  for (size_t i = 0; i < user_sids.size(); ++i) {
+    if (results && sids)
+      results[i] = user_results[i];
+    if (!user_results[i])
+      all_succeeded = false;
+  }
+  return all_succeeded;
+}
+
+void ClearProductStateForUsers(Product product,
+                               const AccessPoint* access_points,
+                               const wchar_t* const* sids, size_t sid_count) {
+  // The registry work is serialized by the lock anyway, so the users are
+  // cleared in turn under one hold of it.
+  LibMutex lock;
+  if (lock.failed())
+    return;
+
+  std::vector<std::wstring> user_sids;
+  if (!GetUserSids(sids, sid_count, &user_sids))
+    return;
+
+  for (size_t i = 0; i < user_sids.size(); ++i)
+    ClearProductState(product, access_points, user_sids[i].c_str());
+}
 
 void ClearProductState(Product product, const AccessPoint* access_points,
                        const wchar_t* sid) {
+  EventQueue::Flush();
+
+  const wchar_t* product_name = GetProductName(product);
+  if (!product_name)
+    return;
+
   LibMutex lock;
   if (lock.failed())
     return;
@@ -1087,31 +1743,32 @@ void ClearProductState(Product product, const AccessPoint* access_points,
   if (!user_key.HasAccess(true))
     return;
 
-  // Delete all product specific state.
-  VERIFY(ClearAllProductEvents(product, sid));
-  VERIFY(FinancialPing::ClearLastPingTime(product, sid));
-
-  // Delete all RLZ's for access points being uninstalled.
-  if (access_points) {
-    for (int i = 0; access_points[i] != NO_ACCESS_POINT; i++) {
-      VERIFY(SetAccessPointRlz(access_points[i], "" , sid));
+  StateCache::InvalidateUser(sid);
+  SharedStateMirror::InvalidateUser(sid);
+  PingParamsCache::InvalidateUser(sid);
+
+  // The file store is cleared first, since mirroring its writes would write
+  // the registry again.
+  if (RlzValueStore::IsFileStoreEnabled()) {
+    ScopedValueStore scoped_store(sid, true);
+    RlzValueStore* store = scoped_store.get();
+    EventBitmap no_events;
+    bool cleared = store && store->WriteProductEvents(product, no_events) &&
+        store->WriteStatefulEvents(product, no_events) &&
+        store->WritePingTime(product, 0);
+    for (int i = 0; cleared && access_points &&
+         access_points[i] != NO_ACCESS_POINT; i++) {
+      cleared = store->WriteAccessPointRlz(access_points[i], "");
     }
+    VERIFY(cleared && store->Commit());
   }
 
-  // Delete each of the known subkeys if empty.
-  const wchar_t* subkeys[] = {
-    kRlzsSubkeyName,
-    kEventsSubkeyName,
-    kStatefulEventsSubkeyName,
-    kPingTimesSubkeyName
-  };
-
-  for (int i = 0; i < arraysize(subkeys); i++) {
-    std::wstring subkey_name;
-    base::StringAppendF(&subkey_name, L"%ls\\%ls", kLibKeyName, subkeys[i]);
-    SupplementaryBranding::AppendBrandToString(&subkey_name);
-
-    VERIFY(DeleteKeyIfEmpty(user_key.Get(), subkey_name.c_str()));
+  // Delete all product specific state, and the RLZ's of the access points
+  // being uninstalled, from each of the known subkeys. The subkeys left empty
+  // are deleted too.
+  for (int i = 0; i < arraysize(kProductStateKeys); i++) {
+    VERIFY(ClearProductStateKey(user_key.Get(), kProductStateKeys[i],
+                                product_name, access_points));
   }
 
   // Delete the library key and its parents too now if empty.
@@ -1134,9 +1791,108 @@ bool GetMachineId(wchar_t* buffer, size_t buffer_size) {
   return true;
 }
 
+void PrefetchMachineId() {
+  MachineDealCode::PrefetchMachineId();
+}
+
+void EnableStateCache(bool enable) {
+  StateCache::SetEnabled(enable);
+}
+
+bool SetLockTimeout(int timeout_ms) {
+  if (timeout_ms < 0) {
+    ASSERT_STRING("SetLockTimeout: Invalid timeout");
+    return false;
+  }
+
+  LibMutex::SetDefaultTimeout(timeout_ms);
+  return true;
+}
+
+bool GetLockStats(LockStats* stats) {
+  if (!stats) {
+    ASSERT_STRING("GetLockStats: stats is NULL");
+    return false;
+  }
+
+  LibMutex::GetStats(stats);
+  return true;
+}
+
+void ResetLockStats() {
+  LibMutex::ResetStats();
+}
+
+bool GetPingHealthStats(Product product, PingHealthStats* stats,
+                        const wchar_t* sid) {
+  return PingHealth::Get(product, sid, stats);
+}
+
+bool ResetPingHealthStats(Product product, const wchar_t* sid) {
+  return PingHealth::Reset(product, sid);
+}
+
+void SetTraceCallback(TraceCallback callback, void* context) {
+  ScopedTraceSpan::SetCallback(callback, context);
+}
+
+void EnableSharedStateMirror(bool enable) {
+  SharedStateMirror::SetEnabled(enable);
+}
+
+void EnableCompactEventStorage(bool enable) {
+  EventBitmap::SetEnabled(enable);
+}
+
+void EnableEventWriteBehind(bool enable) {
+  EventQueue::SetEnabled(enable);
+}
+
+bool FlushQueuedEvents() {
+  return EventQueue::Flush();
+}
+
+bool ShutdownEventWriteBehind() {
+  return EventQueue::Shutdown();
+}
+
+void EnableCompressedPings(bool enable) {
+  PingTransport::SetCompressionEnabled(enable);
+}
+
+bool SetPingTransport(PingTransportType type) {
+  scoped_refptr<PingTransport> transport(PingTransport::Create(type));
+  if (!transport)
+    return false;
+
+  PingTransport::Set(transport);
+  return true;
+}
+
+void EnableUserKeyCache(bool enable) {
+  UserKey::SetCacheEnabled(enable);
+}
+
+void InvalidateUserKeyCache(const wchar_t* sid) {
+  UserKey::Invalidate(sid);
+}
+
+void EnableFileStateStore(bool enable, bool mirror_to_registry) {
+  RlzValueStore::SetFileStoreEnabled(enable, mirror_to_registry);
+}
+
 void InitializeTempHivesForTesting(const base::win::RegKey& temp_hklm_key,
                                    const base::win::RegKey& temp_hkcu_key) {
-  // For the moment, the HKCU hive requires no initialization.
+  // For the moment, the HKCU hive requires no initialization. The keys pooled
+  // for it so far are in the hive being overridden.
+  UserKey::Invalidate(NULL);
+
+  // The temporary HKLM hive has no machine key yet.
+  base::subtle::NoBarrier_Store(&g_machine_state_created, 0);
+
+  // Values read from the temporary hives must not be mirrored to other
+  // processes.
+  SharedStateMirror::UsePrivateSectionForTesting();
 
   if (base::win::GetVersion() >= base::win::VERSION_WIN7) {
     // Copy the following HKLM subtrees to the temporary location so that the
@@ -1144,7 +1900,13 @@ void InitializeTempHivesForTesting(const base::win::RegKey& temp_hklm_key,
     //
     //    HKLM\System\CurrentControlSet\Control\Lsa\AccessProviders
     //
-    // This seems to be required since Win7.
+    // This seems to be required since Win7. Hives restored from a copy which
+    // already has the subtree are left as they are.
+    base::win::RegKey existing;
+    if (existing.Open(temp_hklm_key.Handle(), kHKLMAccessProviders,
+                      KEY_READ) == ERROR_SUCCESS)
+      return;
+
     base::win::RegKey dest(temp_hklm_key.Handle(), kHKLMAccessProviders,
                            KEY_ALL_ACCESS);
     CopyRegistryTree(base::win::RegKey(HKEY_LOCAL_MACHINE,
@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <string>
 
+#include "base/basictypes.h"
 #include "base/memory/scoped_ptr.h"
 #include "base/win/registry.h"
 
@@ -167,6 +168,8 @@ static const int kMaxCgiLength = 2048;
 static const int kMaxPingResponseLength = 0x4000;  // 16K
 // The length of the Machine unique ID in WCHARs, excluding the NULL terminator.
 static const int kMachineIdLength = 50;
+// How long library calls wait for the RLZ lock by default, in milliseconds.
+static const int kDefaultLockTimeoutMs = 5000;
 
 
 // Event storage functions.
@@ -180,6 +183,17 @@ static const int kMachineIdLength = 50;
 bool RLZ_LIB_API RecordProductEvent(Product product, AccessPoint point,
                                     Event event_id, const wchar_t* sid=NULL);
 
+// Records |count| events of the product at once, |events[i]| for the access
+// point |points[i]|: the stateful events are read, and the events key opened,
+// once for all of them. If |results| is not NULL, |results[i]| is set to
+// whether the event i was recorded or skipped as stateful. Returns true if all
+// of them were.
+// Access: HKCU write.
+bool RLZ_LIB_API RecordProductEvents(Product product,
+                                     const AccessPoint* points,
+                                     const Event* events, size_t count,
+                                     bool* results, const wchar_t* sid=NULL);
+
 // Get all the events reported by this product as a CGI string to append to
 // the daily ping.
 // Access: HKCU read.
@@ -187,6 +201,10 @@ bool RLZ_LIB_API GetProductEventsAsCgi(Product product, char* unescaped_cgi,
                                        size_t unescaped_cgi_size,
                                        const wchar_t* sid=NULL);
 
+// Whether this product has events to report, without building their CGI.
+// Access: HKCU read.
+bool RLZ_LIB_API HasPendingEvents(Product product, const wchar_t* sid=NULL);
+
 // Clear all reported events and recorded stateful events of this product.
 // This should be called on complete uninstallation of the product.
 // Access: HKCU write.
@@ -199,6 +217,12 @@ bool RLZ_LIB_API ClearAllProductEvents(Product product,
 bool RLZ_LIB_API ClearProductEvent(Product product, AccessPoint point,
                                    Event event_id, const wchar_t* sid=NULL);
 
+// Clears |count| events of the product at once, like RecordProductEvents().
+// Access: HKCU write.
+bool RLZ_LIB_API ClearProductEvents(Product product, const AccessPoint* points,
+                                    const Event* events, size_t count,
+                                    bool* results, const wchar_t* sid=NULL);
+
 // RLZ storage functions.
 
 // Get the RLZ value of the access point. If the access point is not Google, the
@@ -207,6 +231,17 @@ bool RLZ_LIB_API ClearProductEvent(Product product, AccessPoint point,
 bool RLZ_LIB_API GetAccessPointRlz(AccessPoint point, char* rlz,
                                    size_t rlz_size, const wchar_t* sid=NULL);
 
+// Get the RLZ values of several access points at once, taking the lock and
+// reading the registry only once. access_points must be an array of
+// AccessPoints terminated with NO_ACCESS_POINT. rlzs must hold one slot of
+// rlz_size chars for each access point; slot i gets the RLZ of
+// access_points[i], as GetAccessPointRlz() would return it. Returns false if
+// GetAccessPointRlz() would have failed for any of the access points.
+// Access: HKCU read.
+bool RLZ_LIB_API GetAccessPointRlzs(const AccessPoint* access_points,
+                                    char* rlzs, size_t rlz_size,
+                                    const wchar_t* sid=NULL);
+
 // Set the RLZ for the access-point. Fails and asserts if called when the access
 // point is not set to Google.
 // new_rlz should come from a server-response. Client applications should not
@@ -278,6 +313,21 @@ bool RLZ_LIB_API FormFinancialPingRequest(Product product,
                                           size_t request_buffer_size,
                                           const wchar_t* sid=NULL);
 
+// Same as above. If not NULL, required_size receives the exact buffer size
+// required for the request, including the NULL terminator, even when the
+// buffer is too small and the call fails.
+bool RLZ_LIB_API FormFinancialPingRequest(Product product,
+                                          const AccessPoint* access_points,
+                                          const char* product_signature,
+                                          const char* product_brand,
+                                          const char* product_id,
+                                          const char* product_lang,
+                                          bool exclude_machine_id,
+                                          char* request,
+                                          size_t request_buffer_size,
+                                          const wchar_t* sid,
+                                          size_t* required_size);
+
 // Pings the financial server and returns the HTTP response. This will fail
 // if it is too early to ping the server since the last ping.
 //
@@ -300,7 +350,7 @@ bool RLZ_LIB_API PingFinancialServer(Product product,
                                      const wchar_t* sid=NULL);
 
 // Parses the responses from the financial server and updates product state
-// and access point RLZ's in registry.
+// and access point RLZ's in registry. Returns false like ParsePingResponse().
 // Access: HKCU write.
 bool RLZ_LIB_API ParseFinancialPingResponse(Product product,
                                             const char* response,
@@ -319,8 +369,19 @@ bool RLZ_LIB_API GetPingParams(Product product,
                                char* unescaped_cgi, size_t unescaped_cgi_size,
                                const wchar_t* sid=NULL);
 
+// Same as above. If not NULL, required_size receives the exact buffer size
+// required for the CGI, including the NULL terminator, even when the buffer
+// is too small and the call fails.
+bool RLZ_LIB_API GetPingParams(Product product,
+                               const AccessPoint* access_points,
+                               char* unescaped_cgi, size_t unescaped_cgi_size,
+                               const wchar_t* sid, size_t* required_size);
+
 // Parses RLZ related ping response information from the server.
-// Updates stored RLZ values and clears stored events accordingly.
+// Updates stored RLZ values and clears stored events accordingly. Returns
+// false if the response is not valid, or if its changes could not be
+// stored; where registry transactions are available, none of them is
+// applied then.
 // Access: HKCU write.
 bool RLZ_LIB_API ParsePingResponse(Product product, const char* response,
                                    const wchar_t* sid=NULL);
@@ -378,6 +439,115 @@ bool RLZ_LIB_API SendFinancialPing(Product product,
                                    const wchar_t* sid,
                                    const bool skip_time_check);
 
+// Asynchronous financial pings.
+
+class AsyncFinancialPing;
+typedef AsyncFinancialPing* FinancialPingHandle;
+
+// Called once an asynchronous financial ping completes, on a thread pool
+// thread. result is what SendFinancialPing() would have returned; it is false
+// if the ping was cancelled or timed out.
+typedef void (RLZ_LIB_API *FinancialPingCallback)(bool result, void* context);
+
+// Same as SendFinancialPing(), except that only the request is formed on the
+// calling thread. The round trip to the server and the parsing of the
+// response run on the system thread pool, and callback (if not NULL) is then
+// called with context.
+// timeout_ms : If not 0, the ping is cancelled after that many milliseconds.
+//
+// Returns NULL, without calling callback, if no ping is sent: on error, or if
+// it is not time to ping yet. Otherwise the returned handle must be closed
+// with CloseFinancialPingHandle(), and the library must stay loaded until
+// callback has been called. Not supported within the scope of a
+// SupplementaryBranding, since the response is parsed on another thread.
+// Access: HKCU write.
+FinancialPingHandle RLZ_LIB_API SendFinancialPingAsync(
+    Product product,
+    const AccessPoint* access_points,
+    const char* product_signature,
+    const char* product_brand,
+    const char* product_id,
+    const char* product_lang,
+    bool exclude_machine_id,
+    const wchar_t* sid,
+    bool skip_time_check,
+    DWORD timeout_ms,
+    FinancialPingCallback callback,
+    void* context);
+
+// Cancels an asynchronous ping. The callback is still called, with false,
+// unless the ping had already completed.
+// Access: No restrictions.
+void RLZ_LIB_API CancelFinancialPing(FinancialPingHandle handle);
+
+// Releases the handle returned by SendFinancialPingAsync(). Does not cancel
+// the ping.
+// Access: No restrictions.
+void RLZ_LIB_API CloseFinancialPingHandle(FinancialPingHandle handle);
+
+// Coalesced financial pings.
+
+// The arguments of one SendFinancialPing() call.
+struct FinancialPingParams {
+  Product product;
+  const AccessPoint* access_points;
+  const char* product_signature;
+  const char* product_brand;
+  const char* product_id;
+  const char* product_lang;
+  bool exclude_machine_id;
+  bool skip_time_check;
+};
+
+// Sends the financial pings of several products for the same user, with the
+// same behavior as calling SendFinancialPing() for each of them. All the
+// requests are formed and checked against the ping times under one hold of
+// the RLZ lock, sent back to back over one connection to the server, and the
+// responses are then applied under one hold of the lock.
+// pings   : The pings to send, count entries.
+// results : If not NULL, receives count entries, each set to what
+//           SendFinancialPing() would have returned for that ping.
+//
+// Returns true if all the pings were sent and their responses applied.
+// Access: HKCU write.
+bool RLZ_LIB_API SendFinancialPings(const FinancialPingParams* pings,
+                                    size_t count,
+                                    const wchar_t* sid=NULL,
+                                    bool* results=NULL);
+
+// Multi-user calls, for services which handle the state of all the users of
+// the machine.
+//
+// sids      : The user account SIDs, sid_count entries. If NULL, the calls
+//             handle every user whose hive is loaded in HKEY_USERS, i.e. the
+//             users logged on.
+
+// Same as calling SendFinancialPings() for each user. The pings of up to
+// max_threads users (all if 0) are sent at once on the system thread pool,
+// so that their round trips to the server overlap; their registry work still
+// takes the RLZ lock, in turn. Returns once all the pings have completed.
+// results : If not NULL and sids is not NULL, receives sid_count entries,
+//           each set to what SendFinancialPings() returned for that user.
+//
+// Returns true if all the pings of all the users succeeded. Not supported
+// within the scope of a SupplementaryBranding or of a ScopedRlzSession, since
+// the pings run on other threads.
+// Access: HKEY_USERS write, so it requires administrator rights.
+bool RLZ_LIB_API SendFinancialPingsForUsers(const FinancialPingParams* pings,
+                                            size_t count,
+                                            const wchar_t* const* sids,
+                                            size_t sid_count,
+                                            int max_threads,
+                                            bool* results=NULL);
+
+// Same as calling ClearProductState() for each user, under one hold of the
+// RLZ lock.
+// Access: HKEY_USERS write, so it requires administrator rights.
+void RLZ_LIB_API ClearProductStateForUsers(Product product,
+                                           const AccessPoint* access_points,
+                                           const wchar_t* const* sids,
+                                           size_t sid_count);
+
 
 
 // Clears all product-specifc state from the RLZ registry.
@@ -405,6 +575,194 @@ void RLZ_LIB_API ClearProductState(Product product,
 // Access: HKLM read.
 bool GetMachineId(char* buffer, int buffer_size);
 
+// Starts computing the machine ID on a worker thread. The computer SID
+// lookup behind it can take hundreds of milliseconds on machines in a
+// domain, so processes that will ping soon can call this early, but not from
+// DllMain. The thread keeps the RLZ DLL loaded until it is done. The ID is
+// also cached in HKLM for later processes when this one can write there.
+// Access: HKLM read, HKLM write to cache the ID.
+void RLZ_LIB_API PrefetchMachineId();
+
+// Enables or disables an in-process cache of the RLZs, product events and
+// DCC. While enabled, reads are served from memory without taking the RLZ
+// mutex. The cache watches the RLZ registry keys for changes, so values
+// written by other processes are picked up on the next read. Disabled by
+// default; disabling it also frees the cached state.
+// Access: No restrictions.
+void RLZ_LIB_API EnableStateCache(bool enable);
+
+// Enables or disables a mirror of the RLZs and the DCC in shared memory.
+// While enabled, values read by any process of the session are published to
+// the mirror, and reads are served from it without taking the RLZ mutex.
+// Writers always update the mirror. Values written by older versions of the
+// library are picked up within 30 seconds. Disabled by default.
+// Access: No restrictions.
+void RLZ_LIB_API EnableSharedStateMirror(bool enable);
+
+// Sets how long the library calls of this process wait for the RLZ lock
+// before failing. 0 makes them only try the lock. Use a ScopedRlzSession to
+// choose the timeout of a group of calls.
+// Access: No restrictions.
+bool RLZ_LIB_API SetLockTimeout(int timeout_ms);
+
+// Counters of the RLZ lock acquisitions made by this process, since it
+// started or since the last ResetLockStats(). Locks taken again by a thread
+// which already holds the lock are not counted.
+struct LockStats {
+  int64 acquisitions;            // Successful, including the contended ones.
+  int64 contended_acquisitions;  // Acquisitions that had to wait.
+  int64 timeouts;                // Including tries that failed.
+  int64 abandoned;               // Acquisitions of a lock whose owner died.
+  int64 total_wait_ms;           // Time spent waiting, timeouts included.
+  int64 max_wait_ms;
+};
+
+// Access: No restrictions.
+bool RLZ_LIB_API GetLockStats(LockStats* stats);
+void RLZ_LIB_API ResetLockStats();
+
+// The phases of a financial ping. Pings on a kept-alive connection skip the
+// name resolution and the connection, and transports which cannot tell the
+// phases apart count all the time in the reading.
+enum PingPhase {
+  PING_PHASE_RESOLVE,  // Resolving the name of the server, or of the proxy.
+  PING_PHASE_CONNECT,  // Connecting to it.
+  PING_PHASE_SEND,     // Sending the request.
+  PING_PHASE_READ,     // Waiting for the response, and reading it.
+  LAST_PING_PHASE
+};
+
+// The number of buckets of the ping latency histograms. Bucket 0 counts the
+// phases shorter than 1 ms, bucket i those of 2^(i-1) ms to 2^i ms, and the
+// last bucket all the longer ones.
+static const int kPingLatencyBuckets = 16;
+
+// Counters of the financial pings of a product, kept in the registry across
+// processes, since the first ping or since the last ResetPingHealthStats().
+// The lock timeouts are not per product: they are those of all the library
+// calls of the processes of the user, counted by their next ping, and are
+// the same for all the products.
+struct PingHealthStats {
+  int64 start_time;         // The first ping counted, as a FILETIME.
+  uint32 attempts;          // Pings sent, whatever their outcome.
+  uint32 successes;         // Valid responses.
+  uint32 network_failures;  // Pings which got no response.
+  uint32 http_errors;       // Responses with another status than 200.
+  uint32 crc_failures;      // 200 responses which are not valid.
+  uint32 lock_timeouts;     // RLZ lock timeouts of the user, see above.
+  uint32 latency_ms[LAST_PING_PHASE][kPingLatencyBuckets];
+};
+
+// Gets the counters of |product|, all 0 if it has no ping counted.
+// Access: HKCU read.
+bool RLZ_LIB_API GetPingHealthStats(Product product, PingHealthStats* stats,
+                                    const wchar_t* sid=NULL);
+
+// Resets the counters of |product|, and the lock timeouts of the user.
+// Access: HKCU write.
+bool RLZ_LIB_API ResetPingHealthStats(Product product,
+                                      const wchar_t* sid=NULL);
+
+// Tracing, to profile the library calls.
+enum TraceEventType {
+  TRACE_BEGIN,
+  TRACE_END
+};
+
+// Called on the calling thread at the beginning and the end of each DLL
+// export, and of the registry opens, lock waits, network requests and
+// response parsing inside them. |name| is a static string. |duration_us| is
+// 0 for TRACE_BEGIN. The callback must not call the library.
+typedef void (RLZ_LIB_API *TraceCallback)(TraceEventType type,
+                                          const char* name,
+                                          int64 duration_us,
+                                          void* context);
+
+// Sets the trace callback, or disables tracing if |callback| is NULL. Spans
+// which began before the change still end with the previous callback, so
+// its |context| must stay valid until the calls in progress complete.
+// Access: No restrictions.
+void RLZ_LIB_API SetTraceCallback(TraceCallback callback, void* context);
+
+// Enables or disables the compact event storage. While enabled, the events
+// of a product are recorded as one registry bitmap value instead of one value
+// per event, and events recorded by older clients are moved into the bitmap.
+// Events are read from both layouts whether or not it is enabled, so clients
+// which have not enabled it still see all the events. Disabled by default.
+// Access: No restrictions.
+void RLZ_LIB_API EnableCompactEventStorage(bool enable);
+
+// Enables or disables the write-behind recording of events. While enabled,
+// RecordProductEvent() calls for the current user, outside of a
+// SupplementaryBranding, only queue the event in memory and return. The
+// queued events are written in one batch about a second later, and before
+// any library call of this process reads or clears events, so this process
+// always sees them; other processes see them once written. Such calls
+// return true even if the event is later not written. Disabling it writes
+// the queued events. Enabling it keeps the RLZ DLL loaded until the process
+// exits, and processes which enable it must call ShutdownEventWriteBehind()
+// before they exit: the events still queued then are lost otherwise, since
+// the DLL can not write them from DllMain. Disabled by default.
+// Access: No restrictions.
+void RLZ_LIB_API EnableEventWriteBehind(bool enable);
+
+// Writes the events queued by the write-behind recording now. Returns false
+// if they could not be written, in which case they stay queued.
+// Access: HKCU write.
+bool RLZ_LIB_API FlushQueuedEvents();
+
+// Stops the write-behind recording for good: waits for its timer, and writes
+// the queued events. Later events are recorded directly. Required before a
+// process which enabled it exits, see EnableEventWriteBehind(). Must not be
+// called from DllMain.
+// Returns false like FlushQueuedEvents().
+// Access: HKCU write.
+bool RLZ_LIB_API ShutdownEventWriteBehind();
+
+// Enables or disables compressed financial pings in this process. While
+// enabled, pings accept gzip compressed responses. Once the server has sent
+// one, long requests are also sent as a gzip compressed POST body, and again
+// as plain GET requests if the server rejects them. Disabled by default.
+// Access: No restrictions.
+void RLZ_LIB_API EnableCompressedPings(bool enable);
+
+// The HTTP stacks the financial pings can be sent with.
+enum PingTransportType {
+  PING_TRANSPORT_WININET = 0,  // The default; uses the proxy of IE.
+  PING_TRANSPORT_WINHTTP,      // Asynchronous; works from services.
+};
+
+// Sets the HTTP stack the financial pings of this process are sent with
+// from now on. Pings in progress complete with the previous one. Returns
+// false for an unknown type.
+// Access: No restrictions.
+bool RLZ_LIB_API SetPingTransport(PingTransportType type);
+
+// Enables or disables the caching of the user hive keys opened for the |sid|
+// arguments, which saves a registry open per call for processes that handle
+// other users' state, e.g. services. The RLZ subkeys opened in the cached
+// hives and in HKCU are kept open too, so that later calls open the keys
+// relative to them. A cached key keeps the user's hive loaded, so
+// InvalidateUserKeyCache() must be called when the user logs off. Disabling
+// closes all the cached keys. Disabled by default.
+// Access: No restrictions.
+void RLZ_LIB_API EnableUserKeyCache(bool enable);
+
+// Closes the cached hive key of |sid|, or of all the users if |sid| is NULL
+// or empty. Calls in progress keep using the key until they complete.
+// Access: No restrictions.
+void RLZ_LIB_API InvalidateUserKeyCache(const wchar_t* sid);
+
+// Enables or disables the file state store in this process. While enabled,
+// the RLZs, events, ping times and DCC are kept in memory-mapped files, in
+// the local application data directory of each user and in the common
+// application data directory, and are read from them without the RLZ mutex.
+// The registry state is copied into the files the first time they are
+// opened. If |mirror_to_registry| is true, writes also go to the registry,
+// for processes which have not enabled the store; otherwise the registry
+// keeps the state it had when copied. Disabled by default.
+// Access: No restrictions.
+void RLZ_LIB_API EnableFileStateStore(bool enable, bool mirror_to_registry);
 
 // Segment RLZ persistence based on branding information.
 // The RLZ library uses the Windows registry to save persistent information.
@@ -451,6 +809,34 @@ class SupplementaryBranding {
   static std::wstring brand_;
 };
 
+// Holds the RLZ lock for the lifetime of the object. RLZ library calls made on
+// the same thread while a session is alive reuse the lock instead of
+// acquiring it again, and run without other processes interleaving. Useful
+// for sequences of calls, e.g. recording several events before a ping:
+//
+//  {
+//    rlz_lib::ScopedRlzSession session;
+//    if (!session.failed()) {
+//      rlz_lib::RecordProductEvent(...);
+//      rlz_lib::RecordProductEvent(...);
+//    }
+//  }
+//
+// The calls still take the lock themselves if the session failed to get it.
+// A session must be destroyed on the thread that created it.
+class ScopedRlzSession {
+ public:
+  ScopedRlzSession();
+  // Waits at most |timeout_ms| for the lock, 0 only tries it.
+  explicit ScopedRlzSession(int timeout_ms);
+  ~ScopedRlzSession();
+
+  bool failed() const;
+
+ private:
+  scoped_ptr<LibMutex> lock_;
+};
+
 // Initialize temporary HKLM/HKCU registry hives used for testing.
 // Testing RLZ requires reading and writing to the Windows registry.  To keep
 // the tests isolated from the machine's state, as well as to prevent the tests
@@ -462,6 +848,10 @@ class SupplementaryBranding {
 // The two arguments to this function should be the keys that will represent
 // the HKLM and HKCU registry hives during the tests.  This function should be
 // called *before* the hives are overridden.
+//
+// The HKLM subtrees it needs are only copied if |temp_hklm_key| does not have
+// them yet, so that tests can prepare the hives once and restore a copy of
+// them for each test. The per-process state is reset on every call.
 void InitializeTempHivesForTesting(const base::win::RegKey& temp_hklm_key,
                                    const base::win::RegKey& temp_hkcu_key);
 
@@ -14,14 +14,32 @@
 // "TEST" brand is used to test the supplementary brand code code flow.
 
 #include <windows.h>
+#include <algorithm>
+#include <string>
+#include <vector>
 
 #include "base/logging.h"
 #include "base/memory/scoped_ptr.h"
+#include "base/stringprintf.h"
+#include "base/win/registry.h"
+#include "base/win/windows_version.h"
 #include "testing/gmock/include/gmock/gmock.h"
 #include "testing/gtest/include/gtest/gtest.h"
 
+#include "rlz/win/lib/cgi_builder.h"
+#include "rlz/win/lib/financial_ping.h"
+#include "rlz/win/lib/lib_values.h"
 #include "rlz/win/lib/machine_deal.h"
+#include "rlz/win/lib/ping_params_cache.h"
+#include "rlz/win/lib/ping_retry_queue.h"
+#include "rlz/win/lib/ping_transport.h"
+#include "rlz/win/lib/process_info.h"
 #include "rlz/win/lib/rlz_lib.h"
+#include "rlz/win/lib/shared_state_mirror.h"
+#include "rlz/win/lib/user_key.h"
+#include "rlz/win/lib/user_sweep.h"
+#include "rlz/win/lib/value_store.h"
+#include "rlz/win/lib/write_batch.h"
 #include "rlz/win/test/rlz_test_helpers.h"
 
 class MachineDealCodeHelper : public rlz_lib::MachineDealCode {
@@ -98,6 +116,43 @@ TEST_F(RlzLibTest, ClearProductEvent) {
   EXPECT_STREQ("events=W1I", cgi_50);
 }
 
+TEST_F(RlzLibTest, RecordAndClearProductEvents) {
+  char cgi_50[50];
+  rlz_lib::AccessPoint points[] = {
+    rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::IE_HOME_PAGE, rlz_lib::NO_ACCESS_POINT
+  };
+  rlz_lib::Event events[] = {
+    rlz_lib::SET_TO_GOOGLE, rlz_lib::INSTALL, rlz_lib::INSTALL
+  };
+  bool results[arraysize(points)];
+
+  // The invalid access point is reported, and the others recorded.
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_FALSE(rlz_lib::RecordProductEvents(rlz_lib::TOOLBAR_NOTIFIER,
+      points, events, arraysize(points), results));
+  EXPECT_TRUE(results[0]);
+  EXPECT_TRUE(results[1]);
+  EXPECT_FALSE(results[2]);
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             cgi_50, 50));
+  EXPECT_STREQ("events=I7S,W1I", cgi_50);
+
+  EXPECT_TRUE(rlz_lib::ClearProductEvents(rlz_lib::TOOLBAR_NOTIFIER,
+      points, events, 1, NULL));
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             cgi_50, 50));
+  EXPECT_STREQ("events=W1I", cgi_50);
+
+  EXPECT_FALSE(rlz_lib::ClearProductEvents(rlz_lib::TOOLBAR_NOTIFIER,
+      points, events, arraysize(points), results));
+  EXPECT_TRUE(results[0]);
+  EXPECT_TRUE(results[1]);
+  EXPECT_FALSE(results[2]);
+  EXPECT_FALSE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                              cgi_50, 50));
+  EXPECT_STREQ("", cgi_50);
+}
+
 
 TEST_F(RlzLibTest, GetProductEventsAsCgi) {
   char cgi_50[50];
@@ -134,6 +189,37 @@ TEST_F(RlzLibTest, ClearAllAllProductEvents) {
   EXPECT_STREQ("", cgi_50);
 }
 
+TEST_F(RlzLibTest, HasPendingEvents) {
+  rlz_lib::Product product = rlz_lib::TOOLBAR_NOTIFIER;
+
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(product));
+  EXPECT_FALSE(rlz_lib::HasPendingEvents(product));
+
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(product, rlz_lib::IE_DEFAULT_SEARCH,
+                                          rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::HasPendingEvents(product));
+
+  EXPECT_TRUE(rlz_lib::ClearProductEvent(product, rlz_lib::IE_DEFAULT_SEARCH,
+                                         rlz_lib::SET_TO_GOOGLE));
+  EXPECT_FALSE(rlz_lib::HasPendingEvents(product));
+
+  // Events in the compact storage are found too.
+  rlz_lib::EnableCompactEventStorage(true);
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(product, rlz_lib::IE_HOME_PAGE,
+                                          rlz_lib::INSTALL));
+  EXPECT_TRUE(rlz_lib::HasPendingEvents(product));
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(product));
+  EXPECT_FALSE(rlz_lib::HasPendingEvents(product));
+  rlz_lib::EnableCompactEventStorage(false);
+
+  // Stateful events are not pending.
+  rlz_lib::RlzWriteBatch batch;
+  EXPECT_TRUE(batch.RecordStatefulEvent(product, rlz_lib::IE_HOME_PAGE,
+                                        rlz_lib::INSTALL));
+  EXPECT_TRUE(batch.Commit(NULL, false));
+  EXPECT_FALSE(rlz_lib::HasPendingEvents(product));
+}
+
 TEST_F(RlzLibTest, SetAccessPointRlz) {
   char rlz_50[50];
   EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, ""));
@@ -158,6 +244,36 @@ TEST_F(RlzLibTest, GetAccessPointRlz) {
   EXPECT_STREQ("IeTbRlz", rlz_50);
 }
 
+TEST_F(RlzLibTest, GetAccessPointRlzs) {
+  char rlzs[3 * 50];
+  rlz_lib::AccessPoint points[] =
+    {rlz_lib::IETB_SEARCH_BOX, rlz_lib::IE_HOME_PAGE, rlz_lib::QUICK_SEARCH_BOX,
+     rlz_lib::NO_ACCESS_POINT};
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "IeTbRlz"));
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IE_HOME_PAGE, ""));
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::QUICK_SEARCH_BOX, "Qsb"));
+
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlzs(points, rlzs, 50));
+  EXPECT_STREQ("IeTbRlz", rlzs);
+  EXPECT_STREQ("", rlzs + 50);
+  EXPECT_STREQ("Qsb", rlzs + 100);
+
+  // A value which does not fit fails only its own slot.
+  EXPECT_FALSE(rlz_lib::GetAccessPointRlzs(points, rlzs, 5));
+  EXPECT_STREQ("", rlzs);
+  EXPECT_STREQ("", rlzs + 5);
+  EXPECT_STREQ("Qsb", rlzs + 10);
+
+  // Unsupported access points get an empty slot.
+  rlz_lib::AccessPoint mobile_points[] =
+    {rlz_lib::MOBILE_IDLE_SCREEN_WINMOB, rlz_lib::IETB_SEARCH_BOX,
+     rlz_lib::NO_ACCESS_POINT};
+  EXPECT_FALSE(rlz_lib::GetAccessPointRlzs(mobile_points, rlzs, 50));
+  EXPECT_STREQ("", rlzs);
+  EXPECT_STREQ("IeTbRlz", rlzs + 50);
+}
+
 TEST_F(RlzLibTest, GetPingParams) {
   MachineDealCodeHelper::Clear();
 
@@ -189,6 +305,16 @@ TEST_F(RlzLibTest, GetPingParams) {
                                      cgi, 38));
   EXPECT_STREQ("rep=2&rlz=T4:TbRlzValue&dcc=dcc_value", cgi);
 
+  // The required size is reported whether or not the CGI fits.
+  size_t required_size = 0;
+  EXPECT_FALSE(rlz_lib::GetPingParams(rlz_lib::TOOLBAR_NOTIFIER, points,
+                                      cgi, 10, NULL, &required_size));
+  EXPECT_STREQ("", cgi);
+  EXPECT_EQ(38u, required_size);
+  EXPECT_TRUE(rlz_lib::GetPingParams(rlz_lib::TOOLBAR_NOTIFIER, points,
+                                     cgi, 2048, NULL, &required_size));
+  EXPECT_EQ(38u, required_size);
+
   EXPECT_TRUE(GetAccessPointRlz(rlz_lib::IE_HOME_PAGE, cgi, 2048));
   points[2] = rlz_lib::IE_HOME_PAGE;
   EXPECT_TRUE(rlz_lib::GetPingParams(rlz_lib::TOOLBAR_NOTIFIER, points,
@@ -410,6 +536,131 @@ TEST_F(RlzLibTest, SendFinancialPing) {
       "swg", "GGLA", "SwgProductId1234", "en-UK", false);
 }
 
+void RLZ_LIB_API OnFinancialPingDone(bool result, void* context) {
+  SetEvent(static_cast<HANDLE>(context));
+}
+
+TEST_F(RlzLibTest, SendFinancialPingAsync) {
+  rlz_lib::AccessPoint points[] =
+    {rlz_lib::IETB_SEARCH_BOX, rlz_lib::NO_ACCESS_POINT};
+
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+
+  HANDLE done = CreateEvent(NULL, TRUE, FALSE, NULL);
+  ASSERT_TRUE(done != NULL);
+
+  rlz_lib::FinancialPingHandle ping = rlz_lib::SendFinancialPingAsync(
+      rlz_lib::TOOLBAR_NOTIFIER, points, "swg", "GGLA", "SwgProductId1234",
+      "en-UK", false, NULL, true, 30000, OnFinancialPingDone, done);
+
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty()) {
+    // Not supported with a supplementary brand.
+    EXPECT_TRUE(ping == NULL);
+  } else {
+    // Cancelling makes the ping complete without waiting for the network.
+    ASSERT_TRUE(ping != NULL);
+    rlz_lib::CancelFinancialPing(ping);
+    EXPECT_EQ(WAIT_OBJECT_0, WaitForSingleObject(done, 30000));
+    rlz_lib::CloseFinancialPingHandle(ping);
+  }
+
+  CloseHandle(done);
+}
+
+TEST_F(RlzLibTest, SendFinancialPingLoopback) {
+  // The whole ping, without the network.
+  scoped_refptr<rlz_lib::LoopbackPingTransport> transport(
+      new rlz_lib::LoopbackPingTransport);
+  transport->SetResponse("rlzW1: 1R1\r\n"
+                         "ping-interval: 172800\r\n"
+                         "crc32: 84B05079", 200);
+  rlz_lib::PingTransport::Set(transport);
+
+  rlz_lib::AccessPoint points[] =
+    {rlz_lib::IE_HOME_PAGE, rlz_lib::NO_ACCESS_POINT};
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+
+  bool sent = rlz_lib::SendFinancialPing(rlz_lib::TOOLBAR_NOTIFIER, points,
+      "swg", "GGLA", "SwgProductId1234", "en-UK", false, NULL, true);
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty()) {
+    // The brand does not match the supplementary brand.
+    EXPECT_FALSE(sent);
+    EXPECT_EQ(0, transport->request_count());
+  } else {
+    EXPECT_TRUE(sent);
+    EXPECT_EQ(1, transport->request_count());
+    EXPECT_EQ(0U,
+              transport->last_request().find(rlz_lib::kFinancialPingPath));
+
+    char rlz[rlz_lib::kMaxRlzLength + 1];
+    EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IE_HOME_PAGE, rlz,
+                                           arraysize(rlz)));
+    EXPECT_STREQ("1R1", rlz);
+
+    char cgi[50];
+    EXPECT_FALSE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                                cgi, arraysize(cgi)));
+
+    // A server error fails the ping, but the server answered it, so it is
+    // not retried.
+    std::string retry;
+    bool due = false;
+    transport->SetResponse("", 500);
+    EXPECT_FALSE(rlz_lib::SendFinancialPing(rlz_lib::TOOLBAR_NOTIFIER,
+        points, "swg", "GGLA", "SwgProductId1234", "en-UK", false, NULL,
+        true));
+    EXPECT_EQ(2, transport->request_count());
+    EXPECT_FALSE(rlz_lib::PingRetryQueue::Get(rlz_lib::TOOLBAR_NOTIFIER,
+                                              NULL, &retry, &due));
+
+    // A server which can not be reached fails the ping, which is retried.
+    transport->SetResponse("", 0);
+    EXPECT_FALSE(rlz_lib::SendFinancialPing(rlz_lib::TOOLBAR_NOTIFIER,
+        points, "swg", "GGLA", "SwgProductId1234", "en-UK", false, NULL,
+        true));
+    EXPECT_EQ(3, transport->request_count());
+    EXPECT_TRUE(rlz_lib::PingRetryQueue::Get(rlz_lib::TOOLBAR_NOTIFIER,
+                                             NULL, &retry, &due));
+    EXPECT_TRUE(rlz_lib::PingRetryQueue::Clear(rlz_lib::TOOLBAR_NOTIFIER,
+                                               NULL));
+  }
+
+  rlz_lib::PingTransport::Set(NULL);
+}
+
+TEST_F(RlzLibTest, SendFinancialPings) {
+  // As in SendFinancialPing, the ping that goes out is not checked.
+  rlz_lib::AccessPoint toolbar_points[] =
+    {rlz_lib::IETB_SEARCH_BOX, rlz_lib::NO_ACCESS_POINT};
+  rlz_lib::AccessPoint desktop_points[] =
+    {rlz_lib::GD_DESKBAND, rlz_lib::NO_ACCESS_POINT};
+
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+
+  // The desktop product just pinged, so it is not due.
+  EXPECT_TRUE(rlz_lib::FinancialPing::UpdateLastPingTime(rlz_lib::DESKTOP,
+                                                         NULL));
+
+  rlz_lib::FinancialPingParams pings[] = {
+    {rlz_lib::TOOLBAR_NOTIFIER, toolbar_points, "swg", "GGLA",
+     "SwgProductId1234", "en-UK", false, true},
+    {rlz_lib::DESKTOP, desktop_points, "swg", "GGLA", NULL, "en-UK", false,
+     false},
+  };
+
+  bool results[] = {true, true};
+  EXPECT_FALSE(rlz_lib::SendFinancialPings(pings, arraysize(pings), NULL,
+                                           results));
+  EXPECT_FALSE(results[1]);
+
+  EXPECT_FALSE(rlz_lib::SendFinancialPings(NULL, 0));
+}
+
 TEST_F(RlzLibTest, ClearProductState) {
   MachineDealCodeHelper::Clear();
 
@@ -457,6 +708,35 @@ TEST_F(RlzLibTest, ClearProductState) {
   EXPECT_STREQ("", cgi);
 }
 
+TEST_F(RlzLibTest, ClearProductStateDeletesEmptyKeys) {
+  rlz_lib::AccessPoint points[rlz_lib::PACK_AP13 - rlz_lib::PACK_AP0 + 2];
+  for (int i = 0; i <= rlz_lib::PACK_AP13 - rlz_lib::PACK_AP0; ++i) {
+    points[i] = static_cast<rlz_lib::AccessPoint>(rlz_lib::PACK_AP0 + i);
+    EXPECT_TRUE(rlz_lib::SetAccessPointRlz(points[i], "PackRlzValue"));
+    EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::PACK, points[i],
+                                            rlz_lib::INSTALL));
+  }
+  points[rlz_lib::PACK_AP13 - rlz_lib::PACK_AP0 + 1] =
+      rlz_lib::NO_ACCESS_POINT;
+  EXPECT_TRUE(rlz_lib::FinancialPing::UpdateLastPingTime(rlz_lib::PACK,
+                                                         NULL));
+  EXPECT_TRUE(rlz_lib::FinancialPing::SetPingInterval(rlz_lib::PACK, NULL,
+                                                      24 * 3600));
+
+  rlz_lib::ClearProductState(rlz_lib::PACK, points);
+
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::PACK_AP0, rlz,
+                                         arraysize(rlz)));
+  EXPECT_STREQ("", rlz);
+  EXPECT_FALSE(rlz_lib::HasPendingEvents(rlz_lib::PACK));
+
+  // Nothing else was stored, so no key is left behind.
+  base::win::RegKey lib_key(HKEY_CURRENT_USER, rlz_lib::kLibKeyName,
+                            KEY_READ);
+  EXPECT_FALSE(lib_key.Valid());
+}
+
 template<class T>
 class typed_buffer_ptr {
   scoped_array<char> buffer_;
@@ -721,3 +1001,526 @@ TEST_F(RlzLibTest, BrandingWithStatefulEvents) {
                                              value, 50));
   EXPECT_STREQ("events=I7S", value);
 }
+
+TEST_F(RlzLibTest, StateCache) {
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  char cgi_50[50];
+
+  rlz_lib::EnableStateCache(true);
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "IeTbRlz"));
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz, 50));
+  EXPECT_STREQ("IeTbRlz", rlz);
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz, 50));
+  EXPECT_STREQ("IeTbRlz", rlz);
+
+  // Writes from this process are seen immediately.
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "NewRlz"));
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz, 50));
+  EXPECT_STREQ("NewRlz", rlz);
+
+  // So are direct registry writes, as if made by another process.
+  {
+    base::win::RegKey key;
+    EXPECT_TRUE(rlz_lib::GetAccessPointRlzsRegKey(HKEY_CURRENT_USER,
+                                                  KEY_WRITE, &key));
+    EXPECT_EQ(ERROR_SUCCESS, key.WriteValue(L"T4", L"OtherRlz"));
+  }
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz, 50));
+  EXPECT_STREQ("OtherRlz", rlz);
+
+  // A cached value still honours the caller's buffer size.
+  EXPECT_FALSE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz, 4));
+  EXPECT_STREQ("", rlz);
+
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_FALSE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                              cgi_50, 50));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             cgi_50, 50));
+  EXPECT_STREQ("events=I7S", cgi_50);
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             cgi_50, 50));
+  EXPECT_STREQ("events=I7S", cgi_50);
+
+  {
+    rlz_lib::Product product = rlz_lib::TOOLBAR_NOTIFIER;
+    DWORD value = 1;
+    base::win::RegKey key;
+    EXPECT_TRUE(rlz_lib::GetEventsRegKey(HKEY_CURRENT_USER,
+                                         rlz_lib::kEventsSubkeyName, &product,
+                                         KEY_WRITE, &key));
+    EXPECT_EQ(ERROR_SUCCESS, key.WriteValue(L"W1I", value));
+  }
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             cgi_50, 50));
+  EXPECT_STREQ("events=I7S,W1I", cgi_50);
+
+  rlz_lib::EnableStateCache(false);
+}
+
+TEST_F(RlzLibTest, SharedStateMirror) {
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  std::string mirrored;
+
+  rlz_lib::EnableSharedStateMirror(true);
+
+  // Values are mirrored once read.
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "IeTbRlz"));
+  EXPECT_FALSE(rlz_lib::SharedStateMirror::LookupRlz(
+      NULL, rlz_lib::IETB_SEARCH_BOX, &mirrored));
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz, 50));
+  EXPECT_STREQ("IeTbRlz", rlz);
+  EXPECT_TRUE(rlz_lib::SharedStateMirror::LookupRlz(
+      NULL, rlz_lib::IETB_SEARCH_BOX, &mirrored));
+  EXPECT_EQ("IeTbRlz", mirrored);
+
+  // The mirror is read without going to the registry.
+  {
+    base::win::RegKey key;
+    EXPECT_TRUE(rlz_lib::GetAccessPointRlzsRegKey(HKEY_CURRENT_USER,
+                                                  KEY_WRITE, &key));
+    EXPECT_EQ(ERROR_SUCCESS, key.WriteValue(L"T4", L"OtherRlz"));
+  }
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz, 50));
+  EXPECT_STREQ("IeTbRlz", rlz);
+
+  // Writers drop the mirrored values, even when they do not use the mirror.
+  rlz_lib::EnableSharedStateMirror(false);
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "NewRlz"));
+  rlz_lib::EnableSharedStateMirror(true);
+  EXPECT_FALSE(rlz_lib::SharedStateMirror::LookupRlz(
+      NULL, rlz_lib::IETB_SEARCH_BOX, &mirrored));
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz, 50));
+  EXPECT_STREQ("NewRlz", rlz);
+
+  // A mirrored value still honours the caller's buffer size.
+  EXPECT_FALSE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz, 4));
+  EXPECT_STREQ("", rlz);
+
+  // Values are mirrored per user.
+  EXPECT_FALSE(rlz_lib::SharedStateMirror::LookupRlz(
+      L"S-1-5-21-0-0-0-1000", rlz_lib::IETB_SEARCH_BOX, &mirrored));
+
+  rlz_lib::EnableSharedStateMirror(false);
+  EXPECT_FALSE(rlz_lib::SharedStateMirror::LookupRlz(
+      NULL, rlz_lib::IETB_SEARCH_BOX, &mirrored));
+}
+
+TEST_F(RlzLibTest, ScopedRlzSession) {
+  char cgi_50[50];
+
+  rlz_lib::ScopedRlzSession session;
+  EXPECT_FALSE(session.failed());
+
+  // Calls made while the session holds the lock nest inside it.
+  {
+    rlz_lib::ScopedRlzSession nested_session;
+    EXPECT_FALSE(nested_session.failed());
+    EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+    EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+        rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  }
+
+  // The lock is still held by the outer session.
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             cgi_50, 50));
+  EXPECT_STREQ("events=I7S", cgi_50);
+
+  // Nested calls which write also reuse the lock.
+  const char* kPingResponse =
+    "events: I7S\r\n"
+    "crc32: BEC30378";
+  EXPECT_TRUE(rlz_lib::ParsePingResponse(rlz_lib::TOOLBAR_NOTIFIER,
+                                         kPingResponse));
+  EXPECT_FALSE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                              cgi_50, 50));
+}
+
+struct TraceLog {
+  std::vector<std::string> events;
+  int open_spans;
+};
+
+void RLZ_LIB_API OnTraceEvent(rlz_lib::TraceEventType type, const char* name,
+                              int64 duration_us, void* context) {
+  TraceLog* log = static_cast<TraceLog*>(context);
+  log->events.push_back(std::string(type == rlz_lib::TRACE_BEGIN ?
+                                    "+" : "-") + name);
+  log->open_spans += type == rlz_lib::TRACE_BEGIN ? 1 : -1;
+  EXPECT_LE(0, duration_us);
+}
+
+TEST_F(RlzLibTest, TraceCallback) {
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  TraceLog log;
+  log.open_spans = 0;
+
+  rlz_lib::SetTraceCallback(OnTraceEvent, &log);
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz, 50));
+  rlz_lib::SetTraceCallback(NULL, NULL);
+
+  // The RLZs key is opened, and all the spans are closed.
+  ASSERT_LE(2u, log.events.size());
+  EXPECT_EQ("+GetRegKey", log.events[0]);
+  EXPECT_EQ("-GetRegKey", log.events[1]);
+  EXPECT_EQ(0, log.open_spans);
+
+  // Nothing is reported once the callback is cleared.
+  size_t event_count = log.events.size();
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz, 50));
+  EXPECT_EQ(event_count, log.events.size());
+}
+
+// Holds the RLZ lock on another thread until |context| is signaled.
+DWORD WINAPI HoldLockThread(void* context) {
+  HANDLE* events = static_cast<HANDLE*>(context);
+  rlz_lib::ScopedRlzSession session;
+  SetEvent(events[0]);
+  WaitForSingleObject(events[1], INFINITE);
+  return session.failed() ? 1 : 0;
+}
+
+TEST_F(RlzLibTest, LockStats) {
+  rlz_lib::LockStats stats;
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+
+  rlz_lib::ResetLockStats();
+  EXPECT_TRUE(rlz_lib::GetLockStats(&stats));
+  EXPECT_EQ(0, stats.acquisitions);
+  EXPECT_EQ(0, stats.timeouts);
+
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz, 50));
+  {
+    // Nested locks are not counted.
+    rlz_lib::ScopedRlzSession session;
+    EXPECT_FALSE(session.failed());
+    EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz, 50));
+  }
+  EXPECT_TRUE(rlz_lib::GetLockStats(&stats));
+  EXPECT_EQ(2, stats.acquisitions);
+  EXPECT_EQ(0, stats.contended_acquisitions);
+  EXPECT_EQ(0, stats.timeouts);
+  EXPECT_EQ(0, stats.abandoned);
+
+  // While another thread holds the lock, tries and short waits fail.
+  HANDLE events[2] = {CreateEvent(NULL, TRUE, FALSE, NULL),
+                      CreateEvent(NULL, TRUE, FALSE, NULL)};
+  HANDLE thread = CreateThread(NULL, 0, HoldLockThread, events, 0, NULL);
+  ASSERT_TRUE(thread != NULL);
+  EXPECT_EQ(WAIT_OBJECT_0, WaitForSingleObject(events[0], 30000));
+
+  {
+    rlz_lib::ScopedRlzSession session(0);
+    EXPECT_TRUE(session.failed());
+  }
+  EXPECT_TRUE(rlz_lib::SetLockTimeout(10));
+  EXPECT_FALSE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz, 50));
+  EXPECT_TRUE(rlz_lib::SetLockTimeout(rlz_lib::kDefaultLockTimeoutMs));
+  EXPECT_FALSE(rlz_lib::SetLockTimeout(-1));
+
+  SetEvent(events[1]);
+  EXPECT_EQ(WAIT_OBJECT_0, WaitForSingleObject(thread, 30000));
+  DWORD exit_code = 1;
+  EXPECT_TRUE(GetExitCodeThread(thread, &exit_code));
+  EXPECT_EQ(0u, exit_code);
+  CloseHandle(thread);
+  CloseHandle(events[0]);
+  CloseHandle(events[1]);
+
+  EXPECT_TRUE(rlz_lib::GetLockStats(&stats));
+  EXPECT_EQ(3, stats.acquisitions);  // Including the other thread.
+  EXPECT_EQ(2, stats.timeouts);
+  EXPECT_LE(stats.max_wait_ms, stats.total_wait_ms);
+}
+
+TEST_F(RlzLibTest, UserKeyCache) {
+  std::wstring sid;
+  ASSERT_TRUE(rlz_lib::ProcessInfo::GetUserSid(&sid));
+  if (!rlz_lib::ProcessInfo::HasAdminRights())
+    return;  // Other users' keys can only be opened by administrators.
+
+  // Without the cache, each UserKey opens its own key.
+  {
+    rlz_lib::UserKey first(sid.c_str());
+    rlz_lib::UserKey second(sid.c_str());
+    EXPECT_TRUE(first.Get() != HKEY_CURRENT_USER);
+    EXPECT_TRUE(first.Get() != second.Get());
+  }
+
+  rlz_lib::EnableUserKeyCache(true);
+  rlz_lib::UserKey first(sid.c_str());
+  {
+    rlz_lib::UserKey second(sid.c_str());
+    EXPECT_EQ(first.Get(), second.Get());
+    EXPECT_TRUE(second.HasAccess(true));
+  }
+
+  // An invalidated key stays usable by the UserKeys that hold it.
+  rlz_lib::InvalidateUserKeyCache(sid.c_str());
+  {
+    rlz_lib::UserKey second(sid.c_str());
+    EXPECT_TRUE(first.Get() != second.Get());
+  }
+  base::win::RegKey software;
+  EXPECT_EQ(ERROR_SUCCESS, software.Open(first.Get(), L"Software", KEY_READ));
+
+  // Calls with the SID use the cached key.
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz,
+                                         arraysize(rlz), sid.c_str()));
+
+  rlz_lib::EnableUserKeyCache(false);
+}
+
+TEST_F(RlzLibTest, UserKeyCachePoolsSubkeys) {
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  rlz_lib::EnableUserKeyCache(true);
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "Pooled"));
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz,
+                                         arraysize(rlz)));
+  EXPECT_STREQ("Pooled", rlz);
+
+  // Keys deleted behind the pool's back are looked up again.
+  base::win::RegKey lib_key(HKEY_CURRENT_USER, rlz_lib::kLibKeyName,
+                            KEY_ALL_ACCESS);
+  std::wstring rlzs_name(rlz_lib::kRlzsSubkeyName);
+  rlz_lib::SupplementaryBranding::AppendBrandToString(&rlzs_name);
+  EXPECT_EQ(ERROR_SUCCESS, lib_key.DeleteKey(rlzs_name.c_str()));
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz,
+                                         arraysize(rlz)));
+  EXPECT_STREQ("", rlz);
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "Again"));
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz,
+                                         arraysize(rlz)));
+  EXPECT_STREQ("Again", rlz);
+
+  // The keys of another brand are kept apart.
+  if (rlz_lib::SupplementaryBranding::GetBrand().empty()) {
+    {
+      rlz_lib::SupplementaryBranding branding(L"TEST");
+      EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz,
+                                             arraysize(rlz)));
+      EXPECT_STREQ("", rlz);
+    }
+    EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, rlz,
+                                           arraysize(rlz)));
+    EXPECT_STREQ("Again", rlz);
+  }
+
+  rlz_lib::EnableUserKeyCache(false);
+}
+
+TEST_F(RlzLibTest, TempHivesAreRestoredForEachTest) {
+  // Nothing written by the previous tests is left in the restored HKCU.
+  base::win::RegKey lib_key;
+  EXPECT_NE(ERROR_SUCCESS,
+            lib_key.Open(HKEY_CURRENT_USER, rlz_lib::kLibKeyName, KEY_READ));
+
+  // The restored HKLM has the subtrees copied into the template hive.
+  if (base::win::GetVersion() >= base::win::VERSION_WIN7) {
+    base::win::RegKey access_providers;
+    EXPECT_EQ(ERROR_SUCCESS, access_providers.Open(HKEY_LOCAL_MACHINE,
+        L"System\\CurrentControlSet\\Control\\Lsa\\AccessProviders",
+        KEY_READ));
+  }
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "Restored"));
+  EXPECT_EQ(ERROR_SUCCESS,
+            lib_key.Open(HKEY_CURRENT_USER, rlz_lib::kLibKeyName, KEY_READ));
+}
+
+namespace {
+
+struct SweepLog {
+  volatile LONG calls;
+  volatile LONG running;
+  volatile LONG max_running;
+};
+
+bool SweepTask(const wchar_t* sid, void* context) {
+  SweepLog* log = static_cast<SweepLog*>(context);
+  InterlockedIncrement(&log->calls);
+  LONG running = InterlockedIncrement(&log->running);
+  LONG max_running = log->max_running;
+  while (running > max_running &&
+         InterlockedCompareExchange(&log->max_running, running,
+                                    max_running) != max_running)
+    max_running = log->max_running;
+
+  Sleep(50);
+  InterlockedDecrement(&log->running);
+  return std::wstring(sid) != L"S-1-5-21-0-0-0-1002";
+}
+
+}  // namespace anonymous
+
+TEST_F(RlzLibTest, UserSweep) {
+  std::vector<std::wstring> sids;
+  for (int i = 0; i < 6; ++i)
+    sids.push_back(base::StringPrintf(L"S-1-5-21-0-0-0-%d", 1000 + i));
+
+  SweepLog log = {0, 0, 0};
+  bool results[6];
+  rlz_lib::UserSweep::Run(sids, 3, SweepTask, &log, results);
+  EXPECT_EQ(6, log.calls);
+  EXPECT_EQ(0, log.running);
+  EXPECT_LE(log.max_running, 3);
+  for (int i = 0; i < 6; ++i)
+    EXPECT_EQ(i != 2, results[i]);
+
+  // The user running the tests has a loaded hive.
+  std::wstring sid;
+  ASSERT_TRUE(rlz_lib::ProcessInfo::GetUserSid(&sid));
+  ASSERT_TRUE(rlz_lib::UserSweep::GetLoadedUserSids(&sids));
+  EXPECT_NE(sids.end(), std::find(sids.begin(), sids.end(), sid));
+}
+
+TEST_F(RlzLibTest, PingParamsCache) {
+  MachineDealCodeHelper::Clear();
+
+  rlz_lib::AccessPoint points[] =
+    {rlz_lib::IETB_SEARCH_BOX, rlz_lib::NO_ACCESS_POINT};
+  char cgi[50];
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "TbRlz"));
+  EXPECT_TRUE(rlz_lib::GetPingParams(rlz_lib::TOOLBAR_NOTIFIER, points,
+                                     cgi, 50));
+  EXPECT_STREQ("rep=2&rlz=T4:TbRlz", cgi);
+
+  // Params built from values just written are not cached.
+  rlz_lib::PingParamsStamp stamp;
+  {
+    rlz_lib::UserKey user_key(NULL);
+    ASSERT_TRUE(rlz_lib::PingParamsCache::ReadStamp(user_key.Get(), &stamp));
+  }
+  EXPECT_FALSE(stamp.settled);
+  rlz_lib::CgiBuilder builder(cgi, 50);
+  EXPECT_FALSE(rlz_lib::PingParamsCache::Lookup(NULL, points, 1, stamp,
+                                                &builder));
+
+  // Settled params are served until the registry changes.
+  stamp.settled = true;
+  rlz_lib::PingParamsCache::Store(NULL, points, 1, stamp, "rep=2&rlz=T4:Old");
+  EXPECT_TRUE(rlz_lib::PingParamsCache::Lookup(NULL, points, 1, stamp,
+                                               &builder));
+  EXPECT_STREQ("rep=2&rlz=T4:Old", cgi);
+
+  rlz_lib::PingParamsStamp newer = stamp;
+  newer.rlzs_write_time.dwLowDateTime++;
+  builder.Truncate(0);
+  EXPECT_FALSE(rlz_lib::PingParamsCache::Lookup(NULL, points, 1, newer,
+                                                &builder));
+
+  // Other access point lists have entries of their own.
+  rlz_lib::AccessPoint other_points[] =
+    {rlz_lib::IE_HOME_PAGE, rlz_lib::NO_ACCESS_POINT};
+  EXPECT_FALSE(rlz_lib::PingParamsCache::Lookup(NULL, other_points, 1, stamp,
+                                                &builder));
+
+  // Writers drop the cached params.
+  rlz_lib::PingParamsCache::InvalidateMachine();
+  EXPECT_FALSE(rlz_lib::PingParamsCache::Lookup(NULL, points, 1, stamp,
+                                                &builder));
+  rlz_lib::PingParamsCache::Store(NULL, points, 1, stamp, "rep=2&rlz=T4:Old");
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "NewRlz"));
+  EXPECT_FALSE(rlz_lib::PingParamsCache::Lookup(NULL, points, 1, stamp,
+                                                &builder));
+  EXPECT_TRUE(rlz_lib::GetPingParams(rlz_lib::TOOLBAR_NOTIFIER, points,
+                                     cgi, 50));
+  EXPECT_STREQ("rep=2&rlz=T4:NewRlz", cgi);
+}
+
+TEST_F(RlzLibTest, EventWriteBehind) {
+  rlz_lib::Product product = rlz_lib::TOOLBAR_NOTIFIER;
+  char cgi[50];
+
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(product));
+  rlz_lib::EnableEventWriteBehind(true);
+
+  // Events are queued once, and this process sees them right away.
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(product, rlz_lib::IE_HOME_PAGE,
+                                          rlz_lib::INSTALL));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(product, rlz_lib::IE_HOME_PAGE,
+                                          rlz_lib::INSTALL));
+  EXPECT_TRUE(rlz_lib::HasPendingEvents(product));
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(product, cgi, 50));
+  EXPECT_STREQ("events=W1I", cgi);
+
+  // Invalid events are not queued, so the caller gets the failure.
+  EXPECT_FALSE(rlz_lib::RecordProductEvent(product, rlz_lib::IE_HOME_PAGE,
+                                           rlz_lib::INVALID_EVENT));
+  EXPECT_FALSE(rlz_lib::RecordProductEvent(product,
+                                           rlz_lib::NO_ACCESS_POINT,
+                                           rlz_lib::INSTALL));
+
+  // Clearing an event writes the queue first.
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(product,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::ClearProductEvent(product, rlz_lib::IE_DEFAULT_SEARCH,
+                                         rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(product, cgi, 50));
+  EXPECT_STREQ("events=W1I", cgi);
+
+  // Flushed events are in the registry for other processes.
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(product, rlz_lib::IETB_SEARCH_BOX,
+                                          rlz_lib::FIRST_SEARCH));
+  EXPECT_TRUE(rlz_lib::FlushQueuedEvents());
+  {
+    DWORD value = 0;
+    base::win::RegKey key;
+    EXPECT_TRUE(rlz_lib::GetEventsRegKey(HKEY_CURRENT_USER,
+                                         rlz_lib::kEventsSubkeyName, &product,
+                                         KEY_READ, &key));
+    EXPECT_EQ(ERROR_SUCCESS, key.ReadValueDW(L"T4F", &value));
+    EXPECT_EQ(static_cast<DWORD>(1), value);
+  }
+
+  // Stateful events are still skipped.
+  rlz_lib::RlzWriteBatch batch;
+  EXPECT_TRUE(batch.RecordStatefulEvent(product, rlz_lib::IE_HOME_PAGE,
+                                        rlz_lib::ACTIVATE));
+  EXPECT_TRUE(batch.Commit(NULL, false));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(product, rlz_lib::IE_HOME_PAGE,
+                                          rlz_lib::ACTIVATE));
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(product, cgi, 50));
+  EXPECT_STREQ("events=W1I,T4F", cgi);
+
+  // Disabling the queue writes it.
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(product, rlz_lib::IE_DEFAULT_SEARCH,
+                                          rlz_lib::INSTALL));
+  rlz_lib::EnableEventWriteBehind(false);
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(product, cgi, 50));
+  EXPECT_STREQ("events=W1I,T4F,I7I", cgi);
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(product));
+}
+
+TEST_F(RlzLibTest, EventWriteBehindKeepsUnwrittenEvents) {
+  rlz_lib::Product product = rlz_lib::TOOLBAR_NOTIFIER;
+  char cgi[50];
+
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(product));
+  rlz_lib::EnableEventWriteBehind(true);
+
+  // A file store which can not be opened fails the commits.
+  rlz_lib::RlzValueStore::SetFileStoreDirectoriesForTesting(L"Z:\\<rlz>",
+                                                            L"Z:\\<rlz>");
+  rlz_lib::EnableFileStateStore(true, false);
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(product, rlz_lib::IE_HOME_PAGE,
+                                          rlz_lib::INSTALL));
+  EXPECT_FALSE(rlz_lib::FlushQueuedEvents());
+  EXPECT_FALSE(rlz_lib::FlushQueuedEvents());
+
+  // The events stay queued until they can be written.
+  rlz_lib::EnableFileStateStore(false, false);
+  rlz_lib::RlzValueStore::SetFileStoreDirectoriesForTesting(NULL, NULL);
+  EXPECT_TRUE(rlz_lib::FlushQueuedEvents());
+  rlz_lib::EnableEventWriteBehind(false);
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(product, cgi, 50));
+  EXPECT_STREQ("events=W1I", cgi);
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(product));
+}
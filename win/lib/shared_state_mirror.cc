@@ -0,0 +1,475 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// An optional mirror of the RLZs and the DCC in a named shared memory
+// section, which readers in all the processes of a session can use without
+// waiting on the RLZ mutex.
+
+#include "rlz/win/lib/shared_state_mirror.h"
+
+#include <windows.h>
+#include <Aclapi.h>  // For GetSecurityInfo
+#include <string.h>
+
+#include "base/atomicops.h"
+#include "base/basictypes.h"
+#include "base/lazy_instance.h"
+#include "base/stringprintf.h"
+#include "base/synchronization/lock.h"
+#include "base/win/windows_version.h"
+#include "rlz/win/lib/lib_mutex.h"
+#include "rlz/win/lib/process_info.h"
+#include "rlz/win/lib/vista_winnt.h"
+
+namespace {
+
+// Like the RLZ mutex, the section lives in the session namespace. The layout
+// version is part of the name, so that clients with different layouts never
+// share a section.
+const wchar_t kSectionName[] =
+    L"{A946A6A9-917E-4949-B9BC-6BADA8C7FD63}-StateMirror1";
+
+const int kMaxUsers = 16;
+const int kMaxOwnerLength = 256;
+
+// Readers give up and fall back to the registry after this many snapshots
+// were torn by writers.
+const int kMaxReadAttempts = 16;
+
+struct SharedUser {
+  // The SID and the supplementary brand, empty for a free slot.
+  wchar_t owner[kMaxOwnerLength + 1];
+  DWORD last_used;
+  BYTE has_rlz[rlz_lib::LAST_ACCESS_POINT];
+  DWORD rlz_times[rlz_lib::LAST_ACCESS_POINT];
+  char rlzs[rlz_lib::LAST_ACCESS_POINT][rlz_lib::kMaxRlzLength + 1];
+};
+
+// A new section is zero filled, which is the empty state.
+struct SharedSection {
+  // Odd while a writer is updating the section.
+  base::subtle::Atomic32 version;
+  BYTE has_dcc;
+  DWORD dcc_time;
+  char dcc[rlz_lib::kMaxDccLength + 1];
+  SharedUser users[kMaxUsers];
+};
+
+// Whether |object| is labelled medium integrity or higher. Objects keep the
+// label of the process which created them, so a section a low integrity
+// process created first is not trusted.
+bool HasTrustedLabel(HANDLE object) {
+  if (base::win::GetVersion() < base::win::VERSION_VISTA)
+    return true;  // No integrity levels on XP.
+
+  PSECURITY_DESCRIPTOR security_descriptor = NULL;
+  PACL sacl = NULL;
+  if (GetSecurityInfo(object, SE_KERNEL_OBJECT, LABEL_SECURITY_INFORMATION,
+                      NULL, NULL, NULL, &sacl, &security_descriptor) !=
+      ERROR_SUCCESS)
+    return false;
+
+  // Objects without a label are medium integrity.
+  bool trusted = true;
+  for (DWORD i = 0; sacl && i < sacl->AceCount; ++i) {
+    ACE_HEADER* ace = NULL;
+    if (!GetAce(sacl, i, reinterpret_cast<void**>(&ace)) ||
+        ace->AceType != SYSTEM_MANDATORY_LABEL_ACE_TYPE)
+      continue;
+
+    PSID sid = &reinterpret_cast<SYSTEM_MANDATORY_LABEL_ACE*>(ace)->SidStart;
+    DWORD level = *GetSidSubAuthority(sid, *GetSidSubAuthorityCount(sid) - 1);
+    trusted = level >= SECURITY_MANDATORY_MEDIUM_RID;
+  }
+
+  LocalFree(security_descriptor);
+  return trusted;
+}
+
+bool IsFresh(DWORD time) {
+  return GetTickCount() - time <
+      static_cast<DWORD>(rlz_lib::SharedStateMirror::kMaxAgeMs);
+}
+
+// The per-process state of the mirror. The view is never unmapped, so that
+// readers can use it after releasing the lock.
+class MirrorData {
+ public:
+  MirrorData()
+      : enabled_(false),
+        private_section_(false),
+        create_failed_(false),
+        writable_(false),
+        section_(NULL) {}
+
+  base::Lock& lock() { return lock_; }
+
+  bool enabled() const { return enabled_; }
+  void set_enabled(bool enabled) { enabled_ = enabled; }
+
+  // Returns the section, creating it if |create| is true and it does not
+  // exist yet. The caller must hold lock().
+  //
+  // The section keeps its default label, so that low integrity processes,
+  // which may be sandboxed, can not publish values for the other processes
+  // to trust. They only map an existing section, read-only.
+  SharedSection* GetSection(bool create) {
+    if (section_ || (create && create_failed_))
+      return section_;
+
+    std::wstring name(kSectionName);
+    if (private_section_)
+      base::StringAppendF(&name, L"-%u", GetCurrentProcessId());
+
+    bool low_integrity = rlz_lib::ProcessInfo::GetIntegrityLevel() ==
+        rlz_lib::ProcessInfo::LOW_INTEGRITY;
+    HANDLE mapping = NULL;
+    if (low_integrity) {
+      mapping = OpenFileMappingW(FILE_MAP_READ | READ_CONTROL, FALSE,
+                                 name.c_str());
+    } else if (create) {
+      mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                   0, sizeof(SharedSection), name.c_str());
+      create_failed_ = !mapping;
+    } else {
+      mapping = OpenFileMappingW(FILE_MAP_READ | FILE_MAP_WRITE | READ_CONTROL,
+                                 FALSE, name.c_str());
+    }
+    if (mapping && !HasTrustedLabel(mapping)) {
+      CloseHandle(mapping);
+      mapping = NULL;
+      create_failed_ = create;
+    }
+    if (!mapping)
+      return NULL;
+
+    // The mapping handle is kept open for the lifetime of the process.
+    writable_ = !low_integrity;
+    DWORD access = writable_ ? FILE_MAP_READ | FILE_MAP_WRITE : FILE_MAP_READ;
+    section_ = static_cast<SharedSection*>(MapViewOfFile(
+        mapping, access, 0, 0, sizeof(SharedSection)));
+    if (!section_) {
+      CloseHandle(mapping);
+      create_failed_ = create;
+    }
+    return section_;
+  }
+
+  // Whether the view of the section can be written. The caller must hold
+  // lock().
+  bool writable() const { return writable_; }
+
+  // The SID, or the SID of the process user if |sid| is empty, and the
+  // supplementary brand. The caller must hold lock().
+  bool GetOwner(const wchar_t* sid, std::wstring* owner) {
+    if (sid && sid[0]) {
+      *owner = sid;
+    } else {
+      if (process_sid_.empty() &&
+          !rlz_lib::ProcessInfo::GetUserSid(&process_sid_))
+        return false;
+      *owner = process_sid_;
+    }
+
+    owner->push_back(L'\\');
+    owner->append(rlz_lib::SupplementaryBranding::GetBrand());
+    return owner->size() <= kMaxOwnerLength;
+  }
+
+  // The view of the shared section is leaked. The private section is only
+  // used by this process, so it is emptied instead.
+  void UsePrivateSection() {
+    if (private_section_) {
+      if (section_)
+        memset(section_, 0, sizeof(*section_));
+      return;
+    }
+
+    private_section_ = true;
+    create_failed_ = false;
+    section_ = NULL;
+  }
+
+ private:
+  base::Lock lock_;
+  bool enabled_;
+  bool private_section_;
+  bool create_failed_;
+  bool writable_;
+  SharedSection* section_;
+  std::wstring process_sid_;
+
+  DISALLOW_COPY_AND_ASSIGN(MirrorData);
+};
+
+// Leaky, so that it can also be used from a DLL without an AtExitManager.
+base::LazyInstance<MirrorData, base::LeakyLazyInstanceTraits<MirrorData> >
+    g_mirror(base::LINKER_INITIALIZED);
+
+// Gets the section and the owner for a lookup or a store, which are only
+// done when the mirror is enabled. Stores need a writable view.
+bool GetEnabledSection(const wchar_t* sid, bool write, SharedSection** section,
+                       std::wstring* owner) {
+  MirrorData* data = g_mirror.Pointer();
+  base::AutoLock auto_lock(data->lock());
+  if (!data->enabled())
+    return false;
+
+  *section = data->GetSection(true);
+  return *section && (!write || data->writable()) &&
+      (!owner || data->GetOwner(sid, owner));
+}
+
+// Gets an existing, writable section for an invalidation, whether or not the
+// mirror is enabled in this process.
+bool GetExistingSection(const wchar_t* sid, SharedSection** section,
+                        std::wstring* owner) {
+  MirrorData* data = g_mirror.Pointer();
+  base::AutoLock auto_lock(data->lock());
+  *section = data->GetSection(false);
+  return *section && data->writable() &&
+      (!owner || data->GetOwner(sid, owner));
+}
+
+int FindUser(const SharedSection* section, const std::wstring& owner) {
+  for (int i = 0; i < kMaxUsers; ++i) {
+    if (wcsncmp(section->users[i].owner, owner.c_str(),
+                kMaxOwnerLength + 1) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// Returns the slot of |owner|, taking a free slot or the least recently used
+// one if it has none. Only called by writers.
+SharedUser* FindOrAddUser(SharedSection* section, const std::wstring& owner) {
+  int user = FindUser(section, owner);
+  if (user >= 0)
+    return &section->users[user];
+
+  user = 0;
+  DWORD now = GetTickCount();
+  for (int i = 0; i < kMaxUsers; ++i) {
+    if (!section->users[i].owner[0]) {
+      user = i;
+      break;
+    }
+    if (now - section->users[i].last_used >
+        now - section->users[user].last_used)
+      user = i;
+  }
+
+  SharedUser* slot = &section->users[user];
+  memset(slot, 0, sizeof(*slot));
+  wcsncpy(slot->owner, owner.c_str(), kMaxOwnerLength);
+  return slot;
+}
+
+// The seqlock. Writers must hold the RLZ mutex.
+base::subtle::Atomic32 BeginWrite(SharedSection* section) {
+  // A writer which died while updating the section left the version odd.
+  base::subtle::Atomic32 version =
+      (base::subtle::NoBarrier_Load(&section->version) + 1) | 1;
+  base::subtle::NoBarrier_Store(&section->version, version);
+  base::subtle::MemoryBarrier();
+  return version;
+}
+
+void EndWrite(SharedSection* section, base::subtle::Atomic32 version) {
+  base::subtle::Release_Store(&section->version, version + 1);
+}
+
+bool BeginRead(const SharedSection* section,
+               base::subtle::Atomic32* version) {
+  *version = base::subtle::Acquire_Load(&section->version);
+  return (*version & 1) == 0;
+}
+
+bool EndRead(const SharedSection* section, base::subtle::Atomic32 version) {
+  base::subtle::MemoryBarrier();
+  return base::subtle::NoBarrier_Load(&section->version) == version;
+}
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+// static
+void SharedStateMirror::SetEnabled(bool enabled) {
+  MirrorData* data = g_mirror.Pointer();
+  base::AutoLock auto_lock(data->lock());
+  data->set_enabled(enabled);
+}
+
+// static
+bool SharedStateMirror::IsEnabled() {
+  MirrorData* data = g_mirror.Pointer();
+  base::AutoLock auto_lock(data->lock());
+  return data->enabled();
+}
+
+// static
+bool SharedStateMirror::LookupRlz(const wchar_t* sid, AccessPoint point,
+                                  std::string* rlz) {
+  if (point <= NO_ACCESS_POINT || point >= LAST_ACCESS_POINT)
+    return false;
+
+  SharedSection* section = NULL;
+  std::wstring owner;
+  if (!GetEnabledSection(sid, false, &section, &owner))
+    return false;
+
+  for (int attempt = 0; attempt < kMaxReadAttempts; ++attempt) {
+    base::subtle::Atomic32 version;
+    if (!BeginRead(section, &version)) {
+      YieldProcessor();
+      continue;
+    }
+
+    bool found = false;
+    char value[kMaxRlzLength + 1];
+    int user = FindUser(section, owner);
+    if (user >= 0) {
+      const SharedUser& shared_user = section->users[user];
+      found = shared_user.has_rlz[point] &&
+          IsFresh(shared_user.rlz_times[point]);
+      if (found)
+        memcpy(value, shared_user.rlzs[point], sizeof(value));
+    }
+
+    if (!EndRead(section, version))
+      continue;
+
+    if (found) {
+      value[kMaxRlzLength] = 0;
+      rlz->assign(value);
+    }
+    return found;
+  }
+
+  return false;
+}
+
+// static
+bool SharedStateMirror::LookupDcc(std::string* dcc) {
+  SharedSection* section = NULL;
+  if (!GetEnabledSection(NULL, false, &section, NULL))
+    return false;
+
+  for (int attempt = 0; attempt < kMaxReadAttempts; ++attempt) {
+    base::subtle::Atomic32 version;
+    if (!BeginRead(section, &version)) {
+      YieldProcessor();
+      continue;
+    }
+
+    char value[kMaxDccLength + 1];
+    bool found = section->has_dcc && IsFresh(section->dcc_time);
+    if (found)
+      memcpy(value, section->dcc, sizeof(value));
+
+    if (!EndRead(section, version))
+      continue;
+
+    if (found) {
+      value[kMaxDccLength] = 0;
+      dcc->assign(value);
+    }
+    return found;
+  }
+
+  return false;
+}
+
+// static
+void SharedStateMirror::StoreRlz(const wchar_t* sid, AccessPoint point,
+                                 const std::string& rlz) {
+  if (point <= NO_ACCESS_POINT || point >= LAST_ACCESS_POINT ||
+      rlz.size() > kMaxRlzLength)
+    return;
+
+  LibMutex lock;
+  if (lock.failed())
+    return;
+
+  SharedSection* section = NULL;
+  std::wstring owner;
+  if (!GetEnabledSection(sid, true, &section, &owner))
+    return;
+
+  base::subtle::Atomic32 version = BeginWrite(section);
+  SharedUser* user = FindOrAddUser(section, owner);
+  DWORD now = GetTickCount();
+  user->last_used = now;
+  user->has_rlz[point] = 1;
+  user->rlz_times[point] = now;
+  strncpy(user->rlzs[point], rlz.c_str(), kMaxRlzLength + 1);
+  EndWrite(section, version);
+}
+
+// static
+void SharedStateMirror::StoreDcc(const std::string& dcc) {
+  if (dcc.size() > kMaxDccLength)
+    return;
+
+  LibMutex lock;
+  if (lock.failed())
+    return;
+
+  SharedSection* section = NULL;
+  if (!GetEnabledSection(NULL, true, &section, NULL))
+    return;
+
+  base::subtle::Atomic32 version = BeginWrite(section);
+  section->has_dcc = 1;
+  section->dcc_time = GetTickCount();
+  strncpy(section->dcc, dcc.c_str(), kMaxDccLength + 1);
+  EndWrite(section, version);
+}
+
+// static
+void SharedStateMirror::InvalidateUser(const wchar_t* sid) {
+  // Writers usually hold the mutex already, in which case this is free.
+  LibMutex lock;
+  if (lock.failed())
+    return;
+
+  SharedSection* section = NULL;
+  std::wstring owner;
+  if (!GetExistingSection(sid, &section, &owner))
+    return;
+
+  int user = FindUser(section, owner);
+  if (user < 0)
+    return;
+
+  base::subtle::Atomic32 version = BeginWrite(section);
+  memset(section->users[user].has_rlz, 0,
+         sizeof(section->users[user].has_rlz));
+  EndWrite(section, version);
+}
+
+// static
+void SharedStateMirror::InvalidateMachine() {
+  LibMutex lock;
+  if (lock.failed())
+    return;
+
+  SharedSection* section = NULL;
+  if (!GetExistingSection(NULL, &section, NULL) || !section->has_dcc)
+    return;
+
+  base::subtle::Atomic32 version = BeginWrite(section);
+  section->has_dcc = 0;
+  EndWrite(section, version);
+}
+
+// static
+void SharedStateMirror::UsePrivateSectionForTesting() {
+  MirrorData* data = g_mirror.Pointer();
+  base::AutoLock auto_lock(data->lock());
+  data->UsePrivateSection();
+}
+
+}  // namespace rlz_lib
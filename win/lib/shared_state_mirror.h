@@ -0,0 +1,70 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// An optional mirror of the RLZs and the DCC in a named shared memory
+// section, which readers in all the processes of a session can use without
+// waiting on the RLZ mutex.
+
+#ifndef RLZ_WIN_LIB_SHARED_STATE_MIRROR_H_
+#define RLZ_WIN_LIB_SHARED_STATE_MIRROR_H_
+
+#include <string>
+
+#include "rlz/win/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+// Values are published by readers right after reading them from the registry,
+// and dropped by writers, both under the RLZ mutex. A version counter in the
+// section, odd while a writer is updating it, lets readers take a consistent
+// snapshot without a lock (a seqlock).
+//
+// Clients built before the mirror write the registry without dropping the
+// mirrored values, so values older than kMaxAgeMs are ignored.
+//
+// RLZs are mirrored per user SID (NULL or empty for the user running the
+// process) and per supplementary brand.
+//
+// Only processes of medium integrity or higher publish values. Low integrity
+// processes read a mirror those created, and neither publish nor drop values.
+class SharedStateMirror {
+ public:
+  static const int kMaxAgeMs = 30 * 1000;
+
+  // Enables the lookups and the publication of values in this process.
+  // Writers always drop the values they change from an existing mirror, so
+  // that processes using it never see stale values.
+  static void SetEnabled(bool enabled);
+  static bool IsEnabled();
+
+  // Lock free lookups. Return false when disabled, when the value is not
+  // mirrored or too old, or when no consistent snapshot could be taken. A
+  // missing RLZ is mirrored as the empty string.
+  static bool LookupRlz(const wchar_t* sid, AccessPoint point,
+                        std::string* rlz);
+  static bool LookupDcc(std::string* dcc);
+
+  // Publish values just read from the registry. The caller must have held the
+  // RLZ mutex since the read.
+  static void StoreRlz(const wchar_t* sid, AccessPoint point,
+                       const std::string& rlz);
+  static void StoreDcc(const std::string& dcc);
+
+  // Called by writers when they change the registry.
+  static void InvalidateUser(const wchar_t* sid);
+  static void InvalidateMachine();
+
+  // Switches this process to an empty section of its own, so that tests
+  // running on temporary hives do not publish their values to other
+  // processes.
+  static void UsePrivateSectionForTesting();
+
+ private:
+  SharedStateMirror() {}
+  ~SharedStateMirror() {}
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_SHARED_STATE_MIRROR_H_
@@ -0,0 +1,329 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// An optional in-process cache of the RLZ registry state.
+
+#include "rlz/win/lib/state_cache.h"
+
+#include <map>
+
+#include "base/basictypes.h"
+#include "base/lazy_instance.h"
+#include "base/memory/linked_ptr.h"
+#include "base/synchronization/lock.h"
+#include "base/win/registry.h"
+#include "rlz/win/lib/lib_values.h"
+
+namespace {
+
+// The cached state of one brand within a hive.
+struct BrandState {
+  BrandState() {
+    for (size_t i = 0; i < arraysize(rlz_cached); ++i)
+      rlz_cached[i] = false;
+  }
+
+  struct Events {
+    bool has_events;
+    std::string cgi;
+  };
+
+  bool rlz_cached[rlz_lib::LAST_ACCESS_POINT];
+  std::string rlzs[rlz_lib::LAST_ACCESS_POINT];
+  std::map<rlz_lib::Product, Events> events;
+};
+
+// The cached state of a hive, and the watch on its kLibKeyName key.
+struct HiveState {
+  HiveState() : generation(0), has_dcc(false), dcc_cached(false) {}
+
+  base::win::RegKey watch_key;
+  int generation;
+  std::map<std::wstring, BrandState> brands;
+
+  // Only used for the machine hive.
+  bool has_dcc;
+  bool dcc_cached;
+  std::string dcc;
+};
+
+class CacheData {
+ public:
+  CacheData() : enabled_(false), last_generation_(0) {}
+
+  base::Lock& lock() { return lock_; }
+  bool enabled() const { return enabled_; }
+
+  void SetEnabled(bool enabled) {
+    enabled_ = enabled;
+    if (!enabled) {
+      users_.clear();
+      machine_.watch_key.Close();
+      Reset(&machine_);
+    }
+  }
+
+  // Returns the state for the user hive, or NULL if it cannot be watched.
+  HiveState* GetUser(const wchar_t* sid) {
+    std::wstring sid_string(sid ? sid : L"");
+    linked_ptr<HiveState>& state = users_[sid_string];
+    if (!state.get())
+      state.reset(new HiveState);
+    HKEY root = sid_string.empty() ? HKEY_CURRENT_USER : HKEY_USERS;
+    return Validate(state.get(), root, sid_string, 0);
+  }
+
+  // Returns the state for the machine hive, or NULL if it cannot be watched.
+  HiveState* GetMachine() {
+    return Validate(&machine_, HKEY_LOCAL_MACHINE, L"", KEY_WOW64_32KEY);
+  }
+
+  void InvalidateUser(const wchar_t* sid) {
+    HiveMap::iterator it = users_.find(sid ? sid : L"");
+    if (it != users_.end())
+      Reset(it->second.get());
+  }
+
+  void InvalidateMachine() {
+    Reset(&machine_);
+  }
+
+ private:
+  typedef std::map<std::wstring, linked_ptr<HiveState> > HiveMap;
+
+  // Generations are unique across hives and across enabling the cache again,
+  // so a stale token can never match.
+  void Reset(HiveState* state) {
+    state->generation = ++last_generation_;
+    state->brands.clear();
+    state->has_dcc = false;
+    state->dcc_cached = false;
+    state->dcc.clear();
+  }
+
+  // Drops the cached values if the key changed since the last call, and
+  // (re)arms the change notification.
+  HiveState* Validate(HiveState* state, HKEY root, const std::wstring& sid,
+                      REGSAM wow64_access) {
+    if (state->watch_key.Valid() && !state->watch_key.HasChanged())
+      return state;
+
+    Reset(state);
+    state->watch_key.Close();
+
+    std::wstring key_name(sid);
+    if (!key_name.empty())
+      key_name += L"\\";
+    key_name += rlz_lib::kLibKeyName;
+
+    // The RLZ key may not exist yet, in which case nothing is cached until a
+    // writer creates it.
+    if (state->watch_key.Open(root, key_name.c_str(),
+                              KEY_READ | wow64_access) != ERROR_SUCCESS)
+      return NULL;
+
+    if (state->watch_key.StartWatching() != ERROR_SUCCESS) {
+      state->watch_key.Close();
+      return NULL;
+    }
+
+    return state;
+  }
+
+  base::Lock lock_;
+  bool enabled_;
+  int last_generation_;
+  HiveMap users_;
+  HiveState machine_;
+
+  DISALLOW_COPY_AND_ASSIGN(CacheData);
+};
+
+// Leaky, so that it can also be used from a DLL without an AtExitManager.
+base::LazyInstance<CacheData, base::LeakyLazyInstanceTraits<CacheData> >
+    g_cache(base::LINKER_INITIALIZED);
+
+BrandState* GetBrandState(HiveState* state) {
+  return &state->brands[rlz_lib::SupplementaryBranding::GetBrand()];
+}
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+// static
+void StateCache::SetEnabled(bool enabled) {
+  CacheData* cache = g_cache.Pointer();
+  base::AutoLock auto_lock(cache->lock());
+  cache->SetEnabled(enabled);
+}
+
+// static
+bool StateCache::IsEnabled() {
+  CacheData* cache = g_cache.Pointer();
+  base::AutoLock auto_lock(cache->lock());
+  return cache->enabled();
+}
+
+// static
+bool StateCache::LookupRlz(const wchar_t* sid, AccessPoint point,
+                           std::string* rlz, int* generation) {
+  *generation = -1;
+  if (point <= NO_ACCESS_POINT || point >= LAST_ACCESS_POINT)
+    return false;
+
+  CacheData* cache = g_cache.Pointer();
+  base::AutoLock auto_lock(cache->lock());
+  if (!cache->enabled())
+    return false;
+
+  HiveState* state = cache->GetUser(sid);
+  if (!state)
+    return false;
+
+  *generation = state->generation;
+  BrandState* brand = GetBrandState(state);
+  if (!brand->rlz_cached[point])
+    return false;
+
+  *rlz = brand->rlzs[point];
+  return true;
+}
+
+// static
+void StateCache::StoreRlz(const wchar_t* sid, int generation,
+                          AccessPoint point, const std::string& rlz) {
+  if (generation < 0 || point <= NO_ACCESS_POINT || point >= LAST_ACCESS_POINT)
+    return;
+
+  CacheData* cache = g_cache.Pointer();
+  base::AutoLock auto_lock(cache->lock());
+  if (!cache->enabled())
+    return;
+
+  HiveState* state = cache->GetUser(sid);
+  if (!state || state->generation != generation)
+    return;
+
+  BrandState* brand = GetBrandState(state);
+  brand->rlz_cached[point] = true;
+  brand->rlzs[point] = rlz;
+}
+
+// static
+bool StateCache::LookupEventsCgi(const wchar_t* sid, Product product,
+                                 bool* has_events, std::string* cgi,
+                                 int* generation) {
+  *generation = -1;
+
+  CacheData* cache = g_cache.Pointer();
+  base::AutoLock auto_lock(cache->lock());
+  if (!cache->enabled())
+    return false;
+
+  HiveState* state = cache->GetUser(sid);
+  if (!state)
+    return false;
+
+  *generation = state->generation;
+  BrandState* brand = GetBrandState(state);
+  std::map<Product, BrandState::Events>::const_iterator it =
+      brand->events.find(product);
+  if (it == brand->events.end())
+    return false;
+
+  *has_events = it->second.has_events;
+  *cgi = it->second.cgi;
+  return true;
+}
+
+// static
+void StateCache::StoreEventsCgi(const wchar_t* sid, int generation,
+                                Product product, bool has_events,
+                                const std::string& cgi) {
+  if (generation < 0)
+    return;
+
+  CacheData* cache = g_cache.Pointer();
+  base::AutoLock auto_lock(cache->lock());
+  if (!cache->enabled())
+    return;
+
+  HiveState* state = cache->GetUser(sid);
+  if (!state || state->generation != generation)
+    return;
+
+  BrandState::Events& events = GetBrandState(state)->events[product];
+  events.has_events = has_events;
+  events.cgi = cgi;
+}
+
+// static
+bool StateCache::LookupDcc(bool* has_dcc, std::string* dcc, int* generation) {
+  *generation = -1;
+
+  CacheData* cache = g_cache.Pointer();
+  base::AutoLock auto_lock(cache->lock());
+  if (!cache->enabled())
+    return false;
+
+  HiveState* state = cache->GetMachine();
+  if (!state)
+    return false;
+
+  *generation = state->generation;
+  if (!state->dcc_cached)
+    return false;
+
+  *has_dcc = state->has_dcc;
+  *dcc = state->dcc;
+  return true;
+}
+
+// static
+void StateCache::StoreDcc(int generation, bool has_dcc,
+                          const std::string& dcc) {
+  if (generation < 0)
+    return;
+
+  CacheData* cache = g_cache.Pointer();
+  base::AutoLock auto_lock(cache->lock());
+  if (!cache->enabled())
+    return;
+
+  HiveState* state = cache->GetMachine();
+  if (!state || state->generation != generation)
+    return;
+
+  state->dcc_cached = true;
+  state->has_dcc = has_dcc;
+  state->dcc = dcc;
+}
+
+// static
+void StateCache::InvalidateUser(const wchar_t* sid) {
+  CacheData* cache = g_cache.Pointer();
+  base::AutoLock auto_lock(cache->lock());
+  cache->InvalidateUser(sid);
+}
+
+// static
+void StateCache::InvalidateMachine() {
+  CacheData* cache = g_cache.Pointer();
+  base::AutoLock auto_lock(cache->lock());
+  cache->InvalidateMachine();
+}
+
+bool CopyCachedValue(const std::string& value, char* buffer,
+                     size_t buffer_size) {
+  buffer[0] = 0;
+  if (value.length() > buffer_size)
+    return false;
+
+  strncpy(buffer, value.c_str(), buffer_size);
+  buffer[buffer_size - 1] = 0;
+  return true;
+}
+
+}  // namespace rlz_lib
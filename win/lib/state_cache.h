@@ -0,0 +1,65 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// An optional in-process cache of the RLZ registry state. Each user hive and
+// the machine hive is watched with RegNotifyChangeKeyValue on kLibKeyName,
+// so writes made by other processes invalidate the cached values.
+
+#ifndef RLZ_WIN_LIB_STATE_CACHE_H_
+#define RLZ_WIN_LIB_STATE_CACHE_H_
+
+#include <string>
+
+#include "rlz/win/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+// All values are cached per user SID (NULL or empty for HKCU) and per
+// supplementary brand.
+//
+// Lookups return false on a cache miss or when the cache is disabled, and
+// fill |generation| with a token that must be passed back to the matching
+// Store call once the value has been read from the registry. A store is
+// dropped if the state changed in between, so a value read before a
+// concurrent write can never be cached after it.
+class StateCache {
+ public:
+  static void SetEnabled(bool enabled);
+  static bool IsEnabled();
+
+  // RLZ values. A missing RLZ is cached as the empty string.
+  static bool LookupRlz(const wchar_t* sid, AccessPoint point,
+                        std::string* rlz, int* generation);
+  static void StoreRlz(const wchar_t* sid, int generation, AccessPoint point,
+                       const std::string& rlz);
+
+  // Product events, as returned by GetProductEventsAsCgi().
+  static bool LookupEventsCgi(const wchar_t* sid, Product product,
+                              bool* has_events, std::string* cgi,
+                              int* generation);
+  static void StoreEventsCgi(const wchar_t* sid, int generation,
+                             Product product, bool has_events,
+                             const std::string& cgi);
+
+  // The machine DCC.
+  static bool LookupDcc(bool* has_dcc, std::string* dcc, int* generation);
+  static void StoreDcc(int generation, bool has_dcc, const std::string& dcc);
+
+  // Called by writers in this process.
+  static void InvalidateUser(const wchar_t* sid);
+  static void InvalidateMachine();
+
+ private:
+  StateCache() {}
+  ~StateCache() {}
+};
+
+// Copies a cached value into a caller buffer with the same truncation and
+// size semantics as RegKeyReadValue().
+bool CopyCachedValue(const std::string& value, char* buffer,
+                     size_t buffer_size);
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_STATE_CACHE_H_
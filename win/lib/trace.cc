@@ -0,0 +1,66 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Spans reported to the trace callback set with SetTraceCallback().
+
+#include "rlz/win/lib/trace.h"
+
+#include "base/lazy_instance.h"
+#include "base/synchronization/lock.h"
+
+namespace {
+
+struct TraceTarget {
+  TraceTarget() : callback(NULL), context(NULL) {}
+
+  base::Lock lock;
+  rlz_lib::TraceCallback callback;
+  void* context;
+};
+
+// Leaky, so that it can also be used from a DLL without an AtExitManager.
+base::LazyInstance<TraceTarget, base::LeakyLazyInstanceTraits<TraceTarget> >
+    g_trace_target(base::LINKER_INITIALIZED);
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+base::subtle::Atomic32 g_trace_enabled = 0;
+
+void ScopedTraceSpan::End() {
+  if (!callback_)
+    return;
+
+  int64 duration_us = (base::TimeTicks::HighResNow() - start_).InMicroseconds();
+  TraceCallback callback = callback_;
+  callback_ = NULL;
+  callback(TRACE_END, name_, duration_us, context_);
+}
+
+// static
+void ScopedTraceSpan::SetCallback(TraceCallback callback, void* context) {
+  TraceTarget* target = g_trace_target.Pointer();
+  base::AutoLock auto_lock(target->lock);
+  target->callback = callback;
+  target->context = context;
+  base::subtle::NoBarrier_Store(&g_trace_enabled, callback ? 1 : 0);
+}
+
+void ScopedTraceSpan::Begin(const char* name) {
+  TraceTarget* target = g_trace_target.Pointer();
+  {
+    base::AutoLock auto_lock(target->lock);
+    callback_ = target->callback;
+    context_ = target->context;
+  }
+  if (!callback_)
+    return;
+
+  name_ = name;
+  callback_(TRACE_BEGIN, name_, 0, context_);
+  start_ = base::TimeTicks::HighResNow();
+}
+
+}  // namespace rlz_lib
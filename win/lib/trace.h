@@ -0,0 +1,54 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Spans reported to the trace callback set with SetTraceCallback().
+
+#ifndef RLZ_WIN_LIB_TRACE_H_
+#define RLZ_WIN_LIB_TRACE_H_
+
+#include "base/atomicops.h"
+#include "base/basictypes.h"
+#include "base/time.h"
+#include "rlz/win/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+// Non zero while a trace callback is set.
+extern base::subtle::Atomic32 g_trace_enabled;
+
+// Reports TRACE_BEGIN when constructed and TRACE_END with the duration when
+// ended or destroyed. |name| must be a static string. Without a trace
+// callback, a span costs one relaxed load.
+class ScopedTraceSpan {
+ public:
+  explicit ScopedTraceSpan(const char* name) : callback_(NULL) {
+    if (base::subtle::NoBarrier_Load(&g_trace_enabled))
+      Begin(name);
+  }
+
+  ~ScopedTraceSpan() {
+    if (callback_)
+      End();
+  }
+
+  // Ends the span before it goes out of scope.
+  void End();
+
+  static void SetCallback(TraceCallback callback, void* context);
+
+ private:
+  void Begin(const char* name);
+
+  // The callback the span began with, NULL if it is not traced.
+  TraceCallback callback_;
+  void* context_;
+  const char* name_;
+  base::TimeTicks start_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedTraceSpan);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_TRACE_H_
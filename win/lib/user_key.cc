@@ -7,7 +7,12 @@
 
 #include "rlz/win/lib/user_key.h"
 
-#include "base/process_util.h"
+#include <map>
+#include <string>
+
+#include "base/atomicops.h"
+#include "base/lazy_instance.h"
+#include "base/synchronization/lock.h"
 #include "base/win/windows_version.h"
 
 #include "rlz/win/lib/assert.h"
@@ -15,6 +20,119 @@
 
 namespace rlz_lib {
 
+// An HKEY_USERS key shared by the UserKeys of a SID, or a pooled subkey of a
+// hive, closed by the last holder.
+class SharedUserKey : public base::RefCountedThreadSafe<SharedUserKey> {
+ public:
+  explicit SharedUserKey(HKEY key) : key_(key) {}
+
+  HKEY key() const { return key_; }
+
+ private:
+  friend class base::RefCountedThreadSafe<SharedUserKey>;
+
+  ~SharedUserKey() {
+    RegCloseKey(key_);
+  }
+
+  HKEY key_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedUserKey);
+};
+
+}  // namespace rlz_lib
+
+namespace {
+
+typedef std::map<std::wstring, scoped_refptr<rlz_lib::SharedUserKey> >
+    SharedUserKeyMap;
+
+struct UserKeyCache {
+  base::Lock lock;
+  SharedUserKeyMap keys;
+
+  // The pooled subkeys of each of the cached hives and of HKCU, by location.
+  // The pool of a hive is dropped with its key, so the handles of the keys
+  // in the map are never closed and reused while they have a pool.
+  std::map<HKEY, SharedUserKeyMap> pools;
+};
+
+// Leaky, so that it can also be used from a DLL without an AtExitManager.
+base::LazyInstance<UserKeyCache, base::LeakyLazyInstanceTraits<UserKeyCache> >
+    g_cache(base::LINKER_INITIALIZED);
+
+// Set once at startup, so the load does not need a barrier.
+base::subtle::Atomic32 g_cache_enabled = 0;
+
+// Set once HKEY_CURRENT_USER has been found readable.
+base::subtle::Atomic32 g_current_user_probed = 0;
+
+bool IsWriteAccess(REGSAM access) {
+  return (access & (KEY_SET_VALUE | KEY_CREATE_SUB_KEY | KEY_CREATE_LINK)) !=
+      0;
+}
+
+// Gets the pooled key of |location| under |user_key| into |key|, opening or
+// creating it if needed. Returns false if the hive has no pool; otherwise
+// |result| is the registry error, and |key| is set on success.
+bool GetPooledKey(HKEY user_key, const std::wstring& location, bool create,
+                  scoped_refptr<rlz_lib::SharedUserKey>* key, LONG* result) {
+  UserKeyCache* cache = g_cache.Pointer();
+  base::AutoLock lock(cache->lock);
+  if (user_key != HKEY_CURRENT_USER) {
+    SharedUserKeyMap::const_iterator it = cache->keys.begin();
+    while (it != cache->keys.end() && it->second->key() != user_key)
+      ++it;
+    if (it == cache->keys.end())
+      return false;  // Not a cached hive.
+  }
+
+  SharedUserKeyMap& pool = cache->pools[user_key];
+  SharedUserKeyMap::const_iterator it = pool.find(location);
+  if (it != pool.end()) {
+    *key = it->second;
+    *result = ERROR_SUCCESS;
+    return true;
+  }
+
+  // The pooled handle is only used to open the keys relative to it, so it
+  // needs no access rights of its own.
+  HKEY pooled_key = NULL;
+  if (create) {
+    *result = RegCreateKeyExW(user_key, location.c_str(), 0, NULL,
+                              REG_OPTION_NON_VOLATILE, KEY_READ, NULL,
+                              &pooled_key, NULL);
+  } else {
+    *result = RegOpenKeyExW(user_key, location.c_str(), 0, KEY_READ,
+                            &pooled_key);
+  }
+  if (*result != ERROR_SUCCESS)
+    return true;
+
+  *key = new rlz_lib::SharedUserKey(pooled_key);
+  pool[location] = *key;
+  return true;
+}
+
+// Drops |key| from the pool of |user_key|, unless it was replaced already.
+void DropPooledKey(HKEY user_key, const std::wstring& location,
+                   const scoped_refptr<rlz_lib::SharedUserKey>& key) {
+  UserKeyCache* cache = g_cache.Pointer();
+  base::AutoLock lock(cache->lock);
+  std::map<HKEY, SharedUserKeyMap>::iterator pool =
+      cache->pools.find(user_key);
+  if (pool == cache->pools.end())
+    return;
+
+  SharedUserKeyMap::iterator it = pool->second.find(location);
+  if (it != pool->second.end() && it->second.get() == key.get())
+    pool->second.erase(it);
+}
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
 UserKey::UserKey(const wchar_t* sid) {
   if (!sid || !sid[0]) {
     // No SID is specified, so the caller is trying to access HKEY_CURRENT_USER.
@@ -22,10 +140,15 @@ UserKey::UserKey(const wchar_t* sid) {
     // because this will cause problems in the unit tests: if we open
     // HKEY_CURRENT_USER directly here, the overriding done for unit tests will
     // no longer work.  So we try subkey "Software" which is known to always
-    // exist.
+    // exist. The test only asserts, so it is done until it first succeeds.
+    if (base::subtle::NoBarrier_Load(&g_current_user_probed))
+      return;
+
     base::win::RegKey key;
     if (key.Open(HKEY_CURRENT_USER, L"Software", KEY_READ) != ERROR_SUCCESS)
       ASSERT_STRING("Could not open HKEY_CURRENT_USER");
+    else
+      base::subtle::NoBarrier_Store(&g_current_user_probed, 1);
     return;
   }
 
@@ -35,11 +158,40 @@ UserKey::UserKey(const wchar_t* sid) {
     return;
   }
 
-  if (user_key_.Open(HKEY_USERS, sid, KEY_ALL_ACCESS) != ERROR_SUCCESS)
+  if (!base::subtle::NoBarrier_Load(&g_cache_enabled)) {
+    if (user_key_.Open(HKEY_USERS, sid, KEY_ALL_ACCESS) != ERROR_SUCCESS)
+      ASSERT_STRING("UserKey::UserKey Failed to open user key.");
+    return;
+  }
+
+  UserKeyCache* cache = g_cache.Pointer();
+  base::AutoLock lock(cache->lock);
+  SharedUserKeyMap::const_iterator it = cache->keys.find(sid);
+  if (it != cache->keys.end()) {
+    shared_key_ = it->second;
+    return;
+  }
+
+  // Opening the key while holding the lock keeps threads from opening it
+  // more than once. It is only held for cache misses.
+  HKEY key = NULL;
+  if (RegOpenKeyExW(HKEY_USERS, sid, 0, KEY_ALL_ACCESS, &key) !=
+      ERROR_SUCCESS) {
     ASSERT_STRING("UserKey::UserKey Failed to open user key.");
+    return;
+  }
+
+  shared_key_ = new SharedUserKey(key);
+  cache->keys[sid] = shared_key_;
+}
+
+UserKey::~UserKey() {
 }
 
 HKEY UserKey::Get() {
+  if (shared_key_)
+    return shared_key_->key();
+
   // If user_key_ is not valid, this is because the caller is trying to access
   // HKEY_CURRENT_USER.
   return user_key_.Valid() ? user_key_.Handle() : HKEY_CURRENT_USER;
@@ -65,14 +217,13 @@ bool UserKey::HasAccess(HKEY user_key, bool write_access) {
 
   if (write_access) {
     if (base::win::GetVersion() < base::win::VERSION_VISTA) return true;
-    base::ProcessHandle process_handle = base::GetCurrentProcessHandle();
-    base::IntegrityLevel level = base::INTEGRITY_UNKNOWN;
+    ProcessInfo::IntegrityLevel level = ProcessInfo::GetIntegrityLevel();
 
-    if (!base::GetProcessIntegrityLevel(process_handle, &level)) {
+    if (level == ProcessInfo::INTEGRITY_UNKNOWN) {
       ASSERT_STRING("UserKey::HasAccess: Cannot determine Integrity Level.");
       return false;
     }
-    if (level <= base::LOW_INTEGRITY) {
+    if (level <= ProcessInfo::LOW_INTEGRITY) {
       ASSERT_STRING("UserKey::HasAccess: Cannot write from Low Integrity.");
       return false;
     }
@@ -80,4 +231,70 @@ bool UserKey::HasAccess(HKEY user_key, bool write_access) {
   return true;
 }
 
+// static
+void UserKey::SetCacheEnabled(bool enabled) {
+  base::subtle::NoBarrier_Store(&g_cache_enabled, enabled ? 1 : 0);
+  if (!enabled)
+    Invalidate(NULL);
+}
+
+// static
+void UserKey::Invalidate(const wchar_t* sid) {
+  UserKeyCache* cache = g_cache.Pointer();
+  base::AutoLock lock(cache->lock);
+  if (!sid || !sid[0]) {
+    cache->keys.clear();
+    cache->pools.clear();
+    return;
+  }
+
+  SharedUserKeyMap::iterator it = cache->keys.find(sid);
+  if (it != cache->keys.end()) {
+    cache->pools.erase(it->second->key());
+    cache->keys.erase(it);
+  }
+}
+
+// static
+LONG UserKey::OpenKey(HKEY user_key, const std::wstring& location,
+                      const wchar_t* subkey, REGSAM access,
+                      base::win::RegKey* key) {
+  bool create = IsWriteAccess(access);
+  scoped_refptr<SharedUserKey> pooled_key;
+  LONG result = ERROR_SUCCESS;
+  if (base::subtle::NoBarrier_Load(&g_cache_enabled) &&
+      GetPooledKey(user_key, location, create, &pooled_key, &result)) {
+    // Without |location|, there is no |subkey| either.
+    if (result == ERROR_FILE_NOT_FOUND)
+      return result;
+
+    if (pooled_key) {
+      const wchar_t* relative_name = subkey ? subkey : L"";
+      result = create ?
+          key->Create(pooled_key->key(), relative_name, access) :
+          key->Open(pooled_key->key(), relative_name, access);
+      // A key deleted since it was pooled fails all the calls, and is looked
+      // up by its path again.
+      if (result != ERROR_KEY_DELETED)
+        return result;
+      DropPooledKey(user_key, location, pooled_key);
+    }
+  }
+
+  std::wstring key_location(location);
+  if (subkey) {
+    key_location += L'\\';
+    key_location += subkey;
+  }
+  return create ? key->Create(user_key, key_location.c_str(), access) :
+                  key->Open(user_key, key_location.c_str(), access);
+}
+
+// static
+void UserKey::ClosePooledKeys() {
+  UserKeyCache* cache = g_cache.Pointer();
+  base::AutoLock lock(cache->lock);
+  cache->pools.clear();
+}
+
 }  // namespace rlz_lib
@@ -8,21 +8,51 @@
 #ifndef RLZ_WIN_LIB_USER_KEY_H_
 #define RLZ_WIN_LIB_USER_KEY_H_
 
+#include <string>
+
+#include "base/memory/ref_counted.h"
 #include "base/win/registry.h"
 
 namespace rlz_lib {
 
+class SharedUserKey;
+
 class UserKey {
  public:
   UserKey(const wchar_t* sid);
+  ~UserKey();
 
   HKEY Get();
   bool HasAccess(bool write_access);
   static bool HasAccess(HKEY user_key, bool write_access);
 
+  // While enabled, the HKEY_USERS keys opened for a SID are kept open and
+  // shared by the UserKeys of that SID, on all threads. An open key prevents
+  // Windows from unloading the user's hive, so Invalidate() must be called
+  // when the user logs off. Disabling closes all the cached keys. Disabled by
+  // default.
+  static void SetCacheEnabled(bool enabled);
+
+  // Drops the cached key of |sid|, or all of them if |sid| is NULL or empty.
+  // Keys still in use by UserKeys are closed when these are destroyed.
+  static void Invalidate(const wchar_t* sid);
+
+  // Opens |key| on |subkey| of |location| under |user_key|, or on |location|
+  // itself if |subkey| is NULL. The key is created if |access| allows writes.
+  // While the cache is enabled, |location| is kept open in a pool of the
+  // cached hives and of HKCU, and later calls open the key relative to it,
+  // without looking up the whole path again. Returns the registry error.
+  static LONG OpenKey(HKEY user_key, const std::wstring& location,
+                      const wchar_t* subkey, REGSAM access,
+                      base::win::RegKey* key);
+
+  // Closes the pooled keys of all the hives, e.g. when the brand changes.
+  static void ClosePooledKeys();
+
  private:
   UserKey() {}
   base::win::RegKey user_key_;
+  scoped_refptr<SharedUserKey> shared_key_;  // When cached.
 };
 
 }  // namespace rlz_lib
@@ -0,0 +1,129 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Runs per user work for several users at once on the system thread pool.
+
+#include "rlz/win/lib/user_sweep.h"
+
+#include <windows.h>
+
+#include "base/string_util.h"
+#include "rlz/win/lib/assert.h"
+
+namespace {
+
+// The SIDs of local and domain user accounts.
+const wchar_t kUserSidPrefix[] = L"S-1-5-21-";
+
+// The HKEY_USERS keys of the users' classes hives.
+const wchar_t kClassesSuffix[] = L"_Classes";
+
+// The longest key name in the registry.
+const DWORD kMaxKeyNameLength = 255;
+
+// Shared by the threads of a sweep, and owned by the calling thread.
+struct SweepState {
+  const std::vector<std::wstring>* sids;
+  rlz_lib::UserSweep::Task task;
+  void* context;
+  bool* results;
+
+  // The index of the next SID to run the task for.
+  volatile LONG next;
+  // The threads still running, and the event set once they are all done.
+  volatile LONG running;
+  HANDLE done;
+};
+
+DWORD WINAPI RunSweep(void* param) {
+  SweepState* state = static_cast<SweepState*>(param);
+  LONG count = static_cast<LONG>(state->sids->size());
+  for (;;) {
+    LONG index = InterlockedIncrement(&state->next) - 1;
+    if (index >= count)
+      break;
+    state->results[index] =
+        state->task((*state->sids)[index].c_str(), state->context);
+  }
+
+  if (InterlockedDecrement(&state->running) == 0)
+    SetEvent(state->done);
+  return 0;
+}
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+// static
+void UserSweep::Run(const std::vector<std::wstring>& sids, int max_threads,
+                    Task task, void* context, bool* results) {
+  if (sids.empty())
+    return;
+
+  int threads = static_cast<int>(sids.size());
+  if (max_threads > 0 && max_threads < threads)
+    threads = max_threads;
+
+  SweepState state;
+  state.sids = &sids;
+  state.task = task;
+  state.context = context;
+  state.results = results;
+  state.next = 0;
+  state.running = threads;
+  state.done = threads > 1 ? CreateEvent(NULL, TRUE, FALSE, NULL) : NULL;
+  if (!state.done) {
+    // Run all the tasks on the calling thread.
+    state.running = threads = 1;
+  }
+
+  // The calling thread runs tasks as well, so a sweep completes even if no
+  // pool thread can be queued.
+  for (int i = 1; i < threads; ++i) {
+    if (!QueueUserWorkItem(RunSweep, &state, WT_EXECUTELONGFUNCTION)) {
+      ASSERT_STRING("UserSweep::Run: QueueUserWorkItem failed");
+      InterlockedExchangeAdd(&state.running, i - threads);
+      break;
+    }
+  }
+
+  RunSweep(&state);
+
+  if (state.done) {
+    WaitForSingleObject(state.done, INFINITE);
+    CloseHandle(state.done);
+  }
+}
+
+// static
+bool UserSweep::GetLoadedUserSids(std::vector<std::wstring>* sids) {
+  if (!sids) {
+    ASSERT_STRING("UserSweep::GetLoadedUserSids: sids is NULL");
+    return false;
+  }
+
+  sids->clear();
+  wchar_t name[kMaxKeyNameLength + 1];
+  for (DWORD index = 0; ; ++index) {
+    DWORD name_size = arraysize(name);
+    LONG result = RegEnumKeyExW(HKEY_USERS, index, name, &name_size, NULL,
+                                NULL, NULL, NULL);
+    if (result == ERROR_NO_MORE_ITEMS)
+      break;
+    if (result != ERROR_SUCCESS) {
+      ASSERT_STRING("UserSweep::GetLoadedUserSids: Cannot enumerate users");
+      return false;
+    }
+
+    std::wstring sid(name, name_size);
+    if (StartsWith(sid, kUserSidPrefix, false) &&
+        !EndsWith(sid, kClassesSuffix, false))
+      sids->push_back(sid);
+  }
+
+  return true;
+}
+
+}  // namespace rlz_lib
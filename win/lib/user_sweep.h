@@ -0,0 +1,38 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Runs per user work for several users at once on the system thread pool.
+
+#ifndef RLZ_WIN_LIB_USER_SWEEP_H_
+#define RLZ_WIN_LIB_USER_SWEEP_H_
+
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+
+namespace rlz_lib {
+
+class UserSweep {
+ public:
+  // Called once per user, on any of the sweep's threads.
+  typedef bool (*Task)(const wchar_t* sid, void* context);
+
+  // Runs |task| for each of |sids| on at most |max_threads| threads, the
+  // calling thread included, and returns once all the calls have returned.
+  // |results| receives sids.size() entries, the value returned for each SID.
+  static void Run(const std::vector<std::wstring>& sids, int max_threads,
+                  Task task, void* context, bool* results);
+
+  // Gets the SIDs of the user hives loaded in HKEY_USERS, i.e. of the users
+  // logged on and of the services running as a user.
+  static bool GetLoadedUserSids(std::vector<std::wstring>* sids);
+
+ private:
+  DISALLOW_IMPLICIT_CONSTRUCTORS(UserSweep);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_USER_SWEEP_H_
@@ -0,0 +1,168 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The storage backends of the RLZs, events, stateful events, ping times and
+// DCC.
+
+#include "rlz/win/lib/value_store.h"
+
+#include "base/atomicops.h"
+#include "rlz/win/lib/file_value_store.h"
+#include "rlz/win/lib/lib_mutex.h"
+#include "rlz/win/lib/registry_value_store.h"
+
+namespace {
+
+base::subtle::Atomic32 g_file_store_enabled = 0;
+base::subtle::Atomic32 g_mirror_enabled = 0;
+
+// Reads from the file store, and writes to both it and the registry. The
+// registry writes are best effort: the file store holds the state.
+class MirroredValueStore : public rlz_lib::RlzValueStore {
+ public:
+  MirroredValueStore(rlz_lib::RlzValueStore* store,
+                     rlz_lib::RlzValueStore* mirror)
+      : store_(store), mirror_(mirror) {
+  }
+
+  virtual bool HasAccess(bool write_access) {
+    return store_->HasAccess(write_access);
+  }
+
+  virtual bool ReadAccessPointRlz(rlz_lib::AccessPoint point,
+                                  std::string* rlz) {
+    return store_->ReadAccessPointRlz(point, rlz);
+  }
+
+  virtual bool WriteAccessPointRlz(rlz_lib::AccessPoint point,
+                                   const std::string& rlz) {
+    mirror_->WriteAccessPointRlz(point, rlz);
+    return store_->WriteAccessPointRlz(point, rlz);
+  }
+
+  virtual bool ReadProductEvents(rlz_lib::Product product,
+                                 rlz_lib::EventBitmap* events) {
+    return store_->ReadProductEvents(product, events);
+  }
+
+  virtual bool WriteProductEvents(rlz_lib::Product product,
+                                  const rlz_lib::EventBitmap& events) {
+    mirror_->WriteProductEvents(product, events);
+    return store_->WriteProductEvents(product, events);
+  }
+
+  virtual bool ReadStatefulEvents(rlz_lib::Product product,
+                                  rlz_lib::EventBitmap* events) {
+    return store_->ReadStatefulEvents(product, events);
+  }
+
+  virtual bool WriteStatefulEvents(rlz_lib::Product product,
+                                   const rlz_lib::EventBitmap& events) {
+    mirror_->WriteStatefulEvents(product, events);
+    return store_->WriteStatefulEvents(product, events);
+  }
+
+  virtual bool ReadPingTime(rlz_lib::Product product, int64* time) {
+    return store_->ReadPingTime(product, time);
+  }
+
+  virtual bool WritePingTime(rlz_lib::Product product, int64 time) {
+    mirror_->WritePingTime(product, time);
+    return store_->WritePingTime(product, time);
+  }
+
+  virtual bool ReadMachineDealCode(std::string* dcc) {
+    return store_->ReadMachineDealCode(dcc);
+  }
+
+  virtual bool WriteMachineDealCode(const std::string& dcc) {
+    mirror_->WriteMachineDealCode(dcc);
+    return store_->WriteMachineDealCode(dcc);
+  }
+
+  virtual bool Commit() {
+    mirror_->Commit();
+    return store_->Commit();
+  }
+
+  virtual void Discard() {
+    mirror_->Discard();
+    store_->Discard();
+  }
+
+ private:
+  scoped_ptr<rlz_lib::RlzValueStore> store_;
+  scoped_ptr<rlz_lib::RlzValueStore> mirror_;
+
+  DISALLOW_COPY_AND_ASSIGN(MirroredValueStore);
+};
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+// static
+void RlzValueStore::SetFileStoreEnabled(bool enabled,
+                                        bool mirror_to_registry) {
+  base::subtle::NoBarrier_Store(&g_mirror_enabled,
+                                enabled && mirror_to_registry ? 1 : 0);
+  base::subtle::NoBarrier_Store(&g_file_store_enabled, enabled ? 1 : 0);
+}
+
+// static
+bool RlzValueStore::IsFileStoreEnabled() {
+  return base::subtle::NoBarrier_Load(&g_file_store_enabled) != 0;
+}
+
+// static
+void RlzValueStore::SetFileStoreDirectoriesForTesting(
+    const wchar_t* user_directory, const wchar_t* machine_directory) {
+  FileValueStore::SetDirectoriesForTesting(user_directory, machine_directory);
+}
+
+ScopedValueStore::ScopedValueStore(const wchar_t* sid, bool write_access) {
+  if (write_access) {
+    lock_.reset(new LibMutex);
+    if (lock_->failed())
+      return;
+  }
+
+  if (RlzValueStore::IsFileStoreEnabled()) {
+    scoped_ptr<RlzValueStore> file_store(
+        FileValueStore::Open(sid, write_access));
+    if (file_store.get()) {
+      if (write_access && base::subtle::NoBarrier_Load(&g_mirror_enabled)) {
+        store_.reset(new MirroredValueStore(file_store.release(),
+                                            new RegistryValueStore(sid)));
+      } else {
+        store_.reset(file_store.release());
+      }
+      if (!store_->HasAccess(write_access))
+        store_.reset();
+      return;
+    }
+
+    // A reader that can not create the files, or copy the registry state
+    // into them, still finds the state in the registry.
+    if (write_access)
+      return;
+  }
+
+  if (!lock_.get()) {
+    lock_.reset(new LibMutex);
+    if (lock_->failed())
+      return;
+  }
+
+  store_.reset(new RegistryValueStore(sid));
+  if (!store_->HasAccess(write_access))
+    store_.reset();
+}
+
+ScopedValueStore::~ScopedValueStore() {
+  // The store is closed before the mutex is released.
+  store_.reset();
+}
+
+}  // namespace rlz_lib
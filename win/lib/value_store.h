@@ -0,0 +1,105 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The storage backends of the RLZs, events, stateful events, ping times and
+// DCC.
+
+#ifndef RLZ_WIN_LIB_VALUE_STORE_H_
+#define RLZ_WIN_LIB_VALUE_STORE_H_
+
+#include <string>
+
+#include "base/basictypes.h"
+#include "base/memory/scoped_ptr.h"
+#include "rlz/win/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+class EventBitmap;
+class LibMutex;
+
+// The state of one user, and of the machine, in one backend. Writes may only
+// be applied by Commit(), which applies them all together where the backend
+// can. The registry is the default backend; the file store is used instead
+// while enabled, see SetFileStoreEnabled().
+class RlzValueStore {
+ public:
+  virtual ~RlzValueStore() {}
+
+  // Whether the user state can be read, or written.
+  virtual bool HasAccess(bool write_access) = 0;
+
+  // A missing RLZ reads as the empty string, and writing an empty RLZ clears
+  // it. RLZs must be normalized by the caller.
+  virtual bool ReadAccessPointRlz(AccessPoint point, std::string* rlz) = 0;
+  virtual bool WriteAccessPointRlz(AccessPoint point,
+                                   const std::string& rlz) = 0;
+
+  // The events, and stateful events, of the product. Writing replaces all of
+  // them, and an empty bitmap clears them.
+  virtual bool ReadProductEvents(Product product, EventBitmap* events) = 0;
+  virtual bool WriteProductEvents(Product product,
+                                  const EventBitmap& events) = 0;
+  virtual bool ReadStatefulEvents(Product product, EventBitmap* events) = 0;
+  virtual bool WriteStatefulEvents(Product product,
+                                   const EventBitmap& events) = 0;
+
+  // The last ping time of the product, 0 if it never pinged. Writing 0
+  // clears it.
+  virtual bool ReadPingTime(Product product, int64* time) = 0;
+  virtual bool WritePingTime(Product product, int64 time) = 0;
+
+  // The machine DCC, empty if none. Writing an empty DCC clears it. The DCC
+  // must be normalized by the caller.
+  virtual bool ReadMachineDealCode(std::string* dcc) = 0;
+  virtual bool WriteMachineDealCode(const std::string& dcc) = 0;
+
+  // Applies the writes made since the store was opened, or the last commit.
+  // Returns false if any of them failed.
+  virtual bool Commit() = 0;
+
+  // Drops the writes made since the store was opened, or the last commit,
+  // where the backend has not applied them yet.
+  virtual void Discard() = 0;
+
+  // While enabled, the state is kept in memory-mapped files in the profile
+  // directories of the users and of the machine, and the registry state is
+  // copied into them the first time they are written. If
+  // |mirror_to_registry| is true, every write is also made to the registry,
+  // for the clients which still read it. Disabled by default, which keeps the
+  // state in the registry only.
+  static void SetFileStoreEnabled(bool enabled, bool mirror_to_registry);
+  static bool IsFileStoreEnabled();
+
+  // Keeps the store files of the users in subdirectories of |user_directory|
+  // named after their SIDs, and the file of the machine in
+  // |machine_directory|. NULL restores the profile directories. Closes all
+  // the files, so that the directories can be deleted afterwards; the stores
+  // must not be in use.
+  static void SetFileStoreDirectoriesForTesting(
+      const wchar_t* user_directory, const wchar_t* machine_directory);
+};
+
+// Opens the store of the user |sid| (NULL or empty for the user running the
+// process) in the enabled backend. Writers hold the RLZ mutex for the
+// lifetime of the object; readers of the file store do not need it.
+class ScopedValueStore {
+ public:
+  ScopedValueStore(const wchar_t* sid, bool write_access);
+  ~ScopedValueStore();
+
+  // NULL if the mutex could not be acquired, or if the store could not be
+  // opened with the requested access.
+  RlzValueStore* get() { return store_.get(); }
+
+ private:
+  scoped_ptr<LibMutex> lock_;
+  scoped_ptr<RlzValueStore> store_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedValueStore);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_VALUE_STORE_H_
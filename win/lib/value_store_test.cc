@@ -0,0 +1,155 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// A test application for the RLZ state stores.
+//
+// These tests should not be executed on the build server:
+// - They assert for the failed cases.
+// - They modify machine state (registry).
+//
+// These tests require write access to HKLM and HKCU.
+
+#include "base/logging.h"
+#include "base/scoped_temp_dir.h"
+#include "testing/gmock/include/gmock/gmock.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+#include "rlz/win/lib/rlz_lib.h"
+#include "rlz/win/lib/value_store.h"
+#include "rlz/win/test/rlz_test_helpers.h"
+
+class ValueStoreTest : public RlzLibTestBase {
+ protected:
+  virtual void SetUp() {
+    RlzLibTestBase::SetUp();
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    std::wstring directory(temp_dir_.path().value());
+    rlz_lib::RlzValueStore::SetFileStoreDirectoriesForTesting(
+        directory.c_str(), directory.c_str());
+  }
+
+  virtual void TearDown() {
+    rlz_lib::EnableFileStateStore(false, false);
+    rlz_lib::RlzValueStore::SetFileStoreDirectoriesForTesting(NULL, NULL);
+    RlzLibTestBase::TearDown();
+  }
+
+  ScopedTempDir temp_dir_;
+};
+
+TEST_F(ValueStoreTest, FileStore) {
+  char value[50];
+  rlz_lib::EnableFileStateStore(true, false);
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IE_HOME_PAGE, "Home Rlz"));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+  EXPECT_TRUE(rlz_lib::SetMachineDealCode("dcc_value"));
+
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IE_HOME_PAGE, value, 50));
+  EXPECT_STREQ("Home.Rlz", value);
+  EXPECT_TRUE(rlz_lib::HasPendingEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             value, 50));
+  EXPECT_STREQ("events=W1I", value);
+  EXPECT_TRUE(rlz_lib::GetMachineDealCode(value, 50));
+  EXPECT_STREQ("dcc_value", value);
+
+  // The event is cleared, and not recorded again once stateful.
+  const char kResponse[] =
+      "events: W1I\r\n"
+      "stateful-events: W1I\r\n"
+      "dcc: dcc_value\r\n"
+      "crc32: CCD63924";
+  EXPECT_TRUE(rlz_lib::ParsePingResponse(rlz_lib::TOOLBAR_NOTIFIER,
+                                         kResponse));
+  EXPECT_FALSE(rlz_lib::HasPendingEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+  EXPECT_FALSE(rlz_lib::HasPendingEvents(rlz_lib::TOOLBAR_NOTIFIER));
+
+  // Nothing was written to the registry.
+  rlz_lib::EnableFileStateStore(false, false);
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IE_HOME_PAGE, value, 50));
+  EXPECT_STREQ("", value);
+  EXPECT_FALSE(rlz_lib::GetMachineDealCode(value, 50));
+}
+
+TEST_F(ValueStoreTest, MigratesRegistryState) {
+  char value[50];
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IE_HOME_PAGE, "OldRlz"));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+  EXPECT_TRUE(rlz_lib::SetMachineDealCode("old_dcc"));
+
+  rlz_lib::EnableFileStateStore(true, false);
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IE_HOME_PAGE, value, 50));
+  EXPECT_STREQ("OldRlz", value);
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             value, 50));
+  EXPECT_STREQ("events=W1I", value);
+  EXPECT_TRUE(rlz_lib::GetMachineDealCode(value, 50));
+  EXPECT_STREQ("old_dcc", value);
+
+  // The state is only copied once.
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IE_HOME_PAGE, "NewRlz"));
+  EXPECT_FALSE(rlz_lib::HasPendingEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IE_HOME_PAGE, value, 50));
+  EXPECT_STREQ("NewRlz", value);
+
+  rlz_lib::EnableFileStateStore(false, false);
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IE_HOME_PAGE, value, 50));
+  EXPECT_STREQ("OldRlz", value);
+  EXPECT_TRUE(rlz_lib::HasPendingEvents(rlz_lib::TOOLBAR_NOTIFIER));
+}
+
+TEST_F(ValueStoreTest, MirrorsToRegistry) {
+  char value[50];
+  rlz_lib::EnableFileStateStore(true, true);
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IE_HOME_PAGE, "Mirrored"));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+  EXPECT_TRUE(rlz_lib::SetMachineDealCode("mirrored_dcc"));
+
+  // Readers of the registry see the same state.
+  rlz_lib::EnableFileStateStore(false, false);
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IE_HOME_PAGE, value, 50));
+  EXPECT_STREQ("Mirrored", value);
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             value, 50));
+  EXPECT_STREQ("events=W1I", value);
+  EXPECT_TRUE(rlz_lib::GetMachineDealCode(value, 50));
+  EXPECT_STREQ("mirrored_dcc", value);
+
+  // Clears are mirrored too.
+  rlz_lib::EnableFileStateStore(true, true);
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IE_HOME_PAGE, ""));
+
+  rlz_lib::EnableFileStateStore(false, false);
+  EXPECT_FALSE(rlz_lib::HasPendingEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IE_HOME_PAGE, value, 50));
+  EXPECT_STREQ("", value);
+}
+
+TEST_F(ValueStoreTest, DiscardedWritesAreNotPublished) {
+  char value[50];
+  rlz_lib::EnableFileStateStore(true, false);
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IE_HOME_PAGE, "Committed"));
+
+  {
+    rlz_lib::ScopedValueStore scoped_store(NULL, true);
+    rlz_lib::RlzValueStore* store = scoped_store.get();
+    ASSERT_TRUE(store != NULL);
+    EXPECT_TRUE(store->WriteAccessPointRlz(rlz_lib::IE_HOME_PAGE,
+                                           "Discarded"));
+    store->Discard();
+    EXPECT_TRUE(store->Commit());
+  }
+
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IE_HOME_PAGE, value, 50));
+  EXPECT_STREQ("Committed", value);
+}
@@ -0,0 +1,337 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The WinHTTP transport of the financial pings. winhttp.h and wininet.h can
+// not be included together, so this file only uses WinHTTP.
+
+#include "rlz/win/lib/winhttp_transport.h"
+
+#include <windows.h>
+#include <winhttp.h>
+#include <string>
+#include <vector>
+
+#include "base/string_util.h"
+#include "base/utf_string_conversions.h"
+#include "base/win/scoped_handle.h"
+#include "rlz/win/lib/lib_values.h"
+#include "rlz/win/lib/trace.h"
+
+namespace {
+
+// The state of a request, which its status callbacks report to. It must
+// outlive the request handle, until WINHTTP_CALLBACK_STATUS_HANDLE_CLOSING.
+struct RequestState {
+  RequestState()
+      : completed(CreateEvent(NULL, FALSE, FALSE, NULL)),
+        closed(CreateEvent(NULL, TRUE, FALSE, NULL)),
+        succeeded(false),
+        bytes_read(0),
+        timer(NULL) {
+  }
+
+  // Signaled when the pending call completes.
+  base::win::ScopedHandle completed;
+
+  // Signaled once the handle is closed, which also fails any wait.
+  base::win::ScopedHandle closed;
+
+  // Set by the callback before it signals completed.
+  bool succeeded;
+  DWORD bytes_read;
+
+  // Where the callback marks the phases of the request, if not NULL.
+  rlz_lib::PingPhaseTimer* timer;
+};
+
+void CALLBACK WinHttpStatusCallback(HINTERNET handle, DWORD_PTR context,
+                                    DWORD status, LPVOID info,
+                                    DWORD info_length) {
+  // The session and connection handles have no state.
+  RequestState* state = reinterpret_cast<RequestState*>(context);
+  if (!state)
+    return;
+
+  switch (status) {
+  case WINHTTP_CALLBACK_STATUS_NAME_RESOLVED:
+    if (state->timer)
+      state->timer->MarkEnd(rlz_lib::PING_PHASE_RESOLVE);
+    break;
+  case WINHTTP_CALLBACK_STATUS_CONNECTED_TO_SERVER:
+    if (state->timer)
+      state->timer->MarkEnd(rlz_lib::PING_PHASE_CONNECT);
+    break;
+  case WINHTTP_CALLBACK_STATUS_REQUEST_SENT:
+    if (state->timer)
+      state->timer->MarkEnd(rlz_lib::PING_PHASE_SEND);
+    break;
+  case WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE:
+  case WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE:
+    state->succeeded = true;
+    SetEvent(state->completed);
+    break;
+  case WINHTTP_CALLBACK_STATUS_READ_COMPLETE:
+    state->succeeded = true;
+    state->bytes_read = info_length;
+    SetEvent(state->completed);
+    break;
+  case WINHTTP_CALLBACK_STATUS_REQUEST_ERROR:
+    state->succeeded = false;
+    SetEvent(state->completed);
+    break;
+  case WINHTTP_CALLBACK_STATUS_HANDLE_CLOSING:
+    SetEvent(state->closed);
+    break;
+  }
+}
+
+// Waits for the pending call on the request of |state|. Returns false if it
+// failed, or if the request was closed, e.g. by a PingCanceller.
+bool WaitForCompletion(RequestState* state) {
+  HANDLE events[] = { state->completed, state->closed };
+  DWORD result = WaitForMultipleObjects(arraysize(events), events, FALSE,
+                                        INFINITE);
+  return result == WAIT_OBJECT_0 && state->succeeded;
+}
+
+// Owns a request handle and its state, and attaches it to a canceller. The
+// handle is closed, and its callbacks are over, when the object goes away.
+class ScopedWinHttpRequest {
+ public:
+  ScopedWinHttpRequest(HINTERNET request, rlz_lib::PingCanceller* canceller)
+      : request_(request), canceller_(canceller), has_context_(false),
+        attached_(false) {
+    if (!request_)
+      return;
+
+    DWORD_PTR context = reinterpret_cast<DWORD_PTR>(&state_);
+    has_context_ = WinHttpSetOption(request_, WINHTTP_OPTION_CONTEXT_VALUE,
+                                    &context, sizeof(context)) != FALSE;
+    if (has_context_ && canceller_)
+      attached_ = canceller_->Attach(request_, WinHttpCloseHandle);
+  }
+
+  ~ScopedWinHttpRequest() {
+    if (!request_)
+      return;
+
+    if (!attached_ || !canceller_->Detach())
+      WinHttpCloseHandle(request_);
+    if (has_context_)
+      WaitForSingleObject(state_.closed, INFINITE);
+  }
+
+  // Returns false if the request could not be made, or if the ping was
+  // cancelled before the request was attached.
+  bool usable() const {
+    return request_ && has_context_ && (!canceller_ || attached_);
+  }
+
+  bool cancelled() const { return canceller_ && canceller_->cancelled(); }
+
+  HINTERNET get() const { return request_; }
+  RequestState* state() { return &state_; }
+
+ private:
+  HINTERNET request_;
+  rlz_lib::PingCanceller* canceller_;
+  RequestState state_;
+  bool has_context_;
+  bool attached_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedWinHttpRequest);
+};
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+// An asynchronous WinHTTP session, and its connection to the financial
+// server.
+class WinHttpSession : public base::RefCountedThreadSafe<WinHttpSession> {
+ public:
+  WinHttpSession(HINTERNET session, HINTERNET connection)
+      : session_(session), connection_(connection) {
+  }
+
+  HINTERNET connection() const { return connection_; }
+
+ private:
+  friend class base::RefCountedThreadSafe<WinHttpSession>;
+
+  ~WinHttpSession() {
+    WinHttpCloseHandle(connection_);
+    WinHttpCloseHandle(session_);
+  }
+
+  HINTERNET session_;
+  HINTERNET connection_;
+
+  DISALLOW_COPY_AND_ASSIGN(WinHttpSession);
+};
+
+WinHttpPingTransport::WinHttpPingTransport() {
+}
+
+WinHttpPingTransport::~WinHttpPingTransport() {
+}
+
+scoped_refptr<WinHttpSession> WinHttpPingTransport::GetSession() {
+  base::AutoLock auto_lock(lock_);
+  if (session_)
+    return session_;
+
+  ScopedTraceSpan open_span("WinHttpOpen");
+  HINTERNET session = WinHttpOpen(ASCIIToWide(kFinancialPingUserAgent).c_str(),
+                                  WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
+                                  WINHTTP_NO_PROXY_NAME,
+                                  WINHTTP_NO_PROXY_BYPASS, WINHTTP_FLAG_ASYNC);
+  open_span.End();
+  if (!session)
+    return NULL;
+
+  // Set before any requests, which inherit the callback. The resolution,
+  // connection and sending notifications time the phases of the pings.
+  if (WinHttpSetStatusCallback(session, WinHttpStatusCallback,
+                               WINHTTP_CALLBACK_FLAG_ALL_COMPLETIONS |
+                               WINHTTP_CALLBACK_FLAG_HANDLES |
+                               WINHTTP_CALLBACK_FLAG_RESOLVE_NAME |
+                               WINHTTP_CALLBACK_FLAG_CONNECT_TO_SERVER |
+                               WINHTTP_CALLBACK_FLAG_SEND_REQUEST, NULL) ==
+      WINHTTP_INVALID_STATUS_CALLBACK) {
+    WinHttpCloseHandle(session);
+    return NULL;
+  }
+
+  // Connecting does not touch the network yet.
+  ScopedTraceSpan connect_span("WinHttpConnect");
+  HINTERNET connection = WinHttpConnect(session,
+      ASCIIToWide(kFinancialServer).c_str(),
+      static_cast<INTERNET_PORT>(kFinancialPort), 0);
+  connect_span.End();
+  if (!connection) {
+    WinHttpCloseHandle(session);
+    return NULL;
+  }
+
+  session_ = new WinHttpSession(session, connection);
+  return session_;
+}
+
+void WinHttpPingTransport::ResetSession(WinHttpSession* session) {
+  // The session is released without the lock.
+  scoped_refptr<WinHttpSession> previous;
+  base::AutoLock auto_lock(lock_);
+  if (session_.get() == session)
+    previous.swap(session_);
+}
+
+bool WinHttpPingTransport::SendRequest(const HttpRequest& http_request,
+                                       PingCanceller* canceller,
+                                       PingResponseReader* reader,
+                                       PingPhaseTimer* timer,
+                                       DWORD* status) {
+  scoped_refptr<WinHttpSession> session(GetSession());
+  if (!session)
+    return false;
+
+  std::vector<std::wstring> accept_types;
+  for (const char** type = kFinancialPingResponseObjects; *type; ++type)
+    accept_types.push_back(ASCIIToWide(*type));
+  std::vector<const wchar_t*> accept_type_pointers;
+  for (size_t i = 0; i < accept_types.size(); ++i)
+    accept_type_pointers.push_back(accept_types[i].c_str());
+  accept_type_pointers.push_back(NULL);
+
+  // Prepare the HTTP request.
+  ScopedTraceSpan open_span("WinHttpOpenRequest");
+  ScopedWinHttpRequest request(WinHttpOpenRequest(session->connection(),
+      ASCIIToWide(http_request.verb).c_str(),
+      ASCIIToWide(http_request.path).c_str(), NULL, WINHTTP_NO_REFERER,
+      &accept_type_pointers[0], 0), canceller);
+  open_span.End();
+  if (!request.get()) {
+    ResetSession(session);
+    return false;
+  }
+  if (!request.usable())
+    return false;
+  request.state()->timer = timer;
+
+  // Send the HTTP request, and wait for the response headers.
+  std::wstring headers(ASCIIToWide(http_request.headers));
+  const std::string& body = http_request.body;
+  ScopedTraceSpan send_span("WinHttpSendRequest");
+  bool sent = WinHttpSendRequest(request.get(),
+      headers.empty() ? WINHTTP_NO_ADDITIONAL_HEADERS : headers.c_str(),
+      static_cast<DWORD>(headers.size()),
+      body.empty() ? WINHTTP_NO_REQUEST_DATA : const_cast<char*>(body.data()),
+      static_cast<DWORD>(body.size()), static_cast<DWORD>(body.size()),
+      reinterpret_cast<DWORD_PTR>(request.state())) &&
+      WaitForCompletion(request.state());
+  send_span.End();
+  if (sent) {
+    ScopedTraceSpan receive_span("WinHttpReceiveResponse");
+    sent = WinHttpReceiveResponse(request.get(), NULL) &&
+        WaitForCompletion(request.state());
+  }
+  if (!sent) {
+    // Start from scratch next time, e.g. in case the proxy changed.
+    if (!request.cancelled())
+      ResetSession(session);
+    return false;
+  }
+
+  // Check the response status.
+  DWORD status_size = sizeof(*status);
+  if (!WinHttpQueryHeaders(request.get(), WINHTTP_QUERY_STATUS_CODE |
+                           WINHTTP_QUERY_FLAG_NUMBER,
+                           WINHTTP_HEADER_NAME_BY_INDEX, status,
+                           &status_size, WINHTTP_NO_HEADER_INDEX)) {
+    if (!request.cancelled())
+      ResetSession(session);
+    return false;
+  }
+
+  if (HTTP_STATUS_OK != *status)
+    return true;
+
+  bool compressed = false;
+  if (http_request.accept_gzip) {
+    wchar_t encoding[16];
+    DWORD encoding_size = sizeof(encoding);
+    compressed = WinHttpQueryHeaders(request.get(),
+                                     WINHTTP_QUERY_CONTENT_ENCODING,
+                                     WINHTTP_HEADER_NAME_BY_INDEX, encoding,
+                                     &encoding_size,
+                                     WINHTTP_NO_HEADER_INDEX) &&
+                 LowerCaseEqualsASCII(encoding, kGzipEncoding);
+  }
+  reader->Start(compressed);
+
+  // Get the response text, parsing it as it arrives.
+  ScopedTraceSpan read_span("WinHttpReadData");
+  bool read_ok;
+  for (;;) {
+    request.state()->bytes_read = 0;
+    read_ok = WinHttpReadData(request.get(), reader->chunk(),
+                              reader->chunk_size(), NULL) &&
+        WaitForCompletion(request.state());
+    if (!read_ok || request.state()->bytes_read == 0)
+      break;
+
+    if (!reader->Read(request.state()->bytes_read))
+      break;
+  }
+  read_span.End();
+
+  // The rest of a dropped response is left unread, and a partial one is
+  // kept as before, but the connection can not be reused.
+  if (reader->dropped() || (!read_ok && !request.cancelled()))
+    ResetSession(session);
+
+  return true;
+}
+
+}  // namespace rlz_lib
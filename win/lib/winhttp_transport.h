@@ -0,0 +1,51 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The WinHTTP transport of the financial pings.
+
+#ifndef RLZ_WIN_LIB_WINHTTP_TRANSPORT_H_
+#define RLZ_WIN_LIB_WINHTTP_TRANSPORT_H_
+
+#include "base/memory/ref_counted.h"
+#include "base/synchronization/lock.h"
+#include "rlz/win/lib/ping_transport.h"
+
+namespace rlz_lib {
+
+class WinHttpSession;
+
+// Sends the pings with asynchronous WinHTTP calls. The transport keeps one
+// session and connection to the financial server, whose keep-alive
+// connections are shared by all its pings, and starts a new one after a
+// network error. Unlike WinInet, WinHTTP works from services, but uses the
+// proxy set with netsh rather than the one of Internet Explorer.
+class WinHttpPingTransport : public PingTransport {
+ public:
+  WinHttpPingTransport();
+
+ protected:
+  virtual ~WinHttpPingTransport();
+
+  virtual bool SendRequest(const HttpRequest& http_request,
+                           PingCanceller* canceller,
+                           PingResponseReader* reader, PingPhaseTimer* timer,
+                           DWORD* status);
+
+ private:
+  // Returns the session, opening it if needed, or NULL if WinHTTP could not
+  // be initialized. Requests must hold the reference until they are closed.
+  scoped_refptr<WinHttpSession> GetSession();
+
+  // Drops the session if it is still |session|.
+  void ResetSession(WinHttpSession* session);
+
+  base::Lock lock_;
+  scoped_refptr<WinHttpSession> session_;
+
+  DISALLOW_COPY_AND_ASSIGN(WinHttpPingTransport);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_WINHTTP_TRANSPORT_H_
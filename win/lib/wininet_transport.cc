@@ -0,0 +1,182 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The WinInet transport of the financial pings.
+
+#include "rlz/win/lib/wininet_transport.h"
+
+#include <windows.h>
+#include <wininet.h>
+
+#include "base/string_util.h"
+#include "rlz/win/lib/lib_values.h"
+#include "rlz/win/lib/ping_session.h"
+#include "rlz/win/lib/trace.h"
+
+namespace {
+
+class InternetHandle {
+ public:
+  InternetHandle(HINTERNET handle) { handle_ = handle; }
+  ~InternetHandle() { if (handle_) InternetCloseHandle(handle_); }
+  operator HINTERNET() const { return handle_; }
+  bool operator!() const { return (handle_ == NULL); }
+
+  // Gives up ownership without closing the handle.
+  void Release() { handle_ = NULL; }
+
+ private:
+  HINTERNET handle_;
+};
+
+// Attaches a request to a canceller for the lifetime of the object.
+class ScopedCancellableRequest {
+ public:
+  ScopedCancellableRequest(rlz_lib::PingCanceller* canceller,
+                           InternetHandle* request)
+      : canceller_(canceller), request_(request), attached_(false) {
+    if (canceller_)
+      attached_ = canceller_->Attach(*request_, InternetCloseHandle);
+  }
+
+  ~ScopedCancellableRequest() {
+    if (attached_ && canceller_->Detach())
+      request_->Release();
+  }
+
+  // Returns false if the ping was cancelled before the request was attached.
+  bool attached() const { return !canceller_ || attached_; }
+
+  bool cancelled() const { return canceller_ && canceller_->cancelled(); }
+
+ private:
+  rlz_lib::PingCanceller* canceller_;
+  InternetHandle* request_;
+  bool attached_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedCancellableRequest);
+};
+
+// Marks the phases of a request on the PingPhaseTimer of its context. The
+// requests are synchronous, so it is called on the thread sending them.
+void CALLBACK InternetStatusCallback(HINTERNET handle, DWORD_PTR context,
+                                     DWORD status, LPVOID info,
+                                     DWORD info_length) {
+  rlz_lib::PingPhaseTimer* timer =
+      reinterpret_cast<rlz_lib::PingPhaseTimer*>(context);
+  if (!timer)
+    return;
+
+  switch (status) {
+  case INTERNET_STATUS_NAME_RESOLVED:
+    timer->MarkEnd(rlz_lib::PING_PHASE_RESOLVE);
+    break;
+  case INTERNET_STATUS_CONNECTED_TO_SERVER:
+    timer->MarkEnd(rlz_lib::PING_PHASE_CONNECT);
+    break;
+  case INTERNET_STATUS_REQUEST_SENT:
+    timer->MarkEnd(rlz_lib::PING_PHASE_SEND);
+    break;
+  }
+}
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+bool WinInetPingTransport::SendRequest(const HttpRequest& http_request,
+                                       PingCanceller* canceller,
+                                       PingResponseReader* reader,
+                                       PingPhaseTimer* timer,
+                                       DWORD* status) {
+  // Get the shared WinInet session and connection.
+  scoped_refptr<PingSession> session(PingSession::Get());
+  if (!session)
+    return false;
+
+  // Prepare the HTTP request. The timer is its context, which the status
+  // callback marks the phases on.
+  ScopedTraceSpan open_span("HttpOpenRequest");
+  InternetHandle http_handle = HttpOpenRequestA(session->connection(),
+      http_request.verb, http_request.path.c_str(), NULL, NULL,
+      kFinancialPingResponseObjects,
+      INTERNET_FLAG_NO_CACHE_WRITE | INTERNET_FLAG_NO_COOKIES |
+      INTERNET_FLAG_KEEP_CONNECTION, reinterpret_cast<DWORD_PTR>(timer));
+  open_span.End();
+  if (!http_handle) {
+    PingSession::Reset(session);
+    return false;
+  }
+  if (timer)
+    InternetSetStatusCallbackA(http_handle, InternetStatusCallback);
+
+  ScopedCancellableRequest cancellable_request(canceller, &http_handle);
+  if (!cancellable_request.attached())
+    return false;
+
+  // Send the HTTP request. Note: Fails if user is working in off-line mode.
+  const std::string& headers = http_request.headers;
+  const std::string& body = http_request.body;
+  ScopedTraceSpan send_span("HttpSendRequest");
+  BOOL sent = HttpSendRequestA(http_handle,
+      headers.empty() ? NULL : headers.c_str(),
+      static_cast<DWORD>(headers.size()),
+      body.empty() ? NULL : const_cast<char*>(body.data()),
+      static_cast<DWORD>(body.size()));
+  send_span.End();
+  if (!sent) {
+    // Start from scratch next time, e.g. in case the proxy changed.
+    if (!cancellable_request.cancelled())
+      PingSession::Reset(session);
+    return false;
+  }
+
+  // Check the response status.
+  DWORD status_size = sizeof(*status);
+  if (!HttpQueryInfo(http_handle, HTTP_QUERY_STATUS_CODE |
+                     HTTP_QUERY_FLAG_NUMBER, status, &status_size, NULL)) {
+    if (!cancellable_request.cancelled())
+      PingSession::Reset(session);
+    return false;
+  }
+
+  if (HTTP_STATUS_OK != *status)
+    return true;
+
+  bool compressed = false;
+  if (http_request.accept_gzip) {
+    char encoding[16];
+    DWORD encoding_size = sizeof(encoding);
+    compressed = HttpQueryInfoA(http_handle, HTTP_QUERY_CONTENT_ENCODING,
+                                encoding, &encoding_size, NULL) &&
+                 base::strcasecmp(encoding, kGzipEncoding) == 0;
+  }
+  reader->Start(compressed);
+
+  // Get the response text, parsing it as it arrives.
+  ScopedTraceSpan read_span("InternetReadFile");
+  DWORD bytes_read = 0;
+  BOOL read_ok;
+  for (;;) {
+    read_ok = InternetReadFile(http_handle, reader->chunk(),
+                               reader->chunk_size(), &bytes_read);
+    if (!read_ok || bytes_read == 0)
+      break;
+
+    if (!reader->Read(bytes_read))
+      break;
+    bytes_read = 0;
+  }
+  read_span.End();
+
+  // The rest of a dropped response is left unread, and a partial one is
+  // kept as before, but the connection can not be reused.
+  if (reader->dropped() ||
+      (!read_ok && !cancellable_request.cancelled()))
+    PingSession::Reset(session);
+
+  return true;
+}
+
+}  // namespace rlz_lib
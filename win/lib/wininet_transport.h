@@ -0,0 +1,35 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The WinInet transport of the financial pings.
+
+#ifndef RLZ_WIN_LIB_WININET_TRANSPORT_H_
+#define RLZ_WIN_LIB_WININET_TRANSPORT_H_
+
+#include "rlz/win/lib/ping_transport.h"
+
+namespace rlz_lib {
+
+// Sends the pings with blocking WinInet calls, on the shared PingSession.
+// This is the default transport; it uses the proxy settings of Internet
+// Explorer.
+class WinInetPingTransport : public PingTransport {
+ public:
+  WinInetPingTransport() {}
+
+ protected:
+  virtual ~WinInetPingTransport() {}
+
+  virtual bool SendRequest(const HttpRequest& http_request,
+                           PingCanceller* canceller,
+                           PingResponseReader* reader, PingPhaseTimer* timer,
+                           DWORD* status);
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(WinInetPingTransport);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_WININET_TRANSPORT_H_
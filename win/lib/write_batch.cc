@@ -0,0 +1,673 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// A batch of RLZ registry writes applied by a single commit.
+
+#include "rlz/win/lib/write_batch.h"
+
+#include <set>
+
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+#include "base/string_util.h"
+#include "base/stringprintf.h"
+#include "base/utf_string_conversions.h"
+#include "rlz/win/lib/assert.h"
+#include "rlz/win/lib/event_bitmap.h"
+#include "rlz/win/lib/lib_mutex.h"
+#include "rlz/win/lib/lib_values.h"
+#include "rlz/win/lib/machine_deal.h"
+#include "rlz/win/lib/ping_params_cache.h"
+#include "rlz/win/lib/shared_state_mirror.h"
+#include "rlz/win/lib/state_cache.h"
+#include "rlz/win/lib/user_key.h"
+#include "rlz/win/lib/value_store.h"
+
+namespace {
+
+// Current RLZ can only uses [a-zA-Z0-9_\-]
+// We will be more liberal and allow some additional chars, but not url meta
+// chars.
+bool IsGoodRlzChar(const char ch) {
+  if (IsAsciiAlpha(ch) || IsAsciiDigit(ch))
+    return true;
+
+  switch (ch) {
+    case '_':
+    case '-':
+    case '!':
+    case '@':
+    case '$':
+    case '*':
+    case '(':
+    case ')':
+    case ';':
+    case '.':
+    case '<':
+    case '>':
+    return true;
+  }
+
+  return false;
+}
+
+bool IsGoodRlz(const char* rlz) {
+  if (!rlz)
+    return false;
+
+  if (strlen(rlz) > rlz_lib::kMaxRlzLength)
+    return false;
+
+  for (int i = 0; rlz[i]; i++)
+    if (!IsGoodRlzChar(rlz[i]))
+      return false;
+
+  return true;
+}
+
+// This function will remove bad rlz chars and also limit the max rlz to some
+// reasonable size.  It also assumes that normalized_rlz is at least
+// kMaxRlzLength+1 long.
+void NormalizeRlz(const char* raw_rlz, char* normalized_rlz) {
+  int index = 0;
+  for (; raw_rlz[index] != 0 && index < rlz_lib::kMaxRlzLength; ++index) {
+    char current = raw_rlz[index];
+    if (IsGoodRlzChar(current)) {
+      normalized_rlz[index] = current;
+    } else {
+      normalized_rlz[index] = '.';
+    }
+  }
+
+  normalized_rlz[index] = 0;
+}
+
+bool GetEventValueName(rlz_lib::AccessPoint point, rlz_lib::Event event,
+                       std::wstring* value_name) {
+  const char* point_name = rlz_lib::GetAccessPointName(point);
+  const char* event_name = rlz_lib::GetEventName(event);
+  if (!point_name || !event_name)
+    return false;
+
+  if (!point_name[0] || !event_name[0])
+    return false;
+
+  value_name->clear();
+  base::StringAppendF(value_name, L"%ls%ls", ASCIIToWide(point_name).c_str(),
+                      ASCIIToWide(event_name).c_str());
+  return true;
+}
+
+// The Kernel Transaction Manager functions, which are only available on Vista
+// and later.
+class KtmFunctions {
+ public:
+  typedef HANDLE (WINAPI *CreateTransactionFunc)(
+      LPSECURITY_ATTRIBUTES, LPGUID, DWORD, DWORD, DWORD, DWORD, LPWSTR);
+  typedef BOOL (WINAPI *TransactionFunc)(HANDLE);
+  typedef LONG (WINAPI *RegCreateKeyTransactedFunc)(
+      HKEY, LPCWSTR, DWORD, LPWSTR, DWORD, REGSAM, LPSECURITY_ATTRIBUTES,
+      PHKEY, LPDWORD, HANDLE, PVOID);
+  typedef LONG (WINAPI *RegOpenKeyTransactedFunc)(
+      HKEY, LPCWSTR, DWORD, REGSAM, PHKEY, HANDLE, PVOID);
+
+  KtmFunctions()
+      : create_transaction(NULL),
+        commit_transaction(NULL),
+        rollback_transaction(NULL),
+        reg_create_key_transacted(NULL),
+        reg_open_key_transacted(NULL) {
+    HMODULE advapi32 = GetModuleHandleW(L"advapi32.dll");
+    HMODULE ktmw32 = LoadLibraryW(L"ktmw32.dll");
+    if (!advapi32 || !ktmw32)
+      return;
+
+    create_transaction = reinterpret_cast<CreateTransactionFunc>(
+        GetProcAddress(ktmw32, "CreateTransaction"));
+    commit_transaction = reinterpret_cast<TransactionFunc>(
+        GetProcAddress(ktmw32, "CommitTransaction"));
+    rollback_transaction = reinterpret_cast<TransactionFunc>(
+        GetProcAddress(ktmw32, "RollbackTransaction"));
+    reg_create_key_transacted = reinterpret_cast<RegCreateKeyTransactedFunc>(
+        GetProcAddress(advapi32, "RegCreateKeyTransactedW"));
+    reg_open_key_transacted = reinterpret_cast<RegOpenKeyTransactedFunc>(
+        GetProcAddress(advapi32, "RegOpenKeyTransactedW"));
+  }
+
+  bool available() const {
+    return create_transaction && commit_transaction && rollback_transaction &&
+        reg_create_key_transacted && reg_open_key_transacted;
+  }
+
+  CreateTransactionFunc create_transaction;
+  TransactionFunc commit_transaction;
+  TransactionFunc rollback_transaction;
+  RegCreateKeyTransactedFunc reg_create_key_transacted;
+  RegOpenKeyTransactedFunc reg_open_key_transacted;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(KtmFunctions);
+};
+
+base::LazyInstance<KtmFunctions, base::LeakyLazyInstanceTraits<KtmFunctions> >
+    g_ktm(base::LINKER_INITIALIZED);
+
+// Returns false if the hive of |user_key| can not be written through
+// |transaction|, e.g. because it is a remote or an overridden hive, so that
+// the writes must be applied directly. Nothing is written.
+bool SupportsTransactions(HKEY user_key, HANDLE transaction) {
+  HKEY key = NULL;
+  LONG result = g_ktm.Get().reg_open_key_transacted(user_key, L"", 0,
+                                                    KEY_READ, &key,
+                                                    transaction, NULL);
+  if (result == ERROR_SUCCESS)
+    RegCloseKey(key);
+  return result != ERROR_NOT_SUPPORTED &&
+      result != ERROR_TRANSACTIONS_UNSUPPORTED_REMOTE;
+}
+
+// A registry key handle, opened directly or through a transaction.
+class BatchKey {
+ public:
+  BatchKey() : key_(NULL) {}
+  ~BatchKey() {
+    if (key_)
+      RegCloseKey(key_);
+  }
+
+  // Creates the key if it does not exist.
+  bool Create(HKEY root, const std::wstring& location, HANDLE transaction) {
+    DCHECK(!key_);
+    LONG result = transaction ?
+        g_ktm.Get().reg_create_key_transacted(
+            root, location.c_str(), 0, NULL, REG_OPTION_NON_VOLATILE,
+            KEY_READ | KEY_WRITE, NULL, &key_, NULL, transaction, NULL) :
+        RegCreateKeyExW(root, location.c_str(), 0, NULL,
+                        REG_OPTION_NON_VOLATILE, KEY_READ | KEY_WRITE, NULL,
+                        &key_, NULL);
+    if (result != ERROR_SUCCESS)
+      key_ = NULL;
+    return result == ERROR_SUCCESS;
+  }
+
+  // Opens an existing key. Returns ERROR_SUCCESS, or the error code.
+  LONG Open(HKEY root, const std::wstring& location, HANDLE transaction) {
+    DCHECK(!key_);
+    LONG result = transaction ?
+        g_ktm.Get().reg_open_key_transacted(root, location.c_str(), 0,
+                                            KEY_READ | KEY_WRITE, &key_,
+                                            transaction, NULL) :
+        RegOpenKeyExW(root, location.c_str(), 0, KEY_READ | KEY_WRITE, &key_);
+    if (result != ERROR_SUCCESS)
+      key_ = NULL;
+    return result;
+  }
+
+  bool WriteValue(const wchar_t* name, const std::wstring& value) {
+    return RegSetValueExW(key_, name, 0, REG_SZ,
+        reinterpret_cast<const BYTE*>(value.c_str()),
+        static_cast<DWORD>((value.size() + 1) * sizeof(wchar_t))) ==
+        ERROR_SUCCESS;
+  }
+
+  bool WriteValue(const wchar_t* name, DWORD value) {
+    return RegSetValueExW(key_, name, 0, REG_DWORD,
+                          reinterpret_cast<const BYTE*>(&value),
+                          sizeof(value)) == ERROR_SUCCESS;
+  }
+
+  // Deleting a value which does not exist succeeds.
+  bool DeleteValue(const wchar_t* name) {
+    LONG result = RegDeleteValueW(key_, name);
+    return result == ERROR_SUCCESS || result == ERROR_FILE_NOT_FOUND;
+  }
+
+  HKEY handle() const { return key_; }
+
+ private:
+  HKEY key_;
+
+  DISALLOW_COPY_AND_ASSIGN(BatchKey);
+};
+
+typedef std::vector<std::pair<rlz_lib::AccessPoint, rlz_lib::Event> >
+    EventVector;
+
+// Clears |events| from both the legacy per value layout and the bitmap.
+bool ClearEvents(HKEY user_key, HANDLE transaction, rlz_lib::Product product,
+                 const EventVector& events) {
+  bool result = true;
+
+  std::wstring location;
+  rlz_lib::GetEventsRegKeyLocation(rlz_lib::kEventsSubkeyName, &product,
+                                   &location);
+
+  BatchKey key;
+  LONG open_result = key.Open(user_key, location, transaction);
+  if (open_result == ERROR_SUCCESS) {
+    for (size_t i = 0; i < events.size(); ++i) {
+      std::wstring value_name;
+      GetEventValueName(events[i].first, events[i].second, &value_name);
+      if (!key.DeleteValue(value_name.c_str())) {
+        ASSERT_STRING("RlzWriteBatch::Apply: Could not delete an event");
+        result = false;
+      }
+    }
+  } else if (open_result != ERROR_FILE_NOT_FOUND) {
+    ASSERT_STRING("RlzWriteBatch::Apply: Could not open the events key");
+    result = false;
+  }
+
+  BatchKey bits_key;
+  open_result = bits_key.Open(
+      user_key, rlz_lib::GetRegKeyLocation(rlz_lib::kEventBitsSubkeyName),
+      transaction);
+  if (open_result == ERROR_FILE_NOT_FOUND)
+    return result;  // No events bitmaps.
+
+  const wchar_t* product_name = rlz_lib::GetProductName(product);
+  rlz_lib::EventBitmap bitmap;
+  if (open_result != ERROR_SUCCESS ||
+      !bitmap.Read(bits_key.handle(), product_name)) {
+    ASSERT_STRING("RlzWriteBatch::Apply: Could not read the events bitmap");
+    return false;
+  }
+
+  if (bitmap.empty())
+    return result;
+
+  for (size_t i = 0; i < events.size(); ++i)
+    bitmap.Clear(events[i].first, events[i].second);
+
+  if (!bitmap.Write(bits_key.handle(), product_name)) {
+    ASSERT_STRING("RlzWriteBatch::Apply: Could not write the events bitmap");
+    result = false;
+  }
+
+  return result;
+}
+
+// Records |events|, except the stateful events of |product|, in the events
+// bitmap when the compact event storage is enabled, and with one value per
+// event otherwise. The legacy events are left for older clients sharing the
+// hive, which do not read the bitmap, until they are cleared.
+bool RecordEvents(HKEY user_key, HANDLE transaction, rlz_lib::Product product,
+                  const EventVector& events) {
+  const wchar_t* product_name = rlz_lib::GetProductName(product);
+
+  // Find the stateful events, in both layouts.
+  std::wstring stateful_location;
+  rlz_lib::GetEventsRegKeyLocation(rlz_lib::kStatefulEventsSubkeyName,
+                                   &product, &stateful_location);
+  BatchKey stateful_key;
+  stateful_key.Open(user_key, stateful_location, transaction);
+  rlz_lib::EventBitmap stateful_bitmap;
+  BatchKey stateful_bits_key;
+  if (stateful_bits_key.Open(user_key,
+          rlz_lib::GetRegKeyLocation(rlz_lib::kStatefulEventBitsSubkeyName),
+          transaction) == ERROR_SUCCESS)
+    stateful_bitmap.Read(stateful_bits_key.handle(), product_name);
+
+  EventVector new_events;
+  for (size_t i = 0; i < events.size(); ++i) {
+    std::wstring value_name;
+    GetEventValueName(events[i].first, events[i].second, &value_name);
+    if (stateful_bitmap.Has(events[i].first, events[i].second) ||
+        (stateful_key.handle() &&
+         RegQueryValueExW(stateful_key.handle(), value_name.c_str(), NULL,
+                          NULL, NULL, NULL) == ERROR_SUCCESS))
+      continue;
+    new_events.push_back(events[i]);
+  }
+
+  if (new_events.empty())
+    return true;
+
+  std::wstring location;
+  rlz_lib::GetEventsRegKeyLocation(rlz_lib::kEventsSubkeyName, &product,
+                                   &location);
+
+  if (!rlz_lib::EventBitmap::IsEnabled()) {
+    BatchKey key;
+    if (!key.Create(user_key, location, transaction)) {
+      ASSERT_STRING("RlzWriteBatch::Apply: Could not open the events key");
+      return false;
+    }
+
+    bool result = true;
+    for (size_t i = 0; i < new_events.size(); ++i) {
+      std::wstring value_name;
+      GetEventValueName(new_events[i].first, new_events[i].second,
+                        &value_name);
+      if (!key.WriteValue(value_name.c_str(), static_cast<DWORD>(1))) {
+        ASSERT_STRING("RlzWriteBatch::Apply: Could not write an event");
+        result = false;
+      }
+    }
+    return result;
+  }
+
+  BatchKey bits_key;
+  rlz_lib::EventBitmap bitmap;
+  if (!bits_key.Create(user_key,
+          rlz_lib::GetRegKeyLocation(rlz_lib::kEventBitsSubkeyName),
+          transaction) ||
+      !bitmap.Read(bits_key.handle(), product_name)) {
+    ASSERT_STRING("RlzWriteBatch::Apply: Could not read the events bitmap");
+    return false;
+  }
+
+  for (size_t i = 0; i < new_events.size(); ++i)
+    bitmap.Set(new_events[i].first, new_events[i].second);
+
+  if (!bitmap.Write(bits_key.handle(), product_name)) {
+    ASSERT_STRING("RlzWriteBatch::Apply: Could not write the events bitmap");
+    return false;
+  }
+  return true;
+}
+
+// Records |events| in the stateful events bitmap when the compact event
+// storage is enabled, and with one value per event otherwise. The legacy
+// stateful events are left for older clients, as in RecordEvents().
+bool RecordStatefulEvents(HKEY user_key, HANDLE transaction,
+                          rlz_lib::Product product,
+                          const EventVector& events) {
+  std::wstring location;
+  rlz_lib::GetEventsRegKeyLocation(rlz_lib::kStatefulEventsSubkeyName,
+                                   &product, &location);
+
+  if (!rlz_lib::EventBitmap::IsEnabled()) {
+    BatchKey key;
+    if (!key.Create(user_key, location, transaction)) {
+      ASSERT_STRING("RlzWriteBatch::Apply: "
+                    "Could not open the stateful events key");
+      return false;
+    }
+
+    bool result = true;
+    for (size_t i = 0; i < events.size(); ++i) {
+      std::wstring value_name;
+      GetEventValueName(events[i].first, events[i].second, &value_name);
+      if (!key.WriteValue(value_name.c_str(), static_cast<DWORD>(1))) {
+        ASSERT_STRING("RlzWriteBatch::Apply: "
+                      "Could not write a stateful event");
+        result = false;
+      }
+    }
+    return result;
+  }
+
+  const wchar_t* product_name = rlz_lib::GetProductName(product);
+  BatchKey bits_key;
+  rlz_lib::EventBitmap bitmap;
+  if (!bits_key.Create(user_key,
+          rlz_lib::GetRegKeyLocation(rlz_lib::kStatefulEventBitsSubkeyName),
+          transaction) ||
+      !bitmap.Read(bits_key.handle(), product_name)) {
+    ASSERT_STRING("RlzWriteBatch::Apply: "
+                  "Could not read the stateful events bitmap");
+    return false;
+  }
+
+  for (size_t i = 0; i < events.size(); ++i)
+    bitmap.Set(events[i].first, events[i].second);
+
+  if (!bitmap.Write(bits_key.handle(), product_name)) {
+    ASSERT_STRING("RlzWriteBatch::Apply: "
+                  "Could not write the stateful events bitmap");
+    return false;
+  }
+  return true;
+}
+
+}  // namespace anonymous
+
+namespace rlz_lib {
+
+RlzWriteBatch::RlzWriteBatch() : has_dcc_(false) {
+}
+
+RlzWriteBatch::~RlzWriteBatch() {
+}
+
+bool RlzWriteBatch::SetAccessPointRlz(AccessPoint point, const char* new_rlz) {
+  if (!new_rlz) {
+    ASSERT_STRING("RlzWriteBatch::SetAccessPointRlz: Invalid buffer");
+    return false;
+  }
+
+  if (!GetAccessPointName(point))
+    return false;
+
+  if (strlen(new_rlz) > kMaxRlzLength) {
+    ASSERT_STRING("RlzWriteBatch::SetAccessPointRlz: "
+                  "RLZ length is exceeds max allowed.");
+    return false;
+  }
+
+  char normalized_rlz[kMaxRlzLength + 1];
+  NormalizeRlz(new_rlz, normalized_rlz);
+  rlzs_[point] = normalized_rlz;
+  return true;
+}
+
+bool RlzWriteBatch::RecordProductEvent(Product product, AccessPoint point,
+                                       Event event) {
+  std::wstring value_name;
+  if (!GetProductName(product) || !GetEventValueName(point, event, &value_name))
+    return false;
+
+  recorded_events_[product].push_back(ProductEvent(point, event));
+  return true;
+}
+
+bool RlzWriteBatch::ClearProductEvent(Product product, AccessPoint point,
+                                      Event event) {
+  std::wstring value_name;
+  if (!GetProductName(product) || !GetEventValueName(point, event, &value_name))
+    return false;
+
+  cleared_events_[product].push_back(ProductEvent(point, event));
+  return true;
+}
+
+bool RlzWriteBatch::RecordStatefulEvent(Product product, AccessPoint point,
+                                        Event event) {
+  std::wstring value_name;
+  if (!GetProductName(product) || !GetEventValueName(point, event, &value_name))
+    return false;
+
+  stateful_events_[product].push_back(ProductEvent(point, event));
+  return true;
+}
+
+void RlzWriteBatch::SetMachineDealCode(const char* dcc) {
+  has_dcc_ = true;
+  dcc_ = dcc;
+}
+
+bool RlzWriteBatch::empty() const {
+  return rlzs_.empty() && recorded_events_.empty() &&
+      cleared_events_.empty() && stateful_events_.empty() && !has_dcc_;
+}
+
+bool RlzWriteBatch::Commit(const wchar_t* sid, bool transacted) {
+  bool result = true;
+  bool has_user_writes = !rlzs_.empty() || !recorded_events_.empty() ||
+      !cleared_events_.empty() || !stateful_events_.empty();
+  if (has_user_writes && RlzValueStore::IsFileStoreEnabled()) {
+    result = CommitToStore(sid);
+  } else if (has_user_writes) {
+    LibMutex lock;
+    if (lock.failed()) {
+      Clear();
+      return false;
+    }
+
+    UserKey user_key(sid);
+    if (!user_key.HasAccess(true)) {
+      Clear();
+      return false;
+    }
+
+    StateCache::InvalidateUser(sid);
+    SharedStateMirror::InvalidateUser(sid);
+    PingParamsCache::InvalidateUser(sid);
+
+    const KtmFunctions& ktm = g_ktm.Get();
+    HANDLE transaction = INVALID_HANDLE_VALUE;
+    if (transacted && ktm.available())
+      transaction = ktm.create_transaction(NULL, NULL, 0, 0, 0, 0, NULL);
+
+    // The writes are only applied directly when transactions are not
+    // available. Once a transaction is used, any failure fails the commit
+    // and leaves nothing applied.
+    if (transaction != INVALID_HANDLE_VALUE &&
+        !SupportsTransactions(user_key.Get(), transaction)) {
+      CloseHandle(transaction);
+      transaction = INVALID_HANDLE_VALUE;
+    }
+
+    if (transaction != INVALID_HANDLE_VALUE) {
+      result = Apply(user_key.Get(), transaction) &&
+          ktm.commit_transaction(transaction);
+      if (!result) {
+        ASSERT_STRING("RlzWriteBatch::Commit: The transaction failed");
+        ktm.rollback_transaction(transaction);
+      }
+      CloseHandle(transaction);
+    } else {
+      result = Apply(user_key.Get(), NULL);
+    }
+  }
+
+  if (has_dcc_)
+    MachineDealCode::Set(dcc_.c_str());
+
+  Clear();
+  return result;
+}
+
+bool RlzWriteBatch::CommitToStore(const wchar_t* sid) {
+  ScopedValueStore scoped_store(sid, true);
+  RlzValueStore* store = scoped_store.get();
+  if (!store)
+    return false;
+
+  bool result = true;
+  for (RlzMap::const_iterator it = rlzs_.begin(); it != rlzs_.end(); ++it)
+    result &= store->WriteAccessPointRlz(it->first, it->second);
+
+  // Each product is read and written once, in the order Apply() writes the
+  // registry.
+  std::set<Product> products;
+  for (EventMap::const_iterator it = recorded_events_.begin();
+       it != recorded_events_.end(); ++it)
+    products.insert(it->first);
+  for (EventMap::const_iterator it = cleared_events_.begin();
+       it != cleared_events_.end(); ++it)
+    products.insert(it->first);
+  for (EventMap::const_iterator it = stateful_events_.begin();
+       it != stateful_events_.end(); ++it)
+    products.insert(it->first);
+
+  for (std::set<Product>::const_iterator product = products.begin();
+       product != products.end(); ++product) {
+    EventBitmap events;
+    EventBitmap stateful_events;
+    if (!store->ReadProductEvents(*product, &events) ||
+        !store->ReadStatefulEvents(*product, &stateful_events)) {
+      ASSERT_STRING("RlzWriteBatch::CommitToStore: Could not read the events");
+      result = false;
+      continue;
+    }
+
+    EventMap::const_iterator it = recorded_events_.find(*product);
+    if (it != recorded_events_.end()) {
+      for (size_t i = 0; i < it->second.size(); ++i) {
+        if (!stateful_events.Has(it->second[i].first, it->second[i].second))
+          events.Set(it->second[i].first, it->second[i].second);
+      }
+    }
+
+    it = cleared_events_.find(*product);
+    if (it != cleared_events_.end()) {
+      for (size_t i = 0; i < it->second.size(); ++i)
+        events.Clear(it->second[i].first, it->second[i].second);
+    }
+
+    it = stateful_events_.find(*product);
+    if (it != stateful_events_.end()) {
+      for (size_t i = 0; i < it->second.size(); ++i)
+        stateful_events.Set(it->second[i].first, it->second[i].second);
+    }
+
+    result &= store->WriteProductEvents(*product, events);
+    result &= store->WriteStatefulEvents(*product, stateful_events);
+  }
+
+  // All the writes are published together, or not at all.
+  if (!result) {
+    store->Discard();
+    return false;
+  }
+  return store->Commit();
+}
+
+bool RlzWriteBatch::Apply(HKEY user_key, HANDLE transaction) {
+  bool result = true;
+
+  if (!rlzs_.empty()) {
+    BatchKey key;
+    if (!key.Create(user_key, GetRegKeyLocation(kRlzsSubkeyName),
+                    transaction)) {
+      ASSERT_STRING("RlzWriteBatch::Apply: Could not open the RLZs key");
+      return false;
+    }
+
+    for (RlzMap::const_iterator it = rlzs_.begin(); it != rlzs_.end(); ++it) {
+      std::wstring point_name(ASCIIToWide(GetAccessPointName(it->first)));
+      // Setting RLZ to empty == clearing.
+      bool written = it->second.empty() ?
+          key.DeleteValue(point_name.c_str()) :
+          key.WriteValue(point_name.c_str(), ASCIIToWide(it->second));
+      if (!written) {
+        ASSERT_STRING("RlzWriteBatch::Apply: Could not write an RLZ value");
+        result = false;
+      }
+    }
+  }
+
+  for (EventMap::const_iterator it = recorded_events_.begin();
+       it != recorded_events_.end(); ++it) {
+    if (!RecordEvents(user_key, transaction, it->first, it->second))
+      result = false;
+  }
+
+  for (EventMap::const_iterator it = cleared_events_.begin();
+       it != cleared_events_.end(); ++it) {
+    if (!ClearEvents(user_key, transaction, it->first, it->second))
+      result = false;
+  }
+
+  for (EventMap::const_iterator it = stateful_events_.begin();
+       it != stateful_events_.end(); ++it) {
+    if (!RecordStatefulEvents(user_key, transaction, it->first, it->second))
+      result = false;
+  }
+
+  return result;
+}
+
+void RlzWriteBatch::Clear() {
+  rlzs_.clear();
+  recorded_events_.clear();
+  cleared_events_.clear();
+  stateful_events_.clear();
+  has_dcc_ = false;
+  dcc_.clear();
+}
+
+}  // namespace rlz_lib
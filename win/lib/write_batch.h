@@ -0,0 +1,85 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// A batch of RLZ registry writes applied by a single commit.
+
+#ifndef RLZ_WIN_LIB_WRITE_BATCH_H_
+#define RLZ_WIN_LIB_WRITE_BATCH_H_
+
+#include <windows.h>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "rlz/win/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+// Collects RLZ sets, event records and clears, stateful event records and a
+// DCC update, and writes them with one key open per subkey. When transacted,
+// the user state is written through a Kernel Transaction Manager registry
+// transaction on Vista and later, so that either all or none of it is
+// applied. While the file store is enabled, the user state is written to
+// it instead, see RlzValueStore.
+class RlzWriteBatch {
+ public:
+  RlzWriteBatch();
+  ~RlzWriteBatch();
+
+  // Queue a new RLZ for the access point. An empty RLZ clears it. The RLZ is
+  // normalized, and false is returned if it is too long.
+  bool SetAccessPointRlz(AccessPoint point, const char* new_rlz);
+
+  // Queue an event to record for the product, unless it is a stateful event
+  // of the product when the batch is committed.
+  bool RecordProductEvent(Product product, AccessPoint point, Event event);
+
+  // Queue an event to clear from the product events.
+  bool ClearProductEvent(Product product, AccessPoint point, Event event);
+
+  // Queue a stateful event to record for the product.
+  bool RecordStatefulEvent(Product product, AccessPoint point, Event event);
+
+  // Queue a new machine DCC. The DCC is written to HKLM after the user state,
+  // on a best effort basis, since it needs machine write access.
+  void SetMachineDealCode(const char* dcc);
+
+  bool empty() const;
+
+  // Applies all the queued writes to the user hive of |sid|, and clears the
+  // batch. If |transacted| is true, the writes are all applied or none is;
+  // only if the system or the hive does not support transactions are they
+  // applied directly. Returns false if any user write failed.
+  // Access: HKCU write, HKLM write for the DCC.
+  bool Commit(const wchar_t* sid, bool transacted);
+
+ private:
+  typedef std::map<AccessPoint, std::string> RlzMap;
+  typedef std::pair<AccessPoint, Event> ProductEvent;
+  typedef std::map<Product, std::vector<ProductEvent> > EventMap;
+
+  // Applies the user writes to the file store, with a single commit of it.
+  bool CommitToStore(const wchar_t* sid);
+
+  // Applies the user writes to the user key, through |transaction| if it is
+  // not NULL.
+  bool Apply(HKEY user_key, HANDLE transaction);
+
+  void Clear();
+
+  RlzMap rlzs_;
+  EventMap recorded_events_;
+  EventMap cleared_events_;
+  EventMap stateful_events_;
+  bool has_dcc_;
+  std::string dcc_;
+
+  DISALLOW_COPY_AND_ASSIGN(RlzWriteBatch);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_WIN_LIB_WRITE_BATCH_H_
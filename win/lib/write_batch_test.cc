@@ -0,0 +1,120 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// A test application for the RlzWriteBatch class.
+//
+// These tests should not be executed on the build server:
+// - They assert for the failed cases.
+// - They modify machine state (registry).
+//
+// These tests require write access to HKLM and HKCU.
+
+#include "base/logging.h"
+#include "testing/gmock/include/gmock/gmock.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+#include "rlz/win/lib/rlz_lib.h"
+#include "rlz/win/lib/write_batch.h"
+#include "rlz/win/test/rlz_test_helpers.h"
+
+class RlzWriteBatchTest : public RlzLibTestBase {
+};
+
+TEST_F(RlzWriteBatchTest, Commit) {
+  for (int transacted = 0; transacted < 2; ++transacted) {
+    char value[50];
+
+    EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+    EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IE_HOME_PAGE, "OldRlz"));
+    EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+        rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+    EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+        rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+
+    rlz_lib::RlzWriteBatch batch;
+    EXPECT_TRUE(batch.empty());
+    EXPECT_TRUE(batch.SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "Ie Tb"));
+    EXPECT_TRUE(batch.SetAccessPointRlz(rlz_lib::IE_HOME_PAGE, ""));
+    EXPECT_TRUE(batch.ClearProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+        rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+    EXPECT_TRUE(batch.RecordStatefulEvent(rlz_lib::TOOLBAR_NOTIFIER,
+        rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+    EXPECT_FALSE(batch.empty());
+
+    // Nothing is written before the commit.
+    EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IE_HOME_PAGE, value, 50));
+    EXPECT_STREQ("OldRlz", value);
+
+    EXPECT_TRUE(batch.Commit(NULL, transacted != 0));
+    EXPECT_TRUE(batch.empty());
+
+    EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, value,
+                                           50));
+    EXPECT_STREQ("Ie.Tb", value);
+    EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IE_HOME_PAGE, value, 50));
+    EXPECT_STREQ("", value);
+    EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                               value, 50));
+    EXPECT_STREQ("events=W1I", value);
+
+    // The stateful event is no longer recorded.
+    EXPECT_TRUE(rlz_lib::ClearProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+        rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+    EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+        rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+    EXPECT_FALSE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                                value, 50));
+
+    EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  }
+}
+
+TEST_F(RlzWriteBatchTest, InvalidValues) {
+  rlz_lib::RlzWriteBatch batch;
+  EXPECT_FALSE(batch.SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, NULL));
+  EXPECT_FALSE(batch.SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+      "0123456789012345678901234567890123456789"
+      "0123456789012345678901234567890123456789"));
+  EXPECT_FALSE(batch.ClearProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::NO_ACCESS_POINT, rlz_lib::INSTALL));
+  EXPECT_FALSE(batch.RecordStatefulEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INVALID_EVENT));
+  EXPECT_FALSE(batch.RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::NO_ACCESS_POINT, rlz_lib::INSTALL));
+  EXPECT_TRUE(batch.empty());
+
+  // Clearing events which were never recorded succeeds.
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_TRUE(batch.ClearProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+  EXPECT_TRUE(batch.Commit(NULL, true));
+}
+
+TEST_F(RlzWriteBatchTest, RecordProductEvent) {
+  for (int compact = 0; compact < 2; ++compact) {
+    char cgi[50];
+    rlz_lib::EnableCompactEventStorage(compact != 0);
+    EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+
+    rlz_lib::RlzWriteBatch batch;
+    EXPECT_TRUE(batch.RecordStatefulEvent(rlz_lib::TOOLBAR_NOTIFIER,
+        rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+    EXPECT_TRUE(batch.Commit(NULL, false));
+
+    // Stateful events are skipped, as by rlz_lib::RecordProductEvent().
+    EXPECT_TRUE(batch.RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+        rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+    EXPECT_TRUE(batch.RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+        rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+    EXPECT_TRUE(batch.RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+        rlz_lib::IETB_SEARCH_BOX, rlz_lib::FIRST_SEARCH));
+    EXPECT_TRUE(batch.Commit(NULL, compact != 0));
+
+    EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                               cgi, 50));
+    EXPECT_STREQ("events=I7S,T4F", cgi);
+    EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  }
+  rlz_lib::EnableCompactEventStorage(false);
+}
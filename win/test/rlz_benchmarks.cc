@@ -0,0 +1,433 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Microbenchmarks of the library's hot paths, run on temporary hives.
+//
+// Usage: rlz_benchmarks [--json] [--filter=<substring>] [--scale=<n>]
+//
+// Each benchmark runs a fixed number of iterations (times --scale) after a
+// warm up, so that runs on the same machine are comparable. Reported are:
+// - ns/op: wall time per iteration, without the trace callback.
+// - allocs/op: calls to operator new per iteration.
+// - syscalls/op: registry key opens, RLZ mutex waits and releases, and
+//   network calls per iteration, as reported by the trace callback and the
+//   lock statistics. Registry value reads and writes are not traced, so this
+//   is a lower bound of the actual number of system calls.
+
+#include <windows.h>
+#include <shlwapi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+#include <string>
+
+#include "base/at_exit.h"
+#include "base/basictypes.h"
+#include "base/command_line.h"
+#include "base/string_number_conversions.h"
+#include "base/stringprintf.h"
+#include "base/time.h"
+#include "base/win/registry.h"
+#include "rlz/win/lib/crc32.h"
+#include "rlz/win/lib/crc8.h"
+#include "rlz/win/lib/financial_ping.h"
+#include "rlz/win/lib/lib_values.h"
+#include "rlz/win/lib/machine_deal.h"
+#include "rlz/win/lib/ping_transport.h"
+#include "rlz/win/lib/rlz_lib.h"
+
+namespace {
+
+// Benchmarks run on a single thread, so the counters need no atomics.
+int64 g_allocations = 0;
+int64 g_syscalls = 0;
+
+// The traced spans which stand for system calls.
+const char* kSyscallSpans[] = {
+  "GetRegKey",
+  "GetEventsRegKey",
+  "LibMutexWait",
+  "InternetOpen",
+  "InternetConnect",
+  "HttpOpenRequest",
+  "HttpSendRequest",
+  "InternetReadFile",
+  "WinHttpOpen",
+  "WinHttpConnect",
+  "WinHttpOpenRequest",
+  "WinHttpSendRequest",
+  "WinHttpReceiveResponse",
+  "WinHttpReadData",
+};
+
+void RLZ_LIB_API CountSyscalls(rlz_lib::TraceEventType type,
+                               const char* name,
+                               int64 duration_us,
+                               void* context) {
+  if (type != rlz_lib::TRACE_BEGIN)
+    return;
+
+  for (size_t i = 0; i < arraysize(kSyscallSpans); ++i) {
+    if (strcmp(name, kSyscallSpans[i]) == 0) {
+      ++g_syscalls;
+      return;
+    }
+  }
+}
+
+const wchar_t* kHKCUReplacement = L"Software\\Google\\RlzBenchmarks\\HKCU";
+const wchar_t* kHKLMReplacement = L"Software\\Google\\RlzBenchmarks\\HKLM";
+
+bool OverrideRegistryHives() {
+  SHDeleteKey(HKEY_CURRENT_USER, kHKCUReplacement);
+  SHDeleteKey(HKEY_CURRENT_USER, kHKLMReplacement);
+
+  base::win::RegKey hkcu;
+  base::win::RegKey hklm;
+  if (hkcu.Create(HKEY_CURRENT_USER, kHKCUReplacement, KEY_READ) !=
+          ERROR_SUCCESS ||
+      hklm.Create(HKEY_CURRENT_USER, kHKLMReplacement, KEY_READ) !=
+          ERROR_SUCCESS)
+    return false;
+
+  rlz_lib::InitializeTempHivesForTesting(hklm, hkcu);
+
+  return ::RegOverridePredefKey(HKEY_CURRENT_USER, hkcu.Handle()) ==
+             ERROR_SUCCESS &&
+         ::RegOverridePredefKey(HKEY_LOCAL_MACHINE, hklm.Handle()) ==
+             ERROR_SUCCESS;
+}
+
+void UndoOverrideRegistryHives() {
+  ::RegOverridePredefKey(HKEY_CURRENT_USER, NULL);
+  ::RegOverridePredefKey(HKEY_LOCAL_MACHINE, NULL);
+  SHDeleteKey(HKEY_CURRENT_USER, kHKCUReplacement);
+  SHDeleteKey(HKEY_CURRENT_USER, kHKLMReplacement);
+}
+
+const rlz_lib::Product kProduct = rlz_lib::TOOLBAR_NOTIFIER;
+
+// All the access points, terminated with NO_ACCESS_POINT.
+rlz_lib::AccessPoint g_access_points[rlz_lib::LAST_ACCESS_POINT];
+
+// The synthetic ping response of the current benchmark.
+std::string g_response;
+
+unsigned char g_data[1024];
+
+// Builds a valid response of |size| characters, or as close as the checksum
+// line allows, with RLZs for every access point followed by padding lines.
+void BuildResponse(int size) {
+  g_response.clear();
+  if (size <= 0)
+    return;
+
+  const int kChecksumLineLength = 16;  // "crc32: XXXXXXXX"
+  std::string body("version: 3.0.914.7250\r\n");
+  for (int i = rlz_lib::NO_ACCESS_POINT + 1;
+       i < rlz_lib::LAST_ACCESS_POINT; ++i) {
+    const char* name =
+        rlz_lib::GetAccessPointName(static_cast<rlz_lib::AccessPoint>(i));
+    if (!name || !name[0])
+      continue;
+    std::string line = base::StringPrintf("rlz%s: 1%s2_enUS\r\n", name, name);
+    if (static_cast<int>(body.size() + line.size()) + kChecksumLineLength >
+        size)
+      break;
+    body += line;
+  }
+  if (static_cast<int>(body.size()) + kChecksumLineLength + 64 <= size)
+    body += "events: I7S,W1I\r\nstateful-events: W1I\r\n";
+
+  // Pad with lines the parser skips.
+  while (static_cast<int>(body.size()) + kChecksumLineLength < size) {
+    int room = size - kChecksumLineLength - static_cast<int>(body.size());
+    int length = room < 80 ? room : 80;
+    if (length < 3) {
+      body.append(length, '\n');
+      break;
+    }
+    body += "x:";
+    body.append(length - 3, 'a');
+    body += "\n";
+  }
+
+  int crc = 0;
+  rlz_lib::Crc32(body.c_str(), &crc);
+  g_response = body;
+  base::StringAppendF(&g_response, "crc32: %08X", static_cast<unsigned>(crc));
+}
+
+void SetUpAccessPoints(int arg) {
+  int count = 0;
+  for (int i = rlz_lib::NO_ACCESS_POINT + 1;
+       i < rlz_lib::LAST_ACCESS_POINT; ++i) {
+    rlz_lib::AccessPoint point = static_cast<rlz_lib::AccessPoint>(i);
+    g_access_points[count++] = point;
+    rlz_lib::SetAccessPointRlz(point, "1T4GGLQ_enUS");
+  }
+  g_access_points[count] = rlz_lib::NO_ACCESS_POINT;
+}
+
+void SetUpEvents(int arg) {
+  SetUpAccessPoints(arg);
+  rlz_lib::ClearAllProductEvents(kProduct);
+  rlz_lib::RecordProductEvent(kProduct, rlz_lib::IE_DEFAULT_SEARCH,
+                              rlz_lib::SET_TO_GOOGLE);
+  rlz_lib::RecordProductEvent(kProduct, rlz_lib::IE_HOME_PAGE,
+                              rlz_lib::INSTALL);
+  rlz_lib::RecordProductEvent(kProduct, rlz_lib::IETB_SEARCH_BOX,
+                              rlz_lib::FIRST_SEARCH);
+}
+
+void SetUpResponse(int arg) {
+  SetUpAccessPoints(arg);
+  BuildResponse(arg);
+}
+
+// Answers the pings with the response, without the network.
+void SetUpLoopback(int arg) {
+  SetUpEvents(arg);
+  BuildResponse(arg);
+  scoped_refptr<rlz_lib::LoopbackPingTransport> transport(
+      new rlz_lib::LoopbackPingTransport);
+  transport->SetResponse(g_response, 200);
+  rlz_lib::PingTransport::Set(transport);
+}
+
+void SetUpData(int arg) {
+  for (size_t i = 0; i < arraysize(g_data); ++i)
+    g_data[i] = static_cast<unsigned char>(i * 7 + 3);
+}
+
+void RecordProductEvent(int arg) {
+  rlz_lib::RecordProductEvent(kProduct, rlz_lib::IE_HOME_PAGE,
+                              rlz_lib::INSTALL);
+}
+
+void GetProductEventsAsCgi(int arg) {
+  char cgi[rlz_lib::kMaxCgiLength + 1];
+  rlz_lib::GetProductEventsAsCgi(kProduct, cgi, arraysize(cgi));
+}
+
+void GetPingParams(int arg) {
+  char cgi[rlz_lib::kMaxCgiLength + 1];
+  rlz_lib::GetPingParams(kProduct, g_access_points, cgi, arraysize(cgi));
+}
+
+void FormRequest(int arg) {
+  std::string request;
+  rlz_lib::FinancialPing::FormRequest(kProduct, g_access_points, "swg",
+                                      "GGLA", NULL, "en", false, NULL,
+                                      &request);
+}
+
+void IsPingResponseValid(int arg) {
+  int checksum_idx = 0;
+  rlz_lib::IsPingResponseValid(g_response.c_str(), &checksum_idx);
+}
+
+void ParsePingResponse(int arg) {
+  rlz_lib::ParsePingResponse(kProduct, g_response.c_str());
+}
+
+void PingServer(int arg) {
+  std::string response;
+  bool valid_response = false;
+  rlz_lib::FinancialPing::PingServer("/tools/pso/ping?as=swg", &response,
+                                     NULL, &valid_response);
+}
+
+void SendFinancialPing(int arg) {
+  rlz_lib::SendFinancialPing(kProduct, g_access_points, "swg", "GGLA", NULL,
+                             "en", false, NULL, true);
+}
+
+void Crc8Generate(int arg) {
+  unsigned char check_sum = 0;
+  rlz_lib::Crc8::Generate(g_data, arg, &check_sum);
+}
+
+void Crc32(int arg) {
+  rlz_lib::Crc32(g_data, arg);
+}
+
+void GetMachineIdImpl(int arg) {
+  std::wstring id;
+  rlz_lib::MachineDealCode::GetMachineIdImpl(
+      L"S-1-5-21-2345599882-2448789067-1921365677", 2651229008, &id);
+}
+
+struct Benchmark {
+  const char* name;
+  int arg;  // Passed to |set_up| and |run|, and appended to the name if > 0.
+  int iterations;
+  void (*set_up)(int arg);
+  void (*run)(int arg);
+};
+
+const Benchmark kBenchmarks[] = {
+  { "RecordProductEvent", 0, 2000, SetUpEvents, RecordProductEvent },
+  { "GetProductEventsAsCgi", 0, 2000, SetUpEvents, GetProductEventsAsCgi },
+  { "GetPingParams", 0, 1000, SetUpEvents, GetPingParams },
+  { "FinancialPing::FormRequest", 0, 1000, SetUpEvents, FormRequest },
+  { "IsPingResponseValid", 0, 20000, SetUpResponse, IsPingResponseValid },
+  { "IsPingResponseValid", 1024, 20000, SetUpResponse, IsPingResponseValid },
+  { "IsPingResponseValid", 4096, 5000, SetUpResponse, IsPingResponseValid },
+  { "IsPingResponseValid", rlz_lib::kMaxPingResponseLength, 2000,
+    SetUpResponse, IsPingResponseValid },
+  { "ParsePingResponse", 0, 2000, SetUpResponse, ParsePingResponse },
+  { "ParsePingResponse", 1024, 500, SetUpResponse, ParsePingResponse },
+  { "ParsePingResponse", 4096, 500, SetUpResponse, ParsePingResponse },
+  { "ParsePingResponse", rlz_lib::kMaxPingResponseLength, 500,
+    SetUpResponse, ParsePingResponse },
+  { "FinancialPing::PingServer", 1024, 5000, SetUpLoopback, PingServer },
+  { "FinancialPing::PingServer", rlz_lib::kMaxPingResponseLength, 1000,
+    SetUpLoopback, PingServer },
+  { "SendFinancialPing", 1024, 500, SetUpLoopback, SendFinancialPing },
+  { "Crc8::Generate", 64, 100000, SetUpData, Crc8Generate },
+  { "Crc32", 1024, 100000, SetUpData, Crc32 },
+  { "MachineDealCode::GetMachineIdImpl", 0, 20000, NULL, GetMachineIdImpl },
+};
+
+struct Result {
+  std::string name;
+  int iterations;
+  double ns_per_op;
+  double allocs_per_op;
+  double syscalls_per_op;
+};
+
+// The number of system calls made by the mutex, a wait and a release per
+// acquisition, since the last call.
+int64 GetLockSyscalls() {
+  rlz_lib::LockStats stats;
+  if (!rlz_lib::GetLockStats(&stats))
+    return 0;
+  rlz_lib::ResetLockStats();
+  return 2 * stats.acquisitions;
+}
+
+void RunBenchmark(const Benchmark& benchmark, int scale, Result* result) {
+  result->name = benchmark.name;
+  if (benchmark.arg > 0)
+    base::StringAppendF(&result->name, "/%d", benchmark.arg);
+  result->iterations = benchmark.iterations * scale;
+
+  if (benchmark.set_up)
+    benchmark.set_up(benchmark.arg);
+
+  // Warm up the caches, then time without the trace callback.
+  for (int i = 0; i < benchmark.iterations / 10 + 1; ++i)
+    benchmark.run(benchmark.arg);
+
+  base::TimeTicks start = base::TimeTicks::HighResNow();
+  for (int i = 0; i < result->iterations; ++i)
+    benchmark.run(benchmark.arg);
+  base::TimeDelta elapsed = base::TimeTicks::HighResNow() - start;
+  result->ns_per_op =
+      elapsed.InMicroseconds() * 1000.0 / result->iterations;
+
+  // Count on a separate pass, so that the callback does not add to the time.
+  int count_iterations = benchmark.iterations / 10 + 1;
+  rlz_lib::SetTraceCallback(CountSyscalls, NULL);
+  GetLockSyscalls();
+  g_allocations = 0;
+  g_syscalls = 0;
+  for (int i = 0; i < count_iterations; ++i)
+    benchmark.run(benchmark.arg);
+  int64 allocations = g_allocations;
+  int64 syscalls = g_syscalls + GetLockSyscalls();
+  rlz_lib::SetTraceCallback(NULL, NULL);
+
+  result->allocs_per_op = static_cast<double>(allocations) / count_iterations;
+  result->syscalls_per_op = static_cast<double>(syscalls) / count_iterations;
+}
+
+void PrintText(const Result& result) {
+  printf("%-40s %10d %12.1f ns/op %8.2f allocs/op %8.2f syscalls/op\n",
+         result.name.c_str(), result.iterations, result.ns_per_op,
+         result.allocs_per_op, result.syscalls_per_op);
+}
+
+void PrintJson(const Result& result, bool first) {
+  printf("%s\n    {\"name\": \"%s\", \"iterations\": %d, "
+         "\"ns_per_op\": %.1f, \"allocs_per_op\": %.2f, "
+         "\"syscalls_per_op\": %.2f}",
+         first ? "" : ",", result.name.c_str(), result.iterations,
+         result.ns_per_op, result.allocs_per_op, result.syscalls_per_op);
+}
+
+}  // namespace anonymous
+
+// Counts the allocations of the library, which is linked statically.
+void* operator new(size_t size) {
+  ++g_allocations;
+  void* p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) {
+  free(p);
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete[](void* p) {
+  free(p);
+}
+
+int main(int argc, char** argv) {
+  base::AtExitManager at_exit;
+  CommandLine::Init(argc, argv);
+  const CommandLine* command_line = CommandLine::ForCurrentProcess();
+
+  bool json = command_line->HasSwitch("json");
+  std::string filter = command_line->GetSwitchValueASCII("filter");
+  int scale = 1;
+  if (command_line->HasSwitch("scale") &&
+      (!base::StringToInt(command_line->GetSwitchValueASCII("scale"),
+                          &scale) || scale < 1)) {
+    fprintf(stderr, "Invalid --scale.\n");
+    return 1;
+  }
+
+  if (!OverrideRegistryHives()) {
+    fprintf(stderr, "Could not override the registry hives.\n");
+    UndoOverrideRegistryHives();
+    return 1;
+  }
+  rlz_lib::CreateMachineState();
+
+  if (json)
+    printf("{\n  \"benchmarks\": [");
+
+  bool first = true;
+  for (size_t i = 0; i < arraysize(kBenchmarks); ++i) {
+    if (!filter.empty() &&
+        std::string(kBenchmarks[i].name).find(filter) == std::string::npos)
+      continue;
+
+    Result result;
+    RunBenchmark(kBenchmarks[i], scale, &result);
+    if (json)
+      PrintJson(result, first);
+    else
+      PrintText(result);
+    first = false;
+  }
+
+  if (json)
+    printf("\n  ]\n}\n");
+
+  rlz_lib::PingTransport::Set(NULL);
+  UndoOverrideRegistryHives();
+  return 0;
+}
@@ -0,0 +1,985 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Multi-process contention stress test of the shared RLZ state, run on
+// temporary hives.
+//
+// Usage: rlz_stress [--workers=<n>] [--duration=<seconds>]
+//                   [--integrity=<level>,...] [--mix=<op>:<weight>,...]
+//                   [--lock_timeout_ms=<ms>] [--enable=<feature>,...] [--json]
+//
+// The test launches --workers copies of itself (default 4), which run a
+// random mix of library calls against the same temporary hives for
+// --duration seconds (default 10), then reports what they saw:
+// - ops/s and latency percentiles of each operation, failed calls included.
+// - The RLZ lock acquisitions, contention, timeouts and abandonments.
+// - Corruptions: RLZs which none of the workers wrote, and malformed CGI
+//   strings, both as seen by the workers and in the final state.
+//
+// --integrity lists the integrity levels the workers are assigned to in
+// turn, among low, medium and high; the default is medium,low. Levels above
+// the level of the test are refused. Low integrity workers cannot write
+// HKCU, so they only run the read operations of the mix. Integrity levels
+// are ignored before Vista.
+//
+// --mix weighs the operations, among record (RecordProductEvent), set
+// (SetAccessPointRlz), params (GetPingParams), events (GetProductEventsAsCgi),
+// parse (ParsePingResponse) and clear (ClearProductState). The default is
+// record:30,set:10,params:30,events:10,parse:15,clear:5.
+//
+// --enable turns on state_cache, write_behind or user_key_cache in all the
+// workers.
+//
+// The workers use the real RLZ mutex, so the test also contends with the RLZ
+// clients running on the machine. The exit code is 0 if no worker failed and
+// no corruption was found.
+
+#include <windows.h>
+#include <sddl.h>
+#include <shlwapi.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "base/at_exit.h"
+#include "base/basictypes.h"
+#include "base/command_line.h"
+#include "base/string_number_conversions.h"
+#include "base/string_split.h"
+#include "base/stringprintf.h"
+#include "base/time.h"
+#include "base/utf_string_conversions.h"
+#include "base/win/registry.h"
+#include "base/win/scoped_handle.h"
+#include "base/win/windows_version.h"
+#include "rlz/win/lib/crc32.h"
+#include "rlz/win/lib/lib_mutex.h"
+#include "rlz/win/lib/lib_values.h"
+#include "rlz/win/lib/process_info.h"
+#include "rlz/win/lib/rlz_lib.h"
+
+namespace {
+
+const wchar_t* kHKCUReplacement = L"Software\\Google\\RlzStress\\HKCU";
+const wchar_t* kHKLMReplacement = L"Software\\Google\\RlzStress\\HKLM";
+
+const rlz_lib::Product kProduct = rlz_lib::TOOLBAR_NOTIFIER;
+
+// The access points the workers write, terminated with NO_ACCESS_POINT.
+const rlz_lib::AccessPoint kAccessPoints[] = {
+  rlz_lib::IETB_SEARCH_BOX,
+  rlz_lib::IE_DEFAULT_SEARCH,
+  rlz_lib::IE_HOME_PAGE,
+  rlz_lib::NO_ACCESS_POINT,
+};
+
+const int kAccessPointCount = arraysize(kAccessPoints) - 1;
+
+const rlz_lib::Event kEvents[] = {
+  rlz_lib::INSTALL,
+  rlz_lib::SET_TO_GOOGLE,
+  rlz_lib::FIRST_SEARCH,
+};
+
+// The only RLZs the workers write, so that any other value read is corrupt.
+const char* kRlzValues[] = {
+  "1T4GGLQ_enUS",
+  "1T4ADBR_enUS420",
+  "1I7GGLL_enUS",
+  "1I7ADBR_frFR",
+};
+
+bool IsKnownRlz(const std::string& rlz) {
+  for (size_t i = 0; i < arraysize(kRlzValues); ++i) {
+    if (rlz == kRlzValues[i])
+      return true;
+  }
+  return false;
+}
+
+enum Operation {
+  OP_RECORD,
+  OP_SET,
+  OP_PARAMS,
+  OP_EVENTS,
+  OP_PARSE,
+  OP_CLEAR,
+  OP_COUNT
+};
+
+struct OperationInfo {
+  const char* name;
+  bool writes;
+  int default_weight;
+};
+
+const OperationInfo kOperations[OP_COUNT] = {
+  { "record", true, 30 },
+  { "set", true, 10 },
+  { "params", false, 30 },
+  { "events", false, 10 },
+  { "parse", true, 15 },
+  { "clear", true, 5 },
+};
+
+enum IntegrityLevel {
+  LOW,
+  MEDIUM,
+  HIGH
+};
+
+const char* kIntegrityNames[] = { "low", "medium", "high" };
+
+// The mandatory label SIDs of the integrity levels.
+const wchar_t* kIntegritySids[] = {
+  L"S-1-16-4096",
+  L"S-1-16-8192",
+  L"S-1-16-12288",
+};
+
+// A latency histogram with 8 buckets per power of two of microseconds, so
+// that percentiles are within 12.5% of the actual value.
+class LatencyHistogram {
+ public:
+  static const int kSubBuckets = 8;
+  static const int kBuckets = kSubBuckets * 61;
+
+  LatencyHistogram() : count_(0), max_us_(0) {
+    memset(buckets_, 0, sizeof(buckets_));
+  }
+
+  void Add(int64 us) {
+    if (us < 0)
+      us = 0;
+    ++buckets_[GetBucket(us)];
+    ++count_;
+    if (us > max_us_)
+      max_us_ = us;
+  }
+
+  void Merge(int bucket, int64 count) {
+    if (bucket < 0 || bucket >= kBuckets || count <= 0)
+      return;
+    buckets_[bucket] += count;
+    count_ += count;
+  }
+
+  void MergeMax(int64 max_us) {
+    if (max_us > max_us_)
+      max_us_ = max_us;
+  }
+
+  int64 count() const { return count_; }
+  int64 max_us() const { return max_us_; }
+  int64 bucket(int index) const { return buckets_[index]; }
+
+  // The upper bound of the bucket holding the |fraction| percentile.
+  int64 Percentile(double fraction) const {
+    if (!count_)
+      return 0;
+    int64 rank = static_cast<int64>(fraction * count_);
+    if (rank >= count_)
+      rank = count_ - 1;
+    int64 seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      seen += buckets_[i];
+      if (seen > rank) {
+        int64 upper = GetBucketUpperBound(i);
+        return upper < max_us_ ? upper : max_us_;
+      }
+    }
+    return max_us_;
+  }
+
+ private:
+  static int GetBucket(int64 us) {
+    if (us < kSubBuckets)
+      return static_cast<int>(us);
+    int octave = 0;
+    for (int64 value = us; value > 1; value >>= 1)
+      ++octave;
+    int sub_bucket = static_cast<int>((us >> (octave - 3)) & (kSubBuckets - 1));
+    int bucket = kSubBuckets * (octave - 2) + sub_bucket;
+    return bucket < kBuckets ? bucket : kBuckets - 1;
+  }
+
+  static int64 GetBucketUpperBound(int bucket) {
+    if (bucket < kSubBuckets)
+      return bucket;
+    int octave = bucket / kSubBuckets + 2;
+    int64 lower =
+        static_cast<int64>(kSubBuckets + bucket % kSubBuckets) << (octave - 3);
+    return lower + (static_cast<int64>(1) << (octave - 3)) - 1;
+  }
+
+  int64 buckets_[kBuckets];
+  int64 count_;
+  int64 max_us_;
+
+  DISALLOW_COPY_AND_ASSIGN(LatencyHistogram);
+};
+
+struct OperationStats {
+  OperationStats() : failures(0), corruptions(0) {}
+
+  LatencyHistogram latency;
+  int64 failures;
+  int64 corruptions;
+};
+
+struct Options {
+  Options() : workers(4), duration_s(10),
+              lock_timeout_ms(rlz_lib::kDefaultLockTimeoutMs), json(false) {
+    for (int i = 0; i < OP_COUNT; ++i)
+      weights[i] = kOperations[i].default_weight;
+    integrity_levels.push_back(MEDIUM);
+    integrity_levels.push_back(LOW);
+  }
+
+  int workers;
+  int duration_s;
+  int lock_timeout_ms;
+  int weights[OP_COUNT];
+  std::vector<IntegrityLevel> integrity_levels;
+  std::string mix;
+  std::string enable;
+  bool json;
+};
+
+// Parses |mix| into |weights|. Operations not listed get no weight.
+bool ParseMix(const std::string& mix, int* weights) {
+  for (int i = 0; i < OP_COUNT; ++i)
+    weights[i] = 0;
+
+  std::vector<std::string> entries;
+  base::SplitString(mix, ',', &entries);
+  int total = 0;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    std::string::size_type colon = entries[i].find(':');
+    if (colon == std::string::npos)
+      return false;
+    std::string name = entries[i].substr(0, colon);
+    int weight = 0;
+    if (!base::StringToInt(entries[i].substr(colon + 1), &weight) ||
+        weight < 0)
+      return false;
+
+    int op = 0;
+    while (op < OP_COUNT && name != kOperations[op].name)
+      ++op;
+    if (op == OP_COUNT)
+      return false;
+    weights[op] = weight;
+    total += weight;
+  }
+  return total > 0;
+}
+
+bool ParseIntegrityLevels(const std::string& list,
+                          std::vector<IntegrityLevel>* levels) {
+  levels->clear();
+  std::vector<std::string> names;
+  base::SplitString(list, ',', &names);
+  for (size_t i = 0; i < names.size(); ++i) {
+    size_t level = 0;
+    while (level < arraysize(kIntegrityNames) &&
+           names[i] != kIntegrityNames[level])
+      ++level;
+    if (level == arraysize(kIntegrityNames))
+      return false;
+    levels->push_back(static_cast<IntegrityLevel>(level));
+  }
+  return !levels->empty();
+}
+
+bool ApplyFeatures(const std::string& features) {
+  std::vector<std::string> names;
+  base::SplitString(features, ',', &names);
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (names[i] == "state_cache")
+      rlz_lib::EnableStateCache(true);
+    else if (names[i] == "write_behind")
+      rlz_lib::EnableEventWriteBehind(true);
+    else if (names[i] == "user_key_cache")
+      rlz_lib::EnableUserKeyCache(true);
+    else if (!names[i].empty())
+      return false;
+  }
+  return true;
+}
+
+bool GetIntSwitch(const CommandLine* command_line, const char* name,
+                  int minimum, int* value) {
+  if (!command_line->HasSwitch(name))
+    return true;
+  return base::StringToInt(command_line->GetSwitchValueASCII(name), value) &&
+         *value >= minimum;
+}
+
+bool ParseOptions(const CommandLine* command_line, Options* options) {
+  options->json = command_line->HasSwitch("json");
+  options->enable = command_line->GetSwitchValueASCII("enable");
+  if (command_line->HasSwitch("mix")) {
+    options->mix = command_line->GetSwitchValueASCII("mix");
+    if (!ParseMix(options->mix, options->weights)) {
+      fprintf(stderr, "Invalid --mix.\n");
+      return false;
+    }
+  }
+  if (command_line->HasSwitch("integrity") &&
+      !ParseIntegrityLevels(command_line->GetSwitchValueASCII("integrity"),
+                            &options->integrity_levels)) {
+    fprintf(stderr, "Invalid --integrity.\n");
+    return false;
+  }
+  if (!GetIntSwitch(command_line, "workers", 1, &options->workers) ||
+      !GetIntSwitch(command_line, "duration", 1, &options->duration_s) ||
+      !GetIntSwitch(command_line, "lock_timeout_ms", 0,
+                    &options->lock_timeout_ms)) {
+    fprintf(stderr, "Invalid --workers, --duration or --lock_timeout_ms.\n");
+    return false;
+  }
+  return true;
+}
+
+// Checks that |cgi| only holds well-formed events and known RLZs of the
+// access points the workers write.
+bool IsCgiValid(const std::string& cgi) {
+  std::vector<std::string> params;
+  base::SplitString(cgi, '&', &params);
+  for (size_t i = 0; i < params.size(); ++i) {
+    std::string::size_type equals = params[i].find('=');
+    if (equals == std::string::npos)
+      return false;
+    std::string name = params[i].substr(0, equals);
+    std::vector<std::string> values;
+    base::SplitString(params[i].substr(equals + 1), ',', &values);
+
+    if (name == rlz_lib::kRlzCgiVariable) {
+      for (size_t j = 0; j < values.size(); ++j) {
+        std::string::size_type colon =
+            values[j].find(rlz_lib::kRlzCgiIndicator);
+        rlz_lib::AccessPoint point = rlz_lib::NO_ACCESS_POINT;
+        if (colon == std::string::npos ||
+            !rlz_lib::GetAccessPointFromName(values[j].substr(0, colon).c_str(),
+                                             &point) ||
+            point == rlz_lib::NO_ACCESS_POINT ||
+            !IsKnownRlz(values[j].substr(colon + 1)))
+          return false;
+      }
+    } else if (name == rlz_lib::kEventsCgiVariable) {
+      for (size_t j = 0; j < values.size(); ++j) {
+        // An event is the name of an access point followed by a one letter
+        // event name.
+        rlz_lib::AccessPoint point = rlz_lib::NO_ACCESS_POINT;
+        rlz_lib::Event event = rlz_lib::INVALID_EVENT;
+        size_t length = values[j].size();
+        if (length < 2 ||
+            !rlz_lib::GetAccessPointFromName(
+                values[j].substr(0, length - 1).c_str(), &point) ||
+            !rlz_lib::GetEventFromName(values[j].substr(length - 1).c_str(),
+                                       &event))
+          return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Checks the RLZs of the access points one by one, outside of the CGI code.
+bool AreRlzsValid() {
+  for (int i = 0; i < kAccessPointCount; ++i) {
+    char rlz[rlz_lib::kMaxRlzLength + 1];
+    if (!rlz_lib::GetAccessPointRlz(kAccessPoints[i], rlz, arraysize(rlz)))
+      continue;  // Counted as a failure by the callers, if at all.
+    if (rlz[0] && !IsKnownRlz(rlz))
+      return false;
+  }
+  return true;
+}
+
+// Builds a valid ping response setting all the access points to |rlz|.
+std::string BuildResponse(const char* rlz) {
+  std::string body("version: 3.0.914.7250\r\n");
+  for (int i = 0; i < kAccessPointCount; ++i) {
+    base::StringAppendF(&body, "rlz%s: %s\r\n",
+                        rlz_lib::GetAccessPointName(kAccessPoints[i]), rlz);
+  }
+
+  int crc = 0;
+  rlz_lib::Crc32(body.c_str(), &crc);
+  base::StringAppendF(&body, "crc32: %08X", static_cast<unsigned>(crc));
+  return body;
+}
+
+bool OverrideRegistryHives(bool read_only) {
+  base::win::RegKey hkcu;
+  base::win::RegKey hklm;
+  REGSAM access = read_only ? KEY_READ : KEY_ALL_ACCESS;
+  if (hkcu.Open(HKEY_CURRENT_USER, kHKCUReplacement, access) !=
+          ERROR_SUCCESS ||
+      hklm.Open(HKEY_CURRENT_USER, kHKLMReplacement, access) !=
+          ERROR_SUCCESS)
+    return false;
+
+  return ::RegOverridePredefKey(HKEY_CURRENT_USER, hkcu.Handle()) ==
+             ERROR_SUCCESS &&
+         ::RegOverridePredefKey(HKEY_LOCAL_MACHINE, hklm.Handle()) ==
+             ERROR_SUCCESS;
+}
+
+// Creates the temporary hives and the initial state, and overrides the hives
+// of this process with them.
+bool CreateRegistryHives() {
+  SHDeleteKey(HKEY_CURRENT_USER, kHKCUReplacement);
+  SHDeleteKey(HKEY_CURRENT_USER, kHKLMReplacement);
+
+  base::win::RegKey hkcu;
+  base::win::RegKey hklm;
+  if (hkcu.Create(HKEY_CURRENT_USER, kHKCUReplacement, KEY_READ) !=
+          ERROR_SUCCESS ||
+      hklm.Create(HKEY_CURRENT_USER, kHKLMReplacement, KEY_READ) !=
+          ERROR_SUCCESS)
+    return false;
+
+  // Only this process initializes the hives; the workers just override
+  // theirs, so as not to rewrite the hives while other workers use them.
+  rlz_lib::InitializeTempHivesForTesting(hklm, hkcu);
+  if (!OverrideRegistryHives(false) || !rlz_lib::CreateMachineState())
+    return false;
+
+  for (int i = 0; i < kAccessPointCount; ++i) {
+    if (!rlz_lib::SetAccessPointRlz(kAccessPoints[i], kRlzValues[0]) ||
+        !rlz_lib::RecordProductEvent(kProduct, kAccessPoints[i],
+                                     rlz_lib::INSTALL))
+      return false;
+  }
+  return true;
+}
+
+void DeleteRegistryHives() {
+  ::RegOverridePredefKey(HKEY_CURRENT_USER, NULL);
+  ::RegOverridePredefKey(HKEY_LOCAL_MACHINE, NULL);
+  SHDeleteKey(HKEY_CURRENT_USER, kHKCUReplacement);
+  SHDeleteKey(HKEY_CURRENT_USER, kHKLMReplacement);
+}
+
+// A small linear congruential generator, so that each worker draws its own
+// sequence of operations without the CRT's shared state.
+class Random {
+ public:
+  explicit Random(uint32 seed) : state_(seed) {}
+
+  // Returns a number in [0, range).
+  int Next(int range) {
+    state_ = state_ * 1103515245 + 12345;
+    return static_cast<int>((state_ >> 16) % range);
+  }
+
+ private:
+  uint32 state_;
+};
+
+// Runs |op| once, and returns whether it succeeded. |corrupt| is set if it
+// read corrupt state.
+bool RunOperation(Operation op, Random* random,
+                  const std::vector<std::string>& responses, bool* corrupt) {
+  *corrupt = false;
+  rlz_lib::AccessPoint point = kAccessPoints[random->Next(kAccessPointCount)];
+  switch (op) {
+    case OP_RECORD:
+      return rlz_lib::RecordProductEvent(
+          kProduct, point,
+          kEvents[random->Next(static_cast<int>(arraysize(kEvents)))]);
+
+    case OP_SET:
+      return rlz_lib::SetAccessPointRlz(
+          point,
+          kRlzValues[random->Next(static_cast<int>(arraysize(kRlzValues)))]);
+
+    case OP_PARAMS: {
+      char cgi[rlz_lib::kMaxCgiLength + 1];
+      if (!rlz_lib::GetPingParams(kProduct, kAccessPoints, cgi,
+                                  arraysize(cgi)))
+        return false;
+      *corrupt = !IsCgiValid(cgi);
+      return true;
+    }
+
+    case OP_EVENTS: {
+      char cgi[rlz_lib::kMaxCgiLength + 1];
+      // Fails when there are no events, which is not a failure of the call.
+      if (rlz_lib::GetProductEventsAsCgi(kProduct, cgi, arraysize(cgi)))
+        *corrupt = !IsCgiValid(cgi);
+      return true;
+    }
+
+    case OP_PARSE: {
+      const std::string& response =
+          responses[random->Next(static_cast<int>(responses.size()))];
+      return rlz_lib::ParsePingResponse(kProduct, response.c_str());
+    }
+
+    case OP_CLEAR:
+      rlz_lib::ClearProductState(kProduct, kAccessPoints);
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+// Runs the operations of the mix until |duration_s| has elapsed, and prints
+// the results for the parent to collect.
+int RunWorker(const CommandLine* command_line, const Options& options) {
+  rlz_lib::ProcessInfo::IntegrityLevel integrity =
+      rlz_lib::ProcessInfo::GetIntegrityLevel();
+  bool read_only = base::win::GetVersion() >= base::win::VERSION_VISTA &&
+                    integrity <= rlz_lib::ProcessInfo::LOW_INTEGRITY;
+
+  int weights[OP_COUNT];
+  int total_weight = 0;
+  for (int i = 0; i < OP_COUNT; ++i) {
+    weights[i] = read_only && kOperations[i].writes ? 0 : options.weights[i];
+    total_weight += weights[i];
+  }
+
+  if (!OverrideRegistryHives(read_only) ||
+      !ApplyFeatures(options.enable) ||
+      !rlz_lib::SetLockTimeout(options.lock_timeout_ms)) {
+    fprintf(stderr, "Worker could not set up.\n");
+    return 1;
+  }
+
+  std::vector<std::string> responses;
+  for (size_t i = 0; i < arraysize(kRlzValues); ++i)
+    responses.push_back(BuildResponse(kRlzValues[i]));
+
+  int index = 0;
+  base::StringToInt(command_line->GetSwitchValueASCII("worker"), &index);
+  Random random(GetTickCount() ^ (static_cast<uint32>(index) * 2654435761U));
+
+  // Start with the other workers.
+  base::win::ScopedHandle start_event(OpenEvent(
+      SYNCHRONIZE, FALSE,
+      command_line->GetSwitchValueNative("start_event").c_str()));
+  if (!start_event.IsValid() ||
+      WaitForSingleObject(start_event, 60 * 1000) != WAIT_OBJECT_0) {
+    fprintf(stderr, "Worker was not started.\n");
+    return 1;
+  }
+  rlz_lib::ResetLockStats();
+
+  OperationStats stats[OP_COUNT];
+  int reported_corruptions = 0;
+  base::TimeTicks end =
+      base::TimeTicks::Now() + base::TimeDelta::FromSeconds(options.duration_s);
+  while (total_weight > 0 && base::TimeTicks::Now() < end) {
+    int draw = random.Next(total_weight);
+    int op = 0;
+    while (draw >= weights[op])
+      draw -= weights[op++];
+
+    bool corrupt = false;
+    base::TimeTicks start = base::TimeTicks::HighResNow();
+    bool result = RunOperation(static_cast<Operation>(op), &random, responses,
+                               &corrupt);
+    base::TimeDelta elapsed = base::TimeTicks::HighResNow() - start;
+
+    stats[op].latency.Add(elapsed.InMicroseconds());
+    if (!result)
+      ++stats[op].failures;
+    if (corrupt || (kOperations[op].writes && !AreRlzsValid())) {
+      ++stats[op].corruptions;
+      if (reported_corruptions++ < 5)
+        fprintf(stderr, "Worker %d: corrupt state after %s.\n", index,
+                kOperations[op].name);
+    }
+  }
+
+  if (!read_only)
+    rlz_lib::FlushQueuedEvents();
+
+  rlz_lib::LockStats lock_stats;
+  memset(&lock_stats, 0, sizeof(lock_stats));
+  rlz_lib::GetLockStats(&lock_stats);
+
+  // One line per operation: name, failures, corruptions, max latency and the
+  // non-empty histogram buckets as <bucket>:<count>.
+  printf("integrity %d\n", static_cast<int>(integrity));
+  for (int i = 0; i < OP_COUNT; ++i) {
+    const LatencyHistogram& latency = stats[i].latency;
+    printf("op %s %I64d %I64d %I64d", kOperations[i].name, stats[i].failures,
+           stats[i].corruptions, latency.max_us());
+    for (int bucket = 0; bucket < LatencyHistogram::kBuckets; ++bucket) {
+      if (latency.bucket(bucket))
+        printf(" %d:%I64d", bucket, latency.bucket(bucket));
+    }
+    printf("\n");
+  }
+  printf("lock %I64d %I64d %I64d %I64d %I64d %I64d\n",
+         lock_stats.acquisitions, lock_stats.contended_acquisitions,
+         lock_stats.timeouts, lock_stats.abandoned, lock_stats.total_wait_ms,
+         lock_stats.max_wait_ms);
+  fflush(stdout);
+  return 0;
+}
+
+struct Worker {
+  Worker() : integrity(MEDIUM), exit_code(STILL_ACTIVE) {}
+
+  IntegrityLevel integrity;
+  base::win::ScopedHandle process;
+  base::win::ScopedHandle output;  // The read end of the worker's stdout.
+  std::string results;
+  DWORD exit_code;
+};
+
+// Creates a primary token of this process lowered to |integrity|.
+bool CreateTokenAtIntegrity(IntegrityLevel integrity, HANDLE* token) {
+  HANDLE process_token = NULL;
+  if (!OpenProcessToken(GetCurrentProcess(),
+                        TOKEN_DUPLICATE | TOKEN_QUERY | TOKEN_ADJUST_DEFAULT |
+                            TOKEN_ASSIGN_PRIMARY,
+                        &process_token))
+    return false;
+  base::win::ScopedHandle scoped_process_token(process_token);
+  if (!DuplicateTokenEx(process_token, 0, NULL, SecurityImpersonation,
+                        TokenPrimary, token))
+    return false;
+
+  PSID sid = NULL;
+  bool result = false;
+  if (ConvertStringSidToSidW(kIntegritySids[integrity], &sid)) {
+    TOKEN_MANDATORY_LABEL label = {0};
+    label.Label.Attributes = SE_GROUP_INTEGRITY;
+    label.Label.Sid = sid;
+    result = SetTokenInformation(*token, TokenIntegrityLevel, &label,
+                                 sizeof(label) + GetLengthSid(sid)) != FALSE;
+    LocalFree(sid);
+  }
+  if (!result) {
+    CloseHandle(*token);
+    *token = NULL;
+  }
+  return result;
+}
+
+bool LaunchWorker(int index, const Options& options,
+                  const std::wstring& start_event, bool lower_integrity,
+                  Worker* worker) {
+  wchar_t program[MAX_PATH];
+  if (!GetModuleFileName(NULL, program, arraysize(program)))
+    return false;
+
+  std::wstring command = base::StringPrintf(
+      L"\"%ls\" --worker=%d --start_event=%ls --duration=%d "
+      L"--lock_timeout_ms=%d",
+      program, index, start_event.c_str(), options.duration_s,
+      options.lock_timeout_ms);
+  if (!options.mix.empty())
+    command += L" --mix=" + ASCIIToWide(options.mix);
+  if (!options.enable.empty())
+    command += L" --enable=" + ASCIIToWide(options.enable);
+
+  // The worker writes its results to a pipe, which works at all integrity
+  // levels, unlike the temporary directory.
+  SECURITY_ATTRIBUTES attributes = { sizeof(attributes), NULL, TRUE };
+  HANDLE read_pipe = NULL;
+  HANDLE write_pipe = NULL;
+  if (!CreatePipe(&read_pipe, &write_pipe, &attributes, 64 * 1024))
+    return false;
+  worker->output.Set(read_pipe);
+  base::win::ScopedHandle scoped_write_pipe(write_pipe);
+  SetHandleInformation(read_pipe, HANDLE_FLAG_INHERIT, 0);
+
+  STARTUPINFO startup_info = { sizeof(startup_info) };
+  startup_info.dwFlags = STARTF_USESTDHANDLES;
+  startup_info.hStdInput = NULL;
+  startup_info.hStdOutput = write_pipe;
+  startup_info.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+  PROCESS_INFORMATION process_info = {0};
+
+  // CreateProcess may modify the command line.
+  std::vector<wchar_t> command_buffer(command.begin(), command.end());
+  command_buffer.push_back(L'\0');
+
+  BOOL created = FALSE;
+  if (lower_integrity) {
+    HANDLE token = NULL;
+    if (!CreateTokenAtIntegrity(worker->integrity, &token))
+      return false;
+    base::win::ScopedHandle scoped_token(token);
+    created = CreateProcessAsUser(token, NULL, &command_buffer[0], NULL, NULL,
+                                  TRUE, 0, NULL, NULL, &startup_info,
+                                  &process_info);
+  } else {
+    created = CreateProcess(NULL, &command_buffer[0], NULL, NULL, TRUE, 0,
+                            NULL, NULL, &startup_info, &process_info);
+  }
+  if (!created)
+    return false;
+
+  CloseHandle(process_info.hThread);
+  worker->process.Set(process_info.hProcess);
+  return true;
+}
+
+// Reads the results of |worker| until it exits.
+void CollectWorker(Worker* worker) {
+  char buffer[4096];
+  DWORD read = 0;
+  while (ReadFile(worker->output, buffer, sizeof(buffer), &read, NULL) &&
+         read > 0)
+    worker->results.append(buffer, read);
+
+  WaitForSingleObject(worker->process, INFINITE);
+  GetExitCodeProcess(worker->process, &worker->exit_code);
+}
+
+struct Totals {
+  Totals() : failed_workers(0) {
+    memset(&lock, 0, sizeof(lock));
+    for (size_t i = 0; i < arraysize(workers_at); ++i)
+      workers_at[i] = 0;
+  }
+
+  OperationStats ops[OP_COUNT];
+  rlz_lib::LockStats lock;
+  int workers_at[arraysize(kIntegrityNames)];
+  int failed_workers;
+};
+
+// Adds the results printed by a worker to |totals|.
+bool MergeResults(const std::string& results, Totals* totals) {
+  std::vector<std::string> lines;
+  base::SplitString(results, '\n', &lines);
+  bool has_lock_stats = false;
+  for (size_t i = 0; i < lines.size(); ++i) {
+    std::vector<std::string> fields;
+    base::SplitString(lines[i], ' ', &fields);
+    if (fields.empty())
+      continue;
+
+    if (fields[0] == "op" && fields.size() >= 5) {
+      int op = 0;
+      while (op < OP_COUNT && fields[1] != kOperations[op].name)
+        ++op;
+      int64 failures = 0, corruptions = 0, max_us = 0;
+      if (op == OP_COUNT || !base::StringToInt64(fields[2], &failures) ||
+          !base::StringToInt64(fields[3], &corruptions) ||
+          !base::StringToInt64(fields[4], &max_us))
+        return false;
+      OperationStats* stats = &totals->ops[op];
+      stats->failures += failures;
+      stats->corruptions += corruptions;
+      stats->latency.MergeMax(max_us);
+      for (size_t j = 5; j < fields.size(); ++j) {
+        std::string::size_type colon = fields[j].find(':');
+        int bucket = 0;
+        int64 count = 0;
+        if (colon == std::string::npos ||
+            !base::StringToInt(fields[j].substr(0, colon), &bucket) ||
+            !base::StringToInt64(fields[j].substr(colon + 1), &count))
+          return false;
+        stats->latency.Merge(bucket, count);
+      }
+    } else if (fields[0] == "lock" && fields.size() == 7) {
+      int64 values[6];
+      for (size_t j = 0; j < 6; ++j) {
+        if (!base::StringToInt64(fields[j + 1], &values[j]))
+          return false;
+      }
+      totals->lock.acquisitions += values[0];
+      totals->lock.contended_acquisitions += values[1];
+      totals->lock.timeouts += values[2];
+      totals->lock.abandoned += values[3];
+      totals->lock.total_wait_ms += values[4];
+      if (values[5] > totals->lock.max_wait_ms)
+        totals->lock.max_wait_ms = values[5];
+      has_lock_stats = true;
+    }
+  }
+  return has_lock_stats;
+}
+
+double GetTimeoutRate(const rlz_lib::LockStats& lock) {
+  int64 attempts = lock.acquisitions + lock.timeouts;
+  return attempts ? 100.0 * lock.timeouts / attempts : 0.0;
+}
+
+void PrintText(const Options& options, const Totals& totals,
+               int64 final_corruptions) {
+  printf("%d workers (", options.workers);
+  for (size_t i = 0; i < arraysize(kIntegrityNames); ++i) {
+    printf("%s%d %s", i ? ", " : "", totals.workers_at[i],
+           kIntegrityNames[i]);
+  }
+  printf("), %d s\n\n", options.duration_s);
+
+  printf("%-8s %10s %10s %10s %10s %10s %10s %8s %8s\n", "op", "count",
+         "ops/s", "p50 us", "p99 us", "p99.9 us", "max us", "failed",
+         "corrupt");
+  for (int i = 0; i < OP_COUNT; ++i) {
+    const OperationStats& stats = totals.ops[i];
+    printf("%-8s %10I64d %10.1f %10I64d %10I64d %10I64d %10I64d %8I64d "
+           "%8I64d\n", kOperations[i].name, stats.latency.count(),
+           static_cast<double>(stats.latency.count()) / options.duration_s,
+           stats.latency.Percentile(0.5), stats.latency.Percentile(0.99),
+           stats.latency.Percentile(0.999), stats.latency.max_us(),
+           stats.failures, stats.corruptions);
+  }
+
+  printf("\nlock: %I64d acquisitions, %I64d contended, %I64d timeouts "
+         "(%.3f%%), %I64d abandoned, %I64d ms max wait\n",
+         totals.lock.acquisitions, totals.lock.contended_acquisitions,
+         totals.lock.timeouts, GetTimeoutRate(totals.lock),
+         totals.lock.abandoned, totals.lock.max_wait_ms);
+  printf("failed workers: %d\nfinal state: %s\n", totals.failed_workers,
+         final_corruptions ? "corrupt" : "ok");
+}
+
+void PrintJson(const Options& options, const Totals& totals,
+               int64 final_corruptions) {
+  printf("{\n  \"workers\": %d,\n  \"duration_s\": %d,\n  \"integrity\": {",
+         options.workers, options.duration_s);
+  for (size_t i = 0; i < arraysize(kIntegrityNames); ++i) {
+    printf("%s\"%s\": %d", i ? ", " : "", kIntegrityNames[i],
+           totals.workers_at[i]);
+  }
+  printf("},\n  \"ops\": [");
+  for (int i = 0; i < OP_COUNT; ++i) {
+    const OperationStats& stats = totals.ops[i];
+    printf("%s\n    {\"name\": \"%s\", \"count\": %I64d, "
+           "\"ops_per_s\": %.1f, \"p50_us\": %I64d, \"p99_us\": %I64d, "
+           "\"p999_us\": %I64d, \"max_us\": %I64d, \"failures\": %I64d, "
+           "\"corruptions\": %I64d}",
+           i ? "," : "", kOperations[i].name, stats.latency.count(),
+           static_cast<double>(stats.latency.count()) / options.duration_s,
+           stats.latency.Percentile(0.5), stats.latency.Percentile(0.99),
+           stats.latency.Percentile(0.999), stats.latency.max_us(),
+           stats.failures, stats.corruptions);
+  }
+  printf("\n  ],\n  \"lock\": {\"acquisitions\": %I64d, \"contended\": %I64d, "
+         "\"timeouts\": %I64d, \"timeout_rate\": %.5f, \"abandoned\": %I64d, "
+         "\"max_wait_ms\": %I64d},\n",
+         totals.lock.acquisitions, totals.lock.contended_acquisitions,
+         totals.lock.timeouts, GetTimeoutRate(totals.lock) / 100,
+         totals.lock.abandoned, totals.lock.max_wait_ms);
+  printf("  \"failed_workers\": %d,\n  \"final_state_corrupt\": %s\n}\n",
+         totals.failed_workers, final_corruptions ? "true" : "false");
+}
+
+// Returns the integrity level of this process, HIGH if unknown, so that all
+// the levels can be asked for.
+IntegrityLevel GetCurrentIntegrity() {
+  switch (rlz_lib::ProcessInfo::GetIntegrityLevel()) {
+    case rlz_lib::ProcessInfo::LOW_INTEGRITY:
+      return LOW;
+    case rlz_lib::ProcessInfo::MEDIUM_INTEGRITY:
+      return MEDIUM;
+    default:
+      return HIGH;
+  }
+}
+
+int RunParent(const Options& options) {
+  bool has_integrity = base::win::GetVersion() >= base::win::VERSION_VISTA;
+  IntegrityLevel current = has_integrity ? GetCurrentIntegrity() : HIGH;
+  for (size_t i = 0; i < options.integrity_levels.size(); ++i) {
+    if (options.integrity_levels[i] > current) {
+      fprintf(stderr, "Cannot run workers above the integrity level of this "
+                      "process.\n");
+      return 1;
+    }
+  }
+
+  if (!CreateRegistryHives()) {
+    fprintf(stderr, "Could not create the registry hives.\n");
+    DeleteRegistryHives();
+    return 1;
+  }
+
+  // The start event is opened by the low integrity workers too.
+  std::wstring start_event_name =
+      base::StringPrintf(L"RlzStressStart-%u", GetCurrentProcessId());
+  base::win::ScopedHandle start_event(
+      CreateEvent(NULL, TRUE, FALSE, start_event_name.c_str()));
+  if (!start_event.IsValid() ||
+      !rlz_lib::SetObjectToLowIntegrity(start_event)) {
+    fprintf(stderr, "Could not create the start event.\n");
+    DeleteRegistryHives();
+    return 1;
+  }
+
+  Totals totals;
+  std::vector<Worker*> workers;
+  for (int i = 0; i < options.workers; ++i) {
+    Worker* worker = new Worker;
+    worker->integrity = has_integrity ?
+        options.integrity_levels[i % options.integrity_levels.size()] :
+        current;
+    if (!LaunchWorker(i, options, start_event_name,
+                      has_integrity && worker->integrity < current, worker)) {
+      fprintf(stderr, "Could not launch worker %d at %s integrity.\n", i,
+              kIntegrityNames[worker->integrity]);
+      ++totals.failed_workers;
+      delete worker;
+      continue;
+    }
+    workers.push_back(worker);
+  }
+  SetEvent(start_event);
+
+  for (size_t i = 0; i < workers.size(); ++i) {
+    Worker* worker = workers[i];
+    CollectWorker(worker);
+    if (worker->exit_code != 0 || !MergeResults(worker->results, &totals)) {
+      fprintf(stderr, "Worker %d failed with exit code %u.\n",
+              static_cast<int>(i), worker->exit_code);
+      ++totals.failed_workers;
+    } else if (has_integrity) {
+      ++totals.workers_at[worker->integrity];
+    }
+    delete worker;
+  }
+
+  // Check the state the workers left from this process too.
+  int64 final_corruptions = 0;
+  char cgi[rlz_lib::kMaxCgiLength + 1];
+  if (!AreRlzsValid() ||
+      (rlz_lib::GetPingParams(kProduct, kAccessPoints, cgi, arraysize(cgi)) &&
+       !IsCgiValid(cgi)))
+    ++final_corruptions;
+
+  if (options.json)
+    PrintJson(options, totals, final_corruptions);
+  else
+    PrintText(options, totals, final_corruptions);
+
+  DeleteRegistryHives();
+
+  int64 corruptions = final_corruptions;
+  for (int i = 0; i < OP_COUNT; ++i)
+    corruptions += totals.ops[i].corruptions;
+  return totals.failed_workers || corruptions ? 1 : 0;
+}
+
+}  // namespace anonymous
+
+int main(int argc, char** argv) {
+  base::AtExitManager at_exit;
+  CommandLine::Init(argc, argv);
+  const CommandLine* command_line = CommandLine::ForCurrentProcess();
+
+  Options options;
+  if (!ParseOptions(command_line, &options))
+    return 1;
+
+  if (command_line->HasSwitch("worker"))
+    return RunWorker(command_line, options);
+  return RunParent(options);
+}
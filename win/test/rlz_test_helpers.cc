@@ -8,32 +8,100 @@
 
 #include <shlwapi.h>
 
+#include <string>
+
+#include "base/basictypes.h"
 #include "base/win/registry.h"
 #include "rlz/win/lib/rlz_lib.h"
 #include "testing/gtest/include/gtest/gtest.h"
 
 namespace {
 
-const wchar_t* kHKCUReplacement = L"Software\\Google\\RlzUtilUnittest\\HKCU";
-const wchar_t* kHKLMReplacement = L"Software\\Google\\RlzUtilUnittest\\HKLM";
+const wchar_t* kReplacementRoot = L"Software\\Google\\RlzUtilUnittest";
 
-void OverrideRegistryHives() {
-  // Wipe the keys we redirect to.
-  // This gives us a stable run, even in the presence of previous
-  // crashes or failures.
-  LSTATUS err = SHDeleteKey(HKEY_CURRENT_USER, kHKCUReplacement);
-  EXPECT_TRUE(err == ERROR_SUCCESS || err == ERROR_FILE_NOT_FOUND);
-  err = SHDeleteKey(HKEY_CURRENT_USER, kHKLMReplacement);
+// Set once the template hives of this process are prepared. The tests run on
+// a single thread.
+bool g_template_prepared = false;
+
+// The key holding the replacement hives of this process. Parallel shards each
+// get their own, so that they do not wipe each other's hives.
+std::wstring GetReplacementRoot() {
+  std::wstring root(kReplacementRoot);
+  wchar_t shard[16];
+  DWORD length = ::GetEnvironmentVariableW(L"GTEST_SHARD_INDEX", shard,
+                                           arraysize(shard));
+  if (length > 0 && length < arraysize(shard)) {
+    root += L"\\Shard";
+    root += shard;
+  }
+  return root;
+}
+
+// Copies |src| into |dest|. RegCopyTreeW, only available on Vista and later,
+// copies the tree in one call.
+LONG CopyTree(HKEY src, HKEY dest) {
+  typedef LONG (WINAPI *RegCopyTreeFunc)(HKEY, LPCWSTR, HKEY);
+  static RegCopyTreeFunc reg_copy_tree = reinterpret_cast<RegCopyTreeFunc>(
+      ::GetProcAddress(::GetModuleHandleW(L"advapi32.dll"), "RegCopyTreeW"));
+  if (reg_copy_tree)
+    return reg_copy_tree(src, NULL, dest);
+  return ::SHCopyKeyW(src, NULL, dest, 0);
+}
+
+// Prepares the hives once per process, into the template keys which every
+// test then copies, instead of copying the HKLM subtrees the tests need from
+// the real hive each time.
+void PrepareTemplateHives(const std::wstring& root) {
+  if (g_template_prepared)
+    return;
+
+  std::wstring template_root = root + L"\\Template";
+  LSTATUS err = SHDeleteKey(HKEY_CURRENT_USER, template_root.c_str());
   EXPECT_TRUE(err == ERROR_SUCCESS || err == ERROR_FILE_NOT_FOUND);
 
-  // Create the keys we're redirecting HKCU and HKLM to.
   base::win::RegKey hkcu;
   base::win::RegKey hklm;
+  ASSERT_EQ(ERROR_SUCCESS, hkcu.Create(HKEY_CURRENT_USER,
+                                       (template_root + L"\\HKCU").c_str(),
+                                       KEY_READ));
+  ASSERT_EQ(ERROR_SUCCESS, hklm.Create(HKEY_CURRENT_USER,
+                                       (template_root + L"\\HKLM").c_str(),
+                                       KEY_ALL_ACCESS));
+  rlz_lib::InitializeTempHivesForTesting(hklm, hkcu);
+  g_template_prepared = true;
+}
+
+// Wipes the replacement key |name| of |root| and restores it from the
+// template, into |key|.
+void RestoreHive(const std::wstring& root, const wchar_t* name,
+                 base::win::RegKey* key) {
+  // Wiping the keys we redirect to gives us a stable run, even in the
+  // presence of previous crashes or failures.
+  std::wstring replacement = root + L"\\" + name;
+  LSTATUS err = SHDeleteKey(HKEY_CURRENT_USER, replacement.c_str());
+  EXPECT_TRUE(err == ERROR_SUCCESS || err == ERROR_FILE_NOT_FOUND);
+
+  base::win::RegKey template_key;
   ASSERT_EQ(ERROR_SUCCESS,
-      hkcu.Create(HKEY_CURRENT_USER, kHKCUReplacement, KEY_READ));
+      template_key.Open(HKEY_CURRENT_USER,
+                        (root + L"\\Template\\" + name).c_str(), KEY_READ));
   ASSERT_EQ(ERROR_SUCCESS,
-      hklm.Create(HKEY_CURRENT_USER, kHKLMReplacement, KEY_READ));
+      key->Create(HKEY_CURRENT_USER, replacement.c_str(), KEY_ALL_ACCESS));
+  ASSERT_EQ(ERROR_SUCCESS, CopyTree(template_key.Handle(), key->Handle()));
+}
+
+void OverrideRegistryHives() {
+  std::wstring root = GetReplacementRoot();
+  PrepareTemplateHives(root);
+
+  // Create the keys we're redirecting HKCU and HKLM to.
+  base::win::RegKey hkcu;
+  base::win::RegKey hklm;
+  RestoreHive(root, L"HKCU", &hkcu);
+  RestoreHive(root, L"HKLM", &hklm);
 
+  // The restored HKLM already has the subtrees, so this only resets the
+  // state of the library.
   rlz_lib::InitializeTempHivesForTesting(hklm, hkcu);
 
   // And do the switcharoo.